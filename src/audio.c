@@ -0,0 +1,611 @@
+/*  audio.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <tox/tox.h>
+#include <tox/toxav.h>
+
+#include "audio.h"
+#include "toxbot.h"
+#include "misc.h"
+#include "log.h"
+#include "trace.h"
+#include "mem.h"
+
+#define AUDIO_MAX_CLIP_SECONDS 300
+#define AUDIO_TONE_AMPLITUDE 8000
+
+/* A clip decoded to mono PCM at AUDIO_SAMPLE_RATE. A slot is only emptied (pcm NULL) by clip_shed()
+   while nothing plays it, and it never moves, so players may keep pointers. */
+struct Audio_Clip {
+    char name[TOX_MAX_NAME_LENGTH];
+    int16_t *pcm;
+    uint32_t samples;
+    uint64_t last_used;
+};
+
+/* What is playing into one group. gen changes whenever a command modifies the player so that
+   the playback thread doesn't advance a player that was replaced while it was rendering. */
+struct Audio_Player {
+    int groupnum;
+    uint32_t gen;
+    const struct Audio_Clip *clip;
+    uint32_t pos;
+    int32_t clip_gain;
+    bool tone;
+    uint32_t tone_pos;
+    int32_t tone_gain;
+};
+
+static struct Audio_Clip clips[AUDIO_MAX_CLIPS];
+static int num_clips;
+
+/* One second holds exactly AUDIO_TONE_HZ periods, so the buffer loops without a click */
+static int16_t tone_pcm[AUDIO_SAMPLE_RATE];
+static bool tone_ready;
+
+/* players and num_players are protected by tox_lock */
+static struct Audio_Player players[AUDIO_MAX_PLAYERS];
+static int num_players;
+static uint32_t player_gen;
+
+/* the players the playback thread is rendering without tox_lock; set and cleared under it */
+static struct Audio_Player snap[AUDIO_MAX_PLAYERS];
+static int num_snap;
+
+static Tox *audio_tox;
+static pthread_t audio_tid;
+static pthread_cond_t audio_cond = PTHREAD_COND_INITIALIZER;
+static bool audio_running;
+
+/*
+ * Mixing kernels. They work on 4 samples at a time with GCC vector extensions so that the
+ * playback thread can feed many groups per frame; the scalar tails handle the remainder.
+ */
+typedef int16_t v4hi __attribute__((vector_size(8)));
+typedef int32_t v4si __attribute__((vector_size(16)));
+
+static inline v4si clamp_s16(v4si x)
+{
+    const v4si hi = { 32767, 32767, 32767, 32767 };
+    const v4si lo = -hi - 1;
+    v4si m = x > hi;
+    x = (x & ~m) | (hi & m);
+    m = x < lo;
+    return (x & ~m) | (lo & m);
+}
+
+static inline int16_t clamp_sample(int32_t x)
+{
+    return x > 32767 ? 32767 : x < -32768 ? -32768 : x;
+}
+
+void audio_scale(int16_t *dst, const int16_t *src, int n, int32_t gain)
+{
+    v4si g = { gain, gain, gain, gain };
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        v4hi s;
+        memcpy(&s, src + i, sizeof(s));
+        v4si x = __builtin_convertvector(s, v4si);
+        v4hi d = __builtin_convertvector(clamp_s16((x * g) >> 8), v4hi);
+        memcpy(dst + i, &d, sizeof(d));
+    }
+
+    for (; i < n; ++i)
+        dst[i] = clamp_sample((src[i] * gain) >> 8);
+}
+
+void audio_mix(int16_t *dst, const int16_t *src, int n, int32_t gain)
+{
+    v4si g = { gain, gain, gain, gain };
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        v4hi s, d;
+        memcpy(&s, src + i, sizeof(s));
+        memcpy(&d, dst + i, sizeof(d));
+        v4si x = __builtin_convertvector(d, v4si) + ((__builtin_convertvector(s, v4si) * g) >> 8);
+        d = __builtin_convertvector(clamp_s16(x), v4hi);
+        memcpy(dst + i, &d, sizeof(d));
+    }
+
+    for (; i < n; ++i)
+        dst[i] = clamp_sample(dst[i] + ((src[i] * gain) >> 8));
+}
+
+static int32_t volume_gain(int volume)
+{
+    if (volume < 0)
+        volume = 0;
+
+    if (volume > AUDIO_MAX_VOLUME)
+        volume = AUDIO_MAX_VOLUME;
+
+    return volume * 256 / 100;
+}
+
+static void make_tone(void)
+{
+    int i;
+
+    for (i = 0; i < AUDIO_SAMPLE_RATE; ++i)
+        tone_pcm[i] = AUDIO_TONE_AMPLITUDE * sin(2 * M_PI * AUDIO_TONE_HZ * i / AUDIO_SAMPLE_RATE);
+
+    tone_ready = true;
+}
+
+static uint16_t read_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t read_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Decodes a 16-bit PCM WAV file to mono at AUDIO_SAMPLE_RATE, downmixing and resampling
+   (linearly) as needed. Returns the number of samples and puts the buffer in pcm, or -1 on error. */
+static int64_t decode_wav(const char *path, int16_t **pcm)
+{
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL)
+        return -1;
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+
+    if (size < 12) {
+        fclose(fp);
+        return -1;
+    }
+
+    uint8_t *buf = mem_malloc(MEM_IO, size);
+
+    if (buf == NULL)
+        exit(EXIT_FAILURE);
+
+    if (fread(buf, size, 1, fp) != 1 || memcmp(buf, "RIFF", 4) || memcmp(buf + 8, "WAVE", 4)) {
+        mem_free(buf);
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+
+    uint16_t format = 0, channels = 0, bits = 0;
+    uint32_t rate = 0;
+    const uint8_t *data = NULL;
+    uint32_t data_len = 0;
+    long off = 12;
+
+    while (off + 8 <= size) {
+        uint32_t len = read_le32(buf + off + 4);
+        const uint8_t *chunk = buf + off + 8;
+
+        if (len > size - off - 8)
+            len = size - off - 8;
+
+        if (memcmp(buf + off, "fmt ", 4) == 0 && len >= 16) {
+            format = read_le16(chunk);
+            channels = read_le16(chunk + 2);
+            rate = read_le32(chunk + 4);
+            bits = read_le16(chunk + 14);
+        } else if (memcmp(buf + off, "data", 4) == 0) {
+            data = chunk;
+            data_len = len;
+        }
+
+        off += 8 + len + (len & 1);
+    }
+
+    if (format != 1 || bits != 16 || channels == 0 || rate < 8000 || rate > 96000 || data == NULL) {
+        mem_free(buf);
+        return -1;
+    }
+
+    uint64_t frames = data_len / (2 * channels);
+    uint64_t out_len = frames * AUDIO_SAMPLE_RATE / rate;
+
+    if (frames == 0 || out_len > (uint64_t) AUDIO_MAX_CLIP_SECONDS * AUDIO_SAMPLE_RATE) {
+        mem_free(buf);
+        return -1;
+    }
+
+    int16_t *out = mem_malloc(MEM_AUDIO, out_len * sizeof(int16_t));
+
+    if (out == NULL)
+        exit(EXIT_FAILURE);
+
+    uint64_t i;
+
+    for (i = 0; i < out_len; ++i) {
+        /* source position in 16.16 fixed point */
+        uint64_t p = (i * rate << 16) / AUDIO_SAMPLE_RATE;
+        uint64_t f = p >> 16;
+        int32_t frac = p & 0xffff;
+        int32_t a = 0, b = 0;
+        uint16_t c;
+
+        for (c = 0; c < channels; ++c) {
+            a += (int16_t) read_le16(data + (f * channels + c) * 2);
+            b += (int16_t) read_le16(data + ((f + 1 < frames ? f + 1 : f) * channels + c) * 2);
+        }
+
+        a /= channels;
+        b /= channels;
+        out[i] = a + (int32_t) (((int64_t) (b - a) * frac) >> 16);
+    }
+
+    mem_free(buf);
+    *pcm = out;
+    return out_len;
+}
+
+/* Returns the cached clip called name, decoding it on first use. Returns NULL on error. */
+static const struct Audio_Clip *clip_get(const char *name)
+{
+    int i;
+
+    struct Audio_Clip *clip = NULL;
+
+    for (i = 0; i < num_clips; ++i) {
+        if (clips[i].pcm == NULL) {
+            if (clip == NULL)
+                clip = &clips[i];
+        } else if (strcmp(clips[i].name, name) == 0) {
+            clips[i].last_used = get_time_usec();
+            return &clips[i];
+        }
+    }
+
+    size_t len = strlen(name);
+
+    if (len == 0 || len >= sizeof(clips[0].name) || (clip == NULL && num_clips >= AUDIO_MAX_CLIPS))
+        return NULL;
+
+    /* clip names come from chat; don't let them leave the clips directory */
+    for (i = 0; i < len; ++i) {
+        char c = name[i];
+
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-'))
+            return NULL;
+    }
+
+    if (mem_over_limit(MEM_AUDIO)) {
+        mem_rejected(MEM_AUDIO);
+        log_msg(L_WARN, "audio_clip_rejected clip=%s reason=mem_limit", name);
+        return NULL;
+    }
+
+    char path[sizeof(AUDIO_CLIPS_DIR) + TOX_MAX_NAME_LENGTH + 8];
+    snprintf(path, sizeof(path), "%s/%s.wav", AUDIO_CLIPS_DIR, name);
+
+    int16_t *pcm;
+    uint64_t start = get_time_usec();
+    int64_t samples = decode_wav(path, &pcm);
+
+    if (samples < 0) {
+        log_msg(L_WARN, "audio_clip_failed path=%s", path);
+        return NULL;
+    }
+
+    if (clip == NULL)
+        clip = &clips[num_clips++];
+
+    snprintf(clip->name, sizeof(clip->name), "%s", name);
+    clip->pcm = pcm;
+    clip->samples = samples;
+    clip->last_used = get_time_usec();
+
+    log_msg(L_INFO, "audio_clip_cached clip=%s samples=%u usec=%llu", name, clip->samples,
+            (unsigned long long) (get_time_usec() - start));
+    return clip;
+}
+
+static bool clip_in_use(const struct Audio_Clip *clip)
+{
+    int i;
+
+    for (i = 0; i < num_players; ++i) {
+        if (players[i].clip == clip)
+            return true;
+    }
+
+    for (i = 0; i < num_snap; ++i) {
+        if (snap[i].clip == clip)
+            return true;
+    }
+
+    return false;
+}
+
+/* MEM_AUDIO shedder: drops the least recently played clips that nothing is playing until the
+   cache is back under its limit. They are decoded again when next played. Runs under tox_lock. */
+static void clip_shed(void)
+{
+    while (mem_over_limit(MEM_AUDIO)) {
+        struct Audio_Clip *lru = NULL;
+        int i;
+
+        for (i = 0; i < num_clips; ++i) {
+            struct Audio_Clip *c = &clips[i];
+
+            if (c->pcm && !clip_in_use(c) && (lru == NULL || c->last_used < lru->last_used))
+                lru = c;
+        }
+
+        if (lru == NULL)
+            return;
+
+        log_msg(L_INFO, "audio_clip_evicted clip=%s samples=%u", lru->name, lru->samples);
+        mem_free(lru->pcm);
+        lru->pcm = NULL;
+    }
+}
+
+static struct Audio_Player *player_find(int groupnum)
+{
+    int i;
+
+    for (i = 0; i < num_players; ++i) {
+        if (players[i].groupnum == groupnum)
+            return &players[i];
+    }
+
+    return NULL;
+}
+
+static void player_remove(struct Audio_Player *p)
+{
+    *p = players[--num_players];
+}
+
+/* Renders one frame of p into out */
+static void render_frame(const struct Audio_Player *p, int16_t *out)
+{
+    int n = 0;
+
+    if (p->clip) {
+        uint32_t left = p->clip->samples - p->pos;
+        n = left < AUDIO_FRAME_SAMPLES ? left : AUDIO_FRAME_SAMPLES;
+        audio_scale(out, p->clip->pcm + p->pos, n, p->clip_gain);
+    }
+
+    memset(out + n, 0, (AUDIO_FRAME_SAMPLES - n) * sizeof(int16_t));
+
+    if (p->tone) {
+        int first = AUDIO_SAMPLE_RATE - p->tone_pos;
+
+        if (first > AUDIO_FRAME_SAMPLES)
+            first = AUDIO_FRAME_SAMPLES;
+
+        audio_mix(out, tone_pcm + p->tone_pos, first, p->tone_gain);
+        audio_mix(out + first, tone_pcm, AUDIO_FRAME_SAMPLES - first, p->tone_gain);
+    }
+}
+
+/* Moves p on by one frame. Returns false if it has nothing left to play. */
+static bool player_advance(struct Audio_Player *p)
+{
+    if (p->clip) {
+        p->pos += AUDIO_FRAME_SAMPLES;
+
+        if (p->pos >= p->clip->samples)
+            p->clip = NULL;
+    }
+
+    if (p->tone)
+        p->tone_pos = (p->tone_pos + AUDIO_FRAME_SAMPLES) % AUDIO_SAMPLE_RATE;
+
+    return p->clip || p->tone;
+}
+
+/* Sends a frame to every player each AUDIO_FRAME_MS. Frames are rendered from a snapshot without
+   holding tox_lock, which is only taken to copy the players and to send the finished frames. */
+static void *audio_thread(void *arg)
+{
+    static int16_t frames[AUDIO_MAX_PLAYERS][AUDIO_FRAME_SAMPLES];
+    uint64_t next = get_time_usec();
+    uint64_t late = 0;
+
+    trace_thread_name("audio");
+    pthread_mutex_lock(&tox_lock);
+
+    while (audio_running) {
+        if (num_players == 0) {
+            pthread_cond_wait(&audio_cond, &tox_lock);
+            next = get_time_usec();
+            continue;
+        }
+
+        int n = num_players;
+        memcpy(snap, players, n * sizeof(struct Audio_Player));
+        num_snap = n;
+        pthread_mutex_unlock(&tox_lock);
+
+        int i;
+        uint64_t span = trace_start();
+
+        for (i = 0; i < n; ++i)
+            render_frame(&snap[i], frames[i]);
+
+        trace_end("audio_render", span);
+
+        uint64_t now = get_time_usec();
+
+        if (next > now)
+            usleep(next - now);
+        else if (now - next > AUDIO_FRAME_MS * 1000) {
+            /* fell more than a frame behind; restart the clock instead of bursting */
+            next = now;
+            ++late;
+            log_msg(L_WARN, "audio_late count=%llu", (unsigned long long) late);
+        }
+
+        next += AUDIO_FRAME_MS * 1000;
+
+        pthread_mutex_lock(&tox_lock);
+
+        for (i = 0; i < n; ++i) {
+            struct Audio_Player *p = player_find(snap[i].groupnum);
+
+            if (p == NULL || p->gen != snap[i].gen)
+                continue;
+
+            if (toxav_group_send_audio(audio_tox, p->groupnum, frames[i], AUDIO_FRAME_SAMPLES, 1,
+                                       AUDIO_SAMPLE_RATE) != 0 || !player_advance(p))
+                player_remove(p);
+        }
+
+        num_snap = 0;
+    }
+
+    pthread_mutex_unlock(&tox_lock);
+    return NULL;
+}
+
+static int audio_start(Tox *m)
+{
+    if (audio_running)
+        return 0;
+
+    if (!tone_ready)
+        make_tone();
+
+    audio_tox = m;
+    audio_running = true;
+    mem_set_shedder(MEM_AUDIO, clip_shed);
+
+    if (pthread_create(&audio_tid, NULL, audio_thread, NULL) != 0) {
+        audio_running = false;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns groupnum's player, creating it if needed. Returns NULL if there are no free players. */
+static struct Audio_Player *player_get(int groupnum)
+{
+    struct Audio_Player *p = player_find(groupnum);
+
+    if (p == NULL) {
+        if (num_players >= AUDIO_MAX_PLAYERS)
+            return NULL;
+
+        p = &players[num_players++];
+        memset(p, 0, sizeof(struct Audio_Player));
+        p->groupnum = groupnum;
+    }
+
+    p->gen = ++player_gen;
+    return p;
+}
+
+int audio_play(Tox *m, int groupnum, const char *name, int volume)
+{
+    if (audio_start(m) == -1)
+        return -1;
+
+    const struct Audio_Clip *clip = clip_get(name);
+
+    if (clip == NULL)
+        return -1;
+
+    struct Audio_Player *p = player_get(groupnum);
+
+    if (p == NULL)
+        return -1;
+
+    p->clip = clip;
+    p->pos = 0;
+    p->clip_gain = volume_gain(volume);
+    pthread_cond_signal(&audio_cond);
+    return 0;
+}
+
+int audio_tone(Tox *m, int groupnum, int volume)
+{
+    if (audio_start(m) == -1)
+        return -1;
+
+    struct Audio_Player *p = player_find(groupnum);
+
+    if (p && p->tone) {
+        p->tone = false;
+        p->gen = ++player_gen;
+
+        if (p->clip == NULL)
+            player_remove(p);
+
+        return 0;
+    }
+
+    if ((p = player_get(groupnum)) == NULL)
+        return -1;
+
+    p->tone = true;
+    p->tone_pos = 0;
+    p->tone_gain = volume_gain(volume);
+    pthread_cond_signal(&audio_cond);
+    return 1;
+}
+
+void audio_stop(int groupnum)
+{
+    struct Audio_Player *p = player_find(groupnum);
+
+    if (p)
+        player_remove(p);
+}
+
+void audio_shutdown(void)
+{
+    if (audio_running) {
+        pthread_mutex_lock(&tox_lock);
+        audio_running = false;
+        num_players = 0;
+        pthread_cond_signal(&audio_cond);
+        pthread_mutex_unlock(&tox_lock);
+        pthread_join(audio_tid, NULL);
+    }
+
+    int i;
+
+    for (i = 0; i < num_clips; ++i)
+        mem_free(clips[i].pcm);
+
+    num_clips = 0;
+}
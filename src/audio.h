@@ -0,0 +1,62 @@
+/*  audio.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <tox/tox.h>
+
+#define AUDIO_CLIPS_DIR "clips"
+#define AUDIO_SAMPLE_RATE 48000
+#define AUDIO_FRAME_MS 20
+#define AUDIO_FRAME_SAMPLES (AUDIO_SAMPLE_RATE / 1000 * AUDIO_FRAME_MS)
+#define AUDIO_MAX_CLIPS 32
+#define AUDIO_MAX_PLAYERS 64
+#define AUDIO_MAX_VOLUME 200        /* percent */
+#define AUDIO_TONE_HZ 440
+
+/* The functions below must be called with tox_lock held; the first play or tone starts the playback thread. */
+
+/* Starts playing clip (a file AUDIO_CLIPS_DIR/<clip>.wav, decoded and cached on first use;
+   unused clips are dropped from the cache when MEM_AUDIO is over its limit)
+   into AV group groupnum at volume percent, replacing any clip already playing there.
+   Returns 0 on success, -1 if the clip can't be loaded or too many groups are playing. */
+int audio_play(Tox *m, int groupnum, const char *clip, int volume);
+
+/* Toggles the hold tone under groupnum's playback. Returns 1 if it is now on, 0 if off, -1 on error. */
+int audio_tone(Tox *m, int groupnum, int volume);
+
+/* Stops everything playing into groupnum. */
+void audio_stop(int groupnum);
+
+/* Stops the playback thread and frees the clip cache. */
+void audio_shutdown(void);
+
+/* Scales n samples of src by gain (Q8 fixed point, 256 = unity) into dst, saturating. */
+void audio_scale(int16_t *dst, const int16_t *src, int n, int32_t gain);
+
+/* Adds n samples of src scaled by gain (Q8) onto dst, saturating. */
+void audio_mix(int16_t *dst, const int16_t *src, int n, int32_t gain);
+
+#endif /* AUDIO_H */
@@ -0,0 +1,231 @@
+/*  autoinvite.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <tox/tox.h>
+
+#include "autoinvite.h"
+#include "toxbot.h"
+#include "groupchats.h"
+#include "friends.h"
+#include "friendstats.h"
+#include "state.h"
+#include "timer.h"
+#include "misc.h"
+#include "log.h"
+#include "trace.h"
+#include "mem.h"
+
+extern struct Tox_Bot Tox_Bot;
+
+#define TOKEN_UNIT 1000000ULL
+
+/* Friend numbers waiting for an invite, as a ring. queued[] marks friends already in it
+   so a friend whose connection flaps is only invited once. */
+static int32_t *ring;
+static uint32_t ring_size;    /* always a power of two */
+static uint32_t ring_head;
+static uint32_t ring_len;
+
+static uint8_t *queued;
+static uint32_t queued_size;
+
+static uint64_t tokens = AUTO_INVITE_BURST * TOKEN_UNIT;    /* in units of 1/AUTO_INVITE_RATE seconds, scaled by 1e6 */
+static uint64_t last_refill;
+static bool scheduled;
+static uint64_t num_sent;
+
+static void job_auto_invite(Tox *m, void *arg);
+
+static void schedule(uint64_t delay_ms)
+{
+    if (scheduled)
+        return;
+
+    if (timer_add(delay_ms, 0, job_auto_invite, NULL, 0, "auto-invite") == -1) {
+        log_msg(L_WARN, "auto_invite_timer_failed queued=%u", ring_len);
+        return;
+    }
+
+    scheduled = true;
+}
+
+static void ring_push(int32_t friendnum)
+{
+    if (ring_len == ring_size) {
+        uint32_t n = ring_size ? ring_size * 2 : 64;
+        int32_t *p = mem_malloc(MEM_QUEUES, n * sizeof(int32_t));
+
+        if (p == NULL)
+            exit(EXIT_FAILURE);
+
+        uint32_t i;
+
+        for (i = 0; i < ring_len; ++i)
+            p[i] = ring[(ring_head + i) & (ring_size - 1)];
+
+        mem_free(ring);
+        ring = p;
+        ring_size = n;
+        ring_head = 0;
+    }
+
+    ring[(ring_head + ring_len++) & (ring_size - 1)] = friendnum;
+}
+
+static int32_t ring_pop(void)
+{
+    int32_t friendnum = ring[ring_head];
+    ring_head = (ring_head + 1) & (ring_size - 1);
+    --ring_len;
+    return friendnum;
+}
+
+void auto_invite_online(Tox *m, int32_t friendnum)
+{
+    uint8_t key[TOX_CLIENT_ID_SIZE];
+
+    if (friendnum < 0 || tox_get_client_id(m, friendnum, key) == -1 || state_auto_invite(key) == AUTO_INVITE_OFF)
+        return;
+
+    if ((uint32_t) friendnum < queued_size && queued[friendnum])
+        return;
+
+    if (mem_over_limit(MEM_QUEUES)) {
+        mem_rejected(MEM_QUEUES);
+        log_msg(L_WARN, "auto_invite_rejected friend=\"%s\" reason=mem_limit", friend_name(friendnum));
+        return;
+    }
+
+    if ((uint32_t) friendnum >= queued_size) {
+        uint32_t n = MAX((uint32_t) friendnum + 1, queued_size * 2);
+        uint8_t *p = mem_realloc(MEM_QUEUES, queued, n);
+
+        if (p == NULL)
+            exit(EXIT_FAILURE);
+
+        memset(p + queued_size, 0, n - queued_size);
+        queued = p;
+        queued_size = n;
+    }
+
+    queued[friendnum] = 1;
+    ring_push(friendnum);
+    schedule(0);
+}
+
+/* Invites friendnum to the group they opted in to, falling back to the default group.
+   Returns true if the invite reached the core and used up a token. */
+static bool invite(Tox *m, int32_t friendnum)
+{
+    uint8_t key[TOX_CLIENT_ID_SIZE];
+
+    /* they may have gone offline, opted out or been purged while waiting */
+    if (!friend_is_online(friendnum) || tox_get_client_id(m, friendnum, key) == -1)
+        return false;
+
+    int groupnum = state_auto_invite(key);
+
+    if (groupnum == AUTO_INVITE_OFF)
+        return false;
+
+    if (groupnum == AUTO_INVITE_DEFAULT || group_index(groupnum) == -1)
+        groupnum = Tox_Bot.default_groupnum;
+
+    const char *name = friend_name(friendnum);
+    int idx = group_index(groupnum);
+
+    /* a password set after the opt-in still has to be entered with hallo */
+    if (idx == -1 || Tox_Bot.g_chats[idx].has_pass) {
+        log_msg(L_WARN, "invite_failed friend=\"%s\" group=%d reason=%s auto=1", name, groupnum,
+                idx == -1 ? "no_group" : "password");
+        return false;
+    }
+
+    int target = group_route_invite(m, groupnum);
+
+    if (target == -1) {
+        log_msg(L_WARN, "invite_failed friend=\"%s\" group=%d reason=overflow auto=1", name, groupnum);
+        return false;
+    }
+
+    if (tox_invite_friend(m, friendnum, target) == -1) {
+        log_msg(L_WARN, "invite_failed friend=\"%s\" group=%d reason=core auto=1", name, groupnum);
+        return true;
+    }
+
+    ++num_sent;
+    friendstats_invite(friendnum);
+    log_msg(L_INFO, "invite friend=\"%s\" group=%d auto=1", name, target);
+    return true;
+}
+
+static void job_auto_invite(Tox *m, void *arg)
+{
+    uint64_t now = get_time_usec();
+    uint64_t span = trace_start();
+
+    scheduled = false;
+
+    if (last_refill)
+        tokens = MIN(tokens + (now - last_refill) * AUTO_INVITE_RATE, AUTO_INVITE_BURST * TOKEN_UNIT);
+
+    last_refill = now;
+
+    while (ring_len && tokens >= TOKEN_UNIT) {
+        int32_t friendnum = ring_pop();
+        queued[friendnum] = 0;
+
+        if (invite(m, friendnum))
+            tokens -= TOKEN_UNIT;
+    }
+
+    /* come back when the next token is due */
+    if (ring_len)
+        schedule((TOKEN_UNIT - tokens) / AUTO_INVITE_RATE / 1000 + 1);
+
+    trace_end("auto_invite", span);
+}
+
+uint32_t auto_invite_queued(void)
+{
+    return ring_len;
+}
+
+uint64_t auto_invite_sent(void)
+{
+    return num_sent;
+}
+
+void auto_invite_free(void)
+{
+    mem_free(ring);
+    mem_free(queued);
+    ring = NULL;
+    queued = NULL;
+    ring_size = ring_head = ring_len = queued_size = 0;
+}
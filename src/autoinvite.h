@@ -0,0 +1,45 @@
+/*  autoinvite.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef AUTOINVITE_H
+#define AUTOINVITE_H
+
+#include <stdint.h>
+#include <tox/tox.h>
+
+#define AUTO_INVITE_RATE 5      /* invites per second */
+#define AUTO_INVITE_BURST 10    /* invites sent at once after being idle */
+
+/* Called when friendnum comes online. Queues an invite if they opted in with state_set_auto_invite().
+   The queue is drained by a timer at AUTO_INVITE_RATE, so a mass reconnect after a restart is
+   spread out instead of issued in one loop iteration. */
+void auto_invite_online(Tox *m, int32_t friendnum);
+
+/* Returns the number of friends waiting for their invite. */
+uint32_t auto_invite_queued(void);
+
+/* Returns the number of auto-invites sent since startup. */
+uint64_t auto_invite_sent(void);
+
+void auto_invite_free(void);
+
+#endif /* AUTOINVITE_H */
@@ -0,0 +1,307 @@
+/*  bridge.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include <tox/tox.h>
+
+#include "bridge.h"
+#include "misc.h"
+#include "log.h"
+
+/* One direction of a bridge: lines forwarded from src into dest during the current
+   loop iteration are packed into buf and sent together by bridge_do(). */
+struct Bridge_Side {
+    int src;
+    int dest;
+    char buf[TOX_MAX_MESSAGE_LENGTH];
+    int len;
+    uint64_t tokens;         /* in units of 1/BRIDGE_RATE seconds, scaled by 1e6 */
+    uint64_t last_refill;    /* usec */
+    uint64_t forwarded;
+    uint64_t dropped;
+};
+
+struct Bridge {
+    bool active;
+    struct Bridge_Side side[2];
+};
+
+static struct Bridge bridges[MAX_BRIDGES];
+
+/* Content hashes of recently forwarded messages. A message whose content (with any
+   "<name> " prefixes added by bridges removed) is in the window is a loop or a duplicate. */
+static struct {
+    uint64_t hash;
+    uint64_t time;
+} dup_window[BRIDGE_DUP_WINDOW];
+static int dup_pos;
+
+#define TOKEN_UNIT 1000000ULL
+
+static uint64_t content_hash(const char *msg, int len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    int i;
+
+    for (i = 0; i < len; ++i) {
+        h ^= (uint8_t) msg[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+/* skips "<name> " prefixes so a message relayed through several bridges hashes the same */
+static const char *strip_prefixes(const char *msg, int *len)
+{
+    while (*len > 2 && msg[0] == '<') {
+        /* msg is length delimited, not NUL terminated */
+        const char *end = memchr(msg + 1, '>', *len - 1);
+
+        if (end == NULL)
+            break;
+
+        int i = end - msg;
+
+        if (i >= *len - 1 || msg[i + 1] != ' ')
+            break;
+
+        msg += i + 2;
+        *len -= i + 2;
+    }
+
+    return msg;
+}
+
+/* Returns true if hash was seen within BRIDGE_DUP_TIMEOUT, otherwise remembers it. */
+static bool dup_check(uint64_t hash, uint64_t now)
+{
+    int i;
+
+    for (i = 0; i < BRIDGE_DUP_WINDOW; ++i) {
+        if (dup_window[i].hash == hash && dup_window[i].time && !timed_out(dup_window[i].time, now, BRIDGE_DUP_TIMEOUT))
+            return true;
+    }
+
+    dup_window[dup_pos].hash = hash;
+    dup_window[dup_pos].time = now;
+    dup_pos = (dup_pos + 1) % BRIDGE_DUP_WINDOW;
+    return false;
+}
+
+static bool take_token(struct Bridge_Side *s, uint64_t now_us)
+{
+    uint64_t elapsed = now_us - s->last_refill;
+    s->tokens = MIN(s->tokens + elapsed * BRIDGE_RATE, BRIDGE_BURST * TOKEN_UNIT);
+    s->last_refill = now_us;
+
+    if (s->tokens < TOKEN_UNIT)
+        return false;
+
+    s->tokens -= TOKEN_UNIT;
+    return true;
+}
+
+static void side_flush(Tox *m, struct Bridge_Side *s)
+{
+    if (s->len == 0)
+        return;
+
+    if (tox_group_message_send(m, s->dest, (uint8_t *) s->buf, s->len) == -1)
+        log_msg(L_WARN, "bridge_send_failed src=%d dest=%d", s->src, s->dest);
+
+    s->len = 0;
+}
+
+static void side_append(Tox *m, struct Bridge_Side *s, const char *line, int len)
+{
+    if (s->len && s->len + 1 + len > (int) sizeof(s->buf))
+        side_flush(m, s);
+
+    if (s->len)
+        s->buf[s->len++] = '\n';
+
+    len = MIN(len, (int) sizeof(s->buf) - s->len);
+    memcpy(s->buf + s->len, line, len);
+    s->len += len;
+}
+
+static int find_bridge(int a, int b)
+{
+    int i;
+
+    for (i = 0; i < MAX_BRIDGES; ++i) {
+        struct Bridge *br = &bridges[i];
+
+        if (!br->active)
+            continue;
+
+        if ((br->side[0].src == a && br->side[0].dest == b) || (br->side[0].src == b && br->side[0].dest == a))
+            return i;
+    }
+
+    return -1;
+}
+
+int bridge_add(int a, int b)
+{
+    if (a == b || find_bridge(a, b) != -1)
+        return -1;
+
+    int i;
+
+    for (i = 0; i < MAX_BRIDGES; ++i) {
+        if (bridges[i].active)
+            continue;
+
+        struct Bridge *br = &bridges[i];
+        memset(br, 0, sizeof(struct Bridge));
+        br->active = true;
+        br->side[0].src = a;
+        br->side[0].dest = b;
+        br->side[1].src = b;
+        br->side[1].dest = a;
+        br->side[0].tokens = br->side[1].tokens = BRIDGE_BURST * TOKEN_UNIT;
+        br->side[0].last_refill = br->side[1].last_refill = get_time_usec();
+        return 0;
+    }
+
+    return -1;
+}
+
+int bridge_remove(int a, int b)
+{
+    int i = find_bridge(a, b);
+
+    if (i == -1)
+        return -1;
+
+    memset(&bridges[i], 0, sizeof(struct Bridge));
+    return 0;
+}
+
+void bridge_remove_group(int groupnum)
+{
+    int i;
+
+    for (i = 0; i < MAX_BRIDGES; ++i) {
+        if (bridges[i].active && (bridges[i].side[0].src == groupnum || bridges[i].side[0].dest == groupnum))
+            memset(&bridges[i], 0, sizeof(struct Bridge));
+    }
+}
+
+void bridge_group_message(Tox *m, int groupnum, int peernum, const char *msg, uint16_t length)
+{
+    int i, j;
+    bool linked = false;
+
+    for (i = 0; i < MAX_BRIDGES && !linked; ++i)
+        linked = bridges[i].active && (bridges[i].side[0].src == groupnum || bridges[i].side[1].src == groupnum);
+
+    if (!linked || length == 0 || tox_group_peernumber_is_ours(m, groupnum, peernum))
+        return;
+
+    int clen = length;
+    const char *content = strip_prefixes(msg, &clen);
+
+    if (dup_check(content_hash(content, clen), (uint64_t) time(NULL)))
+        return;
+
+    char name[TOX_MAX_NAME_LENGTH + 1];
+    int nlen = tox_group_peername(m, groupnum, peernum, (uint8_t *) name);
+
+    if (nlen < 0)
+        nlen = 0;
+
+    name[MIN(nlen, TOX_MAX_NAME_LENGTH)] = '\0';
+
+    char line[TOX_MAX_MESSAGE_LENGTH];
+    int len = snprintf(line, sizeof(line), "<%s> %.*s", nlen ? name : "?", (int) length, msg);
+    len = MIN(len, (int) sizeof(line) - 1);
+
+    uint64_t now = get_time_usec();
+
+    for (i = 0; i < MAX_BRIDGES; ++i) {
+        if (!bridges[i].active)
+            continue;
+
+        for (j = 0; j < 2; ++j) {
+            struct Bridge_Side *s = &bridges[i].side[j];
+
+            if (s->src != groupnum)
+                continue;
+
+            if (!take_token(s, now)) {
+                if (s->dropped++ == 0 || s->dropped % 100 == 0)
+                    log_msg(L_WARN, "bridge_rate_limited src=%d dest=%d dropped=%"PRIu64, s->src, s->dest,
+                            s->dropped);
+                continue;
+            }
+
+            side_append(m, s, line, len);
+            ++s->forwarded;
+        }
+    }
+}
+
+void bridge_do(Tox *m)
+{
+    int i;
+
+    for (i = 0; i < MAX_BRIDGES; ++i) {
+        if (!bridges[i].active)
+            continue;
+
+        side_flush(m, &bridges[i].side[0]);
+        side_flush(m, &bridges[i].side[1]);
+    }
+}
+
+int bridge_list(char *buf, int size)
+{
+    int len = 0;
+    int i;
+
+    buf[0] = '\0';
+
+    for (i = 0; i < MAX_BRIDGES && len < size; ++i) {
+        const struct Bridge *br = &bridges[i];
+
+        if (!br->active)
+            continue;
+
+        len += snprintf(buf + len, size - len, "%s%d <-> %d | weitergeleitet: %"PRIu64"/%"PRIu64
+                        " | verworfen: %"PRIu64"/%"PRIu64, len ? "\n" : "",
+                        br->side[0].src, br->side[0].dest, br->side[0].forwarded, br->side[1].forwarded,
+                        br->side[0].dropped, br->side[1].dropped);
+    }
+
+    return MIN(len, size - 1);
+}
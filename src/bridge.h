@@ -0,0 +1,55 @@
+/*  bridge.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BRIDGE_H
+#define BRIDGE_H
+
+#include <stdint.h>
+#include <tox/tox.h>
+
+#define MAX_BRIDGES 16
+#define BRIDGE_RATE 5            /* forwarded lines per second per direction */
+#define BRIDGE_BURST 20          /* lines a direction may send at once after being idle */
+#define BRIDGE_DUP_WINDOW 64     /* recently forwarded messages remembered for loop detection */
+#define BRIDGE_DUP_TIMEOUT 30    /* seconds a message is remembered */
+
+/* Links groups a and b so messages in either are forwarded to the other.
+   Returns 0 on success, -1 if the link exists or the bridge table is full. */
+int bridge_add(int a, int b);
+
+/* Returns 0 on success, -1 if a and b aren't linked. */
+int bridge_remove(int a, int b);
+
+/* Removes every bridge touching groupnum. */
+void bridge_remove_group(int groupnum);
+
+/* Called from the group message callback. Queues the message for every group linked to groupnum. */
+void bridge_group_message(Tox *m, int groupnum, int peernum, const char *msg, uint16_t length);
+
+/* Sends everything queued since the last call, one message per direction where possible.
+   Call once per main loop iteration. */
+void bridge_do(Tox *m);
+
+/* Writes one line per bridge into buf. Returns the length written. */
+int bridge_list(char *buf, int size);
+
+#endif /* BRIDGE_H */
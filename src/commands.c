@@ -21,6 +21,7 @@
  */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -32,77 +33,196 @@
 #include <tox/toxav.h>
 
 #include "toxbot.h"
+#include "commands.h"
 #include "misc.h"
 #include "groupchats.h"
+#include "friends.h"
+#include "log.h"
+#include "stats.h"
+#include "bridge.h"
+#include "audio.h"
+#include "recorder.h"
+#include "friendstats.h"
+#include "timer.h"
+#include "reply.h"
+#include "mem.h"
+#include "state.h"
+#include "autoinvite.h"
+#include "trace.h"
+#include "watchdog.h"
+#include "gstats.h"
+#include "spam.h"
+#include "triggers.h"
+#include "history.h"
 
 #define MAX_COMMAND_LENGTH TOX_MAX_MESSAGE_LENGTH
-#define MAX_NUM_ARGS 4
+#define MAX_NUM_ARGS 5
+
+/* The unparsed command being run, for commands that take more words than MAX_NUM_ARGS */
+static const char *command_input;
 
 extern char *DATA_FILE;
-extern char *MASTERLIST_FILE;
 extern char *SETTINGS_FILE;
 extern struct Tox_Bot Tox_Bot;
 
+#define MAX_BATCH_STEPS 32
+
+/* While a batch runs, replies to its sender are collected here and sent as one message
+   (or as few as fit) when it is done, instead of one message per reply. */
+static struct {
+    bool active;
+    bool sending;     /* set while the batch reply itself sends, so it isn't collected again */
+    int32_t friendnum;
+    int is_master;    /* -1 until the first master command of the batch checks it */
+    int step;
+    bool step_replied;
+    bool step_failed;
+    int failed;
+    struct Reply reply;
+} batch;
+
+static bool offline;
+
+void bot_set_offline(bool on)
+{
+    offline = on;
+}
+
+static uint32_t send_reply(Tox *m, int32_t friendnum, const uint8_t *msg, uint32_t length)
+{
+    uint64_t span = trace_start();
+    uint32_t ret = offline ? 1 : tox_send_message(m, friendnum, msg, length);
+    trace_end("tox_send_message", span);
+    stats_reply(ret != 0);
+
+    if (ret != 0)
+        friendstats_sent(friendnum, length);
+
+    return ret;
+}
+
+static void batch_flush(Tox *m)
+{
+    batch.sending = true;
+    reply_send(&batch.reply);
+    batch.sending = false;
+}
+
+static void batch_append(Tox *m, const char *msg, uint32_t length)
+{
+    batch.sending = true;
+
+    if (!batch.step_replied) {
+        reply_printf(&batch.reply, "[%d] %.*s", batch.step, (int) length, msg);
+    } else {
+        reply_text(&batch.reply, msg, length);
+    }
+
+    batch.sending = false;
+    batch.step_replied = true;
+}
+
+uint32_t bot_send_message(Tox *m, int32_t friendnum, const uint8_t *msg, uint32_t length)
+{
+    if (batch.active && !batch.sending && friendnum == batch.friendnum) {
+        batch_append(m, (const char *) msg, length);
+        return 1;
+    }
+
+    return send_reply(m, friendnum, msg, length);
+}
+
+/* friend_is_master() looks up the friend's key and polls the journal, so a batch only asks it once */
+static bool is_master(Tox *m, int friendnum)
+{
+    if (!batch.active || friendnum != batch.friendnum)
+        return friend_is_master(m, friendnum);
+
+    if (batch.is_master == -1)
+        batch.is_master = friend_is_master(m, friendnum);
+
+    return batch.is_master;
+}
+
+/* Error replies go through these, so a batch counts the step as failed */
+static void send_error(Tox *m, int friendnum, const char *msg)
+{
+    batch.step_failed = true;
+    bot_send_message(m, friendnum, (const uint8_t *) msg, strlen(msg));
+}
+
+static void reply_error(struct Reply *r, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void reply_error(struct Reply *r, const char *format, ...)
+{
+    char buf[TOX_MAX_MESSAGE_LENGTH];
+    va_list ap;
+
+    va_start(ap, format);
+    int len = vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+
+    batch.step_failed = true;
+    reply_text(r, buf, MIN(len, (int) sizeof(buf) - 1));
+}
+
 static void authent_failed(Tox *m, int friendnum)
 {
-    const char *outmsg = "Du...Du bist nicht mein Master...";
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+    send_error(m, friendnum, "Du...Du bist nicht mein Master...");
 }
 
 static void cmd_default(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
     const char *outmsg;
 
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
 
     if (argc < 1) {
         outmsg = "Fehler: Raumnummer erforderlich";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
     int groupnum = atoi(argv[1]);
 
     if ((groupnum == 0 && strcmp(argv[1], "0")) || groupnum < 0) {
-        outmsg = "fehler: Ungültige Raumnummer";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        outmsg = "Fehler: Ungültige Raumnummer";
+        send_error(m, friendnum, outmsg);
         return;
     }
 
-    Tox_Bot.default_groupnum = groupnum;
+    state_set_default_group(groupnum);
 
     char msg[MAX_COMMAND_LENGTH];
     snprintf(msg, sizeof(msg), "Standard Gruppennummer auf %d geändert", groupnum);
-    tox_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
+    bot_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
 
-    char name[TOX_MAX_NAME_LENGTH];
-    int len = tox_get_name(m, friendnum, (uint8_t *) name);
-    name[len] = '\0';
+    const char *name = friend_name(friendnum);
 
-    printf("Standard Gruppennummer auf %d geändert von %s", groupnum, name);
+    log_msg(L_INFO, "default_group group=%d friend=\"%s\"", groupnum, name);
 }
 
 static void cmd_gmessage(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
     const char *outmsg;
 
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
 
     if (argc < 1) {
         outmsg = "Fehler: Gruppen nummer erforderlich";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
     if (argc < 2) {
         outmsg = "Fehler: Nachricht erforderlich";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
@@ -110,19 +230,19 @@ static void cmd_gmessage(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMA
 
     if (groupnum == 0 && strcmp(argv[1], "0")) {
         outmsg = "Fehler: Ungültige Gruppennummer";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
     if (group_index(groupnum) == -1) {
         outmsg = "Fehler: Ungültige Gruppennummer";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
     if (argv[2][0] != '\"') {
         outmsg = "Fehler: Nachricht muss in Anführungszeichen stehen";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
@@ -134,129 +254,163 @@ static void cmd_gmessage(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMA
 
     if (tox_group_message_send(m, groupnum, (uint8_t *) msg, strlen(msg)) == -1) {
         outmsg = "Fehler: Konnte Nachricht nicht senden.";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
-    char name[TOX_MAX_NAME_LENGTH];
-    int nlen = tox_get_name(m, friendnum, (uint8_t *) name);
-    name[nlen] = '\0';
+    const char *name = friend_name(friendnum);
     outmsg = "Nachricht gesendet.";
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
-    printf("<%s> Nachricht an Gruppe %d: %s\n", name, groupnum, msg);
+    bot_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+    log_msg(L_INFO, "gmessage friend=\"%s\" group=%d msg=\"%s\"", name, groupnum, msg);
 }
 
 static void cmd_group(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
     const char *outmsg;
 
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
 
     if (argc < 1) {
         outmsg = "Bitte setze den Gruppentyp auf: audio or text";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
     uint8_t type = TOX_GROUPCHAT_TYPE_AV ? !strcasecmp(argv[1], "audio") : TOX_GROUPCHAT_TYPE_TEXT;
 
-    char name[TOX_MAX_NAME_LENGTH];
-    int len = tox_get_name(m, friendnum, (uint8_t *) name);
-    name[len] = '\0';
+    const char *name = friend_name(friendnum);
+
+    if (mem_over_limit(MEM_GROUPS)) {
+        mem_rejected(MEM_GROUPS);
+        log_msg(L_WARN, "group_create_failed friend=\"%s\" reason=mem_limit", name);
+        outmsg = "Fehler: Speicherlimit für Gruppen erreicht";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
 
     int groupnum = -1;
 
     if (type == TOX_GROUPCHAT_TYPE_TEXT)
         groupnum = tox_add_groupchat(m);
     else if (type == TOX_GROUPCHAT_TYPE_AV)
-        groupnum = toxav_add_av_groupchat(m, NULL, NULL);
+        groupnum = toxav_add_av_groupchat(m, recorder_audio_cb, NULL);
 
     if (groupnum == -1) {
-        printf("Gruppenerstellung von %s konnte nicht initialisiert werden\n", name);
+        log_msg(L_WARN, "group_create_failed friend=\"%s\" reason=core", name);
         outmsg = "Gruppenchat konnte nicht initialisiert werden.";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
     const char *password = argc >= 2 ? argv[2] : NULL;
 
     if (password && strlen(argv[2]) >= MAX_PASSWORD_SIZE) {
-        printf("Gruppenerstellung von %s fehlerhaft: Passwort zu lang\n", name);
+        log_msg(L_WARN, "group_create_failed friend=\"%s\" reason=password_length", name);
         outmsg = "Gruppenchat konnte nicht initialisiert werden: Passwort zu lang";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
     if (group_add(groupnum, type, password) == -1) {
-        printf("Gruppenerstellung von %s fehlerhaft\n", name);
+        log_msg(L_WARN, "group_create_failed friend=\"%s\" reason=group_add", name);
         outmsg = "Gruppe konnte nicht erstellt werden";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         tox_del_groupchat(m, groupnum);
         return;
     }
 
+    state_group_created(groupnum);
+
     const char *pw = password ? " (Password geschützt)" : "";
-    printf("Gruppenchat %d wurde erstellt von %s%s\n", groupnum, name, pw);
+    log_msg(L_INFO, "group_create group=%d type=%s friend=\"%s\" password=%d", groupnum,
+            type == TOX_GROUPCHAT_TYPE_AV ? "av" : "text", name, password != NULL);
 
     char msg[MAX_COMMAND_LENGTH];
     snprintf(msg, sizeof(msg), "Gruppenchat %d erstallt %s", groupnum, pw);
-    tox_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
+    bot_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
 }
 
-static void cmd_help(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+/* Preformatted replies for the most frequent non-master commands. Each entry is rebuilt
+   lazily after reply_cache_invalidate() clears its bit. */
+static struct {
+    int valid;
+    char id[TOX_FRIEND_ADDRESS_SIZE * 2 + 1];
+    char help[MAX_COMMAND_LENGTH];
+    int help_len;
+    char info[MAX_COMMAND_LENGTH];
+    int info_len;
+    uint64_t info_minute;    /* uptime is shown with minute resolution */
+    char owner[50];
+} reply_cache;
+
+void reply_cache_invalidate(int which)
 {
-    const char *outmsg;
+    reply_cache.valid &= ~which;
+}
 
-    outmsg = "info : Zeigt dir den Status des Bots, sowie die Gruppenchats";
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+static const char *help_lines[] = {
+    "info : Zeigt dir den Status des Bots, sowie die Gruppenchats",
+    "id : Zeigt dir die Tox-ID des Bots",
+    "hallo : Lädt dich in den bestehenden Gruppen-Chat",
+    "hallo <n> <p> : Lädt dich in eine mit einem Passwort geschützte Gruppe ein",
+    "register <n> <id> : Speichert deine Kontaktdaten im Telefonbuch",
+    "kontakte : Zeigt alle registrierten Kontakte des Bots an",
+    "auto on [n] | off : Lädt dich automatisch ein, sobald du online kommst",
+    "search <n> <wörter> : Durchsucht den Verlauf einer Gruppe, in der du bist",
+    NULL,
+};
 
-    outmsg = "id : Zeigt dir die Tox-ID des Bots";
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+static void cmd_help(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!(reply_cache.valid & REPLY_CACHE_HELP)) {
+        int len = 0;
+        int i;
 
-    outmsg = "hallo : Lädt dich in den bestehenden Gruppen-Chat";
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        for (i = 0; help_lines[i]; ++i)
+            len += snprintf(reply_cache.help + len, sizeof(reply_cache.help) - len, "%s%s",
+                            i ? "\n" : "", help_lines[i]);
 
-    outmsg = "hallo <n> <p> : Lädt dich in eine mit einem Passwort geschützte Gruppe ein";
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        reply_cache.help_len = MIN(len, (int) sizeof(reply_cache.help) - 1);
+        reply_cache.valid |= REPLY_CACHE_HELP;
+    }
 
-    outmsg = "register <n> <id> : Speichert deine Kontaktdaten im Telefonbuch";
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+    struct Reply r;
+    reply_init(&r, m, friendnum);
+    reply_text(&r, reply_cache.help, reply_cache.help_len);
 
-    outmsg = "kontakte : Zeigt alle registrierten Kontakte des Bots an";
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+    if (is_master(m, friendnum))
+        reply_printf(&r, "Für Master-Kommands gucke in die Commands.txt oder frage den Admin des Bots");
 
-    if (friend_is_master(m, friendnum)) {
-        outmsg = "Für Master-Kommands gucke in die Commands.txt oder frage den Admin des Bots";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
-    }
+    reply_send(&r);
 }
 
 static void cmd_id(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
-    char outmsg[TOX_FRIEND_ADDRESS_SIZE * 2 + 1];
-    char address[TOX_FRIEND_ADDRESS_SIZE];
-    tox_get_address(m, (uint8_t *) address);
-    int i;
+    if (!(reply_cache.valid & REPLY_CACHE_ID)) {
+        char address[TOX_FRIEND_ADDRESS_SIZE];
+        tox_get_address(m, (uint8_t *) address);
+        int i;
+
+        for (i = 0; i < TOX_FRIEND_ADDRESS_SIZE; ++i) {
+            char d[3];
+            sprintf(d, "%02X", address[i] & 0xff);
+            memcpy(reply_cache.id + i * 2, d, 2);
+        }
 
-    for (i = 0; i < TOX_FRIEND_ADDRESS_SIZE; ++i) {
-        char d[3];
-        sprintf(d, "%02X", address[i] & 0xff);
-        memcpy(outmsg + i * 2, d, 2);
+        reply_cache.id[TOX_FRIEND_ADDRESS_SIZE * 2] = '\0';
+        reply_cache.valid |= REPLY_CACHE_ID;
     }
 
-    outmsg[TOX_FRIEND_ADDRESS_SIZE * 2] = '\0';
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, TOX_FRIEND_ADDRESS_SIZE * 2);
+    bot_send_message(m, friendnum, (uint8_t *) reply_cache.id, TOX_FRIEND_ADDRESS_SIZE * 2);
 }
 
-static void cmd_info(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+/* Reads the owner from the first line of the settings file, creating the file if it's missing. */
+static void load_owner(char *owner, int len)
 {
-    //Owner-File
-    char owner[50];
-    int len = sizeof(owner);
-
+    uint64_t span = trace_start();
     FILE *in = fopen(SETTINGS_FILE, "rb");
     char fInput[len + 2];
 
@@ -271,67 +425,69 @@ static void cmd_info(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_L
         fclose(in);
     } else {
         FILE *out = fopen(SETTINGS_FILE, "w");
-        fprintf(out, "%s\n", "Owner: Tox-Bot(Ändere den Eigentümer im settings-File)");
         strncpy(owner, "Tox-Bot(Ändere den Eigentümer im settings-File)", len);
-        fclose(out);
+
+        if (out != NULL) {
+            fprintf(out, "%s\n", "Owner: Tox-Bot(Ändere den Eigentümer im settings-File)");
+            fclose(out);
+        }
     }
 
-    char outmsg[MAX_COMMAND_LENGTH];
-    char timestr[64];
+    owner[len - 1] = '\0';
+    owner[strcspn(owner, "\r\n")] = '\0';
+    trace_end("settings_read", span);
+}
 
+static void cmd_info(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
     uint64_t curtime = (uint64_t) time(NULL);
-    get_elapsed_time_str(timestr, sizeof(timestr), curtime - Tox_Bot.start_time);
-    snprintf(outmsg, sizeof(outmsg), "Betriebszeit: %s", timestr);
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
-
-    uint32_t numfriends = tox_count_friendlist(m);
-    uint32_t numonline = tox_get_num_online_friends(m);
-    snprintf(outmsg, sizeof(outmsg), "Freunde: %d (%d online)", numfriends, numonline);
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+    uint64_t uptime = curtime - Tox_Bot.start_time;
 
-    snprintf(outmsg, sizeof(outmsg), "Eigentümer: %s", owner);
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+    if (!(reply_cache.valid & REPLY_CACHE_INFO) || reply_cache.info_minute != uptime / 60) {
+        char timestr[64];
+        get_elapsed_time_str(timestr, sizeof(timestr), uptime);
 
-    snprintf(outmsg, sizeof(outmsg), "Inaktive Freunde werden nach %"PRIu64" Tagen entfernt",
-                                      Tox_Bot.inactive_limit / SECONDS_IN_DAY);
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        if (!(reply_cache.valid & REPLY_CACHE_SETTINGS)) {
+            load_owner(reply_cache.owner, sizeof(reply_cache.owner));
+            reply_cache.valid |= REPLY_CACHE_SETTINGS;
+        }
 
-    /* List active group chats and number of peers in each */
-    uint32_t numchats = tox_count_chatlist(m);
+        uint32_t numfriends = tox_count_friendlist(m);
+        uint32_t numonline = friends_num_online();
+        int len = snprintf(reply_cache.info, sizeof(reply_cache.info),
+                           "Betriebszeit: %s\nFreunde: %d (%d online)\nEigentümer: %s\n"
+                           "Inaktive Freunde werden nach %"PRIu64" Tagen entfernt",
+                           timestr, numfriends, numonline, reply_cache.owner, Tox_Bot.inactive_limit / SECONDS_IN_DAY);
 
-    if (numchats == 0) {
-        tox_send_message(m, friendnum, (uint8_t *) "Keine aktiven Gruppenchats", strlen("Keine aktiven Gruppenchats"));
-        return;
+        reply_cache.info_len = MIN(len, (int) sizeof(reply_cache.info) - 1);
+        reply_cache.info_minute = uptime / 60;
+        reply_cache.valid |= REPLY_CACHE_INFO;
     }
 
-    int32_t *groupchat_list = malloc(numchats * sizeof(int32_t));
-
-    if (groupchat_list == NULL)
-        exit(EXIT_FAILURE);
+    struct Reply r;
+    reply_init(&r, m, friendnum);
+    reply_text(&r, reply_cache.info, reply_cache.info_len);
 
-    if (tox_get_chatlist(m, groupchat_list, numchats) == 0) {
-        free(groupchat_list);
-        return;
-    }
+    /* List active group chats and number of peers in each, from the group registry */
+    int i;
+    int numchats = 0;
 
-    uint32_t i;
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        const struct Group_Chat *g = &Tox_Bot.g_chats[i];
 
-    for (i = 0; i < numchats; ++i) {
-        uint32_t groupnum = groupchat_list[i];
-        int num_peers = tox_group_number_peers(m, groupnum);
+        if (!g->active)
+            continue;
 
-        if (num_peers != -1) {
-            int idx = group_index(groupnum);
-            const char *title = Tox_Bot.g_chats[idx].title_len
-                              ? Tox_Bot.g_chats[idx].title : "Keiner";
-            const char *type = tox_group_get_type(m, groupnum) == TOX_GROUPCHAT_TYPE_TEXT ? "Text" : "Audio";
-            snprintf(outmsg, sizeof(outmsg), "Gruppe %d | %s | Teilnehmer: %d | Name: %s", groupnum, type,
-                                                                                      num_peers, title);
-            tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
-        }
+        const char *title = g->title_len ? g->title : "Keiner";
+        const char *type = g->type == TOX_GROUPCHAT_TYPE_TEXT ? "Text" : "Audio";
+        reply_printf(&r, "Gruppe %d | %s | Teilnehmer: %d | Name: %s", g->num, type, g->num_peers, title);
+        ++numchats;
     }
 
-    free(groupchat_list);
+    if (numchats == 0)
+        reply_printf(&r, "Keine aktiven Gruppenchats");
+
+    reply_send(&r);
 }
 
 static void cmd_invite(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
@@ -344,7 +500,7 @@ static void cmd_invite(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND
 
         if (groupnum == 0 && strcmp(argv[1], "0")) {
             outmsg = "Fehler: Ungültige Gruppennummer.";
-            tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+            send_error(m, friendnum, outmsg);
             return;
         }
     }
@@ -353,50 +509,143 @@ static void cmd_invite(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND
 
     if (idx == -1) {
         outmsg = "Die Gruppe existiert nicht.";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
     int has_pass = Tox_Bot.g_chats[idx].has_pass;
+    char password[MAX_PASSWORD_SIZE];
+    snprintf(password, sizeof(password), "%s", Tox_Bot.g_chats[idx].password);
 
-    char name[TOX_MAX_NAME_LENGTH];
-    int nlen = tox_get_name(m, friendnum, (uint8_t *) name);
-    name[nlen] = '\0';
+    const char *name = friend_name(friendnum);
 
     const char *passwd = NULL;
 
     if (argc >= 2)
         passwd = argv[2];
 
-    if (has_pass && (!passwd || strcmp(argv[2], Tox_Bot.g_chats[idx].password) != 0)) {
-        fprintf(stderr, "Fehler %s in die Gruppe %d einzuladen(falsches Passwort)\n", name, groupnum);
+    if (has_pass && (!passwd || strcmp(argv[2], password) != 0)) {
+        log_msg(L_WARN, "invite_failed friend=\"%s\" group=%d reason=password", name, groupnum);
         outmsg = "Falsches Passwort.";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    /* a full group hands the invite to the least loaded group of its family */
+    int target = group_route_invite(m, groupnum);
+
+    if (target == -1) {
+        log_msg(L_WARN, "invite_failed friend=\"%s\" group=%d reason=overflow", name, groupnum);
+        outmsg = "Die Gruppe ist voll.";
+        send_error(m, friendnum, outmsg);
         return;
     }
 
+    groupnum = target;
+
     if (tox_invite_friend(m, friendnum, groupnum) == -1) {
-        fprintf(stderr, "Fehler %s in die Gruppe %d einzuladen\n", name, groupnum);
+        log_msg(L_WARN, "invite_failed friend=\"%s\" group=%d reason=core", name, groupnum);
         outmsg = "Einladung gescheitert. Bitte melde das Problem im irc #tox @freenode.";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    friendstats_invite(friendnum);
+    log_msg(L_INFO, "invite friend=\"%s\" group=%d", name, groupnum);
+}
+
+static void cmd_auto(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg;
+    uint8_t key[TOX_CLIENT_ID_SIZE];
+
+    if (tox_get_client_id(m, friendnum, key) == -1)
+        return;
+
+    if (argc < 1) {
+        int groupnum = state_auto_invite(key);
+        struct Reply r;
+        reply_init(&r, m, friendnum);
+
+        if (groupnum == AUTO_INVITE_OFF)
+            reply_printf(&r, "Automatische Einladung: aus");
+        else if (groupnum == AUTO_INVITE_DEFAULT)
+            reply_printf(&r, "Automatische Einladung: an (Standardgruppe)");
+        else
+            reply_printf(&r, "Automatische Einladung: an (Gruppe %d)", groupnum);
+
+        if (is_master(m, friendnum))
+            reply_printf(&r, "Angemeldet: %d, Warteschlange: %"PRIu32", gesendet: %"PRIu64,
+                         state_num_auto_invites(), auto_invite_queued(), auto_invite_sent());
+
+        reply_send(&r);
+        return;
+    }
+
+    const char *name = friend_name(friendnum);
+
+    if (strcmp(argv[1], "off") == 0) {
+        if (state_set_auto_invite(key, AUTO_INVITE_OFF) == -1) {
+            outmsg = "Fehler: Einstellung konnte nicht gespeichert werden";
+            send_error(m, friendnum, outmsg);
+            return;
+        }
+
+        outmsg = "Automatische Einladung ausgeschaltet";
+        bot_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        log_msg(L_INFO, "auto_invite friend=\"%s\" enabled=0", name);
+        return;
+    }
+
+    if (strcmp(argv[1], "on") != 0) {
+        outmsg = "Fehler: on oder off erforderlich";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    int groupnum = AUTO_INVITE_DEFAULT;
+
+    if (argc >= 2) {
+        groupnum = atoi(argv[2]);
+        int idx = group_index(groupnum);
+
+        if ((groupnum == 0 && strcmp(argv[2], "0")) || idx == -1) {
+            outmsg = "Die Gruppe existiert nicht.";
+            send_error(m, friendnum, outmsg);
+            return;
+        }
+
+        /* the password would be skipped on every reconnect */
+        if (Tox_Bot.g_chats[idx].has_pass) {
+            outmsg = "Fehler: Automatische Einladungen gehen nur in Gruppen ohne Passwort";
+            send_error(m, friendnum, outmsg);
+            return;
+        }
+    }
+
+    if (state_set_auto_invite(key, groupnum) == -1) {
+        outmsg = "Fehler: Einstellung konnte nicht gespeichert werden";
+        send_error(m, friendnum, outmsg);
         return;
     }
 
-    printf("Hab %s in Gruppe %d eingeladen\n", name, groupnum);
+    outmsg = "Automatische Einladung eingeschaltet. Du wirst eingeladen, sobald du online kommst.";
+    bot_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+    log_msg(L_INFO, "auto_invite friend=\"%s\" enabled=1 group=%d", name, groupnum);
 }
 
 static void cmd_leave(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
     const char *outmsg;
 
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
 
     if (argc < 1) {
         outmsg = "Fehler: Gruppennummer erforderlich";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
@@ -404,40 +653,39 @@ static void cmd_leave(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_
 
     if (groupnum == 0 && strcmp(argv[1], "0")) {
         outmsg = "Fehler: Ungültige Gruppennummer";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
     if (tox_del_groupchat(m, groupnum) == -1) {
         outmsg = "Fehler: Ungültige Gruppennummer";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
     char msg[MAX_COMMAND_LENGTH];
-    char name[TOX_MAX_NAME_LENGTH];
-    int nlen = tox_get_name(m, friendnum, (uint8_t *) name);
-    name[nlen] = '\0';
+    const char *name = friend_name(friendnum);
 
+    state_group_removed(groupnum);
     group_leave(groupnum);
 
-    printf("Verlasse Gruppe %d (%s)\n", groupnum, name);
+    log_msg(L_INFO, "group_leave group=%d friend=\"%s\"", groupnum, name);
     snprintf(msg, sizeof(msg), "Verlasse Gruppe %d", groupnum);
-    tox_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
+    bot_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
 }
 
 static void cmd_master(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
     const char *outmsg;
 
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
 
     if (argc < 1) {
         outmsg = "Fehler: Tox ID erforderlich";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
@@ -445,42 +693,45 @@ static void cmd_master(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND
 
     if (strlen(id) != TOX_FRIEND_ADDRESS_SIZE * 2) {
         outmsg = "Fehler: Ungültige Tox ID";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
-    FILE *fp = fopen(MASTERLIST_FILE, "a");
+    char *key = hex_string_to_bin(id);
+    int ret = state_add_master((uint8_t *) key);
+    mem_free(key);
 
-    if (fp == NULL) {
-        outmsg = "Fehler: Kann masterkey Datei nicht finden";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+    if (ret == -1) {
+        outmsg = "Fehler: Master konnte nicht gespeichert werden";
+        send_error(m, friendnum, outmsg);
         return;
     }
 
-    fprintf(fp, "%s\n", id);
-    fclose(fp);
+    if (ret == 1) {
+        outmsg = "ID ist bereits Master";
+        bot_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        return;
+    }
 
-    char name[TOX_MAX_NAME_LENGTH];
-    int len = tox_get_name(m, friendnum, (uint8_t *) name);
-    name[len] = '\0';
+    const char *name = friend_name(friendnum);
 
-    printf("%s hat Master hinzugefügt: %s\n", name, id);
-    outmsg = "ID zu masterkeys hinzugefügt";
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+    log_msg(L_INFO, "master_add friend=\"%s\" id=%s", name, id);
+    outmsg = "ID zu den Mastern hinzugefügt";
+    bot_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
 }
 
 static void cmd_name(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
     const char *outmsg;
 
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
 
     if (argc < 1) {
         outmsg = "Fehler: Name erforderlich";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
@@ -498,11 +749,9 @@ static void cmd_name(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_L
     name[len] = '\0';
     tox_set_name(m, (uint8_t *) name, (uint16_t) len);
 
-    char m_name[TOX_MAX_NAME_LENGTH];
-    int nlen = tox_get_name(m, friendnum, (uint8_t *) m_name);
-    m_name[nlen] = '\0';
+    const char *m_name = friend_name(friendnum);
 
-    printf("%s ändert Name zu %s\n", m_name, name);
+    log_msg(L_INFO, "set_name friend=\"%s\" name=\"%s\"", m_name, name);
     save_data(m, DATA_FILE);
 }
 
@@ -510,9 +759,14 @@ static void cmd_passwd(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND
 {
     const char *outmsg;
 
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
     if (argc < 1) {
         outmsg = "Fehler: Gruppennummer erforderlich";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
@@ -520,7 +774,7 @@ static void cmd_passwd(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND
 
     if (groupnum == 0 && strcmp(argv[1], "0")) {
         outmsg = "Fehler: Ungültige Gruppennummer";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
@@ -528,37 +782,35 @@ static void cmd_passwd(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND
 
     if (idx == -1) {
         outmsg = "Fehler: Ungültige Gruppennummer";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
-    char name[TOX_MAX_NAME_LENGTH];
-    int nlen = tox_get_name(m, friendnum, (uint8_t *) name);
-    name[nlen] = '\0';
+    const char *name = friend_name(friendnum);
 
     /* no password */
     if (argc < 2) {
-        Tox_Bot.g_chats[idx].has_pass = false;
-        memset(Tox_Bot.g_chats[idx].password, 0, MAX_PASSWORD_SIZE);
+        group_set_password(groupnum, NULL);
+        state_group_changed(groupnum);
 
         outmsg = "Kein Passwort gesetzt";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
-        printf("Kein Passwort für Gruppe %d von %s gesetzt\n", groupnum, name);
+        bot_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        log_msg(L_INFO, "group_passwd group=%d friend=\"%s\" password=0", groupnum, name);
         return;
     }
 
     if (strlen(argv[2]) >= MAX_PASSWORD_SIZE) {
         outmsg = "Passwort zu lang";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
-    Tox_Bot.g_chats[idx].has_pass = true;
-    snprintf(Tox_Bot.g_chats[idx].password, sizeof(Tox_Bot.g_chats[idx].password), "%s", argv[2]);
+    group_set_password(groupnum, argv[2]);
+    state_group_changed(groupnum);
 
     outmsg = "Passwort geändert";
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
-    printf("Passwort für Gruppe %d geändert von %s\n", groupnum, name);
+    bot_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+    log_msg(L_INFO, "group_passwd group=%d friend=\"%s\" password=1", groupnum, name);
 
 }
 
@@ -566,14 +818,14 @@ static void cmd_purge(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_
 {
     const char *outmsg;
 
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
 
     if (argc < 1) {
         outmsg = "Fehler: Nummer > 0 erforderlich";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
@@ -581,36 +833,35 @@ static void cmd_purge(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_
 
     if (days <= 0) {
         outmsg = "Fehler: Nummer > 0 erforderlich";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
     uint64_t seconds = days * SECONDS_IN_DAY;
-    Tox_Bot.inactive_limit = seconds;
+    state_set_purge_limit(seconds);
+    reply_cache_invalidate(REPLY_CACHE_INFO);
 
-    char name[TOX_MAX_NAME_LENGTH];
-    int nlen = tox_get_name(m, friendnum, (uint8_t *) name);
-    name[nlen] = '\0';
+    const char *name = friend_name(friendnum);
 
     char msg[MAX_COMMAND_LENGTH];
     snprintf(msg, sizeof(msg), "Entfernen Zeit auf %"PRIu64" Tage geändert", days);
-    tox_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
+    bot_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
 
-    printf("Entfernen Zeit auf %"PRIu64" Tage geändert von %s\n", days, name);
+    log_msg(L_INFO, "purge_limit days=%"PRIu64" friend=\"%s\"", days, name);
 }
 
 static void cmd_status(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
     const char *outmsg;
 
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
 
     if (argc < 1) {
         outmsg = "Fehler: Status erforderlich";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
@@ -625,17 +876,15 @@ static void cmd_status(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND
         type = TOX_USERSTATUS_BUSY;
     else {
         outmsg = "Ungültiger Status. Gültige Statusmeldungen sind: online, busy und away.";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
     tox_set_user_status(m, type);
 
-    char name[TOX_MAX_NAME_LENGTH];
-    int nlen = tox_get_name(m, friendnum, (uint8_t *) name);
-    name[nlen] = '\0';
+    const char *name = friend_name(friendnum);
 
-    printf("%s ändert Status auf %s\n", name, status);
+    log_msg(L_INFO, "set_status friend=\"%s\" status=%s", name, status);
     save_data(m, DATA_FILE);
 }
 
@@ -643,20 +892,20 @@ static void cmd_statusmessage(Tox *m, int friendnum, int argc, char (*argv)[MAX_
 {
     const char *outmsg;
 
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
 
     if (argc < 1) {
         outmsg = "Fehler: Nachricht erforderlich";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
     if (argv[1][0] != '\"') {
         outmsg = "Fehler: Nachricht muss in Anführungszeichen stehen";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
@@ -668,11 +917,9 @@ static void cmd_statusmessage(Tox *m, int friendnum, int argc, char (*argv)[MAX_
 
     tox_set_status_message(m, (uint8_t *) msg, len);
 
-    char name[TOX_MAX_NAME_LENGTH];
-    int nlen = tox_get_name(m, friendnum, (uint8_t *) name);
-    name[nlen] = '\0';
+    const char *name = friend_name(friendnum);
 
-    printf("%s ändert Status auf \"%s\"\n", name, msg);
+    log_msg(L_INFO, "set_statusmessage friend=\"%s\" msg=\"%s\"", name, msg);
     save_data(m, DATA_FILE);
 }
 
@@ -680,20 +927,20 @@ static void cmd_title_set(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMM
 {
     const char *outmsg;
 
-    if (!friend_is_master(m, friendnum)) {
+    if (!is_master(m, friendnum)) {
         authent_failed(m, friendnum);
         return;
     }
 
     if (argc < 2) {
         outmsg = "Fehler: 2 Argumente erforderlich";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
     if (argv[2][0] != '\"') {
         outmsg = "Fehler: Titel muss in Anführungszeichen stehen";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
@@ -701,7 +948,7 @@ static void cmd_title_set(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMM
 
     if (groupnum == 0 && strcmp(argv[1], "0")) {
         outmsg = "Fehler: Ungültige Gruppennummer";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        send_error(m, friendnum, outmsg);
         return;
     }
 
@@ -711,194 +958,1709 @@ static void cmd_title_set(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMM
     int len = strlen(title) - 1;
     title[len] = '\0';
 
-    char name[TOX_MAX_NAME_LENGTH];
-    int nlen = tox_get_name(m, friendnum, (uint8_t *) name);
-    name[nlen] = '\0';
+    const char *name = friend_name(friendnum);
 
     if (tox_group_set_title(m, groupnum, (uint8_t *) title, len) != 0) {
         outmsg = "Konnte den Titel nicht ändern. Das kann durch eine falsche Gruppennummer oder leere Gruppe ausgelöst werden";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
-        printf("%s konnte den Titel '%s' für Gruppe %d nicht ändern\n", name, title, groupnum);
+        send_error(m, friendnum, outmsg);
+        log_msg(L_WARN, "title_failed friend=\"%s\" group=%d title=\"%s\"", name, groupnum, title);
         return;
     }
 
     int idx = group_index(groupnum);
-    memcpy(Tox_Bot.g_chats[idx].title, title, len + 1);
-    Tox_Bot.g_chats[idx].title_len = len;
 
-    outmsg = "Gruppentitel geändert";
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
-    printf("%s ändert Gruppentitel der Gruppe %d zu %s\n", name, groupnum, title);
-}
+    if (idx != -1) {
+        memcpy(Tox_Bot.g_chats[idx].title, title, len + 1);
+        Tox_Bot.g_chats[idx].title_len = len;
+    }
 
+    state_group_changed(groupnum);
 
-//------------------------------------------------------------------------------
+    outmsg = "Gruppentitel geändert";
+    bot_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+    log_msg(L_INFO, "title friend=\"%s\" group=%d title=\"%s\"", name, groupnum, title);
+}
 
-static void cmd_register(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_bridge(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
     const char *outmsg;
 
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
 
     if (argc < 2) {
-        outmsg = "Fehler: 3 Argumente erforderlich";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        outmsg = "Fehler: 2 Gruppennummern erforderlich";
+        send_error(m, friendnum, outmsg);
         return;
     }
 
-    if (argv[1][0] != '\"') {
-        outmsg = "Fehler: Name muss in Anführungszeichen stehen";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+    int a = atoi(argv[1]);
+    int b = atoi(argv[2]);
+
+    if (group_index(a) == -1 || group_index(b) == -1 || (a == 0 && strcmp(argv[1], "0"))
+        || (b == 0 && strcmp(argv[2], "0"))) {
+        outmsg = "Fehler: Ungültige Gruppennummer";
+        send_error(m, friendnum, outmsg);
         return;
     }
 
-    if (argv[2][0] != '\"') {
-        outmsg = "Fehler: ID muss in Anführungszeichen stehen";
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+    bool unlink = strcmp(argv[0], "unbridge") == 0;
+
+    if ((unlink ? bridge_remove(a, b) : bridge_add(a, b)) == -1) {
+        outmsg = unlink ? "Fehler: Die Gruppen sind nicht verbunden"
+                        : "Fehler: Die Gruppen sind schon verbunden oder es gibt zu viele Brücken";
+        send_error(m, friendnum, outmsg);
         return;
     }
 
-    char name[MAX_COMMAND_LENGTH];
-    snprintf(name, sizeof(name), "%s", &argv[1][1]);
-    int len1 = strlen(name) - 1;
-    name[len1] = '\0';
+    const char *name = friend_name(friendnum);
+    log_msg(L_INFO, "%s a=%d b=%d friend=\"%s\"", unlink ? "bridge_remove" : "bridge_add", a, b, name);
 
-    char id[100];
-    snprintf(id, sizeof(id), "%s", &argv[3][1]);
-    int len = strlen(id) - 1;
-    id[len] = '\0';
+    char msg[MAX_COMMAND_LENGTH];
+    snprintf(msg, sizeof(msg), unlink ? "Brücke %d <-> %d entfernt" : "Brücke %d <-> %d erstellt", a, b);
+    bot_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
+}
+
+static void cmd_bridges(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
 
-    FILE *out = fopen("contacts", "a");
-    fprintf(out, "%s\t:\t%s\n", name, id);
-    fclose(out);
+    char list[MAX_BRIDGES * 128];
+    int len = bridge_list(list, sizeof(list));
 
-    outmsg = "Registrierung erfolgreich";
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
-    printf("%s hat sich registriert.\n", name);
+    if (len == 0)
+        len = snprintf(list, sizeof(list), "Keine Brücken");
+
+    struct Reply r;
+    reply_init(&r, m, friendnum);
+    reply_text(&r, list, len);
+    reply_send(&r);
 }
 
-static void cmd_show_contacts(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+static void cmd_gstats(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
-    //Owner-File
-    char owner[MAX_COMMAND_LENGTH + TOX_FRIEND_ADDRESS_SIZE + 30];
-    int len = MAX_COMMAND_LENGTH + TOX_FRIEND_ADDRESS_SIZE + 30;
-    char outmsg[len];
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
 
-    FILE *in = fopen("contacts", "rb");
-    char fInput[len + 2];
+    struct Reply r;
+    reply_init(&r, m, friendnum);
 
-    snprintf(outmsg, sizeof(outmsg), "Kontakte\n");
-    tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+    if (argc < 1) {
+        char line[128];
+        int i, n = 0;
 
-    if (in != NULL){
-        int count = 0;
-        while(fgets(fInput, (len), in) != NULL) {
-            strncpy(outmsg, fInput, len);
-            *strchr(outmsg, '\n') = ' ';
-            tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
-            count++;
+        for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+            int len = Tox_Bot.g_chats[i].active ? gstats_summary(Tox_Bot.g_chats[i].num, line, sizeof(line)) : 0;
+
+            if (len > 0) {
+                reply_line(&r, line, len);
+                ++n;
+            }
         }
-        fclose(in);
-    } else {
-        printf("Keine Einträge");
-        strncpy(owner, "Keine Einträge", len);
-        strncpy(outmsg, owner, len);
-        tox_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
-        fclose(in);
+
+        if (n == 0)
+            reply_printf(&r, "Noch keine Gruppennachrichten");
+
+        reply_send(&r);
+        return;
     }
-}
 
+    int groupnum = atoi(argv[1]);
+    char report[2048];
+    int len;
 
-/* Parses input command and puts args into arg array.
-   Returns number of arguments on success, -1 on failure. */
-static int parse_command(const char *input, char (*args)[MAX_COMMAND_LENGTH])
-{
-    char *cmd = strdup(input);
+    if ((groupnum == 0 && strcmp(argv[1], "0")) || group_index(groupnum) == -1)
+        reply_error(&r, "Fehler: Ungültige Gruppennummer");
+    else if ((len = gstats_report(groupnum, report, sizeof(report))) == -1)
+        reply_printf(&r, "Gruppe %d: noch keine Nachrichten", groupnum);
+    else
+        reply_text(&r, report, len);
 
-    if (cmd == NULL)
-        exit(EXIT_FAILURE);
+    reply_send(&r);
+}
 
-    int num_args = 0;
-    int i = 0;    /* index of last char in an argument */
+static void cmd_spam(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
 
-    /* characters wrapped in double quotes count as one arg */
-    while (num_args < MAX_NUM_ARGS) {
-        int qt_ofst = 0;    /* set to 1 to offset index for quote char at end of arg */
+    struct Reply r;
+    reply_init(&r, m, friendnum);
 
-        if (*cmd == '\"') {
-            qt_ofst = 1;
-            i = char_find(1, cmd, '\"');
+    if (argc < 1) {
+        char line[160];
+        int i, n = 0;
 
-            if (cmd[i] == '\0') {
-                free(cmd);
-                return -1;
+        for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+            int len = Tox_Bot.g_chats[i].active ? spam_summary(Tox_Bot.g_chats[i].num, line, sizeof(line)) : 0;
+
+            if (len > 0) {
+                reply_line(&r, line, len);
+                ++n;
             }
-        } else {
-            i = char_find(0, cmd, ' ');
         }
 
-        memcpy(args[num_args], cmd, i + qt_ofst);
-        args[num_args++][i + qt_ofst] = '\0';
+        if (n == 0)
+            reply_printf(&r, "Der Spamfilter ist in keiner Gruppe aktiv");
 
-        if (cmd[i] == '\0')    /* no more args */
-            break;
+        reply_send(&r);
+        return;
+    }
 
-        char tmp[MAX_COMMAND_LENGTH];
-        snprintf(tmp, sizeof(tmp), "%s", &cmd[i + 1]);
-        strcpy(cmd, tmp);    /* tmp will always fit inside cmd */
+    int groupnum = atoi(argv[1]);
+    int mode = argc < 2 ? -1 : spam_mode_parse(argv[2]);
+
+    if ((groupnum == 0 && strcmp(argv[1], "0")) || group_index(groupnum) == -1) {
+        reply_error(&r, "Fehler: Ungültige Gruppennummer");
+    } else if (argc < 2) {
+        char line[160];
+        int len = spam_summary(groupnum, line, sizeof(line));
+
+        if (len > 0)
+            reply_line(&r, line, len);
+        else
+            reply_printf(&r, "Gruppe %d: Spamfilter aus", groupnum);
+    } else if (mode == -1) {
+        reply_error(&r, "Fehler: Modus muss off, warn oder report sein");
+    } else if (spam_set_mode(groupnum, mode) == -1) {
+        reply_error(&r, "Fehler: Nicht genug Speicher für den Spamfilter");
+    } else {
+        log_msg(L_INFO, "spam_mode group=%d mode=%s friend=\"%s\"", groupnum, spam_mode_name(mode),
+                friend_name(friendnum));
+        reply_printf(&r, "Spamfilter für Gruppe %d: %s", groupnum, spam_mode_name(mode));
     }
 
-    free(cmd);
-    return num_args;
+    reply_send(&r);
 }
 
-static struct {
-    const char *name;
-    void (*func)(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH]);
-} commands[] = {
-    { "default",          cmd_default       },
-    { "group",            cmd_group         },
-    { "gmessage",         cmd_gmessage      },
-    { "hilfe",            cmd_help          },
-    { "id",               cmd_id            },
-    { "info",             cmd_info          },
-    { "hallo",            cmd_invite        },
-    { "leave",            cmd_leave         },
-    { "master",           cmd_master        },
-    { "name",             cmd_name          },
-    { "passwd",           cmd_passwd        },
-    { "purge",            cmd_purge         },
-    { "status",           cmd_status        },
-    { "statusmessage",    cmd_statusmessage },
-    { "title",            cmd_title_set     },
-    { "register",         cmd_register      },
-    { "kontakte",         cmd_show_contacts },
-    { NULL,               NULL              },
-};
+#define TRIGGER_LIST_MAX 50
 
-static int do_command(Tox *m, int friendnum, int num_args, char (*args)[MAX_COMMAND_LENGTH])
+static void cmd_trigger(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
-    int i;
+    const char *outmsg;
 
-    for (i = 0; commands[i].name; ++i) {
-        if (strcmp(args[0], commands[i].name) == 0) {
-            (commands[i].func)(m, friendnum, num_args - 1, args);
-            return 0;
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 4) {
+        outmsg = "Fehler: trigger <n|all> <sekunden> \"<muster>\" \"<antwort>\"";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    int groupnum = TRIGGER_ALL_GROUPS;
+
+    if (strcmp(argv[1], "all") != 0) {
+        groupnum = atoi(argv[1]);
+
+        if ((groupnum == 0 && strcmp(argv[1], "0")) || group_index(groupnum) == -1) {
+            outmsg = "Fehler: Ungültige Gruppennummer";
+            send_error(m, friendnum, outmsg);
+            return;
         }
     }
 
-    return -1;
+    if (argv[2][0] == '\0' || strspn(argv[2], "0123456789") != strlen(argv[2])) {
+        outmsg = "Fehler: Ungültige Wartezeit";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    if (argv[3][0] != '\"' || argv[4][0] != '\"') {
+        outmsg = "Fehler: Muster und Antwort müssen in Anführungszeichen stehen";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    /* remove opening and closing quotes */
+    char pattern[MAX_COMMAND_LENGTH];
+    snprintf(pattern, sizeof(pattern), "%s", &argv[3][1]);
+    pattern[strlen(pattern) - 1] = '\0';
+
+    char reply[MAX_COMMAND_LENGTH];
+    snprintf(reply, sizeof(reply), "%s", &argv[4][1]);
+    reply[strlen(reply) - 1] = '\0';
+
+    uint32_t cooldown = strtoul(argv[2], NULL, 10);
+
+    if (state_set_trigger(pattern, reply, groupnum, cooldown) == -1) {
+        char msg[MAX_COMMAND_LENGTH];
+        snprintf(msg, sizeof(msg), "Fehler: Muster (1-%d Zeichen) oder Antwort (1-%d Zeichen) ungültig, "
+                 "zu viele Trigger (%d) oder Journal nicht beschreibbar", TRIGGER_MAX_PATTERN, TRIGGER_MAX_REPLY,
+                 MAX_TRIGGERS);
+        send_error(m, friendnum, msg);
+        return;
+    }
+
+    log_msg(L_INFO, "trigger_add pattern=\"%s\" group=%d cooldown=%"PRIu32" friend=\"%s\"", pattern, groupnum,
+            cooldown, friend_name(friendnum));
+
+    outmsg = "Trigger gespeichert";
+    bot_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
 }
 
-int execute(Tox *m, int friendnum, const char *input, int length)
+static void cmd_untrigger(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
 {
-    if (length >= MAX_COMMAND_LENGTH)
+    const char *outmsg;
+
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 1) {
+        outmsg = "Fehler: Muster erforderlich";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    char pattern[MAX_COMMAND_LENGTH];
+    snprintf(pattern, sizeof(pattern), "%s", argv[1][0] == '\"' ? &argv[1][1] : argv[1]);
+
+    if (argv[1][0] == '\"')    /* remove opening and closing quotes */
+        pattern[strlen(pattern) - 1] = '\0';
+
+    if (state_remove_trigger(pattern) == -1) {
+        outmsg = "Fehler: Kein Trigger mit diesem Muster";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    log_msg(L_INFO, "trigger_remove pattern=\"%s\" friend=\"%s\"", pattern, friend_name(friendnum));
+
+    outmsg = "Trigger entfernt";
+    bot_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+}
+
+static void cmd_triggers(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    struct Reply r;
+    reply_init(&r, m, friendnum);
+
+    char line[256];
+    int len = triggers_info(line, sizeof(line));
+    reply_line(&r, line, len);
+
+    int num = state_num_triggers();
+    int i;
+
+    for (i = 0; i < num && i < TRIGGER_LIST_MAX; ++i) {
+        const struct Trigger *t = state_trigger(i);
+        char scope[16];
+
+        if (t->groupnum == TRIGGER_ALL_GROUPS)
+            snprintf(scope, sizeof(scope), "alle");
+        else
+            snprintf(scope, sizeof(scope), "Gruppe %d", t->groupnum);
+
+        /* long replies are cut, but not inside a UTF-8 sequence */
+        int rlen = strlen(t->reply), cut = MIN(rlen, 60);
+
+        while (cut < rlen && cut > 0 && (t->reply[cut] & 0xc0) == 0x80)
+            --cut;
+
+        reply_printf(&r, "\"%s\" (%s, %"PRIu32" s): %.*s%s", t->pattern, scope, t->cooldown, cut, t->reply,
+                     cut < rlen ? "..." : "");
+    }
+
+    if (num > TRIGGER_LIST_MAX)
+        reply_printf(&r, "... und %d weitere", num - TRIGGER_LIST_MAX);
+    else if (num == 0)
+        reply_printf(&r, "Keine Trigger");
+
+    reply_send(&r);
+}
+
+static void cmd_capacity(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg;
+
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 2) {
+        outmsg = "Fehler: Gruppennummer und Kapazität erforderlich";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    int groupnum = atoi(argv[1]);
+    int capacity = atoi(argv[2]);
+
+    if ((groupnum == 0 && strcmp(argv[1], "0")) || capacity < 0 || (capacity == 0 && strcmp(argv[2], "0"))) {
+        outmsg = "Fehler: Ungültige Gruppennummer oder Kapazität";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    if (group_set_capacity(groupnum, capacity) == -1) {
+        outmsg = "Fehler: Ungültige Gruppennummer";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    state_group_changed(groupnum);
+
+    const char *name = friend_name(friendnum);
+    log_msg(L_INFO, "group_capacity group=%d capacity=%d friend=\"%s\"", groupnum, capacity, name);
+
+    char msg[MAX_COMMAND_LENGTH];
+
+    if (capacity)
+        snprintf(msg, sizeof(msg), "Kapazität der Gruppe %d auf %d gesetzt", groupnum, capacity);
+    else
+        snprintf(msg, sizeof(msg), "Kapazität der Gruppe %d aufgehoben", groupnum);
+
+    bot_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
+}
+
+/* Returns the group number in arg if it is an AV group, -1 otherwise (after telling friendnum why). */
+static int av_group_arg(Tox *m, int friendnum, const char *arg)
+{
+    const char *outmsg;
+    int groupnum = atoi(arg);
+    int idx = group_index(groupnum);
+
+    if ((groupnum == 0 && strcmp(arg, "0")) || idx == -1) {
+        outmsg = "Fehler: Ungültige Gruppennummer";
+        send_error(m, friendnum, outmsg);
+        return -1;
+    }
+
+    if (Tox_Bot.g_chats[idx].type != TOX_GROUPCHAT_TYPE_AV) {
+        outmsg = "Fehler: Keine Audio-Gruppe";
+        send_error(m, friendnum, outmsg);
         return -1;
+    }
+
+    return groupnum;
+}
+
+static void cmd_play(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg;
+
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 2) {
+        outmsg = "Fehler: Gruppennummer und Clip erforderlich";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    int groupnum = av_group_arg(m, friendnum, argv[1]);
+
+    if (groupnum == -1)
+        return;
+
+    int volume = argc > 2 ? atoi(argv[3]) : 100;
+
+    if (audio_play(m, groupnum, argv[2], volume) == -1) {
+        outmsg = "Fehler: Clip konnte nicht abgespielt werden";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    log_msg(L_INFO, "audio_play group=%d clip=%s volume=%d friend=\"%s\"", groupnum, argv[2], volume,
+            friend_name(friendnum));
+
+    char msg[MAX_COMMAND_LENGTH];
+    snprintf(msg, sizeof(msg), "Spiele %s in Gruppe %d", argv[2], groupnum);
+    bot_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
+}
+
+static void cmd_tone(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg;
+
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 1) {
+        outmsg = "Fehler: Gruppennummer erforderlich";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    int groupnum = av_group_arg(m, friendnum, argv[1]);
+
+    if (groupnum == -1)
+        return;
+
+    int volume = argc > 1 ? atoi(argv[2]) : 100;
+    int ret = audio_tone(m, groupnum, volume);
+
+    if (ret == -1) {
+        outmsg = "Fehler: Warteton konnte nicht gestartet werden";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    log_msg(L_INFO, "audio_tone group=%d on=%d friend=\"%s\"", groupnum, ret, friend_name(friendnum));
+
+    char msg[MAX_COMMAND_LENGTH];
+    snprintf(msg, sizeof(msg), "Warteton in Gruppe %d %s", groupnum, ret ? "an" : "aus");
+    bot_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
+}
+
+static void cmd_stop(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg;
+
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 1) {
+        outmsg = "Fehler: Gruppennummer erforderlich";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    int groupnum = av_group_arg(m, friendnum, argv[1]);
+
+    if (groupnum == -1)
+        return;
+
+    audio_stop(groupnum);
+
+    char msg[MAX_COMMAND_LENGTH];
+    snprintf(msg, sizeof(msg), "Wiedergabe in Gruppe %d gestoppt", groupnum);
+    bot_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
+}
+
+static void cmd_record(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg;
+
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    char msg[TOX_MAX_MESSAGE_LENGTH];
+
+    if (argc < 1) {
+        int len = recorder_status(msg, sizeof(msg));
+
+        struct Reply r;
+        reply_init(&r, m, friendnum);
+        reply_text(&r, msg, len);
+        reply_send(&r);
+        return;
+    }
+
+    int groupnum = av_group_arg(m, friendnum, argv[1]);
+
+    if (groupnum == -1)
+        return;
+
+    if (argc < 2 || (strcmp(argv[2], "on") && strcmp(argv[2], "off"))) {
+        outmsg = "Fehler: on oder off erforderlich";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    if (strcmp(argv[2], "on") == 0) {
+        if (recorder_start(groupnum) == -1) {
+            outmsg = "Fehler: Aufnahme konnte nicht gestartet werden";
+            send_error(m, friendnum, outmsg);
+            return;
+        }
+
+        snprintf(msg, sizeof(msg), "Gruppe %d wird aufgenommen", groupnum);
+    } else {
+        recorder_stop(groupnum);
+        snprintf(msg, sizeof(msg), "Aufnahme der Gruppe %d beendet", groupnum);
+    }
+
+    log_msg(L_INFO, "record group=%d state=%s friend=\"%s\"", groupnum, argv[2], friend_name(friendnum));
+    bot_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
+}
+
+static void cmd_history(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    struct Reply r;
+    reply_init(&r, m, friendnum);
+
+    if (argc < 1) {
+        char msg[TOX_MAX_MESSAGE_LENGTH];
+        int len = history_status(msg, sizeof(msg));
+
+        if (len > 0)
+            reply_text(&r, msg, len);
+        else
+            reply_printf(&r, "Der Verlauf wird in keiner Gruppe aufgezeichnet");
+
+        reply_send(&r);
+        return;
+    }
+
+    int groupnum = atoi(argv[1]);
+
+    if ((groupnum == 0 && strcmp(argv[1], "0")) || group_index(groupnum) == -1) {
+        reply_error(&r, "Fehler: Ungültige Gruppennummer");
+    } else if (argc < 2) {
+        reply_printf(&r, "Gruppe %d: Verlauf %s", groupnum, history_enabled(groupnum) ? "an" : "aus");
+    } else if (strcmp(argv[2], "on") && strcmp(argv[2], "off")) {
+        reply_error(&r, "Fehler: on oder off erforderlich");
+    } else if (strcmp(argv[2], "on") == 0 && history_start(groupnum) == -1) {
+        reply_error(&r, "Fehler: Verlauf konnte nicht gestartet werden");
+    } else {
+        if (strcmp(argv[2], "off") == 0)
+            history_stop(groupnum);
+
+        log_msg(L_INFO, "history group=%d state=%s friend=\"%s\"", groupnum, argv[2], friend_name(friendnum));
+        reply_printf(&r, "Verlauf der Gruppe %d %s", groupnum,
+                     history_enabled(groupnum) ? "wird aufgezeichnet" : "wird nicht mehr aufgezeichnet");
+    }
+
+    reply_send(&r);
+}
+
+/* Returns true if friendnum is a peer of groupnum */
+static bool friend_in_group(Tox *m, int friendnum, int groupnum)
+{
+    uint8_t key[TOX_CLIENT_ID_SIZE];
+    uint8_t peer_key[TOX_CLIENT_ID_SIZE];
+    int i, peers = tox_group_number_peers(m, groupnum);
+
+    if (tox_get_client_id(m, friendnum, key) == -1)
+        return false;
+
+    for (i = 0; i < peers; ++i) {
+        if (tox_group_peer_pubkey(m, groupnum, i, peer_key) != -1 && memcmp(key, peer_key, TOX_CLIENT_ID_SIZE) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+static void cmd_search(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    struct Reply r;
+    reply_init(&r, m, friendnum);
+
+    int groupnum = argc < 1 ? -1 : atoi(argv[1]);
+
+    if (argc < 2) {
+        reply_error(&r, "Fehler: search <n> <wörter>");
+    } else if ((groupnum == 0 && strcmp(argv[1], "0")) || group_index(groupnum) == -1) {
+        reply_error(&r, "Fehler: Ungültige Gruppennummer");
+    } else if (!is_master(m, friendnum) && !friend_in_group(m, friendnum, groupnum)) {
+        reply_error(&r, "Fehler: Du bist nicht in dieser Gruppe");
+    } else {
+        char msg[TOX_MAX_MESSAGE_LENGTH];
+
+        /* every word after the group number, quoted or not; argv stops at MAX_NUM_ARGS */
+        const char *query = command_input;
+        int i;
+
+        for (i = 0; i < 2; ++i) {
+            query += strspn(query, " ");
+            query += strcspn(query, " ");
+        }
+
+        int found = history_search(groupnum, query, msg, sizeof(msg));
+
+        if (found == -2)
+            reply_error(&r, "Fehler: Für Gruppe %d wird kein Verlauf aufgezeichnet", groupnum);
+        else if (found == -1)
+            reply_error(&r, "Fehler: Keine Suchwörter");
+        else if (found == -3)
+            reply_error(&r, "Fehler: Höchstens %d Suchwörter", HISTORY_MAX_TERMS);
+        else if (found == 0)
+            reply_printf(&r, "Keine Treffer in Gruppe %d", groupnum);
+        else
+            reply_text(&r, msg, strlen(msg));
+    }
+
+    reply_send(&r);
+}
+
+static void cmd_whois(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg;
+
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 1) {
+        outmsg = "Fehler: Name oder Freundesnummer erforderlich";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    int32_t fn = friend_find_by_name(argv[1]);
+
+    if (fn == -1 && (atoi(argv[1]) || strcmp(argv[1], "0") == 0))
+        fn = atoi(argv[1]);
+
+    const struct Friend_Stats *fs = friendstats_get(fn);
+
+    if (fs == NULL || !tox_friend_exists(m, fn)) {
+        outmsg = "Fehler: Unbekannter Freund";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    char counts[FSTAT_NUM_TYPES * 24];
+    int len = 0;
+    int i;
+
+    for (i = 0; i < FSTAT_NUM_TYPES && len < sizeof(counts); ++i)
+        len += snprintf(counts + len, sizeof(counts) - len, " %s=%u", friendstats_type_name(i), fs->commands[i]);
+
+    char last[64] = "nie";
+
+    if (fs->last_command) {
+        time_t t = (time_t) fs->last_command;
+        strftime(last, sizeof(last), "%Y-%m-%d %H:%M", localtime(&t));
+    }
+
+    struct Reply r;
+    reply_init(&r, m, friendnum);
+    reply_printf(&r, "%s (Freund %d)", friend_name(fn), fn);
+    reply_printf(&r, "Befehle:%s", counts);
+    reply_printf(&r, "Letzter Befehl: %s", last);
+    reply_printf(&r, "Einladungen: %u", fs->invites);
+    reply_printf(&r, "Gesendet: %llu Bytes", (unsigned long long) fs->bytes_sent);
+    reply_send(&r);
+}
+
+#define TOP_DEFAULT 10
+#define TOP_MAX 20
+
+static void cmd_top(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    int n = argc >= 1 ? atoi(argv[1]) : TOP_DEFAULT;
+
+    if (n <= 0 || n > TOP_MAX)
+        n = TOP_DEFAULT;
+
+    /* keep the n friends with the most commands, sorted, by insertion */
+    int32_t best[TOP_MAX];
+    uint64_t best_total[TOP_MAX];
+    int num_best = 0;
+    int friends = 0;
+    int never_invited = 0;
+    int32_t i, size = friendstats_size();
+
+    for (i = 0; i < size; ++i) {
+        if (!tox_friend_exists(m, i))
+            continue;
+
+        const struct Friend_Stats *fs = friendstats_get(i);
+        uint64_t total = friendstats_total(fs);
+
+        ++friends;
+
+        if (fs->invites == 0)
+            ++never_invited;
+
+        if (total == 0 || (num_best == n && total <= best_total[n - 1]))
+            continue;
+
+        int j = num_best < n ? num_best++ : n - 1;
+
+        for (; j > 0 && best_total[j - 1] < total; --j) {
+            best[j] = best[j - 1];
+            best_total[j] = best_total[j - 1];
+        }
+
+        best[j] = i;
+        best_total[j] = total;
+    }
+
+    struct Reply r;
+    reply_init(&r, m, friendnum);
+
+    for (i = 0; i < num_best; ++i) {
+        const struct Friend_Stats *fs = friendstats_get(best[i]);
+        reply_printf(&r, "%d. %s: %llu Befehle, %u Einladungen", i + 1, friend_name(best[i]),
+                     (unsigned long long) best_total[i], fs->invites);
+    }
+
+    reply_printf(&r, "Nie eingeladen: %d von %d Freunden", never_invited, friends);
+    reply_send(&r);
+}
+
+/* Parses a time spec for scheduled commands: "HH:MM" is daily at that local time, "N" with an optional
+   s, m, h or d suffix is every N seconds, minutes, hours or days, and a leading '+' makes it run once.
+   Returns 0 on success, -1 if spec is invalid. */
+static int parse_when(const char *spec, uint64_t *delay_ms, uint64_t *interval_ms)
+{
+    int hour, minute;
+    char c;
+
+    if (sscanf(spec, "%d:%d%c", &hour, &minute, &c) == 2) {
+        if (hour < 0 || hour > 23 || minute < 0 || minute > 59)
+            return -1;
+
+        time_t now = time(NULL);
+        struct tm tm = *localtime(&now);
+        tm.tm_hour = hour;
+        tm.tm_min = minute;
+        tm.tm_sec = 0;
+
+        time_t at = mktime(&tm);
+
+        if (at <= now)
+            at += SECONDS_IN_DAY;
+
+        *delay_ms = (uint64_t) (at - now) * 1000;
+        *interval_ms = SECONDS_IN_DAY * 1000;
+        return 0;
+    }
+
+    bool once = spec[0] == '+';
+    char *end;
+    long n = strtol(spec + once, &end, 10);
+    uint64_t unit;
+
+    switch (*end) {
+        case '\0':
+        case 's':
+            unit = 1;
+            break;
+
+        case 'm':
+            unit = 60;
+            break;
+
+        case 'h':
+            unit = 3600;
+            break;
+
+        case 'd':
+            unit = SECONDS_IN_DAY;
+            break;
+
+        default:
+            return -1;
+    }
+
+    if (n <= 0 || end == spec + once || (*end && end[1]))
+        return -1;
+
+    *delay_ms = n * unit * 1000;
+    *interval_ms = once ? 0 : *delay_ms;
+    return 0;
+}
+
+struct Announcement {
+    int groupnum;
+    char msg[MAX_COMMAND_LENGTH];
+};
+
+static void job_announce(Tox *m, void *arg)
+{
+    struct Announcement *a = arg;
+
+    if (tox_group_message_send(m, a->groupnum, (uint8_t *) a->msg, strlen(a->msg)) == -1)
+        log_msg(L_WARN, "announce_failed group=%d", a->groupnum);
+    else
+        log_msg(L_INFO, "announce group=%d msg=\"%s\"", a->groupnum, a->msg);
+}
+
+static void cmd_announce(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg;
+
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 3) {
+        outmsg = "Fehler: Gruppennummer, Zeit und Nachricht erforderlich";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    int groupnum = atoi(argv[1]);
+    uint64_t delay, interval;
+
+    if ((groupnum == 0 && strcmp(argv[1], "0")) || group_index(groupnum) == -1) {
+        outmsg = "Fehler: Ungültige Gruppennummer";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    if (parse_when(argv[2], &delay, &interval) == -1) {
+        outmsg = "Fehler: Ungültige Zeit (HH:MM, N[s|m|h|d] oder +N[s|m|h|d] für einmalig)";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    if (argv[3][0] != '\"') {
+        outmsg = "Fehler: Nachricht muss in Anführungszeichen stehen";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    if (mem_over_limit(MEM_COMMANDS)) {
+        mem_rejected(MEM_COMMANDS);
+        outmsg = "Fehler: Speicherlimit für Befehle erreicht";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    struct Announcement *a = mem_malloc(MEM_COMMANDS, sizeof(struct Announcement));
+
+    if (a == NULL)
+        exit(EXIT_FAILURE);
+
+    /* remove opening and closing quotes */
+    a->groupnum = groupnum;
+    snprintf(a->msg, sizeof(a->msg), "%s", &argv[3][1]);
+    a->msg[strlen(a->msg) - 1] = '\0';
+
+    char desc[64];
+    snprintf(desc, sizeof(desc), "announce %d %.8s \"%.32s\"", groupnum, argv[2], a->msg);
+
+    int id = timer_add(delay, interval, job_announce, a, TIMER_USER | TIMER_FREE_ARG, desc);
+
+    if (id == -1) {
+        mem_free(a);
+        outmsg = "Fehler: Zu viele Timer";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    log_msg(L_INFO, "timer_add id=%d desc=\"%s\" friend=\"%s\"", id, desc, friend_name(friendnum));
+
+    char msg[MAX_COMMAND_LENGTH];
+    snprintf(msg, sizeof(msg), "Ansage geplant (Timer %d)", id);
+    bot_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
+}
+
+struct Scheduled_Clip {
+    int groupnum;
+    int volume;
+    char clip[MAX_COMMAND_LENGTH];
+};
+
+static void job_play(Tox *m, void *arg)
+{
+    struct Scheduled_Clip *c = arg;
+    int idx = group_index(c->groupnum);
+
+    if (idx == -1 || Tox_Bot.g_chats[idx].type != TOX_GROUPCHAT_TYPE_AV
+            || audio_play(m, c->groupnum, c->clip, c->volume) == -1)
+        log_msg(L_WARN, "audio_play_failed group=%d clip=%s", c->groupnum, c->clip);
+    else
+        log_msg(L_INFO, "audio_play group=%d clip=%s volume=%d", c->groupnum, c->clip, c->volume);
+}
+
+static void cmd_playat(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg;
+
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 3) {
+        outmsg = "Fehler: Gruppennummer, Zeit und Clip erforderlich";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    int groupnum = av_group_arg(m, friendnum, argv[1]);
+    uint64_t delay, interval;
+
+    if (groupnum == -1)
+        return;
+
+    if (parse_when(argv[2], &delay, &interval) == -1) {
+        outmsg = "Fehler: Ungültige Zeit (HH:MM, N[s|m|h|d] oder +N[s|m|h|d] für einmalig)";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    if (mem_over_limit(MEM_COMMANDS)) {
+        mem_rejected(MEM_COMMANDS);
+        outmsg = "Fehler: Speicherlimit für Befehle erreicht";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    struct Scheduled_Clip *c = mem_malloc(MEM_COMMANDS, sizeof(struct Scheduled_Clip));
+
+    if (c == NULL)
+        exit(EXIT_FAILURE);
+
+    c->groupnum = groupnum;
+    c->volume = argc > 3 ? atoi(argv[4]) : 100;
+    snprintf(c->clip, sizeof(c->clip), "%s", argv[3]);
+
+    char desc[64];
+    snprintf(desc, sizeof(desc), "play %d %.8s %.32s", groupnum, argv[2], c->clip);
+
+    int id = timer_add(delay, interval, job_play, c, TIMER_USER | TIMER_FREE_ARG, desc);
+
+    if (id == -1) {
+        mem_free(c);
+        outmsg = "Fehler: Zu viele Timer";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    log_msg(L_INFO, "timer_add id=%d desc=\"%s\" friend=\"%s\"", id, desc, friend_name(friendnum));
+
+    char msg[MAX_COMMAND_LENGTH];
+    snprintf(msg, sizeof(msg), "Wiedergabe geplant (Timer %d)", id);
+    bot_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
+}
+
+struct Delayed_Invite {
+    int32_t friendnum;
+    uint8_t public_key[TOX_CLIENT_ID_SIZE];
+    int groupnum;
+};
+
+static void job_invite(Tox *m, void *arg)
+{
+    struct Delayed_Invite *inv = arg;
+    uint8_t key[TOX_CLIENT_ID_SIZE];
+
+    /* the friend may have been deleted and the number reused since */
+    if (tox_get_client_id(m, inv->friendnum, key) == -1 || memcmp(key, inv->public_key, TOX_CLIENT_ID_SIZE))
+        return;
+
+    int groupnum = group_route_invite(m, inv->groupnum);
+
+    if (groupnum == -1 || tox_invite_friend(m, inv->friendnum, groupnum) == -1) {
+        log_msg(L_WARN, "invite_failed friend=\"%s\" group=%d reason=delayed", friend_name(inv->friendnum),
+                inv->groupnum);
+        return;
+    }
+
+    friendstats_invite(inv->friendnum);
+    log_msg(L_INFO, "invite friend=\"%s\" group=%d delayed=1", friend_name(inv->friendnum), groupnum);
+}
+
+static void cmd_invite_later(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg;
+
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 3) {
+        outmsg = "Fehler: Freund, Gruppennummer und Zeit erforderlich";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    int32_t fn = friend_find_by_name(argv[1]);
+
+    if (fn == -1 && (atoi(argv[1]) || strcmp(argv[1], "0") == 0))
+        fn = atoi(argv[1]);
+
+    struct Delayed_Invite inv;
+
+    if (tox_get_client_id(m, fn, inv.public_key) == -1) {
+        outmsg = "Fehler: Unbekannter Freund";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    int groupnum = atoi(argv[2]);
+    uint64_t delay, interval;
+
+    if ((groupnum == 0 && strcmp(argv[2], "0")) || group_index(groupnum) == -1) {
+        outmsg = "Fehler: Ungültige Gruppennummer";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    if (parse_when(argv[3], &delay, &interval) == -1) {
+        outmsg = "Fehler: Ungültige Zeit (HH:MM oder N[s|m|h|d])";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    if (mem_over_limit(MEM_COMMANDS)) {
+        mem_rejected(MEM_COMMANDS);
+        outmsg = "Fehler: Speicherlimit für Befehle erreicht";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    struct Delayed_Invite *a = mem_malloc(MEM_COMMANDS, sizeof(struct Delayed_Invite));
+
+    if (a == NULL)
+        exit(EXIT_FAILURE);
+
+    inv.friendnum = fn;
+    inv.groupnum = groupnum;
+    *a = inv;
+
+    char desc[64];
+    snprintf(desc, sizeof(desc), "invite %s %d", friend_name(fn), groupnum);
+
+    /* invites always run once */
+    int id = timer_add(delay, 0, job_invite, a, TIMER_USER | TIMER_FREE_ARG, desc);
+
+    if (id == -1) {
+        mem_free(a);
+        outmsg = "Fehler: Zu viele Timer";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    log_msg(L_INFO, "timer_add id=%d desc=\"%s\" friend=\"%s\"", id, desc, friend_name(friendnum));
+
+    char msg[MAX_COMMAND_LENGTH];
+    snprintf(msg, sizeof(msg), "Einladung geplant (Timer %d)", id);
+    bot_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
+}
+
+static int export_timer = -1;
+
+static void job_export(Tox *m, void *arg)
+{
+    uint64_t span = trace_start();
+
+    if (stats_export(STATS_EXPORT_FILE) == -1)
+        log_msg(L_WARN, "stats_export_failed path=%s", STATS_EXPORT_FILE);
+
+    trace_end("export", span);
+}
+
+static void cmd_tracing(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg;
+
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 1) {
+        outmsg = trace_enabled() ? "Tracing ist an" : "Tracing ist aus";
+        bot_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        return;
+    }
+
+    if (strcmp(argv[1], "on") != 0 && strcmp(argv[1], "off") != 0) {
+        outmsg = "Fehler: on oder off erforderlich";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    bool on = strcmp(argv[1], "on") == 0;
+    trace_enable(on);
+
+    outmsg = on ? "Tracing eingeschaltet" : "Tracing ausgeschaltet";
+    bot_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+    log_msg(L_INFO, "tracing enabled=%d friend=\"%s\"", on, friend_name(friendnum));
+}
+
+static void cmd_watchdog(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc >= 1) {
+        int ms = atoi(argv[1]);
+
+        if (ms < WATCHDOG_MIN_BUDGET_MS) {
+            char msg[MAX_COMMAND_LENGTH];
+            snprintf(msg, sizeof(msg), "Fehler: Budget in ms erforderlich (mindestens %d)", WATCHDOG_MIN_BUDGET_MS);
+            send_error(m, friendnum, msg);
+            return;
+        }
+
+        watchdog_set_budget(ms);
+        log_msg(L_INFO, "watchdog_budget ms=%d friend=\"%s\"", ms, friend_name(friendnum));
+    }
+
+    struct Reply r;
+    reply_init(&r, m, friendnum);
+    reply_printf(&r, "Budget pro Durchlauf: %"PRIu32" ms", watchdog_budget());
+    reply_printf(&r, "Hänger: %"PRIu64" (längster %"PRIu64" ms), Berichte in %s", watchdog_stalls(),
+                 watchdog_longest(), WATCHDOG_REPORT_FILE);
+    reply_send(&r);
+}
+
+static void cmd_tracedump(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    const char *path = argc >= 1 ? argv[1] : TRACE_FILE;
+    int count = trace_dump(path);
+    char msg[MAX_COMMAND_LENGTH];
+
+    if (count == -1) {
+        snprintf(msg, sizeof(msg), "Fehler: %s konnte nicht geschrieben werden", path);
+        send_error(m, friendnum, msg);
+    } else {
+        snprintf(msg, sizeof(msg), "%d Spans nach %s geschrieben (chrome://tracing oder ui.perfetto.dev)", count, path);
+        bot_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
+    }
+    log_msg(L_INFO, "trace_dump path=%s spans=%d", path, count);
+}
+
+static void cmd_export(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg;
+
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 1) {
+        outmsg = "Fehler: Intervall oder off erforderlich";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    timer_cancel(export_timer, 0);
+    export_timer = -1;
+
+    if (strcmp(argv[1], "off") == 0) {
+        outmsg = "Statistik-Export beendet";
+        bot_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+        return;
+    }
+
+    uint64_t delay, interval;
+
+    if (parse_when(argv[1], &delay, &interval) == -1 || interval == 0) {
+        outmsg = "Fehler: Ungültiges Intervall (N[s|m|h|d])";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    char desc[64];
+    snprintf(desc, sizeof(desc), "export %s", STATS_EXPORT_FILE);
+    export_timer = timer_add(0, interval, job_export, NULL, TIMER_USER, desc);
+
+    if (export_timer == -1) {
+        outmsg = "Fehler: Zu viele Timer";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    char msg[MAX_COMMAND_LENGTH];
+    snprintf(msg, sizeof(msg), "Statistik wird alle %llus nach %s geschrieben (Timer %d)",
+             (unsigned long long) (interval / 1000), STATS_EXPORT_FILE, export_timer);
+    bot_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
+}
+
+static void cmd_timers(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    char list[TIMER_MAX * 128];
+    int len = timer_list(list, sizeof(list), TIMER_USER, get_time_usec() / 1000);
+
+    if (len == 0)
+        len = snprintf(list, sizeof(list), "Keine Timer");
+
+    struct Reply r;
+    reply_init(&r, m, friendnum);
+    reply_text(&r, list, len);
+    reply_send(&r);
+}
+
+static void cmd_cancel(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg;
+
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 1 || timer_cancel(atoi(argv[1]), TIMER_USER) == -1) {
+        outmsg = "Fehler: Unbekannter Timer";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    log_msg(L_INFO, "timer_cancel id=%s friend=\"%s\"", argv[1], friend_name(friendnum));
+    outmsg = "Timer gelöscht";
+    bot_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+}
+
+static void cmd_mem(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    char report[1024];
+    int len = mem_report(report, sizeof(report));
+
+    struct Reply r;
+    reply_init(&r, m, friendnum);
+    reply_text(&r, report, len);
+
+    /* what one more friend or group costs, for sizing hosts */
+    uint32_t numfriends = tox_count_friendlist(m);
+    int peers;
+    int groups = group_totals(&peers);
+
+    reply_printf(&r, "Pro Freund: %zu B, pro Gruppe: %zu B", numfriends ? mem_current(MEM_CONTACTS) / numfriends : 0,
+                 groups ? mem_current(MEM_GROUPS) / groups : 0);
+    reply_send(&r);
+}
+
+static void cmd_memlimit(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg;
+
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    if (argc < 2) {
+        outmsg = "Fehler: Bereich (groups, contacts, commands, io, queues, audio, total) und Limit in kB oder off erforderlich";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    int tag = mem_find_tag(argv[1]);
+
+    if (tag == -1) {
+        outmsg = "Fehler: Unbekannter Bereich";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    long kb = strcmp(argv[2], "off") == 0 ? 0 : atol(argv[2]);
+
+    if (kb <= 0 && strcmp(argv[2], "off")) {
+        outmsg = "Fehler: Ungültiges Limit";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    mem_set_limit(tag, (size_t) kb * 1024);
+
+    char msg[MAX_COMMAND_LENGTH];
+
+    if (kb)
+        snprintf(msg, sizeof(msg), "Limit für %s auf %ld kB gesetzt", mem_tag_name(tag), kb);
+    else
+        snprintf(msg, sizeof(msg), "Limit für %s entfernt", mem_tag_name(tag));
+
+    log_msg(L_INFO, "memlimit tag=%s kb=%ld friend=\"%s\"", mem_tag_name(tag), kb, friend_name(friendnum));
+    bot_send_message(m, friendnum, (uint8_t *) msg, strlen(msg));
+}
+
+static void cmd_stats(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    if (!is_master(m, friendnum)) {
+        authent_failed(m, friendnum);
+        return;
+    }
+
+    char report[2048];
+    int len = stats_report(report, sizeof(report));
+
+    struct Reply r;
+    reply_init(&r, m, friendnum);
+    reply_text(&r, report, len);
+    reply_send(&r);
+}
+
+//------------------------------------------------------------------------------
+
+static void cmd_register(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    const char *outmsg;
+
+
+    if (argc < 2) {
+        outmsg = "Fehler: Name und ID erforderlich";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    if (argv[1][0] != '\"') {
+        outmsg = "Fehler: Name muss in Anführungszeichen stehen";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    if (argv[2][0] != '\"') {
+        outmsg = "Fehler: ID muss in Anführungszeichen stehen";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    /* remove opening and closing quotes */
+    char name[MAX_COMMAND_LENGTH];
+    snprintf(name, sizeof(name), "%s", &argv[1][1]);
+    int len1 = strlen(name);
+
+    if (len1 > 0 && name[len1 - 1] == '\"')
+        name[len1 - 1] = '\0';
+
+    char id[100];
+    snprintf(id, sizeof(id), "%s", &argv[2][1]);
+    int len = strlen(id);
+
+    if (len > 0 && id[len - 1] == '\"')
+        id[len - 1] = '\0';
+
+    if (name[0] == '\0' || id[0] == '\0') {
+        outmsg = "Fehler: Name und ID erforderlich";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    char line[MAX_COMMAND_LENGTH + sizeof(id) + 4];
+    snprintf(line, sizeof(line), "%s\t:\t%s", name, id);
+
+    if (state_add_contact(line) == -1) {
+        outmsg = "Fehler: Registrierung konnte nicht gespeichert werden";
+        send_error(m, friendnum, outmsg);
+        return;
+    }
+
+    outmsg = "Registrierung erfolgreich";
+    bot_send_message(m, friendnum, (uint8_t *) outmsg, strlen(outmsg));
+    log_msg(L_INFO, "register name=\"%s\"", name);
+}
+
+static void cmd_show_contacts(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH])
+{
+    struct Reply r;
+    reply_init(&r, m, friendnum);
+    reply_printf(&r, "Kontakte");
+
+    int i, n = state_num_contacts();
+
+    for (i = 0; i < n; ++i)
+        reply_printf(&r, "%s", state_contact(i));
+
+    if (n == 0)
+        reply_printf(&r, "Keine Einträge");
+
+    reply_send(&r);
+}
+
+
+/* Parses input command and puts args into arg array.
+   Returns number of arguments on success, -1 on failure. */
+static int parse_command(const char *input, char (*args)[MAX_COMMAND_LENGTH])
+{
+    char *cmd = mem_strdup(MEM_COMMANDS, input);
+
+    if (cmd == NULL)
+        exit(EXIT_FAILURE);
+
+    int num_args = 0;
+    int i = 0;    /* index of last char in an argument */
+
+    /* characters wrapped in double quotes count as one arg */
+    while (num_args < MAX_NUM_ARGS) {
+        int qt_ofst = 0;    /* set to 1 to offset index for quote char at end of arg */
+
+        if (*cmd == '\"') {
+            qt_ofst = 1;
+            i = char_find(1, cmd, '\"');
+
+            if (cmd[i] == '\0') {
+                mem_free(cmd);
+                return -1;
+            }
+        } else {
+            i = char_find(0, cmd, ' ');
+        }
+
+        memcpy(args[num_args], cmd, i + qt_ofst);
+        args[num_args++][i + qt_ofst] = '\0';
+
+        if (cmd[i] == '\0')    /* no more args */
+            break;
+
+        /* the space after a closing quote separates args too */
+        if (qt_ofst && cmd[i + 1] == ' ')
+            ++i;
+
+        char tmp[MAX_COMMAND_LENGTH];
+        snprintf(tmp, sizeof(tmp), "%s", &cmd[i + 1]);
+        strcpy(cmd, tmp);    /* tmp will always fit inside cmd */
+    }
+
+    mem_free(cmd);
+    return num_args;
+}
+
+static struct {
+    const char *name;
+    void (*func)(Tox *m, int friendnum, int argc, char (*argv)[MAX_COMMAND_LENGTH]);
+    int type;    /* counted in the friend's stats */
+} commands[] = {
+    { "announce",         cmd_announce,      FSTAT_MASTER   },
+    { "bridge",           cmd_bridge,        FSTAT_MASTER   },
+    { "bridges",          cmd_bridges,       FSTAT_MASTER   },
+    { "cancel",           cmd_cancel,        FSTAT_MASTER   },
+    { "capacity",         cmd_capacity,      FSTAT_MASTER   },
+    { "default",          cmd_default,       FSTAT_MASTER   },
+    { "export",           cmd_export,        FSTAT_MASTER   },
+    { "group",            cmd_group,         FSTAT_MASTER   },
+    { "gmessage",         cmd_gmessage,      FSTAT_MASTER   },
+    { "gstats",           cmd_gstats,        FSTAT_MASTER   },
+    { "spam",             cmd_spam,          FSTAT_MASTER   },
+    { "trigger",          cmd_trigger,       FSTAT_MASTER   },
+    { "triggers",         cmd_triggers,      FSTAT_MASTER   },
+    { "untrigger",        cmd_untrigger,     FSTAT_MASTER   },
+    { "hilfe",            cmd_help,          FSTAT_HELP     },
+    { "id",               cmd_id,            FSTAT_ID       },
+    { "info",             cmd_info,          FSTAT_INFO     },
+    { "invite",           cmd_invite_later,  FSTAT_MASTER   },
+    { "hallo",            cmd_invite,        FSTAT_INVITE   },
+    { "auto",             cmd_auto,          FSTAT_INVITE   },
+    { "leave",            cmd_leave,         FSTAT_MASTER   },
+    { "master",           cmd_master,        FSTAT_MASTER   },
+    { "mem",              cmd_mem,           FSTAT_MASTER   },
+    { "memlimit",         cmd_memlimit,      FSTAT_MASTER   },
+    { "name",             cmd_name,          FSTAT_MASTER   },
+    { "passwd",           cmd_passwd,        FSTAT_MASTER   },
+    { "play",             cmd_play,          FSTAT_MASTER   },
+    { "playat",           cmd_playat,        FSTAT_MASTER   },
+    { "purge",            cmd_purge,         FSTAT_MASTER   },
+    { "status",           cmd_status,        FSTAT_MASTER   },
+    { "statusmessage",    cmd_statusmessage, FSTAT_MASTER   },
+    { "stats",            cmd_stats,         FSTAT_MASTER   },
+    { "stop",             cmd_stop,          FSTAT_MASTER   },
+    { "timers",           cmd_timers,        FSTAT_MASTER   },
+    { "title",            cmd_title_set,     FSTAT_MASTER   },
+    { "tone",             cmd_tone,          FSTAT_MASTER   },
+    { "top",              cmd_top,           FSTAT_MASTER   },
+    { "tracedump",        cmd_tracedump,     FSTAT_MASTER   },
+    { "tracing",          cmd_tracing,       FSTAT_MASTER   },
+    { "unbridge",         cmd_bridge,        FSTAT_MASTER   },
+    { "watchdog",         cmd_watchdog,      FSTAT_MASTER   },
+    { "whois",            cmd_whois,         FSTAT_MASTER   },
+    { "record",           cmd_record,        FSTAT_MASTER   },
+    { "history",          cmd_history,       FSTAT_MASTER   },
+    { "search",           cmd_search,        FSTAT_INFO     },
+    { "register",         cmd_register,      FSTAT_CONTACTS },
+    { "kontakte",         cmd_show_contacts, FSTAT_CONTACTS },
+    { NULL,               NULL,              0              },
+};
+
+static int do_command(Tox *m, int friendnum, int num_args, char (*args)[MAX_COMMAND_LENGTH])
+{
+    int i;
+
+    for (i = 0; commands[i].name; ++i) {
+        if (strcmp(args[0], commands[i].name) == 0) {
+            friendstats_command(friendnum, commands[i].type);
+
+            uint64_t span = trace_start();
+            watchdog_command(commands[i].name, friendnum);
+            (commands[i].func)(m, friendnum, num_args - 1, args);
+            watchdog_command(NULL, -1);
+            trace_end(commands[i].name, span);
+            return 0;
+        }
+    }
 
+    return -1;
+}
+
+static int execute_one(Tox *m, int friendnum, const char *input)
+{
+    uint64_t start = get_time_usec();
     char args[MAX_NUM_ARGS][MAX_COMMAND_LENGTH];
+    uint64_t span = trace_start();
     int num_args = parse_command(input, args);
+    trace_end("parse_command", span);
+
+    command_input = input;
+    int ret = num_args == -1 ? -1 : do_command(m, friendnum, num_args, args);
+    command_input = NULL;
+
+    if (ret == -1) {
+        friendstats_command(friendnum, FSTAT_INVALID);
+        stats_invalid_command();
+        return -1;
+    }
+
+    stats_command(get_time_usec() - start);
+    return 0;
+}
+
+/* Returns true if input is a batch: it starts with the word batch, or has a ';' outside quotes. */
+static bool is_batch(const char *input)
+{
+    if (strncmp(input, "batch", 5) == 0 && (input[5] == ' ' || input[5] == '\n'))
+        return true;
+
+    bool quoted = false;
+
+    for (; *input; ++input) {
+        if (*input == '\"')
+            quoted = !quoted;
+        else if (*input == ';' && !quoted)
+            return true;
+    }
+
+    return false;
+}
+
+/* Runs the ';' or newline separated commands of input in order, with one master check, and replies
+   once with every step's output (or "ok") followed by a summary. */
+static int execute_batch(Tox *m, int friendnum, const char *input)
+{
+    char buf[MAX_COMMAND_LENGTH];
+    snprintf(buf, sizeof(buf), "%s", strncmp(input, "batch", 5) == 0 ? input + 5 : input);
+
+    char *steps[MAX_BATCH_STEPS];
+    int num_steps = 0;
+    int skipped = 0;
+    bool quoted = false;
+    char *p, *start = buf;
+
+    for (p = buf; ; ++p) {
+        if (*p == '\"') {
+            quoted = !quoted;
+            continue;
+        }
+
+        if (*p != '\0' && (quoted || (*p != ';' && *p != '\n')))
+            continue;
+
+        bool end = *p == '\0';
+        *p = '\0';
+
+        /* trim, parse_command() splits on single spaces */
+        while (*start == ' ' || *start == '\t' || *start == '\r')
+            ++start;
+
+        char *last = p;
+
+        while (last > start && (last[-1] == ' ' || last[-1] == '\t' || last[-1] == '\r'))
+            *--last = '\0';
+
+        if (*start) {
+            if (num_steps < MAX_BATCH_STEPS)
+                steps[num_steps++] = start;
+            else
+                ++skipped;
+        }
+
+        if (end)
+            break;
+
+        start = p + 1;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.active = true;
+    batch.friendnum = friendnum;
+    batch.is_master = -1;
+    reply_init(&batch.reply, m, friendnum);
 
-    if (num_args == -1)
+    int i;
+
+    for (i = 0; i < num_steps; ++i) {
+        batch.step = i + 1;
+        batch.step_replied = false;
+        batch.step_failed = false;
+
+        if (execute_one(m, friendnum, steps[i]) == -1) {
+            char msg[MAX_COMMAND_LENGTH];
+            snprintf(msg, sizeof(msg), "Ungültiger Befehl: %.64s", steps[i]);
+            batch_append(m, msg, strlen(msg));
+            batch.step_failed = true;
+        } else if (!batch.step_replied) {
+            batch_append(m, "ok", 2);
+        }
+
+        if (batch.step_failed)
+            ++batch.failed;
+    }
+
+    char summary[128];
+    int len = snprintf(summary, sizeof(summary), "%d von %d Befehlen ausgeführt", num_steps - batch.failed, num_steps);
+
+    if (skipped)
+        snprintf(summary + len, sizeof(summary) - len, ", %d übersprungen (max. %d)", skipped, MAX_BATCH_STEPS);
+
+    batch.step_replied = true;
+    batch_append(m, summary, strlen(summary));
+    batch_flush(m);
+    batch.active = false;
+
+    log_msg(L_DEBUG, "batch friend=\"%s\" steps=%d failed=%d", friend_name(friendnum), num_steps, batch.failed);
+    return 0;
+}
+
+int execute(Tox *m, int friendnum, const char *input, int length)
+{
+    if (length >= MAX_COMMAND_LENGTH)
         return -1;
 
-    return do_command(m, friendnum, num_args, args);
+    const struct Bot_Stats *stats = stats_get();
+    uint64_t replies = stats->replies_sent + stats->replies_dropped;
+    int ret;
+
+    if (is_batch(input))
+        ret = execute_batch(m, friendnum, input);
+    else
+        ret = execute_one(m, friendnum, input);
+
+    stats_reply_messages(stats->replies_sent + stats->replies_dropped - replies);
+    return ret;
 }
@@ -23,6 +23,28 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 
+#include <stdbool.h>
+
+/* Cached replies, see reply_cache_invalidate() */
+#define REPLY_CACHE_ID   (1 << 0)    /* our Tox ID: changes with the nospam value */
+#define REPLY_CACHE_HELP (1 << 1)    /* help text */
+#define REPLY_CACHE_INFO (1 << 2)    /* info header: friend counts, purge limit */
+#define REPLY_CACHE_SETTINGS (1 << 3)    /* owner from the settings file */
+#define REPLY_CACHE_ALL  (REPLY_CACHE_ID | REPLY_CACHE_HELP | REPLY_CACHE_INFO | REPLY_CACHE_SETTINGS)
+
 int execute(Tox *m, int friendnumber, const char *input, int length);
 
+/* Marks cached replies as stale so they are rebuilt on next use. Call it whenever
+   the data behind them changes (profile load, nospam change, settings reload,
+   friend added, removed or going on/offline). */
+void reply_cache_invalidate(int which);
+
+/* Sends a message to friendnum and records the result in the bot stats.
+   Returns the message id, or 0 if the message could not be queued. */
+uint32_t bot_send_message(Tox *m, int32_t friendnum, const uint8_t *msg, uint32_t length);
+
+/* For runs without a network (load test, replay), where no friend is ever connected: replies are
+   counted as sent without handing them to Tox, so the stats show what the bot would have sent. */
+void bot_set_offline(bool offline);
+
 #endif    /* COMMANDS_H */
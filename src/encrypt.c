@@ -0,0 +1,188 @@
+/*  encrypt.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <tox/tox.h>
+#include <tox/toxencryptsave.h>
+
+#include "encrypt.h"
+#include "misc.h"
+#include "log.h"
+
+/* The derived key lives in its own page, locked so that it is never swapped out */
+static uint8_t *key_page;
+static size_t page_size;
+static bool have_key;
+
+static void wipe(void *buf, size_t len)
+{
+    volatile uint8_t *p = buf;
+
+    while (len--)
+        *p++ = 0;
+}
+
+static uint8_t *locked_page(void)
+{
+    if (key_page)
+        return key_page;
+
+    page_size = sysconf(_SC_PAGESIZE);
+
+    void *p;
+
+    if (posix_memalign(&p, page_size, page_size) != 0)
+        exit(EXIT_FAILURE);
+
+    if (mlock(p, page_size) != 0)
+        log_msg(L_WARN, "encrypt_mlock_failed");
+
+    /* a core dump would contain the key */
+    struct rlimit rl = { 0, 0 };
+    setrlimit(RLIMIT_CORE, &rl);
+
+    key_page = p;
+    return key_page;
+}
+
+int encrypt_set_passphrase(const char *passphrase, size_t length, const uint8_t *data)
+{
+    uint8_t *key = locked_page();
+    uint64_t start = get_time_usec();
+    int ret;
+
+    if (data) {
+        uint8_t salt[TOX_PASS_SALT_LENGTH];
+
+        if (tox_get_salt((uint8_t *) data, salt) != 0)
+            return -1;
+
+        ret = tox_derive_key_with_salt((uint8_t *) passphrase, length, salt, key);
+    } else {
+        ret = tox_derive_key_from_pass((uint8_t *) passphrase, length, key);
+    }
+
+    if (ret != 0) {
+        wipe(key, TOX_PASS_KEY_LENGTH);
+        have_key = false;
+        return -1;
+    }
+
+    have_key = true;
+    log_msg(L_INFO, "encrypt_key_derived usec=%llu", (unsigned long long) (get_time_usec() - start));
+    return 0;
+}
+
+/* Reads a line from the terminal with echo off. Returns its length, or -1 on error. */
+static int read_passphrase(const char *prompt, char *buf, size_t size)
+{
+    FILE *tty = fopen("/dev/tty", "r+");
+
+    if (tty == NULL)
+        return -1;
+
+    struct termios old, noecho;
+    bool restore = tcgetattr(fileno(tty), &old) == 0;
+
+    if (restore) {
+        noecho = old;
+        noecho.c_lflag &= ~ECHO;
+        tcsetattr(fileno(tty), TCSAFLUSH, &noecho);
+    }
+
+    fprintf(tty, "%s", prompt);
+    fflush(tty);
+
+    char *line = fgets(buf, size, tty);
+
+    if (restore)
+        tcsetattr(fileno(tty), TCSAFLUSH, &old);
+
+    fprintf(tty, "\n");
+    fclose(tty);
+
+    if (line == NULL)
+        return -1;
+
+    int len = strlen(buf);
+
+    if (len > 0 && buf[len - 1] == '\n')
+        buf[--len] = '\0';
+
+    return len;
+}
+
+int encrypt_prompt(const uint8_t *data)
+{
+    char pass[ENCRYPT_MAX_PASS];
+    int len;
+    const char *env = getenv(ENCRYPT_PASS_ENV);
+
+    if (env) {
+        len = snprintf(pass, sizeof(pass), "%s", env);
+        unsetenv(ENCRYPT_PASS_ENV);    /* keep it from the shells started by system() */
+    } else {
+        len = read_passphrase("Passwort: ", pass, sizeof(pass));
+
+        if (len > 0 && data == NULL) {
+            char again[ENCRYPT_MAX_PASS];
+            int len2 = read_passphrase("Passwort wiederholen: ", again, sizeof(again));
+
+            if (len2 != len || memcmp(pass, again, len) != 0) {
+                fprintf(stderr, "Passwörter stimmen nicht überein\n");
+                len = -1;
+            }
+
+            wipe(again, sizeof(again));
+        }
+    }
+
+    int ret = len > 0 && len < sizeof(pass) ? encrypt_set_passphrase(pass, len, data) : -1;
+    wipe(pass, sizeof(pass));
+    return ret;
+}
+
+uint8_t *encrypt_key(void)
+{
+    return have_key ? key_page : NULL;
+}
+
+void encrypt_clear(void)
+{
+    if (key_page == NULL)
+        return;
+
+    wipe(key_page, page_size);
+    munlock(key_page, page_size);
+    free(key_page);
+    key_page = NULL;
+    have_key = false;
+}
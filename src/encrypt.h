@@ -0,0 +1,47 @@
+/*  encrypt.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ENCRYPT_H
+#define ENCRYPT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ENCRYPT_PASS_ENV "TOXBOT_PASSPHRASE"
+#define ENCRYPT_MAX_PASS 256
+
+/* Derives the profile key from passphrase and caches it in locked memory. The salt is taken from the
+   encrypted profile data, or a new one is generated if data is NULL. Returns 0 on success, -1 on error. */
+int encrypt_set_passphrase(const char *passphrase, size_t length, const uint8_t *data);
+
+/* Reads the passphrase from the environment variable ENCRYPT_PASS_ENV or, failing that, from the
+   terminal without echo, and caches the key as encrypt_set_passphrase() does. A new passphrase
+   (data == NULL) is asked for twice. Returns 0 on success, -1 on error. */
+int encrypt_prompt(const uint8_t *data);
+
+/* Returns the cached key, or NULL if the profile is not encrypted. */
+uint8_t *encrypt_key(void);
+
+/* Wipes and releases the cached key; the profile is saved unencrypted from then on. */
+void encrypt_clear(void);
+
+#endif /* ENCRYPT_H */
@@ -0,0 +1,344 @@
+/*  friends.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <tox/tox.h>
+
+#include "friends.h"
+#include "misc.h"
+#include "mem.h"
+
+/* One entry per friend number. Names are stored in exactly sized heap buffers so a
+   bot with a large friend list only pays for the names it actually has. */
+struct Friend_Name {
+    char *name;
+    uint16_t len;
+    int32_t next;    /* next entry in the same hash bucket, -1 terminates */
+};
+
+static struct Friend_Name *names;
+static uint32_t names_size;
+
+static int32_t *buckets;
+static uint32_t num_buckets;    /* always a power of two */
+
+/* Online friends as a dense array plus the position of each friend in it, so that
+   status changes, lookups and the count are O(1) and iteration is O(online).
+   A friend that is offline has position -1. */
+static int32_t *online;
+static uint32_t num_online;
+static uint32_t online_size;
+
+static int32_t *online_pos;
+static uint32_t online_pos_size;
+
+static uint32_t name_hash(const char *name, uint16_t len)
+{
+    uint32_t h = 2166136261u;
+    uint16_t i;
+
+    for (i = 0; i < len; ++i) {
+        h ^= (uint8_t) name[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static void bucket_unlink(int32_t friendnum)
+{
+    struct Friend_Name *f = &names[friendnum];
+
+    if (f->len == 0 || num_buckets == 0)
+        return;
+
+    int32_t *link = &buckets[name_hash(f->name, f->len) & (num_buckets - 1)];
+
+    while (*link != -1) {
+        if (*link == friendnum) {
+            *link = f->next;
+            break;
+        }
+
+        link = &names[*link].next;
+    }
+
+    f->next = -1;
+}
+
+static void bucket_link(int32_t friendnum)
+{
+    struct Friend_Name *f = &names[friendnum];
+
+    if (f->len == 0)
+        return;
+
+    uint32_t b = name_hash(f->name, f->len) & (num_buckets - 1);
+    f->next = buckets[b];
+    buckets[b] = friendnum;
+}
+
+static void rehash(uint32_t n)
+{
+    int32_t *b = mem_realloc(MEM_CONTACTS, buckets, n * sizeof(int32_t));
+
+    if (b == NULL)
+        exit(EXIT_FAILURE);
+
+    buckets = b;
+    num_buckets = n;
+
+    uint32_t i;
+
+    for (i = 0; i < num_buckets; ++i)
+        buckets[i] = -1;
+
+    for (i = 0; i < names_size; ++i)
+        bucket_link(i);
+}
+
+static void realloc_names(uint32_t n)
+{
+    struct Friend_Name *f = mem_realloc(MEM_CONTACTS, names, n * sizeof(struct Friend_Name));
+
+    if (f == NULL)
+        exit(EXIT_FAILURE);
+
+    uint32_t i;
+
+    for (i = names_size; i < n; ++i) {
+        f[i].name = NULL;
+        f[i].len = 0;
+        f[i].next = -1;
+    }
+
+    names = f;
+    names_size = n;
+
+    /* keep the load factor at or below one name per bucket */
+    if (num_buckets < names_size) {
+        uint32_t nb = num_buckets ? num_buckets : 64;
+
+        while (nb < names_size)
+            nb <<= 1;
+
+        rehash(nb);
+    }
+}
+
+void friend_name_set(int32_t friendnum, const char *name, uint16_t length)
+{
+    if (friendnum < 0)
+        return;
+
+    if ((uint32_t) friendnum >= names_size && (name == NULL || length == 0))
+        return;
+
+    if ((uint32_t) friendnum >= names_size)
+        realloc_names(MAX((uint32_t) friendnum + 1, names_size * 2));
+
+    struct Friend_Name *f = &names[friendnum];
+    bucket_unlink(friendnum);
+
+    if (name == NULL)
+        length = 0;
+
+    if (length != f->len || f->name == NULL) {
+        mem_free(f->name);
+        f->name = NULL;
+
+        if (length) {
+            f->name = mem_malloc(MEM_CONTACTS, length + 1);
+
+            if (f->name == NULL)
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (length) {
+        memcpy(f->name, name, length);
+        f->name[length] = '\0';
+    }
+
+    f->len = length;
+    bucket_link(friendnum);
+}
+
+void friend_remove(int32_t friendnum)
+{
+    friend_name_set(friendnum, NULL, 0);
+    friend_set_online(friendnum, false);
+}
+
+static void realloc_online_pos(uint32_t n)
+{
+    int32_t *p = mem_realloc(MEM_CONTACTS, online_pos, n * sizeof(int32_t));
+
+    if (p == NULL)
+        exit(EXIT_FAILURE);
+
+    uint32_t i;
+
+    for (i = online_pos_size; i < n; ++i)
+        p[i] = -1;
+
+    online_pos = p;
+    online_pos_size = n;
+}
+
+void friend_set_online(int32_t friendnum, bool status)
+{
+    if (friendnum < 0 || friend_is_online(friendnum) == status)
+        return;
+
+    if (status) {
+        if ((uint32_t) friendnum >= online_pos_size)
+            realloc_online_pos(MAX((uint32_t) friendnum + 1, online_pos_size * 2));
+
+        if (num_online == online_size) {
+            uint32_t n = online_size ? online_size * 2 : 64;
+            int32_t *p = mem_realloc(MEM_CONTACTS, online, n * sizeof(int32_t));
+
+            if (p == NULL)
+                exit(EXIT_FAILURE);
+
+            online = p;
+            online_size = n;
+        }
+
+        online_pos[friendnum] = num_online;
+        online[num_online++] = friendnum;
+        return;
+    }
+
+    /* move the last entry into the hole */
+    int32_t pos = online_pos[friendnum];
+    int32_t last = online[--num_online];
+    online[pos] = last;
+    online_pos[last] = pos;
+    online_pos[friendnum] = -1;
+}
+
+bool friend_is_online(int32_t friendnum)
+{
+    return friendnum >= 0 && (uint32_t) friendnum < online_pos_size && online_pos[friendnum] != -1;
+}
+
+uint32_t friends_num_online(void)
+{
+    return num_online;
+}
+
+const int32_t *friends_online(uint32_t *count)
+{
+    *count = num_online;
+    return online;
+}
+
+const char *friend_name(int32_t friendnum)
+{
+    if (friendnum < 0 || (uint32_t) friendnum >= names_size || names[friendnum].len == 0)
+        return "";
+
+    return names[friendnum].name;
+}
+
+uint16_t friend_name_len(int32_t friendnum)
+{
+    if (friendnum < 0 || (uint32_t) friendnum >= names_size)
+        return 0;
+
+    return names[friendnum].len;
+}
+
+int32_t friend_find_by_name(const char *name)
+{
+    size_t len = strlen(name);
+
+    if (len == 0 || len > TOX_MAX_NAME_LENGTH || num_buckets == 0)
+        return -1;
+
+    int32_t i = buckets[name_hash(name, len) & (num_buckets - 1)];
+
+    for (; i != -1; i = names[i].next) {
+        if (names[i].len == len && memcmp(names[i].name, name, len) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+void friends_load(Tox *m)
+{
+    uint32_t numfriends = tox_count_friendlist(m);
+
+    if (numfriends == 0)
+        return;
+
+    int32_t *friend_list = mem_malloc(MEM_IO, numfriends * sizeof(int32_t));
+
+    if (friend_list == NULL)
+        exit(EXIT_FAILURE);
+
+    uint32_t count = tox_get_friendlist(m, friend_list, numfriends);
+    uint32_t i;
+
+    for (i = 0; i < count; ++i) {
+        char name[TOX_MAX_NAME_LENGTH];
+        int len = tox_get_name(m, friend_list[i], (uint8_t *) name);
+
+        if (len > 0)
+            friend_name_set(friend_list[i], name, len);
+
+        if (tox_get_friend_connection_status(m, friend_list[i]) == 1)
+            friend_set_online(friend_list[i], true);
+    }
+
+    mem_free(friend_list);
+}
+
+void friends_free(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < names_size; ++i)
+        mem_free(names[i].name);
+
+    mem_free(names);
+    mem_free(buckets);
+    names = NULL;
+    buckets = NULL;
+    names_size = 0;
+    num_buckets = 0;
+
+    mem_free(online);
+    mem_free(online_pos);
+    online = NULL;
+    online_pos = NULL;
+    num_online = 0;
+    online_size = 0;
+    online_pos_size = 0;
+}
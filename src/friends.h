@@ -0,0 +1,65 @@
+/*  friends.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FRIENDS_H
+#define FRIENDS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <tox/tox.h>
+
+/* Fills the name cache and the online index from the friend list. Call once after the profile is loaded. */
+void friends_load(Tox *m);
+
+/* Frees the name cache and the online index. */
+void friends_free(void);
+
+/* Updates the cached name of friendnum. A NULL name or zero length clears it. */
+void friend_name_set(int32_t friendnum, const char *name, uint16_t length);
+
+/* Removes friendnum from the cache and the online index (e.g. after tox_del_friend). */
+void friend_remove(int32_t friendnum);
+
+/* Returns the cached name of friendnum. The string is borrowed: it is never NULL,
+   and stays valid until the friend's name changes or the friend is removed. */
+const char *friend_name(int32_t friendnum);
+
+/* Returns the length of the cached name of friendnum. */
+uint16_t friend_name_len(int32_t friendnum);
+
+/* Returns the friend number whose name is exactly name, or -1 if there is none. */
+int32_t friend_find_by_name(const char *name);
+
+/* Marks friendnum online or offline. Called from the connection status callback. */
+void friend_set_online(int32_t friendnum, bool status);
+
+/* Returns true if friendnum is currently online. */
+bool friend_is_online(int32_t friendnum);
+
+/* Returns the number of friends currently online. */
+uint32_t friends_num_online(void);
+
+/* Returns the friend numbers currently online, in no particular order, and puts their
+   number in count. The array is borrowed and only valid until the next status change. */
+const int32_t *friends_online(uint32_t *count);
+
+#endif /* FRIENDS_H */
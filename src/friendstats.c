@@ -0,0 +1,341 @@
+/*  friendstats.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <tox/tox.h>
+
+#include "friendstats.h"
+#include "log.h"
+#include "mem.h"
+
+#define FSTAT_MAGIC "TBFS"
+#define FSTAT_VERSION 1
+#define FSTAT_MIN_RECORDS 64
+
+struct Friendstats_Header {
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t num_records;
+};
+
+static int stats_fd = -1;
+static uint8_t *map;
+static size_t map_size;
+static struct Friend_Stats *records;
+static int32_t num_records;
+
+static const char *type_names[FSTAT_NUM_TYPES] = {
+    "hilfe", "info", "id", "hallo", "kontakte", "master", "ungültig",
+};
+
+const char *friendstats_type_name(int type)
+{
+    return type >= 0 && type < FSTAT_NUM_TYPES ? type_names[type] : "?";
+}
+
+static size_t file_size_for(int32_t n)
+{
+    return sizeof(struct Friendstats_Header) + (size_t) n * sizeof(struct Friend_Stats);
+}
+
+/* (Re)maps the file with room for n records. Returns 0 on success, -1 on error. */
+static int map_records(int32_t n)
+{
+    size_t size = file_size_for(n);
+
+    if (map) {
+        munmap(map, map_size);
+        mem_account(MEM_CONTACTS, -(int64_t) map_size);
+        map = NULL;
+        records = NULL;
+        num_records = 0;
+    }
+
+    if (ftruncate(stats_fd, size) != 0)
+        return -1;
+
+    uint8_t *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, stats_fd, 0);
+
+    if (p == MAP_FAILED)
+        return -1;
+
+    map = p;
+    map_size = size;
+    mem_account(MEM_CONTACTS, size);
+    records = (struct Friend_Stats *) (map + sizeof(struct Friendstats_Header));
+    num_records = n;
+
+    struct Friendstats_Header *hdr = (struct Friendstats_Header *) map;
+    memcpy(hdr->magic, FSTAT_MAGIC, 4);
+    hdr->version = FSTAT_VERSION;
+    hdr->record_size = sizeof(struct Friend_Stats);
+    hdr->num_records = n;
+    return 0;
+}
+
+/* Makes room for friendnum. Friend numbers are dense, so the table doubles. */
+static int grow(int32_t friendnum)
+{
+    if (friendnum < num_records)
+        return 0;
+
+    int32_t n = num_records ? num_records : FSTAT_MIN_RECORDS;
+
+    while (n <= friendnum)
+        n *= 2;
+
+    if (map_records(n) == -1) {
+        log_msg(L_ERROR, "friendstats_grow_failed records=%d", n);
+        return -1;
+    }
+
+    return 0;
+}
+
+int friendstats_load(Tox *m, const char *path)
+{
+    stats_fd = open(path, O_RDWR | O_CREAT, 0600);
+
+    if (stats_fd == -1)
+        return -1;
+
+    struct Friendstats_Header hdr;
+    int32_t n = 0;
+
+    if (read(stats_fd, &hdr, sizeof(hdr)) == sizeof(hdr) && memcmp(hdr.magic, FSTAT_MAGIC, 4) == 0
+            && hdr.version == FSTAT_VERSION && hdr.record_size == sizeof(struct Friend_Stats)) {
+        struct stat st;
+
+        if (fstat(stats_fd, &st) == 0 && (off_t) file_size_for(hdr.num_records) <= st.st_size)
+            n = hdr.num_records;
+    } else if (ftruncate(stats_fd, 0) != 0) {
+        goto on_error;
+    }
+
+    uint32_t numfriends = tox_count_friendlist(m);
+    int32_t max_fn = -1;
+
+    if (numfriends) {
+        int32_t *friend_list = mem_malloc(MEM_IO, numfriends * sizeof(int32_t));
+
+        if (friend_list == NULL)
+            exit(EXIT_FAILURE);
+
+        uint32_t count = tox_get_friendlist(m, friend_list, numfriends);
+        uint32_t i;
+
+        for (i = 0; i < count; ++i) {
+            if (friend_list[i] > max_fn)
+                max_fn = friend_list[i];
+        }
+
+        mem_free(friend_list);
+    }
+
+    if (n < FSTAT_MIN_RECORDS)
+        n = FSTAT_MIN_RECORDS;
+
+    while (n <= max_fn)
+        n *= 2;
+
+    if (map_records(n) == -1)
+        goto on_error;
+
+    /* friend numbers are reused after deletions, so records are only kept for the same key */
+    int32_t i;
+    int reset = 0;
+
+    for (i = 0; i < num_records; ++i) {
+        uint8_t key[TOX_CLIENT_ID_SIZE];
+
+        if (tox_get_client_id(m, i, key) == -1) {
+            memset(&records[i], 0, sizeof(struct Friend_Stats));
+        } else if (memcmp(records[i].public_key, key, TOX_CLIENT_ID_SIZE) != 0) {
+            memset(&records[i], 0, sizeof(struct Friend_Stats));
+            memcpy(records[i].public_key, key, TOX_CLIENT_ID_SIZE);
+            ++reset;
+        }
+    }
+
+    log_msg(L_INFO, "friendstats_load path=%s records=%d reset=%d", path, num_records, reset);
+    return 0;
+
+on_error:
+    close(stats_fd);
+    stats_fd = -1;
+    return -1;
+}
+
+void friendstats_sync(void)
+{
+    if (map)
+        msync(map, map_size, MS_ASYNC);
+}
+
+void friendstats_close(void)
+{
+    if (map) {
+        msync(map, map_size, MS_SYNC);
+        munmap(map, map_size);
+        mem_account(MEM_CONTACTS, -(int64_t) map_size);
+        map = NULL;
+        records = NULL;
+        num_records = 0;
+    }
+
+    if (stats_fd != -1) {
+        close(stats_fd);
+        stats_fd = -1;
+    }
+}
+
+void friendstats_add(Tox *m, int32_t friendnum)
+{
+    if (stats_fd == -1 || friendnum < 0 || grow(friendnum) == -1)
+        return;
+
+    memset(&records[friendnum], 0, sizeof(struct Friend_Stats));
+    tox_get_client_id(m, friendnum, records[friendnum].public_key);
+}
+
+void friendstats_remove(int32_t friendnum)
+{
+    if (friendnum >= 0 && friendnum < num_records)
+        memset(&records[friendnum], 0, sizeof(struct Friend_Stats));
+}
+
+void friendstats_command(int32_t friendnum, int type)
+{
+    if (friendnum < 0 || friendnum >= num_records || type < 0 || type >= FSTAT_NUM_TYPES)
+        return;
+
+    ++records[friendnum].commands[type];
+    records[friendnum].last_command = (uint64_t) time(NULL);
+}
+
+void friendstats_invite(int32_t friendnum)
+{
+    if (friendnum >= 0 && friendnum < num_records)
+        ++records[friendnum].invites;
+}
+
+void friendstats_sent(int32_t friendnum, uint32_t bytes)
+{
+    if (friendnum >= 0 && friendnum < num_records)
+        records[friendnum].bytes_sent += bytes;
+}
+
+const struct Friend_Stats *friendstats_get(int32_t friendnum)
+{
+    if (friendnum < 0 || friendnum >= num_records)
+        return NULL;
+
+    return &records[friendnum];
+}
+
+int32_t friendstats_size(void)
+{
+    return num_records;
+}
+
+uint64_t friendstats_total(const struct Friend_Stats *s)
+{
+    uint64_t total = 0;
+    int i;
+
+    for (i = 0; i < FSTAT_NUM_TYPES; ++i)
+        total += s->commands[i];
+
+    return total;
+}
+
+static bool record_used(const struct Friend_Stats *s)
+{
+    int i;
+
+    for (i = 0; i < TOX_CLIENT_ID_SIZE; ++i) {
+        if (s->public_key[i])
+            return true;
+    }
+
+    return false;
+}
+
+int friendstats_dump(const char *path, FILE *fp)
+{
+    FILE *in = fopen(path, "rb");
+
+    if (in == NULL)
+        return -1;
+
+    struct Friendstats_Header hdr;
+
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, FSTAT_MAGIC, 4) != 0
+            || hdr.version != FSTAT_VERSION || hdr.record_size != sizeof(struct Friend_Stats)) {
+        fclose(in);
+        return -1;
+    }
+
+    int i;
+    fprintf(fp, "friend,public_key");
+
+    for (i = 0; i < FSTAT_NUM_TYPES; ++i)
+        fprintf(fp, ",%s", type_names[i]);
+
+    fprintf(fp, ",last_command,invites,bytes_sent\n");
+
+    struct Friend_Stats s;
+    uint32_t fn;
+    int count = 0;
+
+    for (fn = 0; fn < hdr.num_records && fread(&s, sizeof(s), 1, in) == 1; ++fn) {
+        if (!record_used(&s))
+            continue;
+
+        fprintf(fp, "%u,", fn);
+
+        for (i = 0; i < TOX_CLIENT_ID_SIZE; ++i)
+            fprintf(fp, "%02X", s.public_key[i]);
+
+        for (i = 0; i < FSTAT_NUM_TYPES; ++i)
+            fprintf(fp, ",%u", s.commands[i]);
+
+        fprintf(fp, ",%llu,%u,%llu\n", (unsigned long long) s.last_command, s.invites,
+                (unsigned long long) s.bytes_sent);
+        ++count;
+    }
+
+    fclose(in);
+    return count;
+}
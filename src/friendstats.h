@@ -0,0 +1,89 @@
+/*  friendstats.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FRIENDSTATS_H
+#define FRIENDSTATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <tox/tox.h>
+
+/* Command types counted per friend */
+enum {
+    FSTAT_HELP,
+    FSTAT_INFO,
+    FSTAT_ID,
+    FSTAT_INVITE,
+    FSTAT_CONTACTS,
+    FSTAT_MASTER,
+    FSTAT_INVALID,
+    FSTAT_NUM_TYPES
+};
+
+/* One fixed-size record per friend number, stored in place in the mapped file. The public key
+   tells whether the record still belongs to the friend that has this number. */
+struct Friend_Stats {
+    uint8_t public_key[TOX_CLIENT_ID_SIZE];
+    uint32_t commands[FSTAT_NUM_TYPES];
+    uint32_t invites;
+    uint64_t last_command;    /* unix time, 0 if never */
+    uint64_t bytes_sent;
+};
+
+/* Maps the stats file at path, creating it if needed, and makes its records match the friend list.
+   Returns 0 on success, -1 on error (stats are then not kept). */
+int friendstats_load(Tox *m, const char *path);
+
+/* Schedules the mapped records to be written to disk. */
+void friendstats_sync(void);
+
+/* Writes the records to disk and unmaps the file. */
+void friendstats_close(void);
+
+/* Starts a fresh record for a new friend. */
+void friendstats_add(Tox *m, int32_t friendnum);
+
+/* Clears the record of a deleted friend. */
+void friendstats_remove(int32_t friendnum);
+
+/* The counters below only touch the mapped memory. */
+void friendstats_command(int32_t friendnum, int type);
+void friendstats_invite(int32_t friendnum);
+void friendstats_sent(int32_t friendnum, uint32_t bytes);
+
+/* Returns friendnum's record, or NULL if there is none. */
+const struct Friend_Stats *friendstats_get(int32_t friendnum);
+
+/* Returns the number of records (friend numbers) in the table. */
+int32_t friendstats_size(void);
+
+/* Returns the sum of all command counts of s. */
+uint64_t friendstats_total(const struct Friend_Stats *s);
+
+/* Returns the name of a command type. */
+const char *friendstats_type_name(int type);
+
+/* Prints the records of the stats file at path to fp as CSV without starting Tox.
+   Returns the number of records printed, or -1 if the file can't be read. */
+int friendstats_dump(const char *path, FILE *fp);
+
+#endif /* FRIENDSTATS_H */
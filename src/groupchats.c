@@ -23,22 +23,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/types.h>
+
+#include <tox/tox.h>
+#include <tox/toxav.h>
 
 #include "toxbot.h"
 #include "groupchats.h"
+#include "bridge.h"
+#include "gstats.h"
+#include "spam.h"
+#include "audio.h"
+#include "recorder.h"
+#include "history.h"
+#include "log.h"
+#include "misc.h"
+#include "mem.h"
 
 extern struct Tox_Bot Tox_Bot;
 
 void realloc_groupchats(int n)
 {
     if (n <= 0) {
-        free(Tox_Bot.g_chats);
+        mem_free(Tox_Bot.g_chats);
         Tox_Bot.g_chats = NULL;
         return;
     }
 
-    struct Group_Chat *g = realloc(Tox_Bot.g_chats, n * sizeof(struct Group_Chat));
+    struct Group_Chat *g = mem_realloc(MEM_GROUPS, Tox_Bot.g_chats, n * sizeof(struct Group_Chat));
 
     if (g == NULL)
         exit(EXIT_FAILURE);
@@ -61,6 +75,9 @@ int group_add(int groupnum, uint8_t type, const char *password)
         Tox_Bot.g_chats[i].num = groupnum;
         Tox_Bot.g_chats[i].active = true;
         Tox_Bot.g_chats[i].type = type;
+        Tox_Bot.g_chats[i].num_peers = 1;    /* ourselves, until the core reports the peer list */
+        Tox_Bot.g_chats[i].parent = -1;
+        Tox_Bot.g_chats[i].created = get_time_usec();
 
         if (password) {
             Tox_Bot.g_chats[i].has_pass = true;
@@ -87,6 +104,19 @@ void group_leave(int groupnum)
         }
     }
 
+    bridge_remove_group(groupnum);
+    gstats_remove(groupnum);
+    spam_remove(groupnum);
+    audio_stop(groupnum);
+    recorder_stop(groupnum);
+    history_remove(groupnum);
+
+    /* overflow groups of a root that's gone become roots themselves */
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        if (Tox_Bot.g_chats[i].active && Tox_Bot.g_chats[i].parent == groupnum)
+            Tox_Bot.g_chats[i].parent = -1;
+    }
+
     for (i = Tox_Bot.chats_idx; i > 0; --i) {
         if (Tox_Bot.g_chats[i - 1].active)
             break;
@@ -107,3 +137,207 @@ int group_index(int groupnum)
 
     return -1;
 }
+
+void group_set_peers(int groupnum, int num_peers)
+{
+    int idx = group_index(groupnum);
+
+    if (idx == -1 || num_peers < 0)
+        return;
+
+    Tox_Bot.g_chats[idx].num_peers = num_peers;
+
+    if (num_peers > 1)
+        Tox_Bot.g_chats[idx].joined = true;
+}
+
+int group_totals(int *total_peers)
+{
+    int i;
+    int groups = 0;
+    int peers = 0;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        if (Tox_Bot.g_chats[i].active) {
+            ++groups;
+            peers += Tox_Bot.g_chats[i].num_peers;
+        }
+    }
+
+    if (total_peers)
+        *total_peers = peers;
+
+    return groups;
+}
+
+/* returns true if the group at idx belongs to the family rooted at root */
+static bool in_family(int idx, int root)
+{
+    const struct Group_Chat *g = &Tox_Bot.g_chats[idx];
+    return g->active && (g->num == root || g->parent == root);
+}
+
+static int family_root(int groupnum)
+{
+    int idx = group_index(groupnum);
+
+    if (idx == -1)
+        return -1;
+
+    int parent = Tox_Bot.g_chats[idx].parent;
+    return parent != -1 && group_index(parent) != -1 ? parent : groupnum;
+}
+
+int group_set_capacity(int groupnum, int capacity)
+{
+    int root = family_root(groupnum);
+
+    if (root == -1)
+        return -1;
+
+    int i;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        if (in_family(i, root))
+            Tox_Bot.g_chats[i].capacity = capacity;
+    }
+
+    return 0;
+}
+
+int group_set_password(int groupnum, const char *password)
+{
+    int root = family_root(groupnum);
+
+    if (root == -1)
+        return -1;
+
+    int i;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        if (!in_family(i, root))
+            continue;
+
+        struct Group_Chat *g = &Tox_Bot.g_chats[i];
+        memset(g->password, 0, MAX_PASSWORD_SIZE);
+        g->has_pass = password != NULL;
+
+        if (password)
+            snprintf(g->password, sizeof(g->password), "%s", password);
+    }
+
+    return 0;
+}
+
+static int create_overflow_group(Tox *m, int root)
+{
+    int ridx = group_index(root);
+    uint8_t type = Tox_Bot.g_chats[ridx].type;
+    int groupnum = -1;
+
+    if (type == TOX_GROUPCHAT_TYPE_TEXT)
+        groupnum = tox_add_groupchat(m);
+    else if (type == TOX_GROUPCHAT_TYPE_AV)
+        groupnum = toxav_add_av_groupchat(m, recorder_audio_cb, NULL);
+
+    if (groupnum == -1)
+        return -1;
+
+    char password[MAX_PASSWORD_SIZE];
+    snprintf(password, sizeof(password), "%s", Tox_Bot.g_chats[ridx].password);
+    bool has_pass = Tox_Bot.g_chats[ridx].has_pass;
+
+    if (group_add(groupnum, type, has_pass ? password : NULL) == -1) {
+        tox_del_groupchat(m, groupnum);
+        return -1;
+    }
+
+    /* group_add may have moved the registry */
+    ridx = group_index(root);
+    int idx = group_index(groupnum);
+    int i;
+    int members = 0;
+
+    Tox_Bot.g_chats[idx].parent = root;
+    Tox_Bot.g_chats[idx].capacity = Tox_Bot.g_chats[ridx].capacity;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        if (in_family(i, root))
+            ++members;
+    }
+
+    if (Tox_Bot.g_chats[ridx].title_len) {
+        char title[TOX_MAX_NAME_LENGTH];
+        int len = snprintf(title, sizeof(title), "%s #%d", Tox_Bot.g_chats[ridx].title, members);
+        len = MIN(len, (int) sizeof(title) - 1);
+        len = MIN(len, UINT8_MAX);
+        title[len] = '\0';
+
+        tox_group_set_title(m, groupnum, (uint8_t *) title, len);
+        memcpy(Tox_Bot.g_chats[idx].title, title, len + 1);
+        Tox_Bot.g_chats[idx].title_len = len;
+    }
+
+    log_msg(L_INFO, "group_overflow_create group=%d root=%d members=%d", groupnum, root, members);
+    return groupnum;
+}
+
+int group_route_invite(Tox *m, int groupnum)
+{
+    int root = family_root(groupnum);
+
+    if (root == -1)
+        return -1;
+
+    int idx = group_index(groupnum);
+    int capacity = Tox_Bot.g_chats[idx].capacity;
+
+    if (capacity <= 0 || Tox_Bot.g_chats[idx].num_peers < capacity)
+        return groupnum;
+
+    int best = -1;
+    int i;
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        if (!in_family(i, root) || Tox_Bot.g_chats[i].num_peers >= capacity)
+            continue;
+
+        if (best == -1 || Tox_Bot.g_chats[i].num_peers < Tox_Bot.g_chats[best].num_peers)
+            best = i;
+    }
+
+    if (best != -1)
+        return Tox_Bot.g_chats[best].num;
+
+    return create_overflow_group(m, root);
+}
+
+void group_collapse_overflow(Tox *m)
+{
+    uint64_t now = get_time_usec();
+    int i;
+
+    for (i = Tox_Bot.chats_idx - 1; i >= 0; --i) {
+        /* group_leave() shrinks the registry past trailing free slots */
+        if (i >= Tox_Bot.chats_idx)
+            continue;
+
+        struct Group_Chat *g = &Tox_Bot.g_chats[i];
+
+        if (!g->active || g->parent == -1 || g->num_peers > 1)
+            continue;
+
+        /* a new group waits for its invitee; one nobody joined is still used by group_route_invite() */
+        if (!g->joined || !timed_out(g->created, now, GROUP_COLLAPSE_INTERVAL * 1000000ULL))
+            continue;
+
+        int groupnum = g->num;
+        int root = g->parent;
+
+        if (tox_del_groupchat(m, groupnum) == -1)
+            continue;
+
+        group_leave(groupnum);
+        log_msg(L_INFO, "group_overflow_collapse group=%d root=%d", groupnum, root);
+    }
+}
@@ -25,6 +25,7 @@
 
 #define SECONDS_IN_DAY 86400UL
 #define MAX_PASSWORD_SIZE 64
+#define GROUP_COLLAPSE_INTERVAL 60    /* seconds between checks for empty overflow groups */
 
 struct Group_Chat {
     int num;
@@ -34,6 +35,12 @@ struct Group_Chat {
     char title[TOX_MAX_NAME_LENGTH];
     int title_len;
     char password[MAX_PASSWORD_SIZE];
+    int num_peers;    /* kept current by the namelist-change callback */
+    int capacity;     /* peers before invites overflow into another group; 0 for no limit */
+    int parent;       /* group number of the family's root for overflow groups, -1 otherwise */
+    bool owned;       /* created with the group command: journaled and created again at startup */
+    uint64_t created;    /* get_time_usec() when added */
+    bool joined;         /* another peer has been in the group */
 };
 
 int group_add(int groupnum, uint8_t type, const char *password);
@@ -41,4 +48,26 @@ void group_leave(int groupnum);
 int group_index(int groupnum);
 void realloc_groupchats(int n);
 
+/* Updates the cached peer count of groupnum. */
+void group_set_peers(int groupnum, int num_peers);
+
+/* Sets the capacity of groupnum and its overflow groups. Returns 0 on success, -1 if there is no such group. */
+int group_set_capacity(int groupnum, int capacity);
+
+/* Sets or clears (password == NULL) the password of groupnum and its overflow groups.
+   Returns 0 on success, -1 if there is no such group. */
+int group_set_password(int groupnum, const char *password);
+
+/* Returns the group an invite to groupnum should go to: groupnum itself unless it has a capacity and
+   is full, otherwise the least loaded group of its family. If the whole family is full a new overflow
+   group with the same type, password and numbered title is created.
+   Returns -1 if groupnum doesn't exist or the overflow group could not be created. */
+int group_route_invite(Tox *m, int groupnum);
+
+/* Deletes overflow groups older than GROUP_COLLAPSE_INTERVAL that had peers and now only have the bot. */
+void group_collapse_overflow(Tox *m);
+
+/* Returns the number of active groups and puts the sum of their peer counts in total_peers. */
+int group_totals(int *total_peers);
+
 #endif  /* GROUPCHATS_H */
@@ -0,0 +1,359 @@
+/*  gstats.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include <tox/tox.h>
+
+#include "gstats.h"
+#include "misc.h"
+#include "mem.h"
+
+#define WINDOW_SLOTS 60
+#define HLL_REGISTERS (1 << GSTATS_HLL_BITS)
+
+/* Counts per slot for the last WINDOW_SLOTS slots (seconds or minutes) */
+struct Window {
+    uint32_t count[WINDOW_SLOTS];
+    uint64_t last;    /* slot the newest count belongs to */
+};
+
+struct Top_Talker {
+    uint8_t key[TOX_CLIENT_ID_SIZE];
+    char name[GSTATS_NAME_LENGTH + 1];
+    uint32_t count;    /* count-min estimate, never below the true count */
+};
+
+struct Group_Stats {
+    uint64_t total;
+    struct Window seconds;
+    struct Window minutes;
+    uint8_t hll[2][HLL_REGISTERS];    /* current and previous hour */
+    uint64_t hll_hour;
+    uint32_t cms[GSTATS_CMS_DEPTH][GSTATS_CMS_WIDTH];
+    struct Top_Talker top[GSTATS_TOP_K];
+    int num_top;
+};
+
+static struct Group_Stats **groups;    /* indexed by group number */
+static int groups_size;
+
+static void window_advance(struct Window *w, uint64_t slot)
+{
+    if (slot <= w->last)
+        return;
+
+    if (slot - w->last >= WINDOW_SLOTS) {
+        memset(w->count, 0, sizeof(w->count));
+    } else {
+        uint64_t s;
+
+        for (s = w->last + 1; s <= slot; ++s)
+            w->count[s % WINDOW_SLOTS] = 0;
+    }
+
+    w->last = slot;
+}
+
+static void window_add(struct Window *w, uint64_t slot)
+{
+    window_advance(w, slot);
+    ++w->count[slot % WINDOW_SLOTS];
+}
+
+static uint64_t window_sum(struct Window *w, uint64_t slot)
+{
+    window_advance(w, slot);
+
+    uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < WINDOW_SLOTS; ++i)
+        sum += w->count[i];
+
+    return sum;
+}
+
+/* FNV-1a followed by a murmur finalizer, so every bit depends on the whole key */
+static uint64_t key_hash(const uint8_t *key)
+{
+    uint64_t h = 14695981039346656037ULL;
+    int i;
+
+    for (i = 0; i < TOX_CLIENT_ID_SIZE; ++i) {
+        h ^= key[i];
+        h *= 1099511628211ULL;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static void hll_rotate(struct Group_Stats *g, uint64_t hour)
+{
+    if (hour == g->hll_hour)
+        return;
+
+    if (hour == g->hll_hour + 1)
+        memcpy(g->hll[1], g->hll[0], HLL_REGISTERS);
+    else
+        memset(g->hll[1], 0, HLL_REGISTERS);
+
+    memset(g->hll[0], 0, HLL_REGISTERS);
+    g->hll_hour = hour;
+}
+
+static void hll_add(struct Group_Stats *g, uint64_t h)
+{
+    uint32_t idx = h >> (64 - GSTATS_HLL_BITS);
+    uint64_t rest = (h << GSTATS_HLL_BITS) | (1ULL << (GSTATS_HLL_BITS - 1));
+    uint8_t rank = __builtin_clzll(rest) + 1;
+
+    if (rank > g->hll[0][idx])
+        g->hll[0][idx] = rank;
+}
+
+/* Estimates the distinct peers over both hours by merging the registers */
+static uint64_t hll_estimate(const struct Group_Stats *g)
+{
+    double sum = 0;
+    int zeros = 0;
+    int i;
+
+    for (i = 0; i < HLL_REGISTERS; ++i) {
+        uint8_t r = MAX(g->hll[0][i], g->hll[1][i]);
+        sum += ldexp(1.0, -r);
+        zeros += r == 0;
+    }
+
+    double m = HLL_REGISTERS;
+    double e = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+
+    /* linear counting is more accurate while many registers are empty */
+    if (e <= 2.5 * m && zeros)
+        e = m * log(m / zeros);
+
+    return (uint64_t) (e + 0.5);
+}
+
+/* Adds one to key's counters and returns its new estimate */
+static uint32_t cms_add(struct Group_Stats *g, uint64_t h)
+{
+    uint32_t h1 = h, h2 = h >> 32;
+    uint32_t est = UINT32_MAX;
+    int i;
+
+    for (i = 0; i < GSTATS_CMS_DEPTH; ++i) {
+        uint32_t *c = &g->cms[i][(h1 + i * h2) % GSTATS_CMS_WIDTH];
+
+        if (*c < UINT32_MAX)
+            ++*c;
+
+        est = MIN(est, *c);
+    }
+
+    return est;
+}
+
+static void top_update(Tox *m, struct Group_Stats *g, int groupnum, int peernum, const uint8_t *key, uint32_t count)
+{
+    int i, min = 0;
+
+    for (i = 0; i < g->num_top; ++i) {
+        if (memcmp(g->top[i].key, key, TOX_CLIENT_ID_SIZE) == 0) {
+            g->top[i].count = count;
+            return;
+        }
+
+        if (g->top[i].count < g->top[min].count)
+            min = i;
+    }
+
+    if (g->num_top < GSTATS_TOP_K)
+        min = g->num_top++;
+    else if (count <= g->top[min].count)
+        return;
+
+    struct Top_Talker *t = &g->top[min];
+    uint8_t name[TOX_MAX_NAME_LENGTH];
+    int len = tox_group_peername(m, groupnum, peernum, name);
+
+    /* truncate without splitting a UTF-8 sequence */
+    if (len > GSTATS_NAME_LENGTH) {
+        len = GSTATS_NAME_LENGTH;
+
+        while (len > 0 && (name[len] & 0xc0) == 0x80)
+            --len;
+    }
+
+    memcpy(t->key, key, TOX_CLIENT_ID_SIZE);
+    copy_tox_str(t->name, sizeof(t->name), (const char *) name, MAX(len, 0));
+    t->count = count;
+}
+
+static struct Group_Stats *get_stats(int groupnum)
+{
+    if (groupnum >= groups_size) {
+        int n = MAX(groupnum + 1, groups_size * 2);
+        struct Group_Stats **p = mem_realloc(MEM_GROUPS, groups, n * sizeof(struct Group_Stats *));
+
+        if (p == NULL)
+            exit(EXIT_FAILURE);
+
+        memset(p + groups_size, 0, (n - groups_size) * sizeof(struct Group_Stats *));
+        groups = p;
+        groups_size = n;
+    }
+
+    if (groups[groupnum] == NULL) {
+        groups[groupnum] = mem_calloc(MEM_GROUPS, 1, sizeof(struct Group_Stats));
+
+        if (groups[groupnum] == NULL)
+            exit(EXIT_FAILURE);
+    }
+
+    return groups[groupnum];
+}
+
+void gstats_message(Tox *m, int groupnum, int peernum)
+{
+    uint8_t key[TOX_CLIENT_ID_SIZE];
+
+    if (groupnum < 0 || tox_group_peernumber_is_ours(m, groupnum, peernum)
+            || tox_group_peer_pubkey(m, groupnum, peernum, key) == -1)
+        return;
+
+    /* a new group costs a few kB; only existing ones keep counting over the limit */
+    if ((groupnum >= groups_size || groups[groupnum] == NULL) && mem_over_limit(MEM_GROUPS)) {
+        mem_rejected(MEM_GROUPS);
+        return;
+    }
+
+    struct Group_Stats *g = get_stats(groupnum);
+    uint64_t now = get_time_usec() / 1000000;
+    uint64_t h = key_hash(key);
+
+    ++g->total;
+    window_add(&g->seconds, now);
+    window_add(&g->minutes, now / 60);
+    hll_rotate(g, now / 3600);
+    hll_add(g, h);
+    top_update(m, g, groupnum, peernum, key, cms_add(g, h));
+}
+
+void gstats_remove(int groupnum)
+{
+    if (groupnum < 0 || groupnum >= groups_size)
+        return;
+
+    mem_free(groups[groupnum]);
+    groups[groupnum] = NULL;
+}
+
+static int top_cmp(const void *a, const void *b)
+{
+    uint32_t x = ((const struct Top_Talker *) a)->count, y = ((const struct Top_Talker *) b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+int gstats_summary(int groupnum, char *buf, int size)
+{
+    if (groupnum < 0 || groupnum >= groups_size || groups[groupnum] == NULL)
+        return 0;
+
+    struct Group_Stats *g = groups[groupnum];
+    uint64_t now = get_time_usec() / 1000000;
+    hll_rotate(g, now / 3600);
+
+    int len = snprintf(buf, size, "Gruppe %d: %"PRIu64"/min, %"PRIu64"/h, ~%"PRIu64" Sprecher", groupnum,
+                       window_sum(&g->seconds, now), window_sum(&g->minutes, now / 60), hll_estimate(g));
+    return MIN(len, size - 1);
+}
+
+int gstats_report(int groupnum, char *buf, int size)
+{
+    if (groupnum < 0 || groupnum >= groups_size || groups[groupnum] == NULL)
+        return -1;
+
+    struct Group_Stats *g = groups[groupnum];
+    uint64_t now = get_time_usec() / 1000000;
+    int len = 0;
+
+#define REPORT_LINE(...) \
+    do { \
+        if (len < size) \
+            len += snprintf(buf + len, size - len, __VA_ARGS__); \
+    } while (0)
+
+    hll_rotate(g, now / 3600);
+
+    REPORT_LINE("Gruppe %d: %"PRIu64" Nachrichten seit Start\n", groupnum, g->total);
+    REPORT_LINE("Letzte Minute: %"PRIu64", letzte Stunde: %"PRIu64"\n", window_sum(&g->seconds, now),
+                window_sum(&g->minutes, now / 60));
+    REPORT_LINE("Aktive Sprecher (1-2 h): ~%"PRIu64"\n", hll_estimate(g));
+
+    struct Top_Talker top[GSTATS_TOP_K];
+    int i;
+
+    memcpy(top, g->top, g->num_top * sizeof(struct Top_Talker));
+    qsort(top, g->num_top, sizeof(struct Top_Talker), top_cmp);
+
+    REPORT_LINE("Top-Sprecher seit Start (geschätzt):\n");
+
+    for (i = 0; i < g->num_top; ++i) {
+        REPORT_LINE("%d. %s (%02X%02X%02X%02X) ~%"PRIu32"\n", i + 1, top[i].name[0] ? top[i].name : "?",
+                    top[i].key[0], top[i].key[1], top[i].key[2], top[i].key[3], top[i].count);
+    }
+
+#undef REPORT_LINE
+
+    if (len >= size)
+        len = size - 1;
+
+    /* no trailing newline */
+    if (len > 0 && buf[len - 1] == '\n')
+        buf[--len] = '\0';
+
+    return len;
+}
+
+void gstats_free(void)
+{
+    int i;
+
+    for (i = 0; i < groups_size; ++i)
+        mem_free(groups[i]);
+
+    mem_free(groups);
+    groups = NULL;
+    groups_size = 0;
+}
@@ -0,0 +1,54 @@
+/*  gstats.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef GSTATS_H
+#define GSTATS_H
+
+#include <stdint.h>
+#include <tox/tox.h>
+
+/* Per-group activity in fixed memory (about 7 kB per group that has seen a message):
+   message counts over the last minute and hour in sliding windows of 60 slots, a HyperLogLog
+   of the peers that talked in the current and previous hour, and a count-min sketch that
+   feeds a list of the GSTATS_TOP_K top talkers since startup. */
+#define GSTATS_HLL_BITS 10                        /* 1024 registers, about 3% standard error */
+#define GSTATS_CMS_DEPTH 4
+#define GSTATS_CMS_WIDTH 256
+#define GSTATS_TOP_K 8
+#define GSTATS_NAME_LENGTH 32                     /* peer names are kept truncated to this */
+
+/* Called from the group message callback. */
+void gstats_message(Tox *m, int groupnum, int peernum);
+
+/* Forgets the stats of groupnum. Called by group_leave(). */
+void gstats_remove(int groupnum);
+
+/* Writes the stats of groupnum into buf, one line each. Returns the length written,
+   or -1 if the group has seen no messages. */
+int gstats_report(int groupnum, char *buf, int size);
+
+/* Writes a one line summary of groupnum into buf. Returns the length written, 0 if it has seen no messages. */
+int gstats_summary(int groupnum, char *buf, int size);
+
+void gstats_free(void);
+
+#endif /* GSTATS_H */
@@ -0,0 +1,979 @@
+/*  history.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <tox/tox.h>
+
+#include "history.h"
+#include "misc.h"
+#include "log.h"
+#include "mem.h"
+#include "trace.h"
+
+/* Both file types start with a 4 byte magic, a version byte and 3 bytes of padding.
+   Segment records: uint32 length of the rest, int64 unix time, uint8 name length, name, message.
+   Index: uint32 number of terms, uint32 number of messages, the terms sorted by hash, then
+   the posting lists as varints of the gaps between message offsets. */
+#define SEGMENT_MAGIC "TBHS"
+#define INDEX_MAGIC "TBHI"
+#define HISTORY_VERSION 1
+#define HEADER_SIZE 8
+#define RECORD_MIN 13           /* length field, time and name length */
+#define TERM_MIN 2              /* shorter words aren't indexed */
+#define TERM_MAX 32             /* longer words are hashed on their first TERM_MAX bytes */
+#define RESULT_LENGTH 160       /* bytes of a message shown in a search result */
+
+struct Index_Term {
+    uint64_t hash;
+    uint32_t postings;    /* offset of the posting list after the term table */
+    uint32_t count;
+};
+
+struct History_Group {
+    int groupnum;
+    FILE *fp;               /* NULL while capture is off */
+    uint32_t seg;           /* segment being written */
+    uint32_t size;          /* its size */
+    uint32_t next_index;    /* oldest segment that may still need an index */
+    uint64_t messages;
+    bool dirty;
+};
+
+static struct History_Group groups[HISTORY_MAX_GROUPS];
+static int num_groups;
+
+/* One segment is indexed at a time */
+static struct {
+    int groupnum;
+    uint32_t seg;
+    bool ok;
+} job;
+
+static bool indexing;
+static bool index_started;
+static pthread_t index_tid;
+
+static bool archived;    /* files of an earlier run were moved away */
+
+static void segment_path(char *buf, size_t size, int groupnum, uint32_t seg, const char *ext)
+{
+    snprintf(buf, size, "%s/g%d.%"PRIu32".%s", HISTORY_DIR, groupnum, seg, ext);
+}
+
+static struct History_Group *find_group(int groupnum)
+{
+    int i;
+
+    for (i = 0; i < num_groups; ++i) {
+        if (groups[i].groupnum == groupnum)
+            return &groups[i];
+    }
+
+    return NULL;
+}
+
+/* Finds the oldest and newest segment of groupnum on disk. Returns false if there is none. */
+static bool segment_range(int groupnum, uint32_t *lo, uint32_t *hi)
+{
+    DIR *dir = opendir(HISTORY_DIR);
+    bool found = false;
+    struct dirent *e;
+
+    if (dir == NULL)
+        return false;
+
+    while ((e = readdir(dir)) != NULL) {
+        int num;
+        uint32_t seg;
+        char ext[4];
+
+        if (sscanf(e->d_name, "g%d.%"SCNu32".%3s", &num, &seg, ext) != 3 || num != groupnum || strcmp(ext, "log"))
+            continue;
+
+        if (!found || seg < *lo)
+            *lo = seg;
+
+        if (!found || seg > *hi)
+            *hi = seg;
+
+        found = true;
+    }
+
+    closedir(dir);
+    return found;
+}
+
+/* Calls add() for every word of text: runs of ASCII letters and digits or of non-ASCII bytes,
+   with ASCII lowercased. URLs fall apart into their words, so "github" finds github.com links. */
+static void tokenize(const uint8_t *text, uint32_t length, void (*add)(uint64_t hash, void *arg), void *arg)
+{
+    uint32_t i = 0;
+
+    while (i < length) {
+        uint64_t h = 14695981039346656037ULL;
+        uint32_t len = 0;
+
+        for (; i < length; ++i) {
+            uint8_t c = text[i];
+
+            if (c >= 'A' && c <= 'Z')
+                c += 'a' - 'A';
+            else if (c < 0x80 && !(c >= 'a' && c <= 'z') && !(c >= '0' && c <= '9'))
+                break;
+
+            if (len++ < TERM_MAX) {
+                h ^= c;
+                h *= 1099511628211ULL;
+            }
+        }
+
+        if (len >= TERM_MIN)
+            add(h, arg);
+
+        ++i;
+    }
+}
+
+static uint8_t *map_file(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    uint8_t *p = NULL;
+
+    if (fstat(fd, &st) == 0 && st.st_size >= HEADER_SIZE) {
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (p == MAP_FAILED) {
+            p = NULL;
+        } else {
+            *size = st.st_size;
+            mem_account(MEM_IO, st.st_size);
+        }
+    }
+
+    close(fd);
+    return p;
+}
+
+static void unmap_file(uint8_t *p, size_t size)
+{
+    munmap(p, size);
+    mem_account(MEM_IO, -(int64_t) size);
+}
+
+/* INDEXER */
+
+struct Posting {
+    uint64_t hash;
+    uint32_t offset;
+};
+
+struct Postings {
+    struct Posting *p;
+    uint32_t len;
+    uint32_t size;
+    uint32_t offset;    /* of the message being tokenized */
+};
+
+static void add_posting(uint64_t hash, void *arg)
+{
+    struct Postings *ps = arg;
+
+    if (ps->len == ps->size) {
+        uint32_t n = ps->size ? ps->size * 2 : 4096;
+        struct Posting *p = mem_realloc(MEM_IO, ps->p, n * sizeof(struct Posting));
+
+        if (p == NULL)
+            exit(EXIT_FAILURE);
+
+        ps->p = p;
+        ps->size = n;
+    }
+
+    ps->p[ps->len].hash = hash;
+    ps->p[ps->len++].offset = ps->offset;
+}
+
+static int posting_cmp(const void *a, const void *b)
+{
+    const struct Posting *x = a, *y = b;
+
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static uint32_t put_varint(uint8_t *buf, uint32_t v)
+{
+    uint32_t n = 0;
+
+    while (v >= 0x80) {
+        buf[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+
+    buf[n++] = v;
+    return n;
+}
+
+/* Writes the index of a closed segment next to it. Runs in the indexer thread. */
+static bool index_segment(int groupnum, uint32_t seg)
+{
+    char path[PATH_MAX];
+    size_t size;
+
+    segment_path(path, sizeof(path), groupnum, seg, "log");
+    uint8_t *map = map_file(path, &size);
+
+    if (map == NULL)
+        return false;
+
+    if (memcmp(map, SEGMENT_MAGIC, 4) != 0) {
+        unmap_file(map, size);
+        return false;
+    }
+
+    struct Postings ps = { NULL, 0, 0, 0 };
+    uint32_t messages = 0;
+    size_t off = HEADER_SIZE;
+
+    while (off + RECORD_MIN <= size) {
+        uint32_t len;
+        memcpy(&len, map + off, sizeof(len));
+
+        /* a record cut short by a crash ends the segment */
+        if (len < RECORD_MIN - 4 || off + 4 + len > size)
+            break;
+
+        const uint8_t *body = map + off + 4;
+        uint8_t name_len = MIN(body[8], len - 9);
+
+        ps.offset = off;
+        tokenize(body + 9, name_len, add_posting, &ps);
+        tokenize(body + 9 + name_len, len - 9 - name_len, add_posting, &ps);
+        ++messages;
+        off += 4 + len;
+    }
+
+    unmap_file(map, size);
+    qsort(ps.p, ps.len, sizeof(struct Posting), posting_cmp);
+
+    uint32_t num_terms = 0, i;
+
+    for (i = 0; i < ps.len; ++i)
+        num_terms += i == 0 || ps.p[i].hash != ps.p[i - 1].hash;
+
+    size_t table = HEADER_SIZE + 8 + (size_t) num_terms * sizeof(struct Index_Term);
+    uint8_t *buf = mem_malloc(MEM_IO, table + (size_t) ps.len * 5);
+
+    if (buf == NULL)
+        exit(EXIT_FAILURE);
+
+    memcpy(buf, INDEX_MAGIC, 4);
+    buf[4] = HISTORY_VERSION;
+    buf[5] = buf[6] = buf[7] = 0;
+    memcpy(buf + HEADER_SIZE, &num_terms, sizeof(num_terms));
+    memcpy(buf + HEADER_SIZE + 4, &messages, sizeof(messages));
+
+    struct Index_Term *terms = (struct Index_Term *) (buf + HEADER_SIZE + 8);
+    uint32_t t = 0, pos = 0, prev = 0;
+
+    for (i = 0; i < ps.len; ++i) {
+        if (i == 0 || ps.p[i].hash != ps.p[i - 1].hash) {
+            terms[t].hash = ps.p[i].hash;
+            terms[t].postings = pos;
+            terms[t++].count = 0;
+            prev = 0;
+        } else if (ps.p[i].offset == prev) {
+            continue;    /* the word occurs more than once in the message */
+        }
+
+        pos += put_varint(buf + table + pos, ps.p[i].offset - prev);
+        prev = ps.p[i].offset;
+        ++terms[t - 1].count;
+    }
+
+    char tmp[PATH_MAX + 4];
+    segment_path(path, sizeof(path), groupnum, seg, "idx");
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp, "wb");
+    bool ok = fp != NULL && fwrite(buf, table + pos, 1, fp) == 1;
+
+    if (fp && fclose(fp) != 0)
+        ok = false;
+
+    if (!ok || rename(tmp, path) != 0) {
+        log_msg(L_ERROR, "history_index_failed path=%s error=\"%s\"", path, strerror(errno));
+        remove(tmp);
+        ok = false;
+    } else {
+        log_msg(L_INFO, "history_index group=%d segment=%"PRIu32" messages=%"PRIu32" terms=%"PRIu32" bytes=%zu",
+                groupnum, seg, messages, num_terms, table + pos);
+    }
+
+    mem_free(buf);
+    mem_free(ps.p);
+    return ok;
+}
+
+static void *index_thread(void *arg)
+{
+    trace_thread_name("history");
+
+    uint64_t span = trace_start();
+    job.ok = index_segment(job.groupnum, job.seg);
+    trace_end("history_index", span);
+
+    __atomic_store_n(&indexing, false, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Waits for the indexer and moves on past the segment it worked on */
+static void index_join(void)
+{
+    pthread_join(index_tid, NULL);
+    index_started = false;
+
+    /* a segment that can't be indexed is scanned instead */
+    struct History_Group *g = find_group(job.groupnum);
+
+    if (g && g->next_index == job.seg)
+        ++g->next_index;
+}
+
+/* Moves the files of groupnum, or of every group if groupnum is -1, to HISTORY_OLD_DIR.
+   Group numbers are reused after a leave and change at restart, so a later group with
+   the same number must never see them. */
+static void archive(int groupnum)
+{
+    if (mkdir(HISTORY_OLD_DIR, 0700) == -1 && errno != EEXIST)
+        return;
+
+    static unsigned int archives;    /* tells apart archives made in the same second */
+    DIR *dir = opendir(HISTORY_DIR);
+    struct dirent *e;
+    long stamp = time(NULL);
+    unsigned int n = archives++;
+
+    if (dir == NULL)
+        return;
+
+    while ((e = readdir(dir)) != NULL) {
+        int num;
+        uint32_t seg;
+
+        if (sscanf(e->d_name, "g%d.%"SCNu32".", &num, &seg) != 2 || (groupnum != -1 && num != groupnum))
+            continue;
+
+        char from[PATH_MAX], to[PATH_MAX];
+        snprintf(from, sizeof(from), "%s/%s", HISTORY_DIR, e->d_name);
+        snprintf(to, sizeof(to), "%s/%ld-%u-%s", HISTORY_OLD_DIR, stamp, n, e->d_name);
+
+        if (rename(from, to) != 0) {
+            log_msg(L_ERROR, "history_archive_failed path=%s error=\"%s\"", from, strerror(errno));
+            remove(from);
+        }
+    }
+
+    closedir(dir);
+    log_msg(L_INFO, "history_archive group=%d", groupnum);
+}
+
+/* CAPTURE */
+
+static int open_segment(struct History_Group *g)
+{
+    char path[PATH_MAX];
+    segment_path(path, sizeof(path), g->groupnum, g->seg, "log");
+
+    if ((g->fp = fopen(path, "ab")) == NULL) {
+        log_msg(L_ERROR, "history_open_failed path=%s error=\"%s\"", path, strerror(errno));
+        return -1;
+    }
+
+    uint8_t header[HEADER_SIZE] = { 0 };
+    memcpy(header, SEGMENT_MAGIC, 4);
+    header[4] = HISTORY_VERSION;
+
+    if (fwrite(header, sizeof(header), 1, g->fp) != 1) {
+        fclose(g->fp);
+        g->fp = NULL;
+        return -1;
+    }
+
+    g->size = HEADER_SIZE;
+    return 0;
+}
+
+/* Closes the full segment, which the indexer picks up, and deletes the oldest one past the limit */
+static void rotate(struct History_Group *g)
+{
+    fclose(g->fp);
+    g->fp = NULL;
+    ++g->seg;
+
+    if (g->seg >= HISTORY_MAX_SEGMENTS) {
+        char path[PATH_MAX];
+        uint32_t old = g->seg - HISTORY_MAX_SEGMENTS;
+
+        segment_path(path, sizeof(path), g->groupnum, old, "log");
+        remove(path);
+        segment_path(path, sizeof(path), g->groupnum, old, "idx");
+        remove(path);
+    }
+
+    open_segment(g);
+}
+
+int history_start(int groupnum)
+{
+    struct History_Group *g = find_group(groupnum);
+
+    if (g && g->fp)
+        return 0;
+
+    if (g) {    /* capture was turned off: go on with a new segment */
+        ++g->seg;
+        return open_segment(g);
+    }
+
+    if (num_groups == HISTORY_MAX_GROUPS || (mkdir(HISTORY_DIR, 0700) == -1 && errno != EEXIST))
+        return -1;
+
+    /* whatever an earlier run captured belongs to groups that may have other numbers now */
+    if (!archived) {
+        archive(-1);
+        archived = true;
+    }
+
+    g = &groups[num_groups];
+    memset(g, 0, sizeof(struct History_Group));
+    g->groupnum = groupnum;
+
+    if (open_segment(g) == -1)
+        return -1;
+
+    ++num_groups;
+    return 0;
+}
+
+void history_stop(int groupnum)
+{
+    struct History_Group *g = find_group(groupnum);
+
+    if (g == NULL || g->fp == NULL)
+        return;
+
+    fclose(g->fp);
+    g->fp = NULL;
+    g->dirty = false;
+}
+
+void history_remove(int groupnum)
+{
+    struct History_Group *g = find_group(groupnum);
+
+    if (g == NULL)
+        return;
+
+    /* the indexer must not write an index for a file that is moved away */
+    if (index_started && job.groupnum == groupnum)
+        index_join();
+
+    history_stop(groupnum);
+    *g = groups[--num_groups];
+    archive(groupnum);
+}
+
+bool history_enabled(int groupnum)
+{
+    struct History_Group *g = find_group(groupnum);
+    return g && g->fp;
+}
+
+void history_message(Tox *m, int groupnum, int peernum, const char *msg, uint16_t length)
+{
+    struct History_Group *g = find_group(groupnum);
+
+    if (g == NULL || g->fp == NULL || tox_group_peernumber_is_ours(m, groupnum, peernum))
+        return;
+
+    uint8_t name[TOX_MAX_NAME_LENGTH];
+    int name_len = tox_group_peername(m, groupnum, peernum, name);
+    uint8_t nlen = MIN(MAX(name_len, 0), UINT8_MAX);
+    int64_t t = time(NULL);
+    uint32_t len = 8 + 1 + nlen + length;
+
+    fwrite(&len, sizeof(len), 1, g->fp);
+    fwrite(&t, sizeof(t), 1, g->fp);
+    fwrite(&nlen, 1, 1, g->fp);
+    fwrite(name, nlen, 1, g->fp);
+    fwrite(msg, length, 1, g->fp);
+
+    g->size += 4 + len;
+    g->dirty = true;
+    ++g->messages;
+
+    if (g->size >= HISTORY_SEGMENT_SIZE)
+        rotate(g);
+}
+
+void history_do(void)
+{
+    int i;
+
+    for (i = 0; i < num_groups; ++i) {
+        if (groups[i].dirty && groups[i].fp) {
+            fflush(groups[i].fp);
+            groups[i].dirty = false;
+        }
+    }
+
+    if (__atomic_load_n(&indexing, __ATOMIC_ACQUIRE))
+        return;
+
+    if (index_started)
+        index_join();
+
+    if (mem_over_limit(MEM_IO))
+        return;
+
+    for (i = 0; i < num_groups; ++i) {
+        struct History_Group *g = &groups[i];
+        char path[PATH_MAX];
+
+        /* skip segments that are indexed or gone; the one being written waits, even while capture is off */
+        while (g->next_index < g->seg) {
+            segment_path(path, sizeof(path), g->groupnum, g->next_index, "idx");
+
+            if (!file_exists(path)) {
+                segment_path(path, sizeof(path), g->groupnum, g->next_index, "log");
+
+                if (file_exists(path))
+                    break;
+            }
+
+            ++g->next_index;
+        }
+
+        if (g->next_index == g->seg)
+            continue;
+
+        job.groupnum = g->groupnum;
+        job.seg = g->next_index;
+        __atomic_store_n(&indexing, true, __ATOMIC_RELEASE);
+
+        if (pthread_create(&index_tid, NULL, index_thread, NULL) != 0) {
+            job.ok = index_segment(job.groupnum, job.seg);
+            __atomic_store_n(&indexing, false, __ATOMIC_RELEASE);
+            ++g->next_index;
+            return;
+        }
+
+        index_started = true;
+        return;
+    }
+}
+
+/* SEARCH */
+
+struct Query {
+    uint64_t terms[HISTORY_MAX_TERMS];
+    int num_terms;
+    bool too_many;
+    uint32_t seen;    /* bit per term, while checking a message */
+};
+
+static void add_query_term(uint64_t hash, void *arg)
+{
+    struct Query *q = arg;
+    int i;
+
+    for (i = 0; i < q->num_terms; ++i) {
+        if (q->terms[i] == hash)
+            return;
+    }
+
+    if (q->num_terms < HISTORY_MAX_TERMS)
+        q->terms[q->num_terms++] = hash;
+    else
+        q->too_many = true;
+}
+
+static void mark_term(uint64_t hash, void *arg)
+{
+    struct Query *q = arg;
+    int i;
+
+    for (i = 0; i < q->num_terms; ++i) {
+        if (q->terms[i] == hash)
+            q->seen |= 1u << i;
+    }
+}
+
+/* Returns true if the record at off has every term of q. Index hits are checked too, since the
+   index only knows hashes. */
+static bool record_matches(const uint8_t *map, size_t size, size_t off, struct Query *q)
+{
+    uint32_t len;
+
+    if (off + RECORD_MIN > size)
+        return false;
+
+    memcpy(&len, map + off, sizeof(len));
+
+    if (len < RECORD_MIN - 4 || off + 4 + len > size)
+        return false;
+
+    const uint8_t *body = map + off + 4;
+    uint8_t name_len = MIN(body[8], len - 9);
+
+    q->seen = 0;
+    tokenize(body + 9, name_len, mark_term, q);
+    tokenize(body + 9 + name_len, len - 9 - name_len, mark_term, q);
+    return q->seen == (1u << q->num_terms) - 1;
+}
+
+static int append_result(const uint8_t *map, size_t off, char *buf, int size, int len)
+{
+    uint32_t rlen;
+    int64_t t;
+
+    memcpy(&rlen, map + off, sizeof(rlen));
+    memcpy(&t, map + off + 4, sizeof(t));
+
+    const uint8_t *body = map + off + 4;
+    uint8_t name_len = MIN(body[8], rlen - 9);
+    const char *name = (const char *) body + 9;
+    const char *msg = name + name_len;
+    int msg_len = rlen - 9 - name_len;
+    int cut = MIN(msg_len, RESULT_LENGTH);
+
+    /* don't cut inside a UTF-8 sequence */
+    while (cut < msg_len && cut > 0 && (msg[cut] & 0xc0) == 0x80)
+        --cut;
+
+    char when[32];
+    struct tm tm;
+    time_t tt = t;
+    localtime_r(&tt, &tm);
+    strftime(when, sizeof(when), "%d.%m. %H:%M", &tm);
+
+    int start = len;
+
+    if (len < size)
+        len += snprintf(buf + len, size - len, "[%s] %.*s: %.*s%s\n", when, name_len, name, cut, msg,
+                        cut < msg_len ? "..." : "");
+
+    /* one line per result */
+    int i;
+
+    for (i = start; i < MIN(len, size) - 1; ++i) {
+        if (buf[i] == '\n' || buf[i] == '\r')
+            buf[i] = ' ';
+    }
+
+    return len;
+}
+
+static uint32_t get_varint(const uint8_t **p, const uint8_t *end)
+{
+    uint32_t v = 0;
+    int shift = 0;
+
+    while (*p < end && shift < 35) {
+        uint8_t b = *(*p)++;
+        v |= (uint32_t) (b & 0x7f) << shift;
+
+        if (!(b & 0x80))
+            break;
+
+        shift += 7;
+    }
+
+    return v;
+}
+
+static const struct Index_Term *find_term(const struct Index_Term *terms, uint32_t num_terms, uint64_t hash)
+{
+    uint32_t lo = 0, hi = num_terms;
+
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+
+        if (terms[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo < num_terms && terms[lo].hash == hash ? &terms[lo] : NULL;
+}
+
+/* Puts the offsets of the messages that have every term of q, per the index, into *offsets.
+   Returns their number, or -1 if the index can't be used. */
+static int64_t index_candidates(const uint8_t *idx, size_t size, const struct Query *q, uint32_t **offsets)
+{
+    uint32_t num_terms;
+
+    if (size < HEADER_SIZE + 8 || memcmp(idx, INDEX_MAGIC, 4) != 0 || idx[4] != HISTORY_VERSION)
+        return -1;
+
+    memcpy(&num_terms, idx + HEADER_SIZE, sizeof(num_terms));
+
+    size_t table = HEADER_SIZE + 8 + (size_t) num_terms * sizeof(struct Index_Term);
+
+    if (table > size)
+        return -1;
+
+    const struct Index_Term *terms = (const struct Index_Term *) (idx + HEADER_SIZE + 8);
+    const struct Index_Term *found[HISTORY_MAX_TERMS];
+    int i, rarest = 0;
+
+    for (i = 0; i < q->num_terms; ++i) {
+        if ((found[i] = find_term(terms, num_terms, q->terms[i])) == NULL)
+            return 0;
+
+        if (found[i]->count < found[rarest]->count)
+            rarest = i;
+    }
+
+    /* start from the shortest list and keep what every other list has too */
+    uint32_t n = found[rarest]->count;
+    uint32_t *out = mem_malloc(MEM_IO, MAX(n, 1) * sizeof(uint32_t));
+
+    if (out == NULL)
+        exit(EXIT_FAILURE);
+
+    const uint8_t *p = idx + table + found[rarest]->postings;
+    uint32_t off = 0, k;
+
+    for (k = 0; k < n; ++k)
+        out[k] = off += get_varint(&p, idx + size);
+
+    for (i = 0; i < q->num_terms && n > 0; ++i) {
+        if (i == rarest)
+            continue;
+
+        uint32_t kept = 0, j = 0, cur = 0;
+        p = idx + table + found[i]->postings;
+        off = 0;
+
+        for (k = 0; k < found[i]->count && j < n; ++k) {
+            cur = off += get_varint(&p, idx + size);
+
+            while (j < n && out[j] < cur)
+                ++j;
+
+            if (j < n && out[j] == cur)
+                out[kept++] = out[j++];
+        }
+
+        n = kept;
+    }
+
+    *offsets = out;
+    return n;
+}
+
+/* Puts the offsets of every record of a segment without an index into *offsets */
+static int64_t scan_candidates(const uint8_t *map, size_t size, uint32_t **offsets)
+{
+    uint32_t n = 0, cap = 256;
+    uint32_t *out = mem_malloc(MEM_IO, cap * sizeof(uint32_t));
+    size_t off = HEADER_SIZE;
+
+    if (out == NULL)
+        exit(EXIT_FAILURE);
+
+    while (off + RECORD_MIN <= size) {
+        uint32_t len;
+        memcpy(&len, map + off, sizeof(len));
+
+        if (len < RECORD_MIN - 4 || off + 4 + len > size)
+            break;
+
+        if (n == cap) {
+            uint32_t *p = mem_realloc(MEM_IO, out, cap * 2 * sizeof(uint32_t));
+
+            if (p == NULL)
+                exit(EXIT_FAILURE);
+
+            out = p;
+            cap *= 2;
+        }
+
+        out[n++] = off;
+        off += 4 + len;
+    }
+
+    *offsets = out;
+    return n;
+}
+
+static void search_segment(int groupnum, uint32_t seg, struct Query *q, char *buf, int size, int *len, int *found)
+{
+    char path[PATH_MAX];
+    size_t log_size, idx_size;
+
+    segment_path(path, sizeof(path), groupnum, seg, "log");
+    uint8_t *map = map_file(path, &log_size);
+
+    if (map == NULL)
+        return;
+
+    if (memcmp(map, SEGMENT_MAGIC, 4) != 0) {
+        unmap_file(map, log_size);
+        return;
+    }
+
+    uint32_t *offsets = NULL;
+    int64_t n = -1;
+
+    segment_path(path, sizeof(path), groupnum, seg, "idx");
+    uint8_t *idx = map_file(path, &idx_size);
+
+    if (idx) {
+        n = index_candidates(idx, idx_size, q, &offsets);
+        unmap_file(idx, idx_size);
+    }
+
+    if (n == -1)
+        n = scan_candidates(map, log_size, &offsets);
+
+    /* newest first */
+    for (; n > 0 && *found < HISTORY_RESULTS; --n) {
+        if (record_matches(map, log_size, offsets[n - 1], q)) {
+            *len = append_result(map, offsets[n - 1], buf, size, *len);
+            ++*found;
+        }
+    }
+
+    mem_free(offsets);
+    unmap_file(map, log_size);
+}
+
+int history_search(int groupnum, const char *query, char *buf, int size)
+{
+    struct Query q;
+    q.num_terms = 0;
+    q.too_many = false;
+    tokenize((const uint8_t *) query, strlen(query), add_query_term, &q);
+
+    if (q.num_terms == 0)
+        return -1;
+
+    /* dropping words would find more than was asked for */
+    if (q.too_many)
+        return -3;
+
+    struct History_Group *g = find_group(groupnum);
+
+    /* only what was captured since this group got its number */
+    if (g == NULL)
+        return -2;
+
+    uint64_t span = trace_start();
+    uint32_t lo, hi;
+    int len = 0, found = 0;
+
+    if (g->fp) {
+        fflush(g->fp);
+        g->dirty = false;
+    }
+
+    buf[0] = '\0';
+
+    if (segment_range(groupnum, &lo, &hi)) {
+        uint32_t seg;
+
+        for (seg = hi + 1; seg-- > lo && found < HISTORY_RESULTS;)
+            search_segment(groupnum, seg, &q, buf, size, &len, &found);
+    }
+
+    /* no trailing newline */
+    len = MIN(len, size - 1);
+
+    if (len > 0 && buf[len - 1] == '\n')
+        buf[--len] = '\0';
+
+    trace_end("history_search", span);
+    return found;
+}
+
+int history_status(char *buf, int size)
+{
+    int len = 0, i;
+
+    for (i = 0; i < num_groups && len < size; ++i) {
+        struct History_Group *g = &groups[i];
+        len += snprintf(buf + len, size - len, "Gruppe %d: %s, Segment %"PRIu32" (%"PRIu32" kB), %"PRIu64
+                        " Nachrichten, Index bis Segment %"PRIu32"\n", g->groupnum, g->fp ? "an" : "aus", g->seg,
+                        g->size / 1024, g->messages, g->next_index);
+    }
+
+    if (len < size && __atomic_load_n(&indexing, __ATOMIC_ACQUIRE))
+        len += snprintf(buf + len, size - len, "Indexer läuft\n");
+
+    len = MIN(len, size - 1);
+
+    if (len > 0 && buf[len - 1] == '\n')
+        buf[--len] = '\0';
+
+    return len;
+}
+
+void history_shutdown(void)
+{
+    int i;
+
+    for (i = 0; i < num_groups; ++i)
+        history_stop(groups[i].groupnum);
+
+    num_groups = 0;
+
+    if (index_started) {
+        pthread_join(index_tid, NULL);
+        index_started = false;
+    }
+}
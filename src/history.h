@@ -0,0 +1,76 @@
+/*  history.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <tox/tox.h>
+
+/* Group messages of captured groups are appended to segment files HISTORY_DIR/g<n>.<seg>.log.
+   A full segment is closed and a background thread writes an inverted index for it to
+   g<n>.<seg>.idx: the hashes of the words in it, each with the offsets of the messages containing
+   it. Searches map the indexes and only read the messages they point to; segments without an
+   index yet (the one being written at least) are scanned.
+   Group numbers are reused, so a group's files are moved to HISTORY_OLD_DIR when the bot leaves
+   it, and the files of an earlier run when capture is first started; neither is searched again. */
+#define HISTORY_DIR "history"
+#define HISTORY_OLD_DIR "history/old"
+#define HISTORY_MAX_GROUPS 16
+#define HISTORY_SEGMENT_SIZE (256 * 1024)    /* bytes before a segment is closed and indexed */
+#define HISTORY_MAX_SEGMENTS 64              /* per group; older segments are deleted */
+#define HISTORY_MAX_TERMS 8
+#define HISTORY_RESULTS 5
+
+/* Starts capturing the messages of groupnum. Returns 0 on success, -1 on error. */
+int history_start(int groupnum);
+
+/* Stops capturing groupnum. What was captured can still be searched. */
+void history_stop(int groupnum);
+
+/* Stops capturing groupnum and moves its files to HISTORY_OLD_DIR. Called by group_leave(). */
+void history_remove(int groupnum);
+
+bool history_enabled(int groupnum);
+
+/* Called from the group message callback. */
+void history_message(Tox *m, int groupnum, int peernum, const char *msg, uint16_t length);
+
+/* Flushes captured messages and starts indexing a closed segment if there is one waiting.
+   Call once per main loop iteration. */
+void history_do(void);
+
+/* Searches the history of groupnum for messages containing every word of query, newest first,
+   and writes up to HISTORY_RESULTS of them into buf, one line each.
+   Returns the number of matches written, -1 if query has no words, -2 if the history of
+   groupnum was never started since the bot joined it, or -3 if query has more than
+   HISTORY_MAX_TERMS words. */
+int history_search(int groupnum, const char *query, char *buf, int size);
+
+/* Puts a summary of the captured groups in buf. Returns its length. */
+int history_status(char *buf, int size);
+
+/* Stops capturing and waits for the indexer. */
+void history_shutdown(void);
+
+#endif /* HISTORY_H */
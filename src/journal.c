@@ -0,0 +1,563 @@
+/*  journal.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "misc.h"
+#include "log.h"
+#include "trace.h"
+#include "mem.h"
+
+struct Journal_Header {
+    uint32_t crc;       /* over the rest of the header and the payload */
+    uint16_t length;
+    uint8_t type;
+    uint8_t reserved;
+};
+
+static char *journal_path;
+static bool journal_writable;
+static journal_apply_cb *apply_record;
+static journal_snapshot_cb *snapshot_state;
+
+/* Several processes may append (toxbot -a while the bot runs). The first writer holds
+   path.owner for as long as it runs and is the only one that rotates and compacts.
+   Appends and rotations take path.lock, so no record lands in a segment after the
+   owner's last poll of it, and another writer moves on to the segment the owner rotated to. */
+static int owner_fd = -1;
+static int lock_fd = -1;
+static bool journal_owner;
+
+static int seg_fd = -1;
+static uint32_t seg_gen;      /* current segment */
+static off_t seg_size;
+static off_t seg_read;        /* records before this offset have been applied */
+
+/* the snapshot being built; only touched by the compaction thread once it is started */
+static uint8_t *snap_buf;
+static size_t snap_len;
+static size_t snap_size;
+static uint32_t snap_gen;
+
+static pthread_t compact_tid;
+static bool compact_started;
+static bool compacting;
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *p, size_t len)
+{
+    if (crc_table[1] == 0) {
+        uint32_t i, j;
+
+        for (i = 0; i < 256; ++i) {
+            uint32_t c = i;
+
+            for (j = 0; j < 8; ++j)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+
+            crc_table[i] = c;
+        }
+    }
+
+    crc = ~crc;
+
+    while (len--)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+static uint32_t record_crc(const struct Journal_Header *h, const uint8_t *data)
+{
+    uint32_t crc = crc32_update(0, (const uint8_t *) h + sizeof(h->crc), sizeof(*h) - sizeof(h->crc));
+    return crc32_update(crc, data, h->length);
+}
+
+/* Builds the record for type and data in buf. Returns its size. */
+static size_t record_build(uint8_t *buf, int type, const void *data, uint16_t length)
+{
+    struct Journal_Header h = { 0, length, type, 0 };
+    h.crc = record_crc(&h, data);
+
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), data, length);
+    return sizeof(h) + length;
+}
+
+static void segment_path(char *buf, int size, uint32_t gen)
+{
+    snprintf(buf, size, "%s.%u", journal_path, gen);
+}
+
+static void journal_lock(void)
+{
+    if (lock_fd != -1)
+        flock(lock_fd, LOCK_EX);
+}
+
+static void journal_unlock(void)
+{
+    if (lock_fd != -1)
+        flock(lock_fd, LOCK_UN);
+}
+
+/* Becomes the owner if no other process is. Returns true if we are. */
+static bool take_ownership(void)
+{
+    if (!journal_owner && owner_fd != -1 && flock(owner_fd, LOCK_EX | LOCK_NB) == 0)
+        journal_owner = true;
+
+    return journal_owner;
+}
+
+/* Opens path.ext for locking. Returns the fd or -1. */
+static int open_lock_file(const char *ext)
+{
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s.%s", journal_path, ext);
+
+    int fd = open(file, O_RDWR | O_CREAT, 0600);
+
+    if (fd == -1)
+        log_msg(L_ERROR, "journal_lock_failed path=%s error=\"%s\"", file, strerror(errno));
+
+    return fd;
+}
+
+/* Applies the complete records in buf. Returns the number of bytes they take up;
+   anything after that is a torn or corrupt record. Sets *snap_next to the segment a
+   snapshot continues with if it has a snapshot record. */
+static size_t replay_buf(const uint8_t *buf, size_t len, int *count, uint32_t *snap_next)
+{
+    size_t pos = 0;
+
+    while (len - pos >= sizeof(struct Journal_Header)) {
+        struct Journal_Header h;
+        memcpy(&h, buf + pos, sizeof(h));
+
+        if (len - pos - sizeof(h) < h.length || h.length > JOURNAL_MAX_RECORD
+                || record_crc(&h, buf + pos + sizeof(h)) != h.crc)
+            break;
+
+        const uint8_t *data = buf + pos + sizeof(h);
+
+        if (h.type == JOURNAL_SNAPSHOT) {
+            if (snap_next && h.length == sizeof(uint32_t))
+                memcpy(snap_next, data, sizeof(uint32_t));
+        } else {
+            apply_record(h.type, data, h.length);
+            ++*count;
+        }
+
+        pos += sizeof(h) + h.length;
+    }
+
+    return pos;
+}
+
+/* Reads the file at path from offset. Returns a buffer that must be freed with mem_free(), or NULL. */
+static uint8_t *read_from(const char *path, off_t offset, size_t *len)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || st.st_size < offset) {
+        close(fd);
+        return NULL;
+    }
+
+    *len = st.st_size - offset;
+    uint8_t *buf = mem_malloc(MEM_IO, *len + 1);
+
+    if (buf == NULL)
+        exit(EXIT_FAILURE);
+
+    if (pread(fd, buf, *len, offset) != (ssize_t) *len) {
+        mem_free(buf);
+        close(fd);
+        return NULL;
+    }
+
+    close(fd);
+    return buf;
+}
+
+int journal_open(const char *path, bool writable, journal_apply_cb *apply, journal_snapshot_cb *snapshot)
+{
+    journal_path = mem_strdup(MEM_IO, path);
+
+    if (journal_path == NULL)
+        exit(EXIT_FAILURE);
+
+    journal_writable = writable;
+    apply_record = apply;
+    snapshot_state = snapshot;
+
+    if (writable) {
+        owner_fd = open_lock_file("owner");
+        lock_fd = open_lock_file("lock");
+        take_ownership();
+    }
+
+    char file[PATH_MAX];
+    int count = 0;
+    uint32_t gen = 0;
+    size_t len;
+    uint8_t *buf;
+
+    /* don't cut off a record another process is writing */
+    journal_lock();
+    snprintf(file, sizeof(file), "%s.snap", path);
+
+    if ((buf = read_from(file, 0, &len)) != NULL) {
+        /* snapshots are renamed into place whole, so a bad one is damage, not a crash */
+        if (replay_buf(buf, len, &count, &gen) != len)
+            log_msg(L_ERROR, "journal_snapshot_corrupt path=%s", file);
+
+        mem_free(buf);
+    }
+
+    seg_gen = gen;
+    seg_size = 0;
+
+    for (;; ++gen) {
+        segment_path(file, sizeof(file), gen);
+
+        if ((buf = read_from(file, 0, &len)) == NULL)
+            break;
+
+        size_t good = replay_buf(buf, len, &count, NULL);
+        mem_free(buf);
+
+        seg_gen = gen;
+        seg_size = good;
+
+        /* a torn record is the tail of the last segment after a crash; cut it off so appends follow good data */
+        if (good != len) {
+            log_msg(L_WARN, "journal_truncated path=%s offset=%zu bytes=%zu", file, good, len - good);
+
+            if (writable && truncate(file, good) != 0)
+                log_msg(L_ERROR, "journal_truncate_failed path=%s error=\"%s\"", file, strerror(errno));
+        }
+    }
+
+    seg_read = seg_size;
+
+    if (writable) {
+        segment_path(file, sizeof(file), seg_gen);
+        seg_fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0600);
+
+        if (seg_fd == -1) {
+            log_msg(L_ERROR, "journal_open_failed path=%s error=\"%s\"", file, strerror(errno));
+            journal_unlock();
+            return -1;
+        }
+    }
+
+    journal_unlock();
+    log_msg(L_INFO, "journal_open path=%s records=%d segment=%u owner=%d", path, count, seg_gen, journal_owner);
+    return count;
+}
+
+int journal_append(int type, const void *data, uint16_t length)
+{
+    /* read-only: the change only lives in memory */
+    if (!journal_writable)
+        return 0;
+
+    if (seg_fd == -1 || length > JOURNAL_MAX_RECORD)
+        return -1;
+
+    /* compact before writing: the caller applies this record only after we return,
+       so a snapshot taken afterwards would miss it */
+    if (seg_size > JOURNAL_COMPACT_SIZE)
+        journal_compact();
+
+    uint8_t buf[sizeof(struct Journal_Header) + JOURNAL_MAX_RECORD];
+    size_t len = record_build(buf, type, data, length);
+    uint64_t span = trace_start();
+
+    journal_lock();
+
+    /* apply what other processes appended first, so memory matches a replay;
+       this also follows the owner if it rotated past our segment */
+    journal_poll();
+
+    if (write(seg_fd, buf, len) != (ssize_t) len || fdatasync(seg_fd) != 0) {
+        log_msg(L_ERROR, "journal_append_failed type=%d error=\"%s\"", type, strerror(errno));
+        journal_unlock();
+        trace_end("journal_append", span);
+        return -1;
+    }
+
+    journal_unlock();
+    trace_end("journal_append", span);
+
+    off_t end = lseek(seg_fd, 0, SEEK_CUR);
+
+    /* polled under the lock, so the caller applies the only record after seg_read */
+    seg_read = end;
+
+    seg_size = end;
+    return 0;
+}
+
+void journal_poll(void)
+{
+    if (journal_path == NULL)
+        return;
+
+    char file[PATH_MAX];
+    struct stat st;
+    int count = 0;
+
+    for (;;) {
+        segment_path(file, sizeof(file), seg_gen);
+
+        if (stat(file, &st) == 0 && st.st_size > seg_read) {
+            size_t len;
+            uint8_t *buf = read_from(file, seg_read, &len);
+
+            if (buf == NULL)
+                break;
+
+            seg_read += replay_buf(buf, len, &count, NULL);
+            mem_free(buf);
+        }
+
+        /* another process rotated: go on with its segment */
+        segment_path(file, sizeof(file), seg_gen + 1);
+
+        if (stat(file, &st) != 0)
+            break;
+
+        if (seg_fd != -1) {
+            int fd = open(file, O_WRONLY | O_APPEND, 0600);
+
+            if (fd == -1)
+                break;
+
+            close(seg_fd);
+            seg_fd = fd;
+        }
+
+        ++seg_gen;
+        seg_read = seg_size = 0;
+    }
+
+    if (count)
+        log_msg(L_INFO, "journal_poll records=%d", count);
+}
+
+void journal_snapshot_add(int type, const void *data, uint16_t length)
+{
+    if (length > JOURNAL_MAX_RECORD)
+        return;
+
+    size_t need = sizeof(struct Journal_Header) + length;
+
+    if (snap_len + need > snap_size) {
+        size_t size = MAX(snap_size * 2, snap_len + need + 4096);
+        uint8_t *p = mem_realloc(MEM_IO, snap_buf, size);
+
+        if (p == NULL)
+            exit(EXIT_FAILURE);
+
+        snap_buf = p;
+        snap_size = size;
+    }
+
+    snap_len += record_build(snap_buf + snap_len, type, data, length);
+}
+
+/* Writes the snapshot next to the journal, renames it into place and deletes the segments it covers */
+static void *compact_thread(void *arg)
+{
+    trace_thread_name("journal");
+
+    uint64_t span = trace_start();
+    uint64_t start = get_time_usec();
+    char tmp[PATH_MAX], file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s.snap", journal_path);
+    snprintf(tmp, sizeof(tmp), "%s.snap.tmp", journal_path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    bool ok = fd != -1 && write(fd, snap_buf, snap_len) == (ssize_t) snap_len && fsync(fd) == 0;
+
+    if (fd != -1 && close(fd) != 0)
+        ok = false;
+
+    if (!ok || rename(tmp, file) != 0) {
+        /* the old snapshot and segments still replay to the same state */
+        log_msg(L_ERROR, "journal_compact_failed path=%s error=\"%s\"", file, strerror(errno));
+        remove(tmp);
+    } else {
+        uint32_t gen = snap_gen;
+
+        while (gen-- > 0) {
+            segment_path(file, sizeof(file), gen);
+
+            if (unlink(file) != 0)
+                break;
+        }
+
+        log_msg(L_INFO, "journal_compact bytes=%zu segment=%u usec=%llu", snap_len, snap_gen,
+                (unsigned long long) (get_time_usec() - start));
+    }
+
+    mem_free(snap_buf);
+    snap_buf = NULL;
+    snap_len = snap_size = 0;
+    trace_end("journal_snapshot", span);
+    __atomic_store_n(&compacting, false, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int journal_compact(void)
+{
+    if (seg_fd == -1)
+        return -1;
+
+    /* segments belong to the owner; another writer leaves them alone */
+    if (!take_ownership())
+        return 0;
+
+    if (__atomic_load_n(&compacting, __ATOMIC_ACQUIRE))
+        return 0;
+
+    if (compact_started) {
+        pthread_join(compact_tid, NULL);
+        compact_started = false;
+    }
+
+    /* the snapshot must include records other processes added to the segment it replaces,
+       and none may be added after this poll */
+    journal_lock();
+    journal_poll();
+
+    char file[PATH_MAX];
+    segment_path(file, sizeof(file), seg_gen + 1);
+    int fd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0600);
+
+    if (fd == -1) {
+        log_msg(L_ERROR, "journal_open_failed path=%s error=\"%s\"", file, strerror(errno));
+        journal_unlock();
+        return -1;
+    }
+
+    journal_unlock();
+    close(seg_fd);
+    seg_fd = fd;
+    seg_size = seg_read = 0;
+    snap_gen = ++seg_gen;
+
+    journal_snapshot_add(JOURNAL_SNAPSHOT, &snap_gen, sizeof(snap_gen));
+    snapshot_state();
+
+    __atomic_store_n(&compacting, true, __ATOMIC_RELEASE);
+
+    if (pthread_create(&compact_tid, NULL, compact_thread, NULL) != 0) {
+        compact_thread(NULL);
+        return 0;
+    }
+
+    compact_started = true;
+    return 0;
+}
+
+void journal_close(void)
+{
+    if (compact_started) {
+        pthread_join(compact_tid, NULL);
+        compact_started = false;
+    }
+
+    if (seg_fd != -1)
+        close(seg_fd);
+
+    /* closing releases the locks */
+    if (owner_fd != -1)
+        close(owner_fd);
+
+    if (lock_fd != -1)
+        close(lock_fd);
+
+    seg_fd = owner_fd = lock_fd = -1;
+    journal_owner = false;
+    mem_free(journal_path);
+    journal_path = NULL;
+}
+
+void journal_remove(const char *path)
+{
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+
+    char *slash = strrchr(dir, '/');
+    const char *base = slash ? slash + 1 : path;
+
+    if (slash)
+        *slash = '\0';
+    else
+        snprintf(dir, sizeof(dir), ".");
+
+    DIR *d = opendir(dir);
+
+    if (d == NULL)
+        return;
+
+    size_t len = strlen(base);
+    struct dirent *e;
+
+    while ((e = readdir(d)) != NULL) {
+        if (strncmp(e->d_name, base, len) != 0 || e->d_name[len] != '.')
+            continue;
+
+        const char *ext = e->d_name + len + 1;
+
+        if (strcmp(ext, "snap") && strcmp(ext, "snap.tmp") && strcmp(ext, "lock") && strcmp(ext, "owner")
+                && strspn(ext, "0123456789") != strlen(ext))
+            continue;
+
+        char file[PATH_MAX + NAME_MAX + 2];
+        snprintf(file, sizeof(file), "%s/%s", dir, e->d_name);
+        unlink(file);
+    }
+
+    closedir(d);
+}
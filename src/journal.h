@@ -0,0 +1,73 @@
+/*  journal.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * An append-only log of state changes. Every record carries a CRC-32, so a record torn by a crash
+ * is detected and dropped on replay. Records go to numbered segments (path.0, path.1, ...); once
+ * the current one passes JOURNAL_COMPACT_SIZE the whole state is written to a snapshot (path.snap)
+ * by a background thread, after which the segments it covers are deleted. A snapshot names the
+ * first segment that isn't in it, so a crash at any point replays to the same state.
+ * Other processes may append while the bot runs; only the first writer (the owner) compacts,
+ * and path.lock keeps their appends out of a segment the owner is rotating away from.
+ */
+#define JOURNAL_COMPACT_SIZE (64 * 1024)
+#define JOURNAL_MAX_RECORD 1024    /* payload bytes */
+#define JOURNAL_SNAPSHOT 0         /* reserved record type: first record of a snapshot */
+
+/* Applies one replayed record to the state. */
+typedef void journal_apply_cb(int type, const uint8_t *data, uint16_t length);
+
+/* Writes the whole state with journal_snapshot_add(). */
+typedef void journal_snapshot_cb(void);
+
+/* Replays path's snapshot and segments through apply. If writable is false nothing is ever
+   written (appends are ignored), which lets a replay or test run on the real state.
+   Returns the number of records replayed, or -1 on error. */
+int journal_open(const char *path, bool writable, journal_apply_cb *apply, journal_snapshot_cb *snapshot);
+
+/* Appends one record with a single write and waits for it to reach the disk.
+   Returns 0 on success, -1 on error. */
+int journal_append(int type, const void *data, uint16_t length);
+
+/* Applies records appended by another process since the last call, e.g. a master added from
+   the command line while the bot is running. */
+void journal_poll(void);
+
+/* Starts a compaction unless one is running or another process owns the journal.
+   Returns 0 on success, -1 on error. */
+int journal_compact(void);
+
+/* Called from the snapshot callback for every record of the state. */
+void journal_snapshot_add(int type, const void *data, uint16_t length);
+
+/* Waits for a running compaction and closes the journal. */
+void journal_close(void);
+
+/* Deletes path's snapshot and all of its segments. */
+void journal_remove(const char *path);
+
+#endif /* JOURNAL_H */
@@ -0,0 +1,289 @@
+/*  loadgen.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include <tox/tox.h>
+
+#include "toxbot.h"
+#include "groupchats.h"
+#include "friends.h"
+#include "loadgen.h"
+#include "stats.h"
+#include "misc.h"
+#include "log.h"
+#include "mem.h"
+#include "state.h"
+#include "commands.h"
+
+extern bool FLAG_EXIT;
+extern struct Tox_Bot Tox_Bot;
+
+#define LOADGEN_TOX_DO_INTERVAL 40000    /* usec, same pace as the main loop */
+#define LOADGEN_PROGRESS_INTERVAL 10     /* seconds */
+
+/* Weighted command mix sent by synthetic friends. The last entry is deliberately invalid. */
+static const struct {
+    const char *msg;
+    int weight;
+} command_mix[] = {
+    { "hallo",      40 },
+    { "info",       20 },
+    { "kontakte",   15 },
+    { "id",         10 },
+    { "hilfe",      10 },
+    { "blah",        5 },
+    { NULL,          0 },
+};
+
+/* Per-event probabilities in percent, once all friends exist */
+#define LOADGEN_PCT_GROUP_INVITE 1
+#define LOADGEN_PCT_NAME_CHANGE  4
+#define LOADGEN_PCT_CONNECTION   4
+
+static uint32_t rng_state;
+
+/* xorshift32; the load is reproducible for a given seed */
+static uint32_t rng_next(void)
+{
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rng_state = x;
+    return x;
+}
+
+static void random_key(uint8_t *key)
+{
+    int i;
+
+    for (i = 0; i < TOX_CLIENT_ID_SIZE; ++i)
+        key[i] = rng_next() & 0xff;
+}
+
+static const char *pick_command(void)
+{
+    int total = 0;
+    int i;
+
+    for (i = 0; command_mix[i].msg; ++i)
+        total += command_mix[i].weight;
+
+    int r = rng_next() % total;
+
+    for (i = 0; command_mix[i].msg; ++i) {
+        if (r < command_mix[i].weight)
+            break;
+
+        r -= command_mix[i].weight;
+    }
+
+    return command_mix[i].msg;
+}
+
+struct Loadgen_State {
+    int32_t *friends;
+    uint32_t num_friends;
+    uint64_t requests;
+    uint64_t messages;
+    uint64_t invites;
+    uint64_t name_changes;
+    uint64_t status_changes;
+};
+
+static void friend_request(Tox *m, struct Loadgen_State *st)
+{
+    uint8_t key[TOX_CLIENT_ID_SIZE];
+    random_key(key);
+
+    /* friend 0 is made a master so that master-only paths (group invites) are exercised too */
+    if (st->num_friends == 0 && state_add_master(key) == -1)
+        log_msg(L_WARN, "loadgen_master_failed path=%s", LOADGEN_JOURNAL_FILE);
+
+    const char *hello = "Hallo, ich bin ein Testfreund";
+    cb_friend_request(m, key, (const uint8_t *) hello, strlen(hello), NULL);
+    ++st->requests;
+
+    int32_t friendnum = tox_get_friend_number(m, key);
+
+    if (friendnum != -1) {
+        st->friends[st->num_friends++] = friendnum;
+        cb_connection_status(m, friendnum, 1, NULL);
+    }
+}
+
+static void one_event(Tox *m, struct Loadgen_State *st, uint32_t target_friends)
+{
+    /* ramp up: half of the events are friend requests until every friend exists */
+    if (st->num_friends == 0 || (st->num_friends < target_friends && (rng_next() & 1))) {
+        friend_request(m, st);
+        return;
+    }
+
+    int32_t friendnum = st->friends[rng_next() % st->num_friends];
+    uint32_t r = rng_next() % 100;
+
+    if (r < LOADGEN_PCT_GROUP_INVITE) {
+        uint8_t data[TOX_CLIENT_ID_SIZE * 2];
+        random_key(data);
+        random_key(data + TOX_CLIENT_ID_SIZE);
+        cb_group_invite(m, st->friends[0], TOX_GROUPCHAT_TYPE_TEXT, data, sizeof(data), NULL);
+        ++st->invites;
+        return;
+    }
+
+    if (r < LOADGEN_PCT_GROUP_INVITE + LOADGEN_PCT_NAME_CHANGE) {
+        char name[32];
+        int len = snprintf(name, sizeof(name), "Testfreund %"PRIu32, rng_next() % 100000);
+        cb_name_change(m, friendnum, (const uint8_t *) name, len, NULL);
+        ++st->name_changes;
+        return;
+    }
+
+    if (r < LOADGEN_PCT_GROUP_INVITE + LOADGEN_PCT_NAME_CHANGE + LOADGEN_PCT_CONNECTION) {
+        cb_connection_status(m, friendnum, !friend_is_online(friendnum), NULL);
+        ++st->status_changes;
+        return;
+    }
+
+    const char *msg = pick_command();
+    cb_friend_message(m, friendnum, (const uint8_t *) msg, strlen(msg), NULL);
+    ++st->messages;
+}
+
+static int create_default_group(Tox *m)
+{
+    int groupnum = tox_add_groupchat(m);
+
+    if (groupnum == -1)
+        return -1;
+
+    if (group_add(groupnum, TOX_GROUPCHAT_TYPE_TEXT, NULL) == -1) {
+        tox_del_groupchat(m, groupnum);
+        return -1;
+    }
+
+    Tox_Bot.default_groupnum = groupnum;
+    return 0;
+}
+
+static void print_report(const struct Loadgen_State *st, uint64_t events, uint64_t elapsed_us,
+                         long rss_start, long rss_peak, long rss_end, const struct Loadgen_Options *opts)
+{
+    const struct Bot_Stats *s = stats_get();
+    double secs = elapsed_us / 1000000.0;
+
+    printf("\nLasttest: %"PRIu64" Ereignisse in %.1f s (Ziel %"PRIu32"/s, erreicht %.1f/s)\n",
+           events, secs, opts->rate, secs > 0 ? events / secs : 0.0);
+    printf("  Freundschaftsanfragen: %"PRIu64" (%"PRIu32" Freunde)\n", st->requests, st->num_friends);
+    printf("  Nachrichten: %"PRIu64"  Gruppeneinladungen: %"PRIu64"  Namensänderungen: %"PRIu64"\n",
+           st->messages, st->invites, st->name_changes);
+    printf("  Verbindungswechsel: %"PRIu64" (%"PRIu32" online)\n", st->status_changes, friends_num_online());
+    printf("  Befehle: %"PRIu64" ausgeführt, %"PRIu64" ungültig\n", s->commands, s->invalid_commands);
+    printf("  Latenz p50/p99/p999/max: %"PRIu64"/%"PRIu64"/%"PRIu64"/%"PRIu64" us\n",
+           stats_latency_percentile(50.0), stats_latency_percentile(99.0),
+           stats_latency_percentile(99.9), s->latency_max);
+    printf("  Antworten: %"PRIu64" gesendet, %"PRIu64" verworfen\n", s->replies_sent, s->replies_dropped);
+    printf("  RSS: %ld kB -> %ld kB (Spitze %ld kB, Zuwachs %ld kB)\n", rss_start, rss_end, rss_peak,
+           rss_end - rss_start);
+    printf("  Gruppen im Register: %d\n", Tox_Bot.chats_idx);
+}
+
+int loadgen_run(Tox *m, const struct Loadgen_Options *opts)
+{
+    if (opts->rate == 0 || opts->num_friends == 0)
+        return -1;
+
+    struct Loadgen_State st;
+    memset(&st, 0, sizeof(st));
+    st.friends = mem_malloc(MEM_CONTACTS, opts->num_friends * sizeof(int32_t));
+
+    if (st.friends == NULL)
+        return -1;
+
+    rng_state = opts->seed ? opts->seed : 0x9e3779b9;
+
+    if (create_default_group(m) == -1)
+        log_msg(L_WARN, "loadgen_group_failed");
+
+    /* the synthetic friends are never connected, so Tox would refuse every reply */
+    bot_set_offline(true);
+    stats_reset();
+
+    long rss_start = stats_rss_kb();
+    long rss_peak = rss_start;
+    uint64_t start = get_time_usec();
+    uint64_t end = start + (uint64_t) opts->duration * 1000000;
+    uint64_t next_tox_do = start;
+    uint64_t next_progress = start + LOADGEN_PROGRESS_INTERVAL * 1000000ULL;
+    uint64_t events = 0;
+    uint64_t now;
+
+    printf("Lasttest: %"PRIu32" Freunde, %"PRIu32" Ereignisse/s, %"PRIu32" s\n", opts->num_friends,
+           opts->rate, opts->duration);
+
+    while ((now = get_time_usec()) < end && !FLAG_EXIT) {
+        uint64_t due = (now - start) * opts->rate / 1000000;
+
+        while (events < due) {
+            one_event(m, &st, opts->num_friends);
+            ++events;
+
+            /* don't starve tox_do if the bot can't keep up with the target rate */
+            if ((events & 63) == 0 && get_time_usec() >= next_tox_do)
+                break;
+        }
+
+        now = get_time_usec();
+
+        if (now >= next_tox_do) {
+            tox_do(m);
+            next_tox_do = now + LOADGEN_TOX_DO_INTERVAL;
+        }
+
+        if (now >= next_progress) {
+            long rss = stats_rss_kb();
+            rss_peak = MAX(rss_peak, rss);
+            printf("  %"PRIu64" s: %"PRIu64" Ereignisse, p99 %"PRIu64" us, RSS %ld kB\n",
+                   (now - start) / 1000000, events, stats_latency_percentile(99.0), rss);
+            next_progress += LOADGEN_PROGRESS_INTERVAL * 1000000ULL;
+        }
+
+        if (events >= due)
+            usleep(1000);
+    }
+
+    long rss_end = stats_rss_kb();
+    rss_peak = MAX(rss_peak, rss_end);
+    print_report(&st, events, get_time_usec() - start, rss_start, rss_peak, rss_end, opts);
+
+    mem_free(st.friends);
+    return 0;
+}
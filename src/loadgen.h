@@ -0,0 +1,48 @@
+/*  loadgen.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <stdint.h>
+#include <tox/tox.h>
+
+#define LOADGEN_DATA_FILE "toxbot_loadtest_save"
+#define LOADGEN_MASTERLIST_FILE "toxbot_loadtest_masterkeys"
+#define LOADGEN_JOURNAL_FILE "toxbot_loadtest.journal"
+#define LOADGEN_FRIENDSTATS_FILE "toxbot_loadtest_friendstats"
+
+struct Loadgen_Options {
+    uint32_t num_friends;    /* friends created by synthetic friend requests */
+    uint32_t rate;           /* target events per second */
+    uint32_t duration;       /* seconds */
+    uint32_t seed;
+};
+
+/* Drives the bot callbacks with a scripted mix of friend requests, commands and group invites
+   at the target rate, without bootstrapping to the network, and prints a report.
+   The bot must already be initialized, using LOADGEN_DATA_FILE and LOADGEN_JOURNAL_FILE
+   so the real profile and masters are never touched.
+   Returns 0 on success, -1 on failure. */
+int loadgen_run(Tox *m, const struct Loadgen_Options *opts);
+
+#endif /* LOADGEN_H */
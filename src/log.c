@@ -0,0 +1,333 @@
+/*  log.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "trace.h"
+#include "mem.h"
+
+/* Lines are formatted by the caller straight into a slot of a bounded lock-free queue
+   (one sequence number per slot, so any thread may log). A single writer thread drains
+   the queue in batches, prepends the timestamp and level, and does all file I/O. */
+struct Log_Slot {
+    uint32_t seq;
+    uint8_t level;
+    uint16_t len;
+    time_t time;
+    char text[LOG_LINE_SIZE];
+};
+
+static struct Log_Slot ring[LOG_RING_SIZE];
+static uint32_t enqueue_pos;
+static uint32_t dequeue_pos;
+
+static uint64_t num_dropped;
+static int log_level = L_INFO;
+
+static bool running;
+static bool stop_writer;
+static bool echo_stderr;
+static pthread_t writer_thread;
+
+static FILE *log_fp;
+static char *log_path;
+static long log_fsize;
+
+static const char *level_names[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+#define WRITE_BUF_SIZE (64 * 1024)
+
+static void rotate_files(void)
+{
+    if (log_fp) {
+        fclose(log_fp);
+        log_fp = NULL;
+    }
+
+    char from[512];
+    char to[512];
+    int i;
+
+    for (i = LOG_NUM_FILES - 1; i > 0; --i) {
+        if (i == 1)
+            snprintf(from, sizeof(from), "%s", log_path);
+        else
+            snprintf(from, sizeof(from), "%s.%d", log_path, i - 1);
+
+        snprintf(to, sizeof(to), "%s.%d", log_path, i);
+        rename(from, to);
+    }
+
+    log_fp = fopen(log_path, "a");
+    log_fsize = 0;
+}
+
+static void write_batch(const char *buf, size_t len)
+{
+    if (len == 0)
+        return;
+
+    if (echo_stderr)
+        fwrite(buf, len, 1, stderr);
+
+    if (log_fp == NULL)
+        return;
+
+    uint64_t span = trace_start();
+    fwrite(buf, len, 1, log_fp);
+    fflush(log_fp);
+    trace_end("log_write", span);
+    log_fsize += len;
+
+    if (log_fsize >= LOG_MAX_FILE_SIZE)
+        rotate_files();
+}
+
+static size_t format_prefix(char *buf, size_t size, time_t t, int level)
+{
+    struct tm tm;
+    localtime_r(&t, &tm);
+    size_t n = strftime(buf, size, "%Y-%m-%d %H:%M:%S ", &tm);
+    return n + snprintf(buf + n, size - n, "%s ", level_names[level]);
+}
+
+/* Drains every ready slot into buf, writing whenever buf fills up.
+   Returns the number of lines drained. */
+static int drain(char *buf)
+{
+    size_t len = 0;
+    int count = 0;
+    time_t last_time = 0;
+    char prefix[64];
+    size_t prefix_len = 0;
+    int prefix_level = -1;
+
+    for (;;) {
+        struct Log_Slot *slot = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq != dequeue_pos + 1)
+            break;
+
+        if (slot->time != last_time || slot->level != prefix_level) {
+            prefix_len = format_prefix(prefix, sizeof(prefix), slot->time, slot->level);
+            last_time = slot->time;
+            prefix_level = slot->level;
+        }
+
+        if (len + prefix_len + slot->len + 1 > WRITE_BUF_SIZE) {
+            write_batch(buf, len);
+            len = 0;
+        }
+
+        memcpy(buf + len, prefix, prefix_len);
+        len += prefix_len;
+        memcpy(buf + len, slot->text, slot->len);
+        len += slot->len;
+        buf[len++] = '\n';
+
+        __atomic_store_n(&slot->seq, dequeue_pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        ++dequeue_pos;
+        ++count;
+    }
+
+    write_batch(buf, len);
+    return count;
+}
+
+static void *writer_loop(void *arg)
+{
+    trace_thread_name("log");
+
+    char *buf = mem_malloc(MEM_IO, WRITE_BUF_SIZE);
+    uint64_t reported_drops = 0;
+
+    if (buf == NULL)
+        exit(EXIT_FAILURE);
+
+    for (;;) {
+        bool stop = __atomic_load_n(&stop_writer, __ATOMIC_ACQUIRE);
+        int count = drain(buf);
+
+        uint64_t drops = __atomic_load_n(&num_dropped, __ATOMIC_RELAXED);
+
+        if (drops != reported_drops) {
+            int n = format_prefix(buf, WRITE_BUF_SIZE, time(NULL), L_WARN);
+            n += snprintf(buf + n, WRITE_BUF_SIZE - n, "log_overflow dropped=%"PRIu64" total=%"PRIu64"\n",
+                          drops - reported_drops, drops);
+            write_batch(buf, n);
+            reported_drops = drops;
+        }
+
+        if (stop)
+            break;
+
+        if (count == 0)
+            usleep(LOG_FLUSH_INTERVAL * 1000);
+    }
+
+    mem_free(buf);
+    return NULL;
+}
+
+int log_init(const char *path, int min_level, bool echo)
+{
+    if (running)
+        return 0;
+
+    log_path = mem_strdup(MEM_IO, path);
+
+    if (log_path == NULL)
+        return -1;
+
+    log_fp = fopen(log_path, "a");
+
+    if (log_fp == NULL) {
+        mem_free(log_path);
+        log_path = NULL;
+        return -1;
+    }
+
+    fseek(log_fp, 0, SEEK_END);
+    log_fsize = ftell(log_fp);
+
+    uint32_t i;
+
+    for (i = 0; i < LOG_RING_SIZE; ++i)
+        ring[i].seq = i;
+
+    enqueue_pos = 0;
+    dequeue_pos = 0;
+    log_level = min_level;
+    echo_stderr = echo;
+    stop_writer = false;
+
+    if (pthread_create(&writer_thread, NULL, writer_loop, NULL) != 0) {
+        fclose(log_fp);
+        log_fp = NULL;
+        mem_free(log_path);
+        log_path = NULL;
+        return -1;
+    }
+
+    __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void log_shutdown(void)
+{
+    if (!running)
+        return;
+
+    __atomic_store_n(&stop_writer, true, __ATOMIC_RELEASE);
+    pthread_join(writer_thread, NULL);
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+
+    if (log_fp)
+        fclose(log_fp);
+
+    log_fp = NULL;
+    mem_free(log_path);
+    log_path = NULL;
+}
+
+void log_set_level(int level)
+{
+    log_level = level;
+}
+
+uint64_t log_dropped(void)
+{
+    return __atomic_load_n(&num_dropped, __ATOMIC_RELAXED);
+}
+
+/* log lines must stay on one line no matter what names or messages contain */
+static void strip_newlines(char *s, int len)
+{
+    int i;
+
+    for (i = 0; i < len; ++i) {
+        if (s[i] == '\n' || s[i] == '\r')
+            s[i] = ' ';
+    }
+}
+
+void log_msg(int level, const char *fmt, ...)
+{
+    if (level < log_level || level < L_DEBUG || level > L_ERROR)
+        return;
+
+    va_list ap;
+
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        va_start(ap, fmt);
+        fprintf(stderr, "%s ", level_names[level]);
+        vfprintf(stderr, fmt, ap);
+        fprintf(stderr, "\n");
+        va_end(ap);
+        return;
+    }
+
+    struct Log_Slot *slot;
+    uint32_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+
+    for (;;) {
+        slot = &ring[pos & (LOG_RING_SIZE - 1)];
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int32_t diff = (int32_t) (seq - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            __atomic_add_fetch(&num_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    va_start(ap, fmt);
+    int len = vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+    va_end(ap);
+
+    if (len < 0)
+        len = 0;
+    else if (len >= (int) sizeof(slot->text))
+        len = sizeof(slot->text) - 1;
+
+    strip_newlines(slot->text, len);
+    slot->len = len;
+    slot->level = level;
+    slot->time = time(NULL);
+
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,60 @@
+/*  log.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define LOG_LINE_SIZE 480              /* longer lines are truncated */
+#define LOG_RING_SIZE 1024             /* must be a power of two */
+#define LOG_FLUSH_INTERVAL 100         /* ms between batch flushes when idle */
+#define LOG_MAX_FILE_SIZE (4 * 1024 * 1024)
+#define LOG_NUM_FILES 3                /* path, path.1 ... path.(LOG_NUM_FILES - 1) */
+
+enum {
+    L_DEBUG,
+    L_INFO,
+    L_WARN,
+    L_ERROR,
+};
+
+/* Starts the background writer thread that flushes to path (rotating at LOG_MAX_FILE_SIZE).
+   If echo is true every line is also written to stderr.
+   Returns 0 on success, -1 on failure. Until this succeeds log_msg() writes straight to stderr. */
+int log_init(const char *path, int min_level, bool echo);
+
+/* Flushes everything still queued and stops the writer thread. */
+void log_shutdown(void);
+
+void log_set_level(int level);
+
+/* Queues one log line. Never blocks: if the ring is full the line is dropped and counted.
+   By convention fmt starts with an event name followed by key=value fields,
+   e.g. log_msg(L_INFO, "invite friend=\"%s\" group=%d", name, groupnum). */
+void log_msg(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* Returns the number of lines dropped because the ring was full. */
+uint64_t log_dropped(void);
+
+#endif /* LOG_H */
@@ -0,0 +1,274 @@
+/*  mem.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "mem.h"
+#include "stats.h"
+#include "log.h"
+
+/* Every block starts with its size and tag. The header keeps the alignment of malloc(). */
+union Mem_Header {
+    struct {
+        size_t size;
+        int tag;
+    };
+    long double align_ld;    /* no max_align_t in C99 */
+    void *align_p;
+    uint64_t align_u;
+};
+
+/* Counters are updated with atomics: the recorder and log threads allocate too */
+static size_t mem_cur[MEM_NUM_TAGS + 1];
+static size_t mem_max[MEM_NUM_TAGS + 1];
+static size_t mem_lim[MEM_NUM_TAGS + 1];
+static bool mem_over[MEM_NUM_TAGS + 1];
+static uint64_t mem_refused[MEM_NUM_TAGS];
+static void (*shedders[MEM_NUM_TAGS])(void);
+
+static const char *tag_names[MEM_NUM_TAGS + 1] = {
+    "groups",
+    "contacts",
+    "commands",
+    "io",
+    "queues",
+    "audio",
+    "total",
+};
+
+static void peak_update(int idx, size_t cur)
+{
+    size_t peak = __atomic_load_n(&mem_max[idx], __ATOMIC_RELAXED);
+
+    while (cur > peak && !__atomic_compare_exchange_n(&mem_max[idx], &peak, cur, true, __ATOMIC_RELAXED,
+                                                      __ATOMIC_RELAXED))
+        ;
+}
+
+static void mem_count(int tag, int64_t size)
+{
+    size_t cur = __atomic_add_fetch(&mem_cur[tag], size, __ATOMIC_RELAXED);
+    size_t total = __atomic_add_fetch(&mem_cur[MEM_TOTAL], size, __ATOMIC_RELAXED);
+
+    if (size > 0) {
+        peak_update(tag, cur);
+        peak_update(MEM_TOTAL, total);
+    }
+}
+
+void *mem_malloc(int tag, size_t size)
+{
+    union Mem_Header *h = malloc(sizeof(union Mem_Header) + size);
+
+    if (h == NULL)
+        return NULL;
+
+    h->size = size;
+    h->tag = tag;
+    mem_count(tag, size);
+    return h + 1;
+}
+
+void *mem_calloc(int tag, size_t num, size_t size)
+{
+    if (size && num > (SIZE_MAX - sizeof(union Mem_Header)) / size)
+        return NULL;
+
+    void *p = mem_malloc(tag, num * size);
+
+    if (p)
+        memset(p, 0, num * size);
+
+    return p;
+}
+
+void *mem_realloc(int tag, void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return mem_malloc(tag, size);
+
+    union Mem_Header *h = (union Mem_Header *) ptr - 1;
+    size_t old_size = h->size;
+    int old_tag = h->tag;
+
+    h = realloc(h, sizeof(union Mem_Header) + size);
+
+    if (h == NULL)
+        return NULL;
+
+    mem_count(old_tag, -(int64_t) old_size);
+    h->size = size;
+    h->tag = tag;
+    mem_count(tag, size);
+    return h + 1;
+}
+
+char *mem_strdup(int tag, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *p = mem_malloc(tag, len);
+
+    if (p)
+        memcpy(p, s, len);
+
+    return p;
+}
+
+void mem_free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    union Mem_Header *h = (union Mem_Header *) ptr - 1;
+    mem_count(h->tag, -(int64_t) h->size);
+    free(h);
+}
+
+void mem_account(int tag, int64_t size)
+{
+    mem_count(tag, size);
+}
+
+size_t mem_current(int tag)
+{
+    return __atomic_load_n(&mem_cur[tag], __ATOMIC_RELAXED);
+}
+
+size_t mem_peak(int tag)
+{
+    return __atomic_load_n(&mem_max[tag], __ATOMIC_RELAXED);
+}
+
+int mem_set_limit(int tag, size_t limit)
+{
+    if (tag < 0 || tag > MEM_TOTAL)
+        return -1;
+
+    mem_lim[tag] = limit;
+    return 0;
+}
+
+size_t mem_limit(int tag)
+{
+    return mem_lim[tag];
+}
+
+static bool tag_over(int tag)
+{
+    return mem_lim[tag] && mem_current(tag) > mem_lim[tag];
+}
+
+bool mem_over_limit(int tag)
+{
+    return tag_over(tag) || tag_over(MEM_TOTAL);
+}
+
+void mem_rejected(int tag)
+{
+    ++mem_refused[tag];
+}
+
+void mem_set_shedder(int tag, void (*shed)(void))
+{
+    shedders[tag] = shed;
+}
+
+void mem_check(void)
+{
+    int i;
+
+    for (i = 0; i <= MEM_TOTAL; ++i) {
+        bool over = tag_over(i);
+
+        if (over != mem_over[i]) {
+            log_msg(over ? L_WARN : L_INFO, "mem_limit_%s tag=%s current=%zu limit=%zu",
+                    over ? "exceeded" : "ok", tag_names[i], mem_current(i), mem_lim[i]);
+            mem_over[i] = over;
+        }
+    }
+
+    for (i = 0; i < MEM_NUM_TAGS; ++i) {
+        if (shedders[i] && mem_over_limit(i))
+            shedders[i]();
+    }
+}
+
+const char *mem_tag_name(int tag)
+{
+    if (tag < 0 || tag > MEM_TOTAL)
+        return NULL;
+
+    return tag_names[tag];
+}
+
+int mem_find_tag(const char *name)
+{
+    int i;
+
+    for (i = 0; i <= MEM_TOTAL; ++i) {
+        if (strcmp(tag_names[i], name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Formats size in B below 10 kB, in kB above */
+static const char *fmt_size(char *buf, int bufsize, size_t size)
+{
+    if (size < 10 * 1024)
+        snprintf(buf, bufsize, "%zu B", size);
+    else
+        snprintf(buf, bufsize, "%zu kB", size / 1024);
+
+    return buf;
+}
+
+int mem_report(char *buf, int size)
+{
+    char cur[32], peak[32], lim[32];
+    int len = 0;
+    int i;
+
+    for (i = 0; i <= MEM_TOTAL && len < size; ++i) {
+        len += snprintf(buf + len, size - len, "%s%s: %s (Spitze %s", len ? "\n" : "", tag_names[i],
+                        fmt_size(cur, sizeof(cur), mem_current(i)), fmt_size(peak, sizeof(peak), mem_peak(i)));
+
+        if (len < size && mem_lim[i])
+            len += snprintf(buf + len, size - len, ", Limit %s%s", fmt_size(lim, sizeof(lim), mem_lim[i]),
+                            tag_over(i) ? ", überschritten" : "");
+
+        if (len < size && i < MEM_NUM_TAGS && mem_refused[i])
+            len += snprintf(buf + len, size - len, ", %llu abgelehnt", (unsigned long long) mem_refused[i]);
+
+        if (len < size)
+            len += snprintf(buf + len, size - len, ")");
+    }
+
+    if (len < size)
+        len += snprintf(buf + len, size - len, "\nRSS: %ld kB", stats_rss_kb());
+
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,88 @@
+/*  mem.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef MEM_H
+#define MEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MEM_CHECK_INTERVAL 10    /* seconds between soft limit checks */
+
+/* What an allocation is for. Everything the bot allocates itself is tagged, so the difference
+   between the tagged total and the RSS is libtoxcore, libc and the stacks. */
+enum {
+    MEM_GROUPS,      /* group registry */
+    MEM_CONTACTS,    /* friend name cache, per friend stats */
+    MEM_COMMANDS,    /* command parsing, replies, scheduled jobs */
+    MEM_IO,          /* log, profile and file buffers */
+    MEM_QUEUES,      /* recorder queue */
+    MEM_AUDIO,       /* decoded clips */
+    MEM_NUM_TAGS,
+    MEM_TOTAL = MEM_NUM_TAGS,    /* for mem_set_limit(): all tags together */
+};
+
+/* Like malloc(), calloc(), realloc() and strdup(), but counted under tag. They return NULL
+   on failure like the originals. Memory from them must be released with mem_free(). */
+void *mem_malloc(int tag, size_t size);
+void *mem_calloc(int tag, size_t num, size_t size);
+void *mem_realloc(int tag, void *ptr, size_t size);
+char *mem_strdup(int tag, const char *s);
+void mem_free(void *ptr);
+
+/* Counts size bytes (negative to release) that weren't allocated through these functions,
+   e.g. a mapped file. */
+void mem_account(int tag, int64_t size);
+
+size_t mem_current(int tag);
+size_t mem_peak(int tag);
+
+/* Sets the soft limit of tag (or MEM_TOTAL) in bytes; 0 removes it.
+   Returns 0 on success, -1 if tag is invalid. */
+int mem_set_limit(int tag, size_t limit);
+size_t mem_limit(int tag);
+
+/* Returns true if tag is over its soft limit or all tags together are over theirs.
+   Subsystems check this before growing and refuse new work instead. */
+bool mem_over_limit(int tag);
+
+/* Counts work that was refused because tag was over its limit, e.g. a rejected friend request. */
+void mem_rejected(int tag);
+
+/* Registers a function that gives memory of tag back when it is over its limit. */
+void mem_set_shedder(int tag, void (*shed)(void));
+
+/* Runs the shedders of every tag over its limit and logs limits being crossed.
+   Called every MEM_CHECK_INTERVAL seconds. */
+void mem_check(void);
+
+/* Returns the name of tag, or NULL if it is invalid. */
+const char *mem_tag_name(int tag);
+
+/* Returns the tag called name ("total" for MEM_TOTAL), or -1 if there is none. */
+int mem_find_tag(const char *name);
+
+/* Writes one line per tag with current, peak, limit and refusals, and the totals, into buf.
+   Returns the length of the string written. */
+int mem_report(char *buf, int size);
+
+#endif /* MEM_H */
@@ -28,8 +28,10 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "misc.h"
+#include "mem.h"
 
 bool timed_out(uint64_t timestamp, uint64_t curtime, uint64_t timeout)
 {
@@ -39,7 +41,7 @@ bool timed_out(uint64_t timestamp, uint64_t curtime, uint64_t timeout)
 char *hex_string_to_bin(const char *hex_string)
 {
     size_t len = strlen(hex_string);
-    char *val = malloc(len);
+    char *val = mem_malloc(MEM_IO, len);
 
     if (val == NULL)
         exit(EXIT_FAILURE);
@@ -96,3 +98,10 @@ void get_elapsed_time_str(char *buf, int bufsize, uint64_t secs)
 
     snprintf(buf, bufsize, "%lud %luh %lum", days, hours, minutes);
 }
+
+uint64_t get_time_usec(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
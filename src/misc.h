@@ -53,4 +53,7 @@ int char_find(int idx, const char *s, char ch);
 /* Converts seconds to string in format days hours minutes */
 void get_elapsed_time_str(char *buf, int bufsize, uint64_t secs);
 
+/* returns a monotonic timestamp in microseconds */
+uint64_t get_time_usec(void);
+
 #endif /* MISC_H */
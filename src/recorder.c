@@ -0,0 +1,478 @@
+/*  recorder.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <tox/tox.h>
+
+#include "recorder.h"
+#include "misc.h"
+#include "log.h"
+#include "trace.h"
+#include "mem.h"
+
+#define WAV_HEADER_SIZE 44
+#define WRITE_BUF_SIZE (64 * 1024)
+#define POLL_USEC 10000
+
+/* Frames go from the Tox thread (the only producer) to the writer thread (the only consumer)
+   through a single-producer single-consumer ring. Each side owns one index. */
+struct Rec_Frame {
+    int groupnum;
+    int peernum;
+    uint32_t epoch;      /* the group's peer list epoch when the frame arrived */
+    uint32_t samples;    /* per channel */
+    uint8_t channels;
+    uint32_t sample_rate;
+    int16_t pcm[RECORDER_MAX_FRAME];
+};
+
+static struct Rec_Frame *queue;
+static uint32_t queue_head;    /* written by the producer */
+static uint32_t queue_tail;    /* written by the consumer */
+
+/* group number + 1 of each recorded group, 0 for a free entry. Written by the Tox thread,
+   read by both threads. */
+static int rec_groups[RECORDER_MAX_GROUPS];
+
+/* Bumped whenever a peer joins or leaves the group in the same slot of rec_groups, because Tox
+   renumbers the peers then. Only used by the Tox thread; the writer sees it in the frames. */
+static uint32_t rec_epochs[RECORDER_MAX_GROUPS];
+
+static uint64_t frames_queued;
+static uint64_t frames_dropped;
+static uint64_t frames_written;
+static uint64_t write_errors;
+
+static bool running;
+static bool stop_writer;
+static pthread_t writer_tid;
+
+/* The file currently being written for one peer. Only touched by the writer thread. */
+struct Rec_Stream {
+    bool active;
+    int groupnum;
+    int peernum;
+    uint32_t epoch;
+    uint8_t channels;
+    uint32_t sample_rate;
+    FILE *fp;
+    uint64_t data_bytes;
+    uint64_t max_bytes;
+    time_t last_frame;
+};
+
+static struct Rec_Stream streams[RECORDER_MAX_STREAMS];
+static uint32_t file_seq;    /* writer thread only */
+
+/* Returns the index of groupnum in rec_groups, or -1 if it isn't recorded. */
+static int rec_index(int groupnum)
+{
+    int i;
+
+    for (i = 0; i < RECORDER_MAX_GROUPS; ++i) {
+        if (__atomic_load_n(&rec_groups[i], __ATOMIC_RELAXED) == groupnum + 1)
+            return i;
+    }
+
+    return -1;
+}
+
+bool recorder_enabled(int groupnum)
+{
+    return rec_index(groupnum) != -1;
+}
+
+void recorder_audio_cb(Tox *m, int groupnum, int peernum, const int16_t *pcm, unsigned int samples,
+                       uint8_t channels, unsigned int sample_rate, void *userdata)
+{
+    int idx = rec_index(groupnum);
+
+    if (!running || idx == -1)
+        return;
+
+    uint32_t head = queue_head;
+
+    if (channels == 0 || samples * channels > RECORDER_MAX_FRAME
+            || head - __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE) >= RECORDER_QUEUE_LEN) {
+        __atomic_add_fetch(&frames_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct Rec_Frame *f = &queue[head & (RECORDER_QUEUE_LEN - 1)];
+    f->groupnum = groupnum;
+    f->peernum = peernum;
+    f->epoch = rec_epochs[idx];
+    f->samples = samples;
+    f->channels = channels;
+    f->sample_rate = sample_rate;
+    memcpy(f->pcm, pcm, samples * channels * sizeof(int16_t));
+
+    __atomic_store_n(&queue_head, head + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&frames_queued, 1, __ATOMIC_RELAXED);
+}
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void make_wav_header(uint8_t *hdr, uint8_t channels, uint32_t sample_rate, uint32_t data_bytes)
+{
+    memcpy(hdr, "RIFF", 4);
+    put_le32(hdr + 4, 36 + data_bytes);
+    memcpy(hdr + 8, "WAVEfmt ", 8);
+    put_le32(hdr + 16, 16);
+    put_le16(hdr + 20, 1);
+    put_le16(hdr + 22, channels);
+    put_le32(hdr + 24, sample_rate);
+    put_le32(hdr + 28, sample_rate * channels * 2);
+    put_le16(hdr + 32, channels * 2);
+    put_le16(hdr + 34, 16);
+    memcpy(hdr + 36, "data", 4);
+    put_le32(hdr + 40, data_bytes);
+}
+
+/* Fills in the final sizes, gives back the preallocated space that wasn't used and closes the file. */
+static void stream_close(struct Rec_Stream *s)
+{
+    if (s->fp) {
+        uint8_t hdr[WAV_HEADER_SIZE];
+        make_wav_header(hdr, s->channels, s->sample_rate, s->data_bytes);
+
+        fflush(s->fp);
+
+        if (pwrite(fileno(s->fp), hdr, sizeof(hdr), 0) != sizeof(hdr)
+                || ftruncate(fileno(s->fp), WAV_HEADER_SIZE + s->data_bytes) != 0)
+            __atomic_add_fetch(&write_errors, 1, __ATOMIC_RELAXED);
+
+        fclose(s->fp);
+    }
+
+    log_msg(L_INFO, "recorder_segment_done group=%d peer=%d epoch=%u bytes=%llu", s->groupnum, s->peernum,
+            s->epoch, (unsigned long long) s->data_bytes);
+
+    memset(s, 0, sizeof(struct Rec_Stream));
+}
+
+/* Opens a new segment for s. The file is preallocated for a whole segment so that it stays
+   contiguous and writes don't have to extend it. Segments started in the same second get
+   different sequence numbers, and an existing file is never overwritten. */
+static int stream_open(struct Rec_Stream *s)
+{
+    char stamp[32];
+    char path[256];
+    time_t now = time(NULL);
+    int fd;
+
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+
+    do {
+        snprintf(path, sizeof(path), "%s/%d-%d-%s-%u.wav", RECORDER_DIR, s->groupnum, s->peernum, stamp,
+                 file_seq++);
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    } while (fd == -1 && errno == EEXIST);
+
+    if (fd == -1 || (s->fp = fdopen(fd, "wb")) == NULL) {
+        log_msg(L_ERROR, "recorder_open_failed path=%s error=\"%s\"", path, strerror(errno));
+
+        if (fd != -1)
+            close(fd);
+
+        return -1;
+    }
+
+    setvbuf(s->fp, NULL, _IOFBF, WRITE_BUF_SIZE);
+
+    s->max_bytes = (uint64_t) RECORDER_SEGMENT_SECONDS * s->sample_rate * s->channels * 2;
+    s->data_bytes = 0;
+
+    int err = posix_fallocate(fileno(s->fp), 0, WAV_HEADER_SIZE + s->max_bytes);
+
+    if (err != 0)
+        log_msg(L_WARN, "recorder_prealloc_failed path=%s error=\"%s\"", path, strerror(err));
+
+    uint8_t hdr[WAV_HEADER_SIZE];
+    make_wav_header(hdr, s->channels, s->sample_rate, 0);
+
+    if (fwrite(hdr, sizeof(hdr), 1, s->fp) != 1) {
+        fclose(s->fp);
+        s->fp = NULL;
+        return -1;
+    }
+
+    log_msg(L_INFO, "recorder_segment_start path=%s", path);
+    return 0;
+}
+
+static struct Rec_Stream *stream_get(const struct Rec_Frame *f)
+{
+    struct Rec_Stream *free_slot = NULL;
+    int i;
+
+    for (i = 0; i < RECORDER_MAX_STREAMS; ++i) {
+        struct Rec_Stream *s = &streams[i];
+
+        /* the peers were renumbered since this file was started; whoever has the number now
+           is not necessarily the peer in the file */
+        if (s->active && s->groupnum == f->groupnum && s->epoch != f->epoch)
+            stream_close(s);
+
+        if (!s->active) {
+            if (free_slot == NULL)
+                free_slot = s;
+
+            continue;
+        }
+
+        if (s->groupnum == f->groupnum && s->peernum == f->peernum) {
+            /* a new format can't go into the same file */
+            if (s->channels != f->channels || s->sample_rate != f->sample_rate)
+                stream_close(s);
+            else
+                return s;
+
+            free_slot = s;
+            break;
+        }
+    }
+
+    if (free_slot == NULL)
+        return NULL;
+
+    free_slot->active = true;
+    free_slot->groupnum = f->groupnum;
+    free_slot->peernum = f->peernum;
+    free_slot->epoch = f->epoch;
+    free_slot->channels = f->channels;
+    free_slot->sample_rate = f->sample_rate;
+
+    if (stream_open(free_slot) == -1) {
+        memset(free_slot, 0, sizeof(struct Rec_Stream));
+        return NULL;
+    }
+
+    return free_slot;
+}
+
+static void write_frame(const struct Rec_Frame *f)
+{
+    struct Rec_Stream *s = stream_get(f);
+
+    if (s == NULL) {
+        __atomic_add_fetch(&write_errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    size_t len = f->samples * f->channels * sizeof(int16_t);
+
+    if (fwrite(f->pcm, len, 1, s->fp) != 1) {
+        __atomic_add_fetch(&write_errors, 1, __ATOMIC_RELAXED);
+        stream_close(s);
+        return;
+    }
+
+    s->data_bytes += len;
+    s->last_frame = time(NULL);
+    __atomic_add_fetch(&frames_written, 1, __ATOMIC_RELAXED);
+
+    if (s->data_bytes >= s->max_bytes) {
+        struct Rec_Stream next = *s;
+        stream_close(s);
+
+        s->active = true;
+        s->groupnum = next.groupnum;
+        s->peernum = next.peernum;
+        s->epoch = next.epoch;
+        s->channels = next.channels;
+        s->sample_rate = next.sample_rate;
+
+        if (stream_open(s) == -1)
+            memset(s, 0, sizeof(struct Rec_Stream));
+    }
+}
+
+/* Closes the files of peers that went quiet and of groups that are no longer recorded. */
+static void close_stale_streams(bool all)
+{
+    time_t now = time(NULL);
+    int i;
+
+    for (i = 0; i < RECORDER_MAX_STREAMS; ++i) {
+        struct Rec_Stream *s = &streams[i];
+
+        if (s->active && (all || !recorder_enabled(s->groupnum) || now - s->last_frame > RECORDER_IDLE_SECONDS))
+            stream_close(s);
+    }
+}
+
+static void *writer_thread(void *arg)
+{
+    trace_thread_name("recorder");
+
+    time_t last_check = 0;
+
+    while (true) {
+        bool stop = __atomic_load_n(&stop_writer, __ATOMIC_ACQUIRE);
+        uint32_t head = __atomic_load_n(&queue_head, __ATOMIC_ACQUIRE);
+        uint32_t tail = queue_tail;
+
+        /* only polls that found frames, so an idle recorder doesn't fill its buffer */
+        uint64_t span = tail != head ? trace_start() : 0;
+
+        while (tail != head) {
+            write_frame(&queue[tail & (RECORDER_QUEUE_LEN - 1)]);
+            __atomic_store_n(&queue_tail, ++tail, __ATOMIC_RELEASE);
+        }
+
+        trace_end("record_write", span);
+
+        time_t now = time(NULL);
+
+        if (now != last_check) {
+            close_stale_streams(false);
+            last_check = now;
+        }
+
+        if (stop)
+            break;
+
+        usleep(POLL_USEC);
+    }
+
+    close_stale_streams(true);
+    return NULL;
+}
+
+int recorder_start(int groupnum)
+{
+    if (recorder_enabled(groupnum))
+        return 0;
+
+    if (!running) {
+        if (mkdir(RECORDER_DIR, 0700) == -1 && errno != EEXIST)
+            return -1;
+
+        if (queue == NULL) {
+            queue = mem_malloc(MEM_QUEUES, RECORDER_QUEUE_LEN * sizeof(struct Rec_Frame));
+
+            if (queue == NULL)
+                exit(EXIT_FAILURE);
+        }
+
+        stop_writer = false;
+
+        if (pthread_create(&writer_tid, NULL, writer_thread, NULL) != 0)
+            return -1;
+
+        __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+    }
+
+    int i;
+
+    for (i = 0; i < RECORDER_MAX_GROUPS; ++i) {
+        if (rec_groups[i] == 0) {
+            /* a new epoch, so files left open from an earlier recording of this group aren't continued */
+            ++rec_epochs[i];
+            __atomic_store_n(&rec_groups[i], groupnum + 1, __ATOMIC_RELAXED);
+            log_msg(L_INFO, "recorder_start group=%d", groupnum);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+void recorder_stop(int groupnum)
+{
+    int i;
+
+    for (i = 0; i < RECORDER_MAX_GROUPS; ++i) {
+        if (rec_groups[i] == groupnum + 1) {
+            __atomic_store_n(&rec_groups[i], 0, __ATOMIC_RELAXED);
+            log_msg(L_INFO, "recorder_stop group=%d dropped=%llu", groupnum,
+                    (unsigned long long) __atomic_load_n(&frames_dropped, __ATOMIC_RELAXED));
+        }
+    }
+}
+
+void recorder_peers_changed(int groupnum)
+{
+    int idx = rec_index(groupnum);
+
+    if (idx != -1)
+        ++rec_epochs[idx];
+}
+
+int recorder_status(char *buf, int size)
+{
+    int len = snprintf(buf, size, "Aufnahme:");
+    int i;
+
+    for (i = 0; i < RECORDER_MAX_GROUPS && len < size; ++i) {
+        if (rec_groups[i])
+            len += snprintf(buf + len, size - len, " %d", rec_groups[i] - 1);
+    }
+
+    if (len < size) {
+        len += snprintf(buf + len, size - len, "\nFrames: %llu aufgenommen, %llu geschrieben, %llu verworfen, %llu Fehler",
+                        (unsigned long long) __atomic_load_n(&frames_queued, __ATOMIC_RELAXED),
+                        (unsigned long long) __atomic_load_n(&frames_written, __ATOMIC_RELAXED),
+                        (unsigned long long) __atomic_load_n(&frames_dropped, __ATOMIC_RELAXED),
+                        (unsigned long long) __atomic_load_n(&write_errors, __ATOMIC_RELAXED));
+    }
+
+    return len < size ? len : size - 1;
+}
+
+void recorder_shutdown(void)
+{
+    if (!running)
+        return;
+
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&stop_writer, true, __ATOMIC_RELEASE);
+    pthread_join(writer_tid, NULL);
+
+    mem_free(queue);
+    queue = NULL;
+}
@@ -0,0 +1,63 @@
+/*  recorder.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <tox/tox.h>
+
+#define RECORDER_DIR "recordings"
+#define RECORDER_MAX_GROUPS 16
+#define RECORDER_MAX_STREAMS 64
+#define RECORDER_QUEUE_LEN 128               /* frames; must be a power of two */
+#define RECORDER_MAX_FRAME 5760              /* samples over all channels; 60 ms of 48 kHz stereo */
+#define RECORDER_SEGMENT_SECONDS 600         /* a peer's recording is split into files of this length */
+#define RECORDER_IDLE_SECONDS 30             /* a peer's file is closed after this long without audio */
+
+/* Group audio callback for toxav_add_av_groupchat() and toxav_join_av_groupchat(). Frames of
+   groups that are being recorded are copied into a queue; if the writer has fallen behind the
+   frame is dropped and counted. */
+void recorder_audio_cb(Tox *m, int groupnum, int peernum, const int16_t *pcm, unsigned int samples,
+                       uint8_t channels, unsigned int sample_rate, void *userdata);
+
+/* Starts recording groupnum, starting the writer thread if needed. Each peer is written to its own
+   WAV files in RECORDER_DIR. Returns 0 on success, -1 on error. */
+int recorder_start(int groupnum);
+
+/* Stops recording groupnum. Its files are finished by the writer thread. */
+void recorder_stop(int groupnum);
+
+/* Called from the Tox thread when a peer joins or leaves groupnum. Tox renumbers the peers then, so
+   the writer closes every open file of the group and starts new ones with the next frames. */
+void recorder_peers_changed(int groupnum);
+
+bool recorder_enabled(int groupnum);
+
+/* Puts a summary of recorded groups and frame counts in buf. Returns its length. */
+int recorder_status(char *buf, int size);
+
+/* Stops the writer thread after it has written all queued frames and finished all files. */
+void recorder_shutdown(void);
+
+#endif /* RECORDER_H */
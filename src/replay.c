@@ -0,0 +1,368 @@
+/*  replay.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <tox/tox.h>
+
+#include "toxbot.h"
+#include "replay.h"
+#include "stats.h"
+#include "misc.h"
+#include "log.h"
+#include "mem.h"
+#include "commands.h"
+
+extern bool FLAG_EXIT;
+
+#define RECORD_BUF_SIZE (64 * 1024)
+#define REPLAY_TOX_DO_INTERVAL 40000    /* usec */
+
+/* type + three 5-byte varints + length varint */
+#define RECORD_MAX_HEADER 21
+
+static FILE *record_fp;
+static uint64_t record_last;
+static bool record_dirty;
+
+static const char *record_names[] = {
+    "start", "friend_request", "friend_message", "name_change", "group_invite", "group_title", "connection",
+};
+
+static int put_varint(uint8_t *buf, uint64_t v)
+{
+    int n = 0;
+
+    while (v >= 0x80) {
+        buf[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+
+    buf[n++] = v;
+    return n;
+}
+
+static uint32_t zigzag(int32_t v)
+{
+    return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+
+static int32_t unzigzag(uint32_t v)
+{
+    return (int32_t) ((v >> 1) ^ -(v & 1));
+}
+
+static uint64_t wall_time_usec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void record_write(uint8_t type, uint64_t delta, int32_t num, int32_t aux, const uint8_t *data,
+                         uint32_t length)
+{
+    uint8_t hdr[RECORD_MAX_HEADER + 10];
+    int n = 0;
+
+    hdr[n++] = type;
+    n += put_varint(hdr + n, delta);
+    n += put_varint(hdr + n, zigzag(num));
+    n += put_varint(hdr + n, zigzag(aux));
+    n += put_varint(hdr + n, length);
+
+    if (fwrite(hdr, n, 1, record_fp) != 1 || (length && fwrite(data, length, 1, record_fp) != 1)) {
+        log_msg(L_ERROR, "record_write_failed");
+        record_close();
+        return;
+    }
+
+    record_dirty = true;
+}
+
+int record_open(const char *path)
+{
+    record_close();
+
+    bool new_file = !file_exists(path) || file_size(path) == 0;
+    record_fp = fopen(path, "ab");
+
+    if (record_fp == NULL)
+        return -1;
+
+    setvbuf(record_fp, NULL, _IOFBF, RECORD_BUF_SIZE);
+
+    if (new_file) {
+        uint8_t version = RECORD_VERSION;
+
+        if (fwrite(RECORD_MAGIC, 4, 1, record_fp) != 1 || fwrite(&version, 1, 1, record_fp) != 1) {
+            fclose(record_fp);
+            record_fp = NULL;
+            return -1;
+        }
+    }
+
+    uint8_t start[10];
+    int n = put_varint(start, wall_time_usec());
+    record_last = get_time_usec();
+    record_write(RECORD_START, 0, 0, 0, start, n);
+    record_flush();
+
+    return record_fp ? 0 : -1;
+}
+
+bool record_enabled(void)
+{
+    return record_fp != NULL;
+}
+
+void record_flush(void)
+{
+    if (record_fp == NULL || !record_dirty)
+        return;
+
+    fflush(record_fp);
+    record_dirty = false;
+}
+
+void record_close(void)
+{
+    if (record_fp == NULL)
+        return;
+
+    fclose(record_fp);
+    record_fp = NULL;
+    record_dirty = false;
+}
+
+void record_event(uint8_t type, int32_t num, int32_t aux, const uint8_t *data, uint32_t length)
+{
+    if (record_fp == NULL)
+        return;
+
+    uint64_t now = get_time_usec();
+    record_write(type, now - record_last, num, aux, data, length);
+    record_last = now;
+}
+
+/* REPLAY */
+
+struct Replay_Reader {
+    const uint8_t *buf;
+    size_t len;
+    size_t pos;
+};
+
+static int get_varint(struct Replay_Reader *r, uint64_t *out)
+{
+    uint64_t v = 0;
+    int shift = 0;
+
+    while (r->pos < r->len && shift < 64) {
+        uint8_t b = r->buf[r->pos++];
+        v |= (uint64_t) (b & 0x7f) << shift;
+
+        if (!(b & 0x80)) {
+            *out = v;
+            return 0;
+        }
+
+        shift += 7;
+    }
+
+    return -1;
+}
+
+struct Replay_Record {
+    uint8_t type;
+    uint64_t delta;
+    int32_t num;
+    int32_t aux;
+    const uint8_t *data;
+    uint32_t length;
+};
+
+/* Returns 1 if a record was read, 0 at the end of the trace and -1 if the trace is corrupt. */
+static int next_record(struct Replay_Reader *r, struct Replay_Record *rec)
+{
+    if (r->pos == r->len)
+        return 0;
+
+    uint64_t num, aux, length;
+    rec->type = r->buf[r->pos++];
+
+    if (get_varint(r, &rec->delta) || get_varint(r, &num) || get_varint(r, &aux) || get_varint(r, &length))
+        return -1;
+
+    if (rec->type >= RECORD_NUM_TYPES || length > r->len - r->pos)
+        return -1;
+
+    rec->num = unzigzag(num);
+    rec->aux = unzigzag(aux);
+    rec->data = r->buf + r->pos;
+    rec->length = length;
+    r->pos += length;
+    return 1;
+}
+
+static void dispatch(Tox *m, const struct Replay_Record *rec)
+{
+    switch (rec->type) {
+        case RECORD_FRIEND_REQUEST:
+            if (rec->length >= TOX_CLIENT_ID_SIZE)
+                cb_friend_request(m, rec->data, rec->data + TOX_CLIENT_ID_SIZE, rec->length - TOX_CLIENT_ID_SIZE,
+                                  NULL);
+            break;
+
+        case RECORD_FRIEND_MESSAGE:
+            cb_friend_message(m, rec->num, rec->data, rec->length, NULL);
+            break;
+
+        case RECORD_NAME_CHANGE:
+            cb_name_change(m, rec->num, rec->data, rec->length, NULL);
+            break;
+
+        case RECORD_GROUP_INVITE:
+            cb_group_invite(m, rec->num, rec->aux, rec->data, rec->length, NULL);
+            break;
+
+        case RECORD_GROUP_TITLE:
+            cb_group_titlechange(m, rec->num, rec->aux, rec->data, MIN(rec->length, UINT8_MAX), NULL);
+            break;
+
+        case RECORD_CONNECTION_STATUS:
+            cb_connection_status(m, rec->num, rec->aux, NULL);
+            break;
+    }
+}
+
+int replay_run(Tox *m, const char *path, bool fast)
+{
+    off_t len = file_size(path);
+
+    if (len < 5)
+        return -1;
+
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL)
+        return -1;
+
+    uint8_t *buf = mem_malloc(MEM_IO, len);
+
+    if (buf == NULL) {
+        fclose(fp);
+        return -1;
+    }
+
+    if (fread(buf, len, 1, fp) != 1 || memcmp(buf, RECORD_MAGIC, 4) != 0 || buf[4] != RECORD_VERSION) {
+        mem_free(buf);
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+
+    struct Replay_Reader r = { buf, len, 5 };
+    struct Replay_Record rec;
+    uint64_t counts[RECORD_NUM_TYPES] = {0};
+    uint64_t trace_time = 0;    /* offset of the current record within the trace */
+    uint64_t busy = 0;          /* time spent inside callbacks */
+    uint64_t events = 0;
+    int ret;
+
+    /* nothing is bootstrapped, so no recorded friend is connected */
+    bot_set_offline(true);
+    stats_reset();
+
+    uint64_t start = get_time_usec();
+    uint64_t next_tox_do = start;
+
+    printf("Wiedergabe von %s (%s)\n", path, fast ? "so schnell wie möglich" : "aufgezeichnete Geschwindigkeit");
+
+    while (!FLAG_EXIT && (ret = next_record(&r, &rec)) == 1) {
+        trace_time += rec.delta;
+
+        if (!fast) {
+            for (;;) {
+                uint64_t now = get_time_usec();
+
+                if (now - start >= trace_time)
+                    break;
+
+                if (now >= next_tox_do) {
+                    tox_do(m);
+                    next_tox_do = now + REPLAY_TOX_DO_INTERVAL;
+                }
+
+                usleep(MIN(start + trace_time - now, 1000));
+            }
+        }
+
+        ++counts[rec.type];
+
+        if (rec.type == RECORD_START)
+            continue;
+
+        uint64_t t = get_time_usec();
+        dispatch(m, &rec);
+        uint64_t now = get_time_usec();
+        busy += now - t;
+        ++events;
+
+        if (now >= next_tox_do) {
+            tox_do(m);
+            next_tox_do = now + REPLAY_TOX_DO_INTERVAL;
+        }
+    }
+
+    uint64_t elapsed = get_time_usec() - start;
+    mem_free(buf);
+
+    if (ret == -1)
+        fprintf(stderr, "Aufzeichnung beschädigt bei Byte %zu\n", r.pos);
+
+    const struct Bot_Stats *s = stats_get();
+    int i;
+
+    printf("\nWiedergabe: %"PRIu64" Ereignisse in %.3f s (%.1f/s), davon %.3f s in Callbacks\n", events,
+           elapsed / 1000000.0, elapsed ? events * 1000000.0 / elapsed : 0.0, busy / 1000000.0);
+
+    for (i = 1; i < RECORD_NUM_TYPES; ++i)
+        printf("  %-16s %"PRIu64"\n", record_names[i], counts[i]);
+
+    printf("  Befehle: %"PRIu64" ausgeführt, %"PRIu64" ungültig\n", s->commands, s->invalid_commands);
+    printf("  Latenz p50/p99/p999/max: %"PRIu64"/%"PRIu64"/%"PRIu64"/%"PRIu64" us\n",
+           stats_latency_percentile(50.0), stats_latency_percentile(99.0),
+           stats_latency_percentile(99.9), s->latency_max);
+    printf("  Antworten: %"PRIu64" gesendet, %"PRIu64" verworfen\n", s->replies_sent, s->replies_dropped);
+
+    return ret == -1 ? -1 : 0;
+}
@@ -0,0 +1,71 @@
+/*  replay.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <tox/tox.h>
+
+#define REPLAY_DATA_FILE "toxbot_replay_save"
+#define REPLAY_FRIENDSTATS_FILE "toxbot_replay_friendstats"
+
+/* Trace file layout: the magic "TBTR", a version byte, then records of
+     type (1 byte), microseconds since the previous record (varint),
+     num (zigzag varint), aux (zigzag varint), data length (varint), data.
+   A RECORD_START record carries the wall clock time in microseconds as its data
+   and is written every time the recorder is opened, so traces can be appended to. */
+#define RECORD_MAGIC "TBTR"
+#define RECORD_VERSION 1
+
+enum {
+    RECORD_START = 0,
+    RECORD_FRIEND_REQUEST,    /* data: public key followed by the request message */
+    RECORD_FRIEND_MESSAGE,    /* num: friend, data: message */
+    RECORD_NAME_CHANGE,       /* num: friend, data: name */
+    RECORD_GROUP_INVITE,      /* num: friend, aux: group type, data: invite data */
+    RECORD_GROUP_TITLE,       /* num: group, aux: peer, data: title */
+    RECORD_CONNECTION_STATUS, /* num: friend, aux: status */
+    RECORD_NUM_TYPES
+};
+
+/* Opens path for appending and starts recording callback input.
+   Returns 0 on success, -1 on failure. */
+int record_open(const char *path);
+
+/* Flushes buffered records to disk. Cheap when nothing was recorded. */
+void record_flush(void);
+
+void record_close(void);
+
+bool record_enabled(void);
+
+/* Appends one callback input to the trace. Does nothing if recording is off. */
+void record_event(uint8_t type, int32_t num, int32_t aux, const uint8_t *data, uint32_t length);
+
+/* Feeds every record of the trace at path into the bot callbacks, either at the recorded pace
+   or, if fast is true, as fast as possible, and prints a report.
+   Returns 0 on success, -1 if the trace could not be read. */
+int replay_run(Tox *m, const char *path, bool fast);
+
+#endif /* REPLAY_H */
@@ -0,0 +1,135 @@
+/*  reply.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <tox/tox.h>
+
+#include "reply.h"
+#include "commands.h"
+#include "mem.h"
+
+void reply_init(struct Reply *r, Tox *m, int32_t friendnum)
+{
+    r->m = m;
+    r->friendnum = friendnum;
+    r->len = 0;
+    r->sent = 0;
+}
+
+static void reply_flush(struct Reply *r)
+{
+    if (r->len == 0)
+        return;
+
+    bot_send_message(r->m, r->friendnum, (uint8_t *) r->buf, r->len);
+    r->len = 0;
+    ++r->sent;
+}
+
+/* Returns the largest cut <= max that doesn't split a UTF-8 sequence in s. */
+static int utf8_cut(const char *s, int max)
+{
+    int cut = max;
+
+    while (cut > 0 && (s[cut] & 0xc0) == 0x80)
+        --cut;
+
+    /* not UTF-8 after all, cut where we have to */
+    return cut > 0 ? cut : max;
+}
+
+void reply_line(struct Reply *r, const char *line, int length)
+{
+    int sep = r->len ? 1 : 0;
+
+    if (r->len + sep + length > sizeof(r->buf))
+        reply_flush(r);
+
+    /* too long for a message of its own: send full chunks, keep the rest */
+    while (length > (int) sizeof(r->buf)) {
+        int cut = utf8_cut(line, sizeof(r->buf));
+        memcpy(r->buf, line, cut);
+        r->len = cut;
+        reply_flush(r);
+        line += cut;
+        length -= cut;
+    }
+
+    if (r->len)
+        r->buf[r->len++] = '\n';
+
+    memcpy(r->buf + r->len, line, length);
+    r->len += length;
+}
+
+void reply_text(struct Reply *r, const char *text, int length)
+{
+    const char *end = text + length;
+
+    while (text < end) {
+        const char *nl = memchr(text, '\n', end - text);
+        const char *eol = nl ? nl : end;
+
+        reply_line(r, text, eol - text);
+        text = nl ? nl + 1 : end;
+    }
+}
+
+void reply_printf(struct Reply *r, const char *format, ...)
+{
+    char buf[TOX_MAX_MESSAGE_LENGTH];
+    char *text = buf;
+    va_list ap;
+
+    va_start(ap, format);
+    int len = vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+
+    if (len < 0)
+        return;
+
+    if (len >= sizeof(buf)) {
+        text = mem_malloc(MEM_COMMANDS, len + 1);
+
+        if (text == NULL)
+            exit(EXIT_FAILURE);
+
+        va_start(ap, format);
+        vsnprintf(text, len + 1, format, ap);
+        va_end(ap);
+    }
+
+    reply_text(r, text, len);
+
+    if (text != buf)
+        mem_free(text);
+}
+
+int reply_send(struct Reply *r)
+{
+    reply_flush(r);
+    return r->sent;
+}
@@ -0,0 +1,54 @@
+/*  reply.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef REPLY_H
+#define REPLY_H
+
+#include <stdint.h>
+#include <tox/tox.h>
+
+/* Builds a multi-line reply and sends it in as few messages as possible. Lines are packed into
+   messages of up to TOX_MAX_MESSAGE_LENGTH bytes, separated by newlines; a line that doesn't fit
+   in one message is split, never inside a UTF-8 sequence. Messages go out through
+   bot_send_message(), so a reply inside a batch is collected like any other. */
+struct Reply {
+    Tox *m;
+    int32_t friendnum;
+    int len;
+    int sent;    /* messages sent so far */
+    char buf[TOX_MAX_MESSAGE_LENGTH];
+};
+
+void reply_init(struct Reply *r, Tox *m, int32_t friendnum);
+
+/* Appends one line of length bytes. It must not contain newlines. */
+void reply_line(struct Reply *r, const char *line, int length);
+
+/* Appends text of length bytes, which may span several lines. A trailing newline is ignored. */
+void reply_text(struct Reply *r, const char *text, int length);
+
+/* Formats and appends text as with reply_text(). */
+void reply_printf(struct Reply *r, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/* Sends what is left of the reply. Returns the number of messages the reply was sent in. */
+int reply_send(struct Reply *r);
+
+#endif /* REPLY_H */
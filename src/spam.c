@@ -0,0 +1,387 @@
+/*  spam.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <tox/tox.h>
+
+#include "spam.h"
+#include "toxbot.h"
+#include "commands.h"
+#include "friends.h"
+#include "misc.h"
+#include "log.h"
+#include "mem.h"
+#include "trace.h"
+
+#define TOKEN_UNIT 1000000ULL
+
+struct Spam_Peer {
+    uint32_t tag;            /* upper half of the key hash, 0 if the slot is unused */
+    uint32_t strikes;
+    uint64_t tokens;         /* in units of 1/SPAM_RATE seconds, scaled by 1e6 */
+    uint64_t last_refill;    /* usec */
+    uint64_t last_offense;
+    uint64_t last_action;
+};
+
+struct Spam_Filter {
+    int mode;
+    uint8_t bloom[2][SPAM_BLOOM_BITS / 8];    /* current and previous */
+    uint32_t bloom_count;
+    uint64_t bloom_start;
+    struct Spam_Peer peers[SPAM_PEER_SLOTS];
+    uint64_t checked;
+    uint64_t repeats;
+    uint64_t floods;
+    uint64_t actions;
+    uint64_t last_report;
+    uint32_t unreported;
+};
+
+static struct Spam_Filter **filters;    /* indexed by group number */
+static int filters_size;
+
+static const char *mode_names[] = { "off", "warn", "report" };
+
+static uint64_t mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Hashes msg so that near-identical messages collide: ASCII letters are lowercased, runs of the
+   same character count once, and digits, punctuation and whitespace are skipped. Bytes of
+   multibyte UTF-8 characters are kept as they are. Puts the normalized length in len. */
+static uint64_t text_hash(const char *msg, uint16_t length, int *len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    uint8_t prev = 0;
+    uint16_t i;
+
+    *len = 0;
+
+    for (i = 0; i < length; ++i) {
+        uint8_t c = msg[i];
+
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        else if (c < 0x80 && (c < 'a' || c > 'z'))
+            continue;
+
+        if (c == prev)
+            continue;
+
+        prev = c;
+        h ^= c;
+        h *= 1099511628211ULL;
+        ++*len;
+    }
+
+    return mix(h);
+}
+
+static uint64_t key_hash(const uint8_t *key)
+{
+    uint64_t h = 14695981039346656037ULL;
+    int i;
+
+    for (i = 0; i < TOX_CLIENT_ID_SIZE; ++i) {
+        h ^= key[i];
+        h *= 1099511628211ULL;
+    }
+
+    return mix(h);
+}
+
+static void bloom_rotate(struct Spam_Filter *f, uint64_t now)
+{
+    if (f->bloom_count < SPAM_BLOOM_CAPACITY && now - f->bloom_start < SPAM_BLOOM_WINDOW)
+        return;
+
+    if (now - f->bloom_start < 2 * SPAM_BLOOM_WINDOW)
+        memcpy(f->bloom[1], f->bloom[0], sizeof(f->bloom[0]));
+    else
+        memset(f->bloom[1], 0, sizeof(f->bloom[1]));
+
+    memset(f->bloom[0], 0, sizeof(f->bloom[0]));
+    f->bloom_count = 0;
+    f->bloom_start = now;
+}
+
+/* Adds h to the current filter. Returns true if it was already in either filter. */
+static bool bloom_add(struct Spam_Filter *f, uint64_t h, uint64_t now)
+{
+    bloom_rotate(f, now);
+
+    uint32_t h1 = h, h2 = (h >> 32) | 1;
+    bool in_cur = true, in_prev = true;
+    int i;
+
+    for (i = 0; i < SPAM_BLOOM_HASHES; ++i) {
+        uint32_t bit = (h1 + i * h2) % SPAM_BLOOM_BITS;
+        uint8_t mask = 1 << (bit % 8);
+
+        in_cur = in_cur && (f->bloom[0][bit / 8] & mask);
+        in_prev = in_prev && (f->bloom[1][bit / 8] & mask);
+        f->bloom[0][bit / 8] |= mask;
+    }
+
+    if (!in_cur)
+        ++f->bloom_count;
+
+    return in_cur || in_prev;
+}
+
+static bool take_token(struct Spam_Peer *p, uint64_t now_us)
+{
+    uint64_t elapsed = now_us - p->last_refill;
+    p->tokens = MIN(p->tokens + elapsed * SPAM_RATE, SPAM_BURST * TOKEN_UNIT);
+    p->last_refill = now_us;
+
+    if (p->tokens < TOKEN_UNIT)
+        return false;
+
+    p->tokens -= TOKEN_UNIT;
+    return true;
+}
+
+static struct Spam_Peer *get_peer(struct Spam_Filter *f, uint64_t kh, uint64_t now_us)
+{
+    struct Spam_Peer *p = &f->peers[kh % SPAM_PEER_SLOTS];
+    uint32_t tag = (kh >> 32) | 1;
+
+    /* a new peer takes over the slot with a full bucket and no strikes */
+    if (p->tag != tag) {
+        memset(p, 0, sizeof(struct Spam_Peer));
+        p->tag = tag;
+        p->tokens = SPAM_BURST * TOKEN_UNIT;
+        p->last_refill = now_us;
+    }
+
+    return p;
+}
+
+static void report_masters(Tox *m, struct Spam_Filter *f, const char *msg, uint64_t now)
+{
+    if (f->last_report && now - f->last_report < SPAM_REPORT_INTERVAL) {
+        ++f->unreported;
+        return;
+    }
+
+    char buf[TOX_MAX_MESSAGE_LENGTH];
+    int len = snprintf(buf, sizeof(buf), "%s", msg);
+
+    if (f->unreported)
+        len += snprintf(buf + len, sizeof(buf) - len, " (%"PRIu32" weitere Meldungen unterdrückt)", f->unreported);
+
+    len = MIN(len, (int) sizeof(buf) - 1);
+    f->last_report = now;
+    f->unreported = 0;
+
+    uint32_t count, i;
+    const int32_t *online = friends_online(&count);
+
+    for (i = 0; i < count; ++i) {
+        if (friend_is_master(m, online[i]))
+            bot_send_message(m, online[i], (uint8_t *) buf, len);
+    }
+}
+
+static void take_action(Tox *m, struct Spam_Filter *f, int groupnum, int peernum, const uint8_t *key,
+                        bool repeat, uint64_t now)
+{
+    uint8_t raw[TOX_MAX_NAME_LENGTH];
+    char name[TOX_MAX_NAME_LENGTH + 1];
+    int len = tox_group_peername(m, groupnum, peernum, raw);
+    copy_tox_str(name, sizeof(name), (const char *) raw, MAX(len, 0));
+
+    log_msg(L_WARN, "spam group=%d peer=\"%s\" key=%02X%02X%02X%02X reason=%s mode=%s", groupnum, name,
+            key[0], key[1], key[2], key[3], repeat ? "repeat" : "flood", mode_names[f->mode]);
+    ++f->actions;
+
+    char msg[TOX_MAX_MESSAGE_LENGTH];
+
+    if (f->mode == SPAM_WARN) {
+        snprintf(msg, sizeof(msg), repeat ? "%s: Bitte keine Nachrichten wiederholen."
+                                          : "%s: Bitte nicht so viele Nachrichten auf einmal.",
+                 name[0] ? name : "?");
+
+        if (tox_group_message_send(m, groupnum, (uint8_t *) msg, strlen(msg)) == -1)
+            log_msg(L_WARN, "spam_warn_failed group=%d", groupnum);
+
+        return;
+    }
+
+    snprintf(msg, sizeof(msg), "Spam in Gruppe %d von %s (%02X%02X%02X%02X): %s", groupnum, name[0] ? name : "?",
+             key[0], key[1], key[2], key[3], repeat ? "Wiederholungen" : "zu viele Nachrichten");
+    report_masters(m, f, msg, now);
+}
+
+bool spam_message(Tox *m, int groupnum, int peernum, const char *msg, uint16_t length)
+{
+    if (groupnum < 0 || groupnum >= filters_size || filters[groupnum] == NULL)
+        return false;
+
+    uint8_t key[TOX_CLIENT_ID_SIZE];
+
+    if (tox_group_peernumber_is_ours(m, groupnum, peernum) || tox_group_peer_pubkey(m, groupnum, peernum, key) == -1)
+        return false;
+
+    uint64_t span = trace_start();
+    struct Spam_Filter *f = filters[groupnum];
+    uint64_t now_us = get_time_usec();
+    uint64_t now = now_us / 1000000;
+    struct Spam_Peer *p = get_peer(f, key_hash(key), now_us);
+    int len;
+    uint64_t h = text_hash(msg, length, &len);
+
+    /* the bucket is always charged so a flooder's repeats don't refill it */
+    bool flood = !take_token(p, now_us);
+    bool repeat = bloom_add(f, h, now) && len >= SPAM_MIN_LENGTH;
+
+    ++f->checked;
+    f->repeats += repeat;
+    f->floods += flood;
+
+    if (repeat || flood) {
+        if (now - p->last_offense > SPAM_STRIKE_TIMEOUT)
+            p->strikes = 0;
+
+        ++p->strikes;
+        p->last_offense = now;
+
+        if (p->strikes >= SPAM_STRIKES && (p->last_action == 0 || now - p->last_action >= SPAM_ACTION_INTERVAL)) {
+            p->last_action = now;
+            take_action(m, f, groupnum, peernum, key, repeat, now);
+        }
+    }
+
+    bool offender = p->strikes >= SPAM_STRIKES && now - p->last_offense <= SPAM_STRIKE_TIMEOUT;
+    trace_end("spam_check", span);
+    return offender;
+}
+
+int spam_set_mode(int groupnum, int mode)
+{
+    if (groupnum < 0 || mode < SPAM_OFF || mode > SPAM_REPORT)
+        return -1;
+
+    if (mode == SPAM_OFF) {
+        spam_remove(groupnum);
+        return 0;
+    }
+
+    if (groupnum >= filters_size) {
+        int n = MAX(groupnum + 1, filters_size * 2);
+        struct Spam_Filter **p = mem_realloc(MEM_GROUPS, filters, n * sizeof(struct Spam_Filter *));
+
+        if (p == NULL)
+            return -1;
+
+        memset(p + filters_size, 0, (n - filters_size) * sizeof(struct Spam_Filter *));
+        filters = p;
+        filters_size = n;
+    }
+
+    if (filters[groupnum] == NULL) {
+        filters[groupnum] = mem_calloc(MEM_GROUPS, 1, sizeof(struct Spam_Filter));
+
+        if (filters[groupnum] == NULL)
+            return -1;
+
+        filters[groupnum]->bloom_start = get_time_usec() / 1000000;
+    }
+
+    filters[groupnum]->mode = mode;
+    return 0;
+}
+
+int spam_mode(int groupnum)
+{
+    if (groupnum < 0 || groupnum >= filters_size || filters[groupnum] == NULL)
+        return SPAM_OFF;
+
+    return filters[groupnum]->mode;
+}
+
+const char *spam_mode_name(int mode)
+{
+    if (mode < SPAM_OFF || mode > SPAM_REPORT)
+        return NULL;
+
+    return mode_names[mode];
+}
+
+int spam_mode_parse(const char *name)
+{
+    int i;
+
+    for (i = SPAM_OFF; i <= SPAM_REPORT; ++i) {
+        if (strcmp(name, mode_names[i]) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+int spam_summary(int groupnum, char *buf, int size)
+{
+    if (groupnum < 0 || groupnum >= filters_size || filters[groupnum] == NULL)
+        return 0;
+
+    struct Spam_Filter *f = filters[groupnum];
+    int len = snprintf(buf, size, "Gruppe %d: %s, %"PRIu64" geprüft, %"PRIu64" Wiederholungen, %"PRIu64
+                       " zu schnell, %"PRIu64" Maßnahmen", groupnum, mode_names[f->mode], f->checked, f->repeats,
+                       f->floods, f->actions);
+    return MIN(len, size - 1);
+}
+
+void spam_remove(int groupnum)
+{
+    if (groupnum < 0 || groupnum >= filters_size)
+        return;
+
+    mem_free(filters[groupnum]);
+    filters[groupnum] = NULL;
+}
+
+void spam_free(void)
+{
+    int i;
+
+    for (i = 0; i < filters_size; ++i)
+        mem_free(filters[i]);
+
+    mem_free(filters);
+    filters = NULL;
+    filters_size = 0;
+}
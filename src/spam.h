@@ -0,0 +1,77 @@
+/*  spam.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SPAM_H
+#define SPAM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <tox/tox.h>
+
+/* Per-group spam filter in fixed memory (about 7 kB per group it is enabled for).
+   Repeats are caught by a pair of rotating Bloom filters over normalized message text, floods by
+   a token bucket per peer. A peer with SPAM_STRIKES offenses, none more than SPAM_STRIKE_TIMEOUT apart, is an offender. */
+#define SPAM_BLOOM_BITS 16384        /* per filter; two filters are kept */
+#define SPAM_BLOOM_HASHES 4
+#define SPAM_BLOOM_CAPACITY 512      /* messages per filter before it rotates, about 0.02% false positives */
+#define SPAM_BLOOM_WINDOW 60         /* seconds before a filter rotates if it doesn't fill up first */
+#define SPAM_MIN_LENGTH 8            /* shorter normalized messages ("hi", "ok") are never repeats */
+#define SPAM_PEER_SLOTS 64           /* peers tracked per group; peers hashing to the same slot share it */
+#define SPAM_RATE 2                  /* messages per second a peer may send */
+#define SPAM_BURST 8                 /* messages a peer may send at once after being quiet */
+#define SPAM_STRIKES 3               /* offenses before the action is taken */
+#define SPAM_STRIKE_TIMEOUT 60       /* seconds without an offense that clear a peer's strikes */
+#define SPAM_ACTION_INTERVAL 60      /* seconds between actions against the same peer */
+#define SPAM_REPORT_INTERVAL 60      /* seconds between reports to the masters per group */
+
+enum {
+    SPAM_OFF,
+    SPAM_WARN,      /* warn the offender in the group */
+    SPAM_REPORT,    /* tell the masters that are online */
+};
+
+/* Called from the group message callback. Returns true if the message comes from an offender,
+   in which case it shouldn't be passed on (e.g. over a bridge). Never true for groups with the filter off. */
+bool spam_message(Tox *m, int groupnum, int peernum, const char *msg, uint16_t length);
+
+/* Sets the action for groupnum. SPAM_OFF frees the filter.
+   Returns 0 on success, -1 if the filter can't be allocated. */
+int spam_set_mode(int groupnum, int mode);
+
+/* Returns the action for groupnum. */
+int spam_mode(int groupnum);
+
+/* Returns the mode's name as used by the spam command, or NULL for an unknown mode. */
+const char *spam_mode_name(int mode);
+
+/* Parses a mode name. Returns the mode, or -1 if name isn't one. */
+int spam_mode_parse(const char *name);
+
+/* Writes a one line summary of groupnum's filter into buf. Returns the length written, 0 if the filter is off. */
+int spam_summary(int groupnum, char *buf, int size);
+
+/* Forgets the filter of groupnum. Called by group_leave(). */
+void spam_remove(int groupnum);
+
+void spam_free(void);
+
+#endif /* SPAM_H */
@@ -0,0 +1,910 @@
+/*  state.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <tox/tox.h>
+#include <tox/toxav.h>
+
+#include "state.h"
+#include "toxbot.h"
+#include "groupchats.h"
+#include "journal.h"
+#include "recorder.h"
+#include "misc.h"
+#include "log.h"
+#include "mem.h"
+
+extern char *MASTERLIST_FILE;
+extern struct Tox_Bot Tox_Bot;
+
+/* A group from the journal that hasn't been created again yet */
+struct Saved_Group {
+    int num;
+    uint8_t type;
+    int capacity;
+    bool has_pass;
+    char password[MAX_PASSWORD_SIZE];
+    uint8_t title_len;
+    char title[TOX_MAX_NAME_LENGTH];
+    int new_num;    /* set by state_restore_groups(), -1 if it couldn't be created */
+};
+
+static uint8_t (*masters)[TOX_CLIENT_ID_SIZE];
+static int num_masters;
+
+static char **contacts;
+static int num_contacts;
+
+/* Friends that opted in to auto-invites, sorted by client id */
+struct Auto_Invite {
+    uint8_t client_id[TOX_CLIENT_ID_SIZE];
+    int32_t groupnum;
+};
+
+static struct Auto_Invite *auto_invites;
+static int num_auto_invites;
+
+/* Sorted by pattern */
+static struct Trigger *triggers;
+static int num_triggers;
+static uint32_t triggers_gen;
+
+static struct Saved_Group *saved_groups;
+static int num_saved_groups;
+static bool groups_restored;
+
+static int find_master(const uint8_t *client_id)
+{
+    int i;
+
+    for (i = 0; i < num_masters; ++i) {
+        if (memcmp(masters[i], client_id, TOX_CLIENT_ID_SIZE) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+static void apply_master(const uint8_t *client_id)
+{
+    if (find_master(client_id) != -1)
+        return;
+
+    uint8_t (*p)[TOX_CLIENT_ID_SIZE] = mem_realloc(MEM_CONTACTS, masters, (num_masters + 1) * TOX_CLIENT_ID_SIZE);
+
+    if (p == NULL)
+        exit(EXIT_FAILURE);
+
+    masters = p;
+    memcpy(masters[num_masters++], client_id, TOX_CLIENT_ID_SIZE);
+}
+
+/* Returns false if the line was in the phone book already */
+static bool apply_contact(const char *line, uint16_t length)
+{
+    int i;
+
+    for (i = 0; i < num_contacts; ++i) {
+        if (strlen(contacts[i]) == length && memcmp(contacts[i], line, length) == 0)
+            return false;
+    }
+
+    char **p = mem_realloc(MEM_CONTACTS, contacts, (num_contacts + 1) * sizeof(char *));
+    char *c = mem_malloc(MEM_CONTACTS, length + 1);
+
+    if (p == NULL || c == NULL)
+        exit(EXIT_FAILURE);
+
+    memcpy(c, line, length);
+    c[length] = '\0';
+    contacts = p;
+    contacts[num_contacts++] = c;
+    return true;
+}
+
+/* Returns the index of client_id in auto_invites, or -(insertion point) - 1 if it isn't there */
+static int auto_invite_find(const uint8_t *client_id)
+{
+    int lo = 0, hi = num_auto_invites - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int c = memcmp(auto_invites[mid].client_id, client_id, TOX_CLIENT_ID_SIZE);
+
+        if (c == 0)
+            return mid;
+
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return -lo - 1;
+}
+
+static void apply_auto_invite(const uint8_t *client_id, int32_t groupnum)
+{
+    int i = auto_invite_find(client_id);
+
+    if (groupnum == AUTO_INVITE_OFF) {
+        if (i < 0)
+            return;
+
+        memmove(&auto_invites[i], &auto_invites[i + 1], (num_auto_invites - i - 1) * sizeof(struct Auto_Invite));
+        --num_auto_invites;
+        return;
+    }
+
+    if (i >= 0) {
+        auto_invites[i].groupnum = groupnum;
+        return;
+    }
+
+    struct Auto_Invite *p = mem_realloc(MEM_CONTACTS, auto_invites, (num_auto_invites + 1) * sizeof(struct Auto_Invite));
+
+    if (p == NULL)
+        exit(EXIT_FAILURE);
+
+    auto_invites = p;
+    i = -i - 1;
+    memmove(&auto_invites[i + 1], &auto_invites[i], (num_auto_invites - i) * sizeof(struct Auto_Invite));
+    memcpy(auto_invites[i].client_id, client_id, TOX_CLIENT_ID_SIZE);
+    auto_invites[i].groupnum = groupnum;
+    ++num_auto_invites;
+}
+
+static uint16_t auto_invite_encode(uint8_t *buf, const uint8_t *client_id, int32_t groupnum)
+{
+    memcpy(buf, client_id, TOX_CLIENT_ID_SIZE);
+    memcpy(buf + TOX_CLIENT_ID_SIZE, &groupnum, sizeof(groupnum));
+    return TOX_CLIENT_ID_SIZE + sizeof(groupnum);
+}
+
+/* Returns the index of pattern in triggers, or -(insertion point) - 1 if it isn't there */
+static int trigger_find(const char *pattern)
+{
+    int lo = 0, hi = num_triggers - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int c = strcmp(triggers[mid].pattern, pattern);
+
+        if (c == 0)
+            return mid;
+
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return -lo - 1;
+}
+
+/* Copies length bytes of src to dst as a lowercased string. dst must hold length + 1 bytes. */
+static void pattern_copy(char *dst, const char *src, uint16_t length)
+{
+    uint16_t i;
+
+    for (i = 0; i < length; ++i)
+        dst[i] = src[i] >= 'A' && src[i] <= 'Z' ? src[i] + 'a' - 'A' : src[i];
+
+    dst[length] = '\0';
+}
+
+static char *string_copy(const char *s, uint16_t length)
+{
+    char *p = mem_malloc(MEM_GROUPS, length + 1);
+
+    if (p == NULL)
+        exit(EXIT_FAILURE);
+
+    memcpy(p, s, length);
+    p[length] = '\0';
+    return p;
+}
+
+static void apply_trigger(const char *pattern, const char *reply, uint16_t reply_len, int32_t groupnum,
+                          uint32_t cooldown)
+{
+    int i = trigger_find(pattern);
+
+    if (i >= 0) {
+        mem_free(triggers[i].reply);
+    } else {
+        if (num_triggers >= MAX_TRIGGERS) {
+            log_msg(L_WARN, "trigger_dropped pattern=\"%s\" reason=limit", pattern);
+            return;
+        }
+
+        struct Trigger *p = mem_realloc(MEM_GROUPS, triggers, (num_triggers + 1) * sizeof(struct Trigger));
+
+        if (p == NULL)
+            exit(EXIT_FAILURE);
+
+        triggers = p;
+        i = -i - 1;
+        memmove(&triggers[i + 1], &triggers[i], (num_triggers - i) * sizeof(struct Trigger));
+        triggers[i].pattern = string_copy(pattern, strlen(pattern));
+        ++num_triggers;
+    }
+
+    triggers[i].reply = string_copy(reply, reply_len);
+    triggers[i].groupnum = groupnum;
+    triggers[i].cooldown = cooldown;
+    ++triggers_gen;
+}
+
+static void trigger_delete(int i)
+{
+    mem_free(triggers[i].pattern);
+    mem_free(triggers[i].reply);
+    memmove(&triggers[i], &triggers[i + 1], (num_triggers - i - 1) * sizeof(struct Trigger));
+    --num_triggers;
+    ++triggers_gen;
+}
+
+static void apply_trigger_remove(const char *pattern)
+{
+    int i = trigger_find(pattern);
+
+    if (i >= 0)
+        trigger_delete(i);
+}
+
+/* STATE_TRIGGER payload: int32 group number, uint32 cooldown, uint8 pattern length, pattern, reply */
+static uint16_t trigger_encode(uint8_t *buf, const char *pattern, const char *reply, int32_t groupnum,
+                               uint32_t cooldown)
+{
+    uint8_t pattern_len = strlen(pattern);
+    uint16_t reply_len = strlen(reply);
+    uint16_t len = 0;
+
+    memcpy(buf + len, &groupnum, sizeof(groupnum));
+    len += sizeof(groupnum);
+    memcpy(buf + len, &cooldown, sizeof(cooldown));
+    len += sizeof(cooldown);
+    buf[len++] = pattern_len;
+    memcpy(buf + len, pattern, pattern_len);
+    len += pattern_len;
+    memcpy(buf + len, reply, reply_len);
+    len += reply_len;
+
+    return len;
+}
+
+static void trigger_decode(const uint8_t *data, uint16_t length)
+{
+    int32_t groupnum;
+    uint32_t cooldown;
+    char pattern[TRIGGER_MAX_PATTERN + 1];
+
+    if (length < 9)
+        return;
+
+    memcpy(&groupnum, data, sizeof(groupnum));
+    memcpy(&cooldown, data + 4, sizeof(cooldown));
+
+    uint8_t pattern_len = data[8];
+    uint16_t reply_len = length - 9 - pattern_len;
+
+    if (pattern_len == 0 || pattern_len > TRIGGER_MAX_PATTERN || 9 + pattern_len > length
+            || reply_len == 0 || reply_len > TRIGGER_MAX_REPLY)
+        return;
+
+    pattern_copy(pattern, (const char *) data + 9, pattern_len);
+    apply_trigger(pattern, (const char *) data + 9 + pattern_len, reply_len, groupnum, cooldown);
+}
+
+static int saved_group_find(int num)
+{
+    int i;
+
+    for (i = 0; i < num_saved_groups; ++i) {
+        if (saved_groups[i].num == num)
+            return i;
+    }
+
+    return -1;
+}
+
+/* STATE_GROUP payload: int32 num, uint8 type, int32 capacity, uint8 password length, password,
+   uint8 title length, title */
+static uint16_t group_encode(uint8_t *buf, const struct Saved_Group *g)
+{
+    int32_t num = g->num, capacity = g->capacity;
+    uint8_t pass_len = g->has_pass ? strlen(g->password) : 0;
+    uint16_t len = 0;
+
+    memcpy(buf + len, &num, sizeof(num));
+    len += sizeof(num);
+    buf[len++] = g->type;
+    memcpy(buf + len, &capacity, sizeof(capacity));
+    len += sizeof(capacity);
+    buf[len++] = pass_len;
+    memcpy(buf + len, g->password, pass_len);
+    len += pass_len;
+    buf[len++] = g->title_len;
+    memcpy(buf + len, g->title, g->title_len);
+    len += g->title_len;
+
+    return len;
+}
+
+static int group_decode(const uint8_t *data, uint16_t length, struct Saved_Group *g)
+{
+    int32_t num, capacity;
+    uint16_t pos = 0;
+
+    memset(g, 0, sizeof(struct Saved_Group));
+
+    if (length < 10)
+        return -1;
+
+    memcpy(&num, data, sizeof(num));
+    pos += sizeof(num);
+    g->num = num;
+    g->type = data[pos++];
+    memcpy(&capacity, data + pos, sizeof(capacity));
+    pos += sizeof(capacity);
+    g->capacity = capacity;
+
+    uint8_t pass_len = data[pos++];
+
+    if (pass_len >= MAX_PASSWORD_SIZE || pos + pass_len + 1 > length)
+        return -1;
+
+    memcpy(g->password, data + pos, pass_len);
+    g->has_pass = pass_len > 0;
+    pos += pass_len;
+    g->title_len = data[pos++];
+
+    if (g->title_len >= TOX_MAX_NAME_LENGTH || pos + g->title_len > length)
+        return -1;
+
+    memcpy(g->title, data + pos, g->title_len);
+    return 0;
+}
+
+static void apply_group(const uint8_t *data, uint16_t length)
+{
+    struct Saved_Group g;
+
+    /* once the groups exist again the registry is the state; our own records may come back from a poll */
+    if (groups_restored || group_decode(data, length, &g) == -1)
+        return;
+
+    int i = saved_group_find(g.num);
+
+    if (i == -1) {
+        struct Saved_Group *p = mem_realloc(MEM_GROUPS, saved_groups, (num_saved_groups + 1) * sizeof(struct Saved_Group));
+
+        if (p == NULL)
+            exit(EXIT_FAILURE);
+
+        saved_groups = p;
+        i = num_saved_groups++;
+    }
+
+    saved_groups[i] = g;
+}
+
+static void apply_group_remove(int num)
+{
+    int i = saved_group_find(num);
+
+    if (groups_restored || i == -1)
+        return;
+
+    saved_groups[i] = saved_groups[--num_saved_groups];
+}
+
+static void state_apply(int type, const uint8_t *data, uint16_t length)
+{
+    int32_t num;
+    uint64_t seconds;
+
+    switch (type) {
+        case STATE_MASTER:
+            if (length == TOX_CLIENT_ID_SIZE)
+                apply_master(data);
+            break;
+
+        case STATE_CONTACT:
+            apply_contact((const char *) data, length);
+            break;
+
+        case STATE_DEFAULT_GROUP:
+            if (length == sizeof(num)) {
+                memcpy(&num, data, sizeof(num));
+                Tox_Bot.default_groupnum = num;
+            }
+            break;
+
+        case STATE_PURGE_LIMIT:
+            if (length == sizeof(seconds)) {
+                memcpy(&seconds, data, sizeof(seconds));
+                Tox_Bot.inactive_limit = seconds;
+            }
+            break;
+
+        case STATE_GROUP:
+            apply_group(data, length);
+            break;
+
+        case STATE_GROUP_REMOVE:
+            if (length == sizeof(num)) {
+                memcpy(&num, data, sizeof(num));
+                apply_group_remove(num);
+            }
+            break;
+
+        case STATE_AUTO_INVITE:
+            if (length == TOX_CLIENT_ID_SIZE + sizeof(num)) {
+                memcpy(&num, data + TOX_CLIENT_ID_SIZE, sizeof(num));
+                apply_auto_invite(data, num);
+            }
+            break;
+
+        case STATE_TRIGGER:
+            trigger_decode(data, length);
+            break;
+
+        case STATE_TRIGGER_REMOVE:
+            if (length > 0 && length <= TRIGGER_MAX_PATTERN) {
+                char pattern[TRIGGER_MAX_PATTERN + 1];
+                pattern_copy(pattern, (const char *) data, length);
+                apply_trigger_remove(pattern);
+            }
+            break;
+
+        default:
+            log_msg(L_WARN, "journal_unknown_record type=%d", type);
+            break;
+    }
+}
+
+static void snapshot_group(const struct Saved_Group *g)
+{
+    uint8_t buf[JOURNAL_MAX_RECORD];
+    journal_snapshot_add(STATE_GROUP, buf, group_encode(buf, g));
+}
+
+/* Fills in a Saved_Group from the registry entry at idx */
+static void saved_from_registry(struct Saved_Group *g, int idx)
+{
+    const struct Group_Chat *c = &Tox_Bot.g_chats[idx];
+
+    memset(g, 0, sizeof(struct Saved_Group));
+    g->num = c->num;
+    g->type = c->type;
+    g->capacity = c->capacity;
+    g->has_pass = c->has_pass;
+    snprintf(g->password, sizeof(g->password), "%s", c->password);
+    g->title_len = MIN(c->title_len, TOX_MAX_NAME_LENGTH - 1);
+    memcpy(g->title, c->title, g->title_len);
+}
+
+static void state_snapshot(void)
+{
+    int i;
+
+    for (i = 0; i < num_masters; ++i)
+        journal_snapshot_add(STATE_MASTER, masters[i], TOX_CLIENT_ID_SIZE);
+
+    for (i = 0; i < num_contacts; ++i)
+        journal_snapshot_add(STATE_CONTACT, contacts[i], strlen(contacts[i]));
+
+    int32_t num = Tox_Bot.default_groupnum;
+    uint64_t seconds = Tox_Bot.inactive_limit;
+    journal_snapshot_add(STATE_DEFAULT_GROUP, &num, sizeof(num));
+    journal_snapshot_add(STATE_PURGE_LIMIT, &seconds, sizeof(seconds));
+
+    for (i = 0; i < num_auto_invites; ++i) {
+        uint8_t buf[TOX_CLIENT_ID_SIZE + sizeof(int32_t)];
+        journal_snapshot_add(STATE_AUTO_INVITE, buf,
+                             auto_invite_encode(buf, auto_invites[i].client_id, auto_invites[i].groupnum));
+    }
+
+    for (i = 0; i < num_triggers; ++i) {
+        uint8_t buf[JOURNAL_MAX_RECORD];
+        struct Trigger *t = &triggers[i];
+        journal_snapshot_add(STATE_TRIGGER, buf, trigger_encode(buf, t->pattern, t->reply, t->groupnum, t->cooldown));
+    }
+
+    if (!groups_restored) {
+        for (i = 0; i < num_saved_groups; ++i)
+            snapshot_group(&saved_groups[i]);
+
+        return;
+    }
+
+    for (i = 0; i < Tox_Bot.chats_idx; ++i) {
+        if (!Tox_Bot.g_chats[i].active || !Tox_Bot.g_chats[i].owned)
+            continue;
+
+        struct Saved_Group g;
+        saved_from_registry(&g, i);
+        snapshot_group(&g);
+    }
+}
+
+/* Moves the masterkeys and contacts files of older versions into the journal */
+static void import_legacy(void)
+{
+    char line[512];
+    int masters_added = 0, contacts_added = 0;
+    FILE *fp = fopen(MASTERLIST_FILE, "r");
+
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            line[strcspn(line, "\r\n")] = '\0';
+
+            if (strlen(line) < TOX_CLIENT_ID_SIZE * 2)
+                continue;
+
+            line[TOX_CLIENT_ID_SIZE * 2] = '\0';
+            char *key = hex_string_to_bin(line);
+
+            if (state_add_master((uint8_t *) key) == 0)
+                ++masters_added;
+
+            mem_free(key);
+        }
+
+        fclose(fp);
+    }
+
+    if ((fp = fopen(LEGACY_CONTACTS_FILE, "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp)) {
+            line[strcspn(line, "\r\n")] = '\0';
+
+            if (line[0] && state_add_contact(line) == 0)
+                ++contacts_added;
+        }
+
+        fclose(fp);
+    }
+
+    if (masters_added || contacts_added)
+        log_msg(L_INFO, "journal_import masters=%d contacts=%d", masters_added, contacts_added);
+}
+
+int state_load(const char *path, bool writable)
+{
+    int records = journal_open(path, writable, state_apply, state_snapshot);
+
+    if (records == -1)
+        return -1;
+
+    if (records == 0)
+        import_legacy();
+
+    return 0;
+}
+
+static int saved_group_cmp(const void *a, const void *b)
+{
+    return ((const struct Saved_Group *) a)->num - ((const struct Saved_Group *) b)->num;
+}
+
+void state_restore_groups(Tox *m)
+{
+    bool renumbered = false;
+    int default_groupnum = Tox_Bot.default_groupnum;
+    int i;
+
+    qsort(saved_groups, num_saved_groups, sizeof(struct Saved_Group), saved_group_cmp);
+
+    for (i = 0; i < num_saved_groups; ++i) {
+        struct Saved_Group *g = &saved_groups[i];
+        int groupnum = -1;
+
+        if (g->type == TOX_GROUPCHAT_TYPE_TEXT)
+            groupnum = tox_add_groupchat(m);
+        else if (g->type == TOX_GROUPCHAT_TYPE_AV)
+            groupnum = toxav_add_av_groupchat(m, recorder_audio_cb, NULL);
+
+        g->new_num = -1;
+
+        if (groupnum == -1 || group_add(groupnum, g->type, g->has_pass ? g->password : NULL) == -1) {
+            log_msg(L_WARN, "group_restore_failed group=%d", g->num);
+
+            if (groupnum != -1)
+                tox_del_groupchat(m, groupnum);
+
+            renumbered = true;
+            continue;
+        }
+
+        struct Group_Chat *c = &Tox_Bot.g_chats[group_index(groupnum)];
+        c->owned = true;
+        c->capacity = g->capacity;
+
+        if (g->title_len) {
+            tox_group_set_title(m, groupnum, (const uint8_t *) g->title, g->title_len);
+            memcpy(c->title, g->title, g->title_len);
+            c->title[g->title_len] = '\0';
+            c->title_len = g->title_len;
+        }
+
+        g->new_num = groupnum;
+
+        if (g->num == Tox_Bot.default_groupnum)
+            default_groupnum = groupnum;
+
+        if (groupnum != g->num)
+            renumbered = true;
+
+        log_msg(L_INFO, "group_restore group=%d was=%d", groupnum, g->num);
+    }
+
+    Tox_Bot.default_groupnum = default_groupnum;
+
+    /* auto-invites follow their group; invited or lost groups fall back to the default group */
+    for (i = 0; i < num_auto_invites; ++i) {
+        if (auto_invites[i].groupnum < 0)
+            continue;
+
+        int j = saved_group_find(auto_invites[i].groupnum);
+        int groupnum = j != -1 && saved_groups[j].new_num >= 0 ? saved_groups[j].new_num : AUTO_INVITE_DEFAULT;
+
+        if (groupnum != auto_invites[i].groupnum) {
+            auto_invites[i].groupnum = groupnum;
+            renumbered = true;
+        }
+    }
+
+    /* triggers follow their group too; those of invited or lost groups are dropped */
+    for (i = num_triggers - 1; i >= 0; --i) {
+        if (triggers[i].groupnum == TRIGGER_ALL_GROUPS)
+            continue;
+
+        int j = saved_group_find(triggers[i].groupnum);
+
+        if (j == -1 || saved_groups[j].new_num < 0) {
+            log_msg(L_WARN, "trigger_dropped pattern=\"%s\" group=%d", triggers[i].pattern, triggers[i].groupnum);
+            trigger_delete(i);
+            renumbered = true;
+        } else if (saved_groups[j].new_num != triggers[i].groupnum) {
+            triggers[i].groupnum = saved_groups[j].new_num;
+            ++triggers_gen;
+            renumbered = true;
+        }
+    }
+
+    groups_restored = true;
+    mem_free(saved_groups);
+    saved_groups = NULL;
+    num_saved_groups = 0;
+
+    /* the journal still has the old numbers */
+    if (renumbered)
+        journal_compact();
+}
+
+void state_close(void)
+{
+    journal_close();
+
+    int i;
+
+    for (i = 0; i < num_contacts; ++i)
+        mem_free(contacts[i]);
+
+    for (i = 0; i < num_triggers; ++i) {
+        mem_free(triggers[i].pattern);
+        mem_free(triggers[i].reply);
+    }
+
+    mem_free(contacts);
+    mem_free(triggers);
+    mem_free(masters);
+    mem_free(saved_groups);
+    mem_free(auto_invites);
+    contacts = NULL;
+    masters = NULL;
+    saved_groups = NULL;
+    auto_invites = NULL;
+    triggers = NULL;
+    num_contacts = num_masters = num_saved_groups = num_auto_invites = num_triggers = 0;
+}
+
+bool state_is_master(const uint8_t *client_id)
+{
+    /* masters may be added with toxbot -a while we run */
+    journal_poll();
+    return find_master(client_id) != -1;
+}
+
+int state_add_master(const uint8_t *client_id)
+{
+    if (find_master(client_id) != -1)
+        return 1;
+
+    if (journal_append(STATE_MASTER, client_id, TOX_CLIENT_ID_SIZE) == -1)
+        return -1;
+
+    apply_master(client_id);
+    return 0;
+}
+
+int state_add_contact(const char *line)
+{
+    uint16_t length = MIN(strlen(line), JOURNAL_MAX_RECORD);
+
+    if (journal_append(STATE_CONTACT, line, length) == -1)
+        return -1;
+
+    apply_contact(line, length);
+    return 0;
+}
+
+int state_num_contacts(void)
+{
+    return num_contacts;
+}
+
+const char *state_contact(int i)
+{
+    return contacts[i];
+}
+
+void state_set_default_group(int groupnum)
+{
+    int32_t num = groupnum;
+    Tox_Bot.default_groupnum = groupnum;
+    journal_append(STATE_DEFAULT_GROUP, &num, sizeof(num));
+}
+
+void state_set_purge_limit(uint64_t seconds)
+{
+    Tox_Bot.inactive_limit = seconds;
+    journal_append(STATE_PURGE_LIMIT, &seconds, sizeof(seconds));
+}
+
+/* Returns the registry index of the bot's own group that groupnum is (or overflows from), or -1 */
+static int owned_root(int groupnum)
+{
+    int idx = group_index(groupnum);
+
+    if (idx != -1 && Tox_Bot.g_chats[idx].parent != -1)
+        idx = group_index(Tox_Bot.g_chats[idx].parent);
+
+    return idx != -1 && Tox_Bot.g_chats[idx].owned ? idx : -1;
+}
+
+void state_group_created(int groupnum)
+{
+    int idx = group_index(groupnum);
+
+    if (idx == -1)
+        return;
+
+    Tox_Bot.g_chats[idx].owned = true;
+    state_group_changed(groupnum);
+}
+
+void state_group_changed(int groupnum)
+{
+    int idx = owned_root(groupnum);
+
+    if (idx == -1)
+        return;
+
+    struct Saved_Group g;
+    uint8_t buf[JOURNAL_MAX_RECORD];
+
+    saved_from_registry(&g, idx);
+    journal_append(STATE_GROUP, buf, group_encode(buf, &g));
+}
+
+void state_group_removed(int groupnum)
+{
+    int idx = group_index(groupnum);
+
+    if (idx == -1 || !Tox_Bot.g_chats[idx].owned)
+        return;
+
+    int32_t num = groupnum;
+    journal_append(STATE_GROUP_REMOVE, &num, sizeof(num));
+}
+
+int state_set_auto_invite(const uint8_t *client_id, int groupnum)
+{
+    uint8_t buf[TOX_CLIENT_ID_SIZE + sizeof(int32_t)];
+
+    if (journal_append(STATE_AUTO_INVITE, buf, auto_invite_encode(buf, client_id, groupnum)) == -1)
+        return -1;
+
+    apply_auto_invite(client_id, groupnum);
+    return 0;
+}
+
+int state_auto_invite(const uint8_t *client_id)
+{
+    int i = auto_invite_find(client_id);
+    return i >= 0 ? auto_invites[i].groupnum : AUTO_INVITE_OFF;
+}
+
+int state_num_auto_invites(void)
+{
+    return num_auto_invites;
+}
+
+int state_set_trigger(const char *pattern, const char *reply, int groupnum, uint32_t cooldown)
+{
+    size_t pattern_len = strlen(pattern), reply_len = strlen(reply);
+    char lower[TRIGGER_MAX_PATTERN + 1];
+
+    if (pattern_len == 0 || pattern_len > TRIGGER_MAX_PATTERN || reply_len == 0 || reply_len > TRIGGER_MAX_REPLY)
+        return -1;
+
+    pattern_copy(lower, pattern, pattern_len);
+
+    if (num_triggers >= MAX_TRIGGERS && trigger_find(lower) < 0)
+        return -1;
+
+    uint8_t buf[JOURNAL_MAX_RECORD];
+
+    if (journal_append(STATE_TRIGGER, buf, trigger_encode(buf, lower, reply, groupnum, cooldown)) == -1)
+        return -1;
+
+    apply_trigger(lower, reply, reply_len, groupnum, cooldown);
+    return 0;
+}
+
+int state_remove_trigger(const char *pattern)
+{
+    size_t len = strlen(pattern);
+    char lower[TRIGGER_MAX_PATTERN + 1];
+
+    if (len == 0 || len > TRIGGER_MAX_PATTERN)
+        return -1;
+
+    pattern_copy(lower, pattern, len);
+
+    if (trigger_find(lower) < 0 || journal_append(STATE_TRIGGER_REMOVE, lower, len) == -1)
+        return -1;
+
+    apply_trigger_remove(lower);
+    return 0;
+}
+
+int state_num_triggers(void)
+{
+    return num_triggers;
+}
+
+const struct Trigger *state_trigger(int i)
+{
+    return &triggers[i];
+}
+
+uint32_t state_triggers_gen(void)
+{
+    return triggers_gen;
+}
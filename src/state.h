@@ -0,0 +1,119 @@
+/*  state.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef STATE_H
+#define STATE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <tox/tox.h>
+
+#define LEGACY_CONTACTS_FILE "contacts"    /* imported into the journal on first start, like masterkeys */
+
+/* Journal record types of the bot state */
+enum {
+    STATE_MASTER = 1,       /* client id */
+    STATE_CONTACT,          /* phone book line */
+    STATE_DEFAULT_GROUP,    /* int32 group number */
+    STATE_PURGE_LIMIT,      /* uint64 seconds */
+    STATE_GROUP,            /* a group the bot created: number, type, capacity, password and title */
+    STATE_GROUP_REMOVE,     /* int32 group number */
+    STATE_AUTO_INVITE,      /* client id, int32 group number (AUTO_INVITE_DEFAULT or AUTO_INVITE_OFF) */
+    STATE_TRIGGER,          /* int32 group number (TRIGGER_ALL_GROUPS), uint32 cooldown, uint8 pattern length, pattern, reply */
+    STATE_TRIGGER_REMOVE,   /* pattern */
+};
+
+#define AUTO_INVITE_DEFAULT -1    /* invite to whatever the default group is at the time */
+#define AUTO_INVITE_OFF     -2
+
+#define MAX_TRIGGERS 10000
+#define TRIGGER_MAX_PATTERN 64
+#define TRIGGER_MAX_REPLY 512
+#define TRIGGER_ALL_GROUPS -1
+
+/* A keyword auto-reply. Patterns are stored lowercased and are unique. */
+struct Trigger {
+    char *pattern;
+    char *reply;
+    int32_t groupnum;     /* or TRIGGER_ALL_GROUPS */
+    uint32_t cooldown;    /* seconds between replies in the same group */
+};
+
+/* Loads masters, contacts, the default group, the purge limit, the bot's own groups, the
+   auto-invite opt-ins and the triggers from the journal at path. On first start the legacy masterkeys and contacts files are imported. If
+   writable is false changes are kept in memory only. Returns 0 on success, -1 on error. */
+int state_load(const char *path, bool writable);
+
+/* Creates the groups from the journal again. Group numbers may change; the default group,
+   auto-invites and triggers follow.
+   Call once after state_load() and init_tox(). */
+void state_restore_groups(Tox *m);
+
+void state_close(void);
+
+bool state_is_master(const uint8_t *client_id);
+
+/* Returns 0 if the master was added, 1 if it already was one, -1 on error. */
+int state_add_master(const uint8_t *client_id);
+
+/* Adds a line to the phone book. Returns 0 on success, -1 on error. */
+int state_add_contact(const char *line);
+
+int state_num_contacts(void);
+const char *state_contact(int i);
+
+void state_set_default_group(int groupnum);
+void state_set_purge_limit(uint64_t seconds);
+
+/* Marks groupnum as created by the bot, so it is journaled and created again at startup. */
+void state_group_created(int groupnum);
+
+/* Journals the password, capacity and title of groupnum if it's one of the bot's own groups. */
+void state_group_changed(int groupnum);
+
+/* Call before group_leave(). */
+void state_group_removed(int groupnum);
+
+/* Opts a friend in to being invited to groupnum (or AUTO_INVITE_DEFAULT) when they come online,
+   or out with AUTO_INVITE_OFF. Returns 0 on success, -1 on error. */
+int state_set_auto_invite(const uint8_t *client_id, int groupnum);
+
+/* Returns the group a friend wants to be invited to when they come online, AUTO_INVITE_DEFAULT,
+   or AUTO_INVITE_OFF if they haven't opted in. */
+int state_auto_invite(const uint8_t *client_id);
+
+int state_num_auto_invites(void);
+
+/* Adds a trigger, or replaces the one with the same pattern. pattern is lowercased.
+   Returns 0 on success, -1 if it is too long, there are too many triggers or it can't be journaled. */
+int state_set_trigger(const char *pattern, const char *reply, int groupnum, uint32_t cooldown);
+
+/* Returns 0 on success, -1 if there is no trigger with that (case insensitive) pattern or it can't be journaled. */
+int state_remove_trigger(const char *pattern);
+
+/* Triggers are sorted by pattern. The pointer is only valid until the triggers change. */
+int state_num_triggers(void);
+const struct Trigger *state_trigger(int i);
+
+/* Returns a number that changes whenever the triggers do, including changes polled from the journal. */
+uint32_t state_triggers_gen(void);
+
+#endif /* STATE_H */
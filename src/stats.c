@@ -0,0 +1,212 @@
+/*  stats.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include <tox/tox.h>
+
+#include "stats.h"
+#include "groupchats.h"
+#include "misc.h"
+#include "log.h"
+#include "watchdog.h"
+#include "mem.h"
+
+static struct Bot_Stats Bot_Stats;
+
+static int latency_bucket(uint64_t usec)
+{
+    if (usec < LATENCY_SUB_BUCKETS)
+        return usec;
+
+    int msb = 63 - __builtin_clzll(usec);
+    int idx = (msb - 3) * LATENCY_SUB_BUCKETS + ((usec >> (msb - 4)) & (LATENCY_SUB_BUCKETS - 1));
+
+    return idx < LATENCY_NUM_BUCKETS ? idx : LATENCY_NUM_BUCKETS - 1;
+}
+
+/* returns the largest value that falls into bucket idx */
+static uint64_t latency_bucket_max(int idx)
+{
+    if (idx < LATENCY_SUB_BUCKETS)
+        return idx;
+
+    int msb = idx / LATENCY_SUB_BUCKETS + 3;
+    uint64_t sub = idx % LATENCY_SUB_BUCKETS;
+    uint64_t low = (LATENCY_SUB_BUCKETS + sub) << (msb - 4);
+
+    return low + (1ULL << (msb - 4)) - 1;
+}
+
+void stats_command(uint64_t usec)
+{
+    ++Bot_Stats.commands;
+    ++Bot_Stats.latency[latency_bucket(usec)];
+
+    if (usec > Bot_Stats.latency_max)
+        Bot_Stats.latency_max = usec;
+}
+
+void stats_invalid_command(void)
+{
+    ++Bot_Stats.invalid_commands;
+}
+
+void stats_reply(bool sent)
+{
+    if (sent)
+        ++Bot_Stats.replies_sent;
+    else
+        ++Bot_Stats.replies_dropped;
+}
+
+void stats_reply_messages(uint64_t count)
+{
+    ++Bot_Stats.reply_msgs[MIN(count, REPLY_MSG_BUCKETS - 1)];
+
+    if (count > Bot_Stats.reply_msgs_max)
+        Bot_Stats.reply_msgs_max = count;
+}
+
+uint64_t stats_latency_percentile(double p)
+{
+    if (Bot_Stats.commands == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) (Bot_Stats.commands * p / 100.0 + 0.5);
+    uint64_t seen = 0;
+    int i;
+
+    if (rank == 0)
+        rank = 1;
+
+    for (i = 0; i < LATENCY_NUM_BUCKETS; ++i) {
+        seen += Bot_Stats.latency[i];
+
+        if (seen >= rank)
+            return MIN(latency_bucket_max(i), Bot_Stats.latency_max);
+    }
+
+    return Bot_Stats.latency_max;
+}
+
+long stats_rss_kb(void)
+{
+    FILE *fp = fopen("/proc/self/statm", "r");
+
+    if (fp == NULL)
+        return -1;
+
+    long size, resident;
+
+    if (fscanf(fp, "%ld %ld", &size, &resident) != 2) {
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+const struct Bot_Stats *stats_get(void)
+{
+    return &Bot_Stats;
+}
+
+void stats_reset(void)
+{
+    memset(&Bot_Stats, 0, sizeof(Bot_Stats));
+}
+
+int stats_report(char *buf, int size)
+{
+    int len = 0;
+
+#define REPORT_LINE(...) \
+    do { \
+        if (len < size) \
+            len += snprintf(buf + len, size - len, __VA_ARGS__); \
+    } while (0)
+
+    REPORT_LINE("Befehle: %"PRIu64" (ungültig: %"PRIu64")\n", Bot_Stats.commands, Bot_Stats.invalid_commands);
+    REPORT_LINE("Latenz p50/p99/p999/max: %"PRIu64"/%"PRIu64"/%"PRIu64"/%"PRIu64" us\n",
+                stats_latency_percentile(50.0), stats_latency_percentile(99.0),
+                stats_latency_percentile(99.9), Bot_Stats.latency_max);
+    REPORT_LINE("Antworten: %"PRIu64" gesendet, %"PRIu64" verworfen\n", Bot_Stats.replies_sent,
+                Bot_Stats.replies_dropped);
+    REPORT_LINE("Nachrichten pro Befehl 0/1/2/3+: %"PRIu64"/%"PRIu64"/%"PRIu64"/%"PRIu64" (max %"PRIu64")\n",
+                Bot_Stats.reply_msgs[0], Bot_Stats.reply_msgs[1], Bot_Stats.reply_msgs[2],
+                Bot_Stats.reply_msgs[3], Bot_Stats.reply_msgs_max);
+    int peers;
+    int groups = group_totals(&peers);
+    REPORT_LINE("Gruppen: %d (%d Teilnehmer)\n", groups, peers);
+    REPORT_LINE("Speicher (RSS): %ld kB\n", stats_rss_kb());
+    REPORT_LINE("Log-Zeilen verworfen: %"PRIu64"\n", log_dropped());
+    REPORT_LINE("Hänger: %"PRIu64" (längster %"PRIu64" ms)\n", watchdog_stalls(), watchdog_longest());
+
+#undef REPORT_LINE
+
+    if (len >= size)
+        len = size - 1;
+
+    /* no trailing newline */
+    if (len > 0 && buf[len - 1] == '\n')
+        buf[--len] = '\0';
+
+    return len;
+}
+
+int stats_export(const char *path)
+{
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp, "w");
+
+    if (fp == NULL)
+        return -1;
+
+    char report[2048];
+    char mem[1024];
+    char stamp[32];
+    time_t now = time(NULL);
+
+    stats_report(report, sizeof(report));
+    mem_report(mem, sizeof(mem));
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+    bool ok = fprintf(fp, "%s\n%s\n%s\n", stamp, report, mem) > 0;
+
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) != 0) {
+        remove(tmp);
+        return -1;
+    }
+
+    return 0;
+}
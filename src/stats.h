@@ -0,0 +1,74 @@
+/*  stats.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Latencies are kept in a log-linear histogram: 16 sub-buckets per power of two,
+   which bounds the error of a reported percentile to about 6%. */
+#define STATS_EXPORT_FILE "toxbot.stats"    /* written by the master command export */
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_NUM_BUCKETS (38 * LATENCY_SUB_BUCKETS)
+#define REPLY_MSG_BUCKETS 4    /* commands answered with 0, 1, 2 and 3 or more messages */
+
+struct Bot_Stats {
+    uint64_t commands;
+    uint64_t invalid_commands;
+    uint64_t replies_sent;
+    uint64_t replies_dropped;
+    uint64_t latency_max;    /* microseconds */
+    uint64_t latency[LATENCY_NUM_BUCKETS];
+    uint64_t reply_msgs[REPLY_MSG_BUCKETS];
+    uint64_t reply_msgs_max;
+};
+
+/* Records one executed command that took usec microseconds. */
+void stats_command(uint64_t usec);
+
+void stats_invalid_command(void);
+
+/* Records the number of messages a command (or a whole batch) was answered with. */
+void stats_reply_messages(uint64_t count);
+
+/* Records a reply; sent is false if the core refused to queue it. */
+void stats_reply(bool sent);
+
+/* Returns the p-th percentile (0 < p <= 100) of command latency in microseconds. */
+uint64_t stats_latency_percentile(double p);
+
+/* Returns the resident set size of the process in kB, or -1 on error. */
+long stats_rss_kb(void);
+
+const struct Bot_Stats *stats_get(void);
+void stats_reset(void);
+
+/* Writes a human readable summary, one stat per line, into buf.
+   Returns the length of the string written. */
+int stats_report(char *buf, int size);
+
+/* Writes a timestamped stats_report() to path, replacing it atomically. Returns 0 on success, -1 on error. */
+int stats_export(const char *path);
+
+#endif /* STATS_H */
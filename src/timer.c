@@ -0,0 +1,324 @@
+/*  timer.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <tox/tox.h>
+
+#include "timer.h"
+#include "log.h"
+#include "mem.h"
+
+/*
+ * Hierarchical timer wheel. Level 0 has one slot per tick for the next 64 ticks, each level above
+ * covers 64 times the range of the one below. When level 0 wraps, the due slot of the level above
+ * is cascaded down. Insert and cancel are O(1) list operations on a slot; a bitmap per level
+ * tells which slots are in use so that idle ticks are skipped and the next deadline is cheap.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 5    /* 64^5 ticks of 10 ms: about 124 days */
+#define MAX_TICKS ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct Timer {
+    bool active;
+    uint32_t gen;
+    uint64_t expires;    /* tick */
+    uint64_t interval;   /* ticks, 0 for one-shot */
+    timer_cb cb;
+    void *arg;
+    int flags;
+    char desc[64];
+    int level;
+    int slot;
+    struct Timer *prev;
+    struct Timer *next;
+};
+
+static struct Timer timers[TIMER_MAX];
+static struct Timer *free_list;
+static struct Timer *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t bitmap[WHEEL_LEVELS];
+static uint64_t cur_tick;    /* next tick to be processed */
+static int num_timers;
+
+static int timer_id(const struct Timer *t)
+{
+    return (int) (((t->gen & 0x7fffff) << 8) | (t - timers));    /* 8 bits for TIMER_MAX */
+}
+
+static struct Timer *timer_from_id(int id)
+{
+    if (id < 0)
+        return NULL;
+
+    struct Timer *t = &timers[id & (TIMER_MAX - 1)];
+
+    if (!t->active || timer_id(t) != id)
+        return NULL;
+
+    return t;
+}
+
+static void link_timer(struct Timer *t)
+{
+    uint64_t expires = t->expires < cur_tick ? cur_tick : t->expires;
+    uint64_t delta = expires - cur_tick;
+    int level = 0;
+
+    if (delta > MAX_TICKS) {
+        /* out of range: park it at the far end, it is re-linked when it gets there */
+        expires = cur_tick + MAX_TICKS;
+        delta = MAX_TICKS;
+    }
+
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+        ++level;
+
+    int slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    t->level = level;
+    t->slot = slot;
+    t->prev = NULL;
+    t->next = wheel[level][slot];
+
+    if (t->next)
+        t->next->prev = t;
+
+    wheel[level][slot] = t;
+    bitmap[level] |= 1ULL << slot;
+}
+
+static void unlink_timer(struct Timer *t)
+{
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        wheel[t->level][t->slot] = t->next;
+
+    if (t->next)
+        t->next->prev = t->prev;
+
+    if (wheel[t->level][t->slot] == NULL)
+        bitmap[t->level] &= ~(1ULL << t->slot);
+
+    t->prev = t->next = NULL;
+}
+
+static void release_timer(struct Timer *t)
+{
+    if (t->flags & TIMER_FREE_ARG)
+        mem_free(t->arg);
+
+    t->active = false;
+    t->arg = NULL;
+    t->next = free_list;
+    free_list = t;
+    --num_timers;
+}
+
+void timer_init(uint64_t now_ms)
+{
+    int i;
+
+    memset(timers, 0, sizeof(timers));
+    memset(wheel, 0, sizeof(wheel));
+    memset(bitmap, 0, sizeof(bitmap));
+    free_list = NULL;
+
+    for (i = TIMER_MAX - 1; i >= 0; --i) {
+        timers[i].next = free_list;
+        free_list = &timers[i];
+    }
+
+    cur_tick = now_ms / TIMER_TICK_MS;
+    num_timers = 0;
+}
+
+int timer_add(uint64_t delay_ms, uint64_t interval_ms, timer_cb cb, void *arg, int flags, const char *desc)
+{
+    struct Timer *t = free_list;
+
+    if (t == NULL) {
+        log_msg(L_WARN, "timer_full desc=\"%s\"", desc);
+        return -1;
+    }
+
+    free_list = t->next;
+
+    t->active = true;
+    ++t->gen;
+    t->expires = cur_tick + (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    t->interval = interval_ms ? (interval_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS : 0;
+    t->cb = cb;
+    t->arg = arg;
+    t->flags = flags;
+    snprintf(t->desc, sizeof(t->desc), "%s", desc);
+
+    link_timer(t);
+    ++num_timers;
+    return timer_id(t);
+}
+
+int timer_cancel(int id, int flags)
+{
+    struct Timer *t = timer_from_id(id);
+
+    if (t == NULL || (t->flags & flags) != flags)
+        return -1;
+
+    unlink_timer(t);
+    release_timer(t);
+    return 0;
+}
+
+static void cascade(int level, int slot)
+{
+    struct Timer *t = wheel[level][slot];
+
+    wheel[level][slot] = NULL;
+    bitmap[level] &= ~(1ULL << slot);
+
+    while (t) {
+        struct Timer *next = t->next;
+        link_timer(t);
+        t = next;
+    }
+}
+
+static void fire(Tox *m, struct Timer *t)
+{
+    unlink_timer(t);
+
+    if (t->expires > cur_tick) {
+        /* was parked out of range */
+        link_timer(t);
+        return;
+    }
+
+    int id = timer_id(t);
+    t->cb(m, t->arg);
+
+    /* the callback may have cancelled it */
+    if (timer_from_id(id) != t)
+        return;
+
+    if (t->interval) {
+        t->expires += t->interval;
+
+        if (t->expires <= cur_tick)    /* don't fire a burst after a stall */
+            t->expires = cur_tick + t->interval;
+
+        link_timer(t);
+    } else {
+        release_timer(t);
+    }
+}
+
+void timer_run(Tox *m, uint64_t now_ms)
+{
+    uint64_t now = now_ms / TIMER_TICK_MS;
+
+    while (cur_tick <= now) {
+        int idx = cur_tick & WHEEL_MASK;
+
+        if (idx == 0) {
+            int level;
+
+            /* find how far up this tick wraps, then cascade from the top down */
+            for (level = 1; level < WHEEL_LEVELS - 1; ++level) {
+                if ((cur_tick >> (WHEEL_BITS * level)) & WHEEL_MASK)
+                    break;
+            }
+
+            for (; level >= 1; --level)
+                cascade(level, (cur_tick >> (WHEEL_BITS * level)) & WHEEL_MASK);
+        }
+
+        while (wheel[0][idx])
+            fire(m, wheel[0][idx]);
+
+        ++cur_tick;
+
+        /* skip ticks with nothing to do, stopping at the next wrap so cascading still happens */
+        uint64_t pending = idx == WHEEL_MASK ? 0 : bitmap[0] >> (idx + 1);
+
+        if (pending == 0) {
+            uint64_t wrap = (cur_tick + WHEEL_MASK) & ~(uint64_t) WHEEL_MASK;
+            cur_tick = wrap <= now ? wrap : now + 1;
+        }
+    }
+}
+
+uint64_t timer_next_deadline(void)
+{
+    if (num_timers == 0)
+        return TIMER_NEVER;
+
+    int idx = cur_tick & WHEEL_MASK;
+    uint64_t pending = bitmap[0] >> idx;
+    int level;
+
+    /* at a wrap, timers cascading down from above may be due right away */
+    for (level = 1; idx == 0 && level < WHEEL_LEVELS; ++level) {
+        if (bitmap[level])
+            return cur_tick * TIMER_TICK_MS;
+    }
+
+    if (pending)
+        return (cur_tick + __builtin_ctzll(pending)) * TIMER_TICK_MS;
+
+    /* nothing left in level 0 before the wrap; the next cascade is the earliest anything can be due */
+    return ((cur_tick + WHEEL_MASK) & ~(uint64_t) WHEEL_MASK) * TIMER_TICK_MS;
+}
+
+int timer_list(char *buf, int size, int flags, uint64_t now_ms)
+{
+    int len = 0;
+    int i;
+
+    buf[0] = '\0';
+
+    for (i = 0; i < TIMER_MAX && len < size; ++i) {
+        struct Timer *t = &timers[i];
+
+        if (!t->active || (t->flags & flags) != flags)
+            continue;
+
+        uint64_t now = now_ms / TIMER_TICK_MS;
+        uint64_t in = t->expires > now ? (t->expires - now) * TIMER_TICK_MS / 1000 : 0;
+
+        if (t->interval)
+            len += snprintf(buf + len, size - len, "%d: %s (in %llus, alle %llus)\n", timer_id(t), t->desc,
+                            (unsigned long long) in, (unsigned long long) (t->interval * TIMER_TICK_MS / 1000));
+        else
+            len += snprintf(buf + len, size - len, "%d: %s (in %llus)\n", timer_id(t), t->desc,
+                            (unsigned long long) in);
+    }
+
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,62 @@
+/*  timer.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <tox/tox.h>
+
+#define TIMER_TICK_MS 10
+#define TIMER_MAX 256
+#define TIMER_NEVER UINT64_MAX
+
+/* timer_add() flags */
+#define TIMER_FREE_ARG (1 << 0)    /* mem_free(arg) when the timer is cancelled or a one-shot timer has fired */
+#define TIMER_USER     (1 << 1)    /* defined by a master: listed by timer_list() and cancellable by them */
+
+/* Timers live in memory only; nothing here is written to the journal, so a restart drops them. */
+
+typedef void (*timer_cb)(Tox *m, void *arg);
+
+/* Starts the wheel at now (monotonic milliseconds). */
+void timer_init(uint64_t now_ms);
+
+/* Schedules cb(m, arg) to run in delay_ms and then every interval_ms (0 for a one-shot timer).
+   desc is shown by timer_list(). Returns the timer id, or -1 if all timers are in use. */
+int timer_add(uint64_t delay_ms, uint64_t interval_ms, timer_cb cb, void *arg, int flags, const char *desc);
+
+/* Cancels timer id if it has all of flags set. Returns 0 on success, -1 if there is no such timer. */
+int timer_cancel(int id, int flags);
+
+/* Runs every timer that is due at now_ms. */
+void timer_run(Tox *m, uint64_t now_ms);
+
+/* Returns the time (monotonic milliseconds) by which timer_run() must be called next, or TIMER_NEVER
+   if no timers are pending. It is exact for timers due in the next TIMER_TICK_MS * 64 ms and never late. */
+uint64_t timer_next_deadline(void);
+
+/* Puts one line per timer with all of flags set in buf. Returns its length. */
+int timer_list(char *buf, int size, int flags, uint64_t now_ms);
+
+#endif /* TIMER_H */
@@ -35,6 +35,7 @@
 
 #include <tox/tox.h>
 #include <tox/toxav.h>
+#include <tox/toxencryptsave.h>
 
 #include <dirent.h>
 
@@ -42,17 +43,43 @@
 #include "commands.h"
 #include "toxbot.h"
 #include "groupchats.h"
+#include "friends.h"
+#include "autoinvite.h"
+#include "trace.h"
+#include "watchdog.h"
+#include "gstats.h"
+#include "spam.h"
+#include "triggers.h"
+#include "history.h"
+#include "log.h"
+#include "loadgen.h"
+#include "replay.h"
+#include "bridge.h"
+#include "audio.h"
+#include "recorder.h"
+#include "friendstats.h"
+#include "timer.h"
+#include "encrypt.h"
+#include "mem.h"
+#include "state.h"
+#include "journal.h"
 
 #define VERSION "0.2.1"
 #define FRIEND_PURGE_INTERVAL 3600
+#define BENCH_SAVE_FILE "toxbot_bench_save"
 
 bool FLAG_EXIT = false;    /* set on SIGINT */
+bool FLAG_RELOAD = false;  /* set on SIGHUP */
 char *DATA_FILE = "toxbot_save";
-char *MASTERLIST_FILE = "masterkeys";
+char *MASTERLIST_FILE = "masterkeys";    /* only read to import masters into the journal */
+char *JOURNAL_FILE = "toxbot.journal";
 char *SETTINGS_FILE = "settings";
 char *FRIENDS_FILE = "friends";
+char *LOG_FILE = "toxbot.log";
+char *FRIENDSTATS_FILE = "friendstats";
 
 struct Tox_Bot Tox_Bot;
+pthread_mutex_t tox_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void init_toxbot_state(void)
 {
@@ -62,6 +89,8 @@ static void init_toxbot_state(void)
 
     /* 1 year default; anything lower should be explicitly set until we have a config file */
     Tox_Bot.inactive_limit = 31536000;
+
+    timer_init(get_time_usec() / 1000);
 }
 
 static void catch_SIGINT(int sig)
@@ -69,18 +98,23 @@ static void catch_SIGINT(int sig)
     FLAG_EXIT = true;
 }
 
+static void catch_SIGHUP(int sig)
+{
+    FLAG_RELOAD = true;
+}
+
 static void exit_groupchats(Tox *m, uint32_t numchats)
 {
     memset(Tox_Bot.g_chats, 0, Tox_Bot.chats_idx * sizeof(struct Group_Chat));
     realloc_groupchats(0);
 
-    int32_t *groupchat_list = malloc(numchats * sizeof(int32_t));
+    int32_t *groupchat_list = mem_malloc(MEM_IO, numchats * sizeof(int32_t));
 
     if (groupchat_list == NULL)
         return;
 
     if (tox_get_chatlist(m, groupchat_list, numchats) == 0) {
-        free(groupchat_list);
+        mem_free(groupchat_list);
         return;
     }
 
@@ -89,81 +123,108 @@ static void exit_groupchats(Tox *m, uint32_t numchats)
     for (i = 0; i < numchats; ++i)
         tox_del_groupchat(m, groupchat_list[i]);
 
-    free(groupchat_list);
+    mem_free(groupchat_list);
 }
 
 static void exit_toxbot(Tox *m)
 {
+    watchdog_stop();
+    audio_shutdown();
+    recorder_shutdown();
+    history_shutdown();
+
     uint32_t numchats = tox_count_chatlist(m);
 
     if (numchats)
         exit_groupchats(m, numchats);
 
     save_data(m, DATA_FILE);
+    record_close();
+    friendstats_close();
+    state_close();
+    encrypt_clear();
+    friends_free();
+    auto_invite_free();
+    gstats_free();
+    spam_free();
+    triggers_free();
     tox_kill(m);
+    log_msg(L_INFO, "shutdown");
+    log_shutdown();
+    trace_free();
     exit(EXIT_SUCCESS);
 }
 
-/* Returns true if friendnumber's Tox ID is in the masterkeys list, false otherwise.
+/* Returns true if friendnumber's Tox ID is one of the masters in the journal, false otherwise.
    Note that it only compares the public key portion of the IDs. */
 bool friend_is_master(Tox *m, int32_t friendnumber)
 {
-    if (!file_exists(MASTERLIST_FILE)) {
-        FILE *fp = fopen(MASTERLIST_FILE, "w");
+    uint8_t friend_key[TOX_CLIENT_ID_SIZE];
 
-        if (fp == NULL) {
-            fprintf(stderr, "Warning: failed to create masterkeys file\n");
-            return false;
-        }
-
-        fclose(fp);
-        fprintf(stderr, "Warning: creating new masterkeys file. Did you lose the old one?\n");
+    if (tox_get_client_id(m, friendnumber, friend_key) == -1)
         return false;
-    }
 
-    FILE *fp = fopen(MASTERLIST_FILE, "r");
+    uint64_t span = trace_start();
+    bool ret = state_is_master(friend_key);
+    trace_end("master_check", span);
+    return ret;
+}
 
-    if (fp == NULL) {
-        fprintf(stderr, "Warning: failed to read masterkeys file\n");
-        return false;
+/* START CALLBACKS */
+void cb_friend_request(Tox *m, const uint8_t *public_key, const uint8_t *data, uint16_t length,
+                       void *userdata)
+{
+    if (record_enabled()) {
+        uint8_t rec[TOX_CLIENT_ID_SIZE + TOX_MAX_MESSAGE_LENGTH];
+        uint16_t len = MIN(length, TOX_MAX_MESSAGE_LENGTH);
+        memcpy(rec, public_key, TOX_CLIENT_ID_SIZE);
+        memcpy(rec + TOX_CLIENT_ID_SIZE, data, len);
+        record_event(RECORD_FRIEND_REQUEST, 0, 0, rec, TOX_CLIENT_ID_SIZE + len);
     }
 
-    char friend_key[TOX_CLIENT_ID_SIZE];
-    tox_get_client_id(m, friendnumber, (uint8_t *) friend_key);
-    char id[256];
-
-    while (fgets(id, sizeof(id), fp)) {
-        int len = strlen(id);
+    watchdog_event("friend_request", -1);
 
-        if (--len < TOX_CLIENT_ID_SIZE)
-            continue;
+    /* new friends cost name cache and stats space; refuse them rather than grow past the limit */
+    if (mem_over_limit(MEM_CONTACTS)) {
+        mem_rejected(MEM_CONTACTS);
+        log_msg(L_WARN, "friend_request_rejected reason=mem_limit");
+        return;
+    }
 
-        char *key_bin = hex_string_to_bin(id);
+    int32_t friendnum = tox_add_friend_norequest(m, public_key);
 
-        if (memcmp(key_bin, friend_key, TOX_CLIENT_ID_SIZE) == 0) {
-            free(key_bin);
-            fclose(fp);
-            return true;
-        }
-
-        free(key_bin);
+    if (friendnum != -1) {
+        friend_name_set(friendnum, NULL, 0);
+        friendstats_add(m, friendnum);
+        reply_cache_invalidate(REPLY_CACHE_INFO);
     }
 
-    fclose(fp);
-    return false;
+    save_data(m, DATA_FILE);
 }
 
-/* START CALLBACKS */
-static void cb_friend_request(Tox *m, const uint8_t *public_key, const uint8_t *data, uint16_t length,
-                              void *userdata)
+void cb_name_change(Tox *m, int32_t friendnumber, const uint8_t *name, uint16_t length, void *userdata)
 {
-    tox_add_friend_norequest(m, public_key);
-    save_data(m, DATA_FILE);
+    record_event(RECORD_NAME_CHANGE, friendnumber, 0, name, length);
+    friend_name_set(friendnumber, (const char *) name, MIN(length, TOX_MAX_NAME_LENGTH));
+}
+
+void cb_connection_status(Tox *m, int32_t friendnumber, uint8_t status, void *userdata)
+{
+    record_event(RECORD_CONNECTION_STATUS, friendnumber, status, NULL, 0);
+    friend_set_online(friendnumber, status == 1);
+    reply_cache_invalidate(REPLY_CACHE_INFO);
+
+    if (status == 1)
+        auto_invite_online(m, friendnumber);
 }
 
-static void cb_friend_message(Tox *m, int32_t friendnumber, const uint8_t *string, uint16_t length,
-                              void *userdata)
+void cb_friend_message(Tox *m, int32_t friendnumber, const uint8_t *string, uint16_t length,
+                       void *userdata)
 {
+    record_event(RECORD_FRIEND_MESSAGE, friendnumber, 0, string, length);
+
+    trace_begin_message();
+    uint64_t span = trace_start();
     const char *outmsg;
     char message[TOX_MAX_MESSAGE_LENGTH];
     length = copy_tox_str(message, sizeof(message), (const char *) string, length);
@@ -171,44 +232,49 @@ static void cb_friend_message(Tox *m, int32_t friendnumber, const uint8_t *strin
 
     if (length && execute(m, friendnumber, message, length) == -1) {
         outmsg = "Ungültiger Befehl. Bitte gib hilfe ein, um dir die Befehle anzeigen zu lassen.";
-        tox_send_message(m, friendnumber, (uint8_t *) outmsg, strlen(outmsg));
+        bot_send_message(m, friendnumber, (uint8_t *) outmsg, strlen(outmsg));
     }
+
+    trace_end("friend_message", span);
+    trace_end_message();
 }
 
-static void cb_group_invite(Tox *m, int32_t friendnumber, uint8_t type, const uint8_t *group_pub_key, uint16_t length,
-                            void *userdata)
+void cb_group_invite(Tox *m, int32_t friendnumber, uint8_t type, const uint8_t *group_pub_key, uint16_t length,
+                     void *userdata)
 {
+    record_event(RECORD_GROUP_INVITE, friendnumber, type, group_pub_key, length);
+    watchdog_event("group_invite", friendnumber);
+
     if (!friend_is_master(m, friendnumber))
         return;
 
-    char name[TOX_MAX_NAME_LENGTH];
-    int len = tox_get_name(m, friendnumber, (uint8_t *) name);
-    name[len] = '\0';
-
+    const char *name = friend_name(friendnumber);
     int groupnum = -1;
 
     if (type == TOX_GROUPCHAT_TYPE_TEXT)
         groupnum = tox_join_groupchat(m, friendnumber, group_pub_key, length);
     else if (type == TOX_GROUPCHAT_TYPE_AV)
-        groupnum = toxav_join_av_groupchat(m, friendnumber, group_pub_key, length, NULL, NULL);
+        groupnum = toxav_join_av_groupchat(m, friendnumber, group_pub_key, length, recorder_audio_cb, NULL);
 
     if (groupnum == -1) {
-        fprintf(stderr, "Invite from %s failed (core failure)\n", name);
+        log_msg(L_WARN, "group_join_failed friend=\"%s\" reason=core", name);
         return;
     }
 
     if (group_add(groupnum, type, NULL) == -1) {
-        fprintf(stderr, "Invite from %s failed (group_add failed)\n", name);
+        log_msg(L_WARN, "group_join_failed friend=\"%s\" reason=group_add", name);
         tox_del_groupchat(m, groupnum);
         return;
     }
 
-    printf("Accepted groupchat invite from %s [%d]\n", name, groupnum);
+    log_msg(L_INFO, "group_join friend=\"%s\" group=%d", name, groupnum);
 }
 
-static void cb_group_titlechange(Tox *m, int groupnumber, int peernumber, const uint8_t *title, uint8_t length,
-                                 void *userdata)
+void cb_group_titlechange(Tox *m, int groupnumber, int peernumber, const uint8_t *title, uint8_t length,
+                          void *userdata)
 {
+    record_event(RECORD_GROUP_TITLE, groupnumber, peernumber, title, length);
+
     char message[TOX_MAX_MESSAGE_LENGTH];
     length = copy_tox_str(message, sizeof(message), (const char *) title, length);
 
@@ -221,40 +287,87 @@ static void cb_group_titlechange(Tox *m, int groupnumber, int peernumber, const
     Tox_Bot.g_chats[idx].title_len = length;
 }
 
+void cb_group_message(Tox *m, int groupnumber, int peernumber, const uint8_t *message, uint16_t length,
+                      void *userdata)
+{
+    gstats_message(m, groupnumber, peernumber);
+
+    if (spam_message(m, groupnumber, peernumber, (const char *) message, length))
+        return;
+
+    history_message(m, groupnumber, peernumber, (const char *) message, length);
+    triggers_group_message(m, groupnumber, peernumber, (const char *) message, length);
+    bridge_group_message(m, groupnumber, peernumber, (const char *) message, length);
+}
+
+void cb_group_namelist_change(Tox *m, int groupnumber, int peernumber, uint8_t change, void *userdata)
+{
+    if (change == TOX_CHAT_CHANGE_PEER_NAME)
+        return;
+
+    group_set_peers(groupnumber, tox_group_number_peers(m, groupnumber));
+    recorder_peers_changed(groupnumber);
+}
+
 /* END CALLBACKS */
 
 int save_data(Tox *m, const char *path)
 {
+    uint64_t span = trace_start();
+
+    watchdog_event("save", -1);
+
     if (path == NULL)
         goto on_error;
 
-    int len = tox_size(m);
-    char *buf = malloc(len);
+    uint64_t start = get_time_usec();
+    uint8_t *key = encrypt_key();
+    int len = key ? tox_encrypted_size(m) : tox_size(m);
+    char *buf = mem_malloc(MEM_IO, len);
 
     if (buf == NULL)
         exit(EXIT_FAILURE);
 
-    tox_save(m, (uint8_t *) buf);
+    if (key == NULL) {
+        tox_save(m, (uint8_t *) buf);
+    } else if (tox_encrypted_key_save(m, (uint8_t *) buf, key) != 0) {
+        mem_free(buf);
+        goto on_error;
+    }
 
-    FILE *fp = fopen(path, "wb");
+    /* write a copy and rename it over the old file, so a failed save never leaves a torn profile */
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp, "wb");
 
     if (fp == NULL) {
-        free(buf);
+        mem_free(buf);
         goto on_error;
     }
 
     if (fwrite(buf, len, 1, fp) != 1) {
-        free(buf);
+        mem_free(buf);
         fclose(fp);
+        remove(tmp);
         goto on_error;
     }
 
-    free(buf);
-    fclose(fp);
+    mem_free(buf);
+
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+        remove(tmp);
+        goto on_error;
+    }
+
+    log_msg(L_DEBUG, "save path=%s bytes=%d encrypted=%d usec=%llu", path, len, key != NULL,
+            (unsigned long long) (get_time_usec() - start));
+    trace_end("save", span);
     return 0;
 
 on_error:
-    fprintf(stderr, "Warning: save_data failed\n");
+    log_msg(L_ERROR, "save_failed path=%s", path ? path : "(null)");
+    trace_end("save", span);
     return -1;
 }
 
@@ -276,7 +389,7 @@ static int load_data(Tox *m, char *path)
         return -1;
     }
 
-    char *buf = malloc(len);
+    char *buf = mem_malloc(MEM_IO, len);
 
     if (buf == NULL) {
         fclose(fp);
@@ -284,18 +397,30 @@ static int load_data(Tox *m, char *path)
     }
 
     if (fread(buf, len, 1, fp) != 1) {
-        free(buf);
+        mem_free(buf);
         fclose(fp);
         return -1;
     }
 
-    if (tox_load(m, (uint8_t *) buf, len) == 1) {
+    if (len >= TOX_PASS_ENCRYPTION_EXTRA_LENGTH && tox_is_data_encrypted((uint8_t *) buf)) {
+        /* the passphrase is only asked for once; later loads reuse the cached key */
+        if (encrypt_key() == NULL && encrypt_prompt((uint8_t *) buf) == -1) {
+            fprintf(stderr, "Kein Passwort für die verschlüsselte Datei %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+
+        if (tox_encrypted_key_load(m, (uint8_t *) buf, len, encrypt_key()) != 0) {
+            fprintf(stderr, "Falsches Passwort für %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+    } else if (tox_load(m, (uint8_t *) buf, len) == 1) {
         fprintf(stderr, "Data file is encrypted\n");
         exit(EXIT_SUCCESS);
     }
 
-    free(buf);
+    mem_free(buf);
     fclose(fp);
+    reply_cache_invalidate(REPLY_CACHE_ID);
     return 0;
 }
 
@@ -313,8 +438,12 @@ static Tox *init_tox(void)
 
     tox_callback_friend_request(m, cb_friend_request, NULL);
     tox_callback_friend_message(m, cb_friend_message, NULL);
+    tox_callback_name_change(m, cb_name_change, NULL);
+    tox_callback_connection_status(m, cb_connection_status, NULL);
     tox_callback_group_invite(m, cb_group_invite, NULL);
     tox_callback_group_title(m, cb_group_titlechange, NULL);
+    tox_callback_group_namelist_change(m, cb_group_namelist_change, NULL);
+    tox_callback_group_message(m, cb_group_message, NULL);
 
     const char *statusmsg = "Send me the the command 'help' for more info";
     tox_set_status_message(m, (uint8_t *) statusmsg, strlen(statusmsg));
@@ -345,9 +474,9 @@ static void bootstrap_DHT(Tox *m)
         char *key = hex_string_to_bin(nodes[i].key);
 
         if (tox_bootstrap_from_address(m, nodes[i].ip, nodes[i].port, (uint8_t *) key) != 1)
-            fprintf(stderr, "Failed to bootstrap DHT via: %s %d\n", nodes[i].ip, nodes[i].port);
+            log_msg(L_WARN, "bootstrap_failed ip=%s port=%d", nodes[i].ip, nodes[i].port);
 
-        free(key);
+        mem_free(key);
     }
 }
 
@@ -385,13 +514,13 @@ static void purge_inactive_friends(Tox *m)
     if (numfriends == 0)
         return;
 
-    int32_t *friend_list = malloc(numfriends * sizeof(int32_t));
+    int32_t *friend_list = mem_malloc(MEM_IO, numfriends * sizeof(int32_t));
 
     if (friend_list == NULL)
         exit(EXIT_FAILURE);
 
     if (tox_get_friendlist(m, friend_list, numfriends) == 0) {
-        free(friend_list);
+        mem_free(friend_list);
         return;
     }
 
@@ -403,15 +532,80 @@ static void purge_inactive_friends(Tox *m)
 
         uint64_t last_online = tox_get_last_online(m, friendnum);
 
-        if (cur_time - last_online > Tox_Bot.inactive_limit)
+        if (cur_time - last_online > Tox_Bot.inactive_limit) {
             tox_del_friend(m, friendnum);
+            friend_remove(friendnum);
+            friendstats_remove(friendnum);
+            reply_cache_invalidate(REPLY_CACHE_INFO);
+        }
     }
 
-    free(friend_list);
+    mem_free(friend_list);
 }
 
 #define REC_TOX_DO_LOOPS_PER_SEC 25
 
+static void job_purge(Tox *m, void *arg)
+{
+    uint64_t span = trace_start();
+    watchdog_event("purge", -1);
+    purge_inactive_friends(m);
+    trace_end("purge", span);
+
+    save_data(m, DATA_FILE);
+    friendstats_sync();
+}
+
+static void job_collapse(Tox *m, void *arg)
+{
+    group_collapse_overflow(m);
+}
+
+static void job_mem(Tox *m, void *arg)
+{
+    mem_check();
+}
+
+/* Times n saves of the profile to BENCH_SAVE_FILE, unencrypted and encrypted with a cached key,
+   against a single key derivation. */
+static void bench_save(Tox *m, int n)
+{
+    const char *pass = "benchmark";
+    uint64_t total[2] = {0, 0}, max[2] = {0, 0};
+    int enc, i;
+
+    encrypt_clear();
+
+    for (enc = 0; enc < 2; ++enc) {
+        if (enc) {
+            uint64_t start = get_time_usec();
+
+            if (encrypt_set_passphrase(pass, strlen(pass), NULL) == -1) {
+                fprintf(stderr, "Schlüssel konnte nicht abgeleitet werden\n");
+                return;
+            }
+
+            printf("Schlüsselableitung (einmalig): %llu us\n", (unsigned long long) (get_time_usec() - start));
+        }
+
+        for (i = 0; i < n; ++i) {
+            uint64_t start = get_time_usec();
+
+            if (save_data(m, BENCH_SAVE_FILE) == -1)
+                return;
+
+            uint64_t t = get_time_usec() - start;
+            total[enc] += t;
+            max[enc] = MAX(max[enc], t);
+        }
+
+        printf("%s: %d Speicherungen, Mittel %llu us, Max %llu us\n", enc ? "Verschlüsselt" : "Unverschlüsselt", n,
+               (unsigned long long) (total[enc] / n), (unsigned long long) max[enc]);
+    }
+
+    remove(BENCH_SAVE_FILE);
+}
+
 /* Adjusts usleep value so that tox_do runs close to the recommended number of times per second */
 static useconds_t optimal_msleepval(uint64_t *looptimer, uint64_t *loopcount, uint64_t cur_time, useconds_t msleepval)
 {
@@ -443,8 +637,21 @@ bool checkID(int32_t id){
 int main(int argc, char *argv[])
 {
     signal(SIGINT, catch_SIGINT);
+    signal(SIGHUP, catch_SIGHUP);
     umask(S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 
+    /* before the banner so the CSV can be piped */
+    if (argc > 1 && strcmp(argv[1], "--dumpstats")==0) {
+        const char *path = argc > 2 ? argv[2] : FRIENDSTATS_FILE;
+
+        if (friendstats_dump(path, stdout) == -1) {
+            fprintf(stderr, "Statistik %s konnte nicht gelesen werden\n", path);
+            return 1;
+        }
+
+        return 0;
+    }
+
     Tox *m = init_tox();
 
     //Flags and helpmenue
@@ -463,7 +670,7 @@ int main(int argc, char *argv[])
     }
 
     if(argc > 1 && (strcmp(argv[1], "--help")==0 || strcmp(argv[1], "-h")==0)){
-        printf("\ntoxbot [-Option/--Option]\n\nMögliche Optionen:\n\t-h / --help \t\t\t Zeigt diese Nachricht\n\t-b / --background\t\t Startet den Bot im Hintergrund\n\t-a [ID]/ --addmaster [ID]\t Fügt die ID der Masterdatei hinzu\n\t-s / --save\t\t\t Macht ein Backup des bestehenden Bots in ToxBot/Backup/toxbot_save\n\t-r / --restore\t\t\t Stellt einen Bot aus ToxBot/Backup/toxbot_save wieder her\n\t-q / --quit\t\t\t Beendet alle ToxBot-Instanzen\n\nTox-Bot Fork von dj95. Originaler Tox-Bot https://github.com/JFreegman/ToxBot \n\n");
+        printf("\ntoxbot [-Option/--Option]\n\nMögliche Optionen:\n\t-h / --help \t\t\t Zeigt diese Nachricht\n\t-b / --background\t\t Startet den Bot im Hintergrund\n\t-a [ID]/ --addmaster [ID]\t Fügt die ID der Masterdatei hinzu\n\t-s / --save\t\t\t Macht ein Backup des bestehenden Bots in ToxBot/Backup/toxbot_save\n\t-r / --restore\t\t\t Stellt einen Bot aus ToxBot/Backup/toxbot_save wieder her\n\t-q / --quit\t\t\t Beendet alle ToxBot-Instanzen\n\t-L / --loadtest [f] [r] [s]\t Lasttest mit f Freunden, r Ereignissen/s für s Sekunden\n\t-t / --trace [Datei]\t\t Zeichnet alle Eingaben in Datei auf\n\t-R / --replay [Datei] [fast]\t Spielt eine Aufzeichnung offline ab\n\t--dumpstats [Datei]\t\t Gibt die Statistik pro Freund als CSV aus\n\t-e / --encrypt\t\t\t Verschlüsselt toxbot_save mit einem Passwort\n\t--decrypt\t\t\t Entschlüsselt toxbot_save\n\t--benchsave [n]\t\t\t Misst n Speicherungen mit und ohne Verschlüsselung\n\t--benchmatch [n]\t\t Misst die Trigger-Suche mit n Mustern\n\nTox-Bot Fork von dj95. Originaler Tox-Bot https://github.com/JFreegman/ToxBot \n\n");
         return 0;
     }
 
@@ -487,16 +694,24 @@ int main(int argc, char *argv[])
 
     if (argc > 1 && (strcmp(argv[1], "-a")==0 || strcmp(argv[1], "--addmaster")==0)){
         if(argv[2]!=NULL){
-            int len = strlen(argv[2]) + strlen("echo  >> masterkeys");
-            if (len != (76 + strlen("echo  >> masterkeys"))){
+            if (strlen(argv[2]) != TOX_FRIEND_ADDRESS_SIZE * 2) {
                 printf("Ungültiges ID-Format! Bitte die 76-stellige ID eingeben.\n");
                 return 1;
             }
-            char cmd[len];
-            strncpy(cmd, "echo ", len);
-            strncat(cmd, argv[2], len);
-            strncat(cmd, " >> masterkeys", strlen(" >> masterkeys"));
-            system(cmd);
+
+            /* a running bot picks the new master up from the journal; path.lock orders our append
+               against its compaction */
+            char *key = hex_string_to_bin(argv[2]);
+
+            if (state_load(JOURNAL_FILE, true) == -1 || state_add_master((uint8_t *) key) == -1) {
+                fprintf(stderr, "\nJournal %s konnte nicht geschrieben werden\n\n", JOURNAL_FILE);
+                mem_free(key);
+                state_close();
+                return 1;
+            }
+
+            mem_free(key);
+            state_close();
             printf("\nDie ID wurde erfolgreich hinzugefügt\n\n");
         } else {
             printf("\nID fehtl! Benutze -h um die Hilfe zu zeigen.\n\n");
@@ -509,31 +724,206 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    if (argc > 1 && (strcmp(argv[1], "-e")==0 || strcmp(argv[1], "--encrypt")==0)) {
+        if (load_data(m, DATA_FILE) == -1 || encrypt_prompt(NULL) == -1 || save_data(m, DATA_FILE) == -1) {
+            fprintf(stderr, "\nDatei %s konnte nicht verschlüsselt werden\n\n", DATA_FILE);
+            return 1;
+        }
+
+        encrypt_clear();
+        printf("\n%s ist jetzt verschlüsselt\n\n", DATA_FILE);
+        return 0;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--decrypt")==0) {
+        if (load_data(m, DATA_FILE) == -1)
+            return 1;
+
+        encrypt_clear();
+
+        if (save_data(m, DATA_FILE) == -1)
+            return 1;
+
+        printf("\n%s ist jetzt unverschlüsselt\n\n", DATA_FILE);
+        return 0;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--benchsave")==0) {
+        int n = argc > 2 ? atoi(argv[2]) : 100;
+
+        if (file_exists(DATA_FILE) && load_data(m, DATA_FILE) == -1)
+            return 1;
+
+        bench_save(m, n > 0 ? n : 100);
+        encrypt_clear();
+        return 0;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--benchmatch")==0) {
+        int n = argc > 2 ? atoi(argv[2]) : 10000;
+        triggers_bench(n > 0 ? n : 10000);
+        return 0;
+    }
+
+    if (argc > 1 && (strcmp(argv[1], "-L")==0 || strcmp(argv[1], "--loadtest")==0)) {
+        struct Loadgen_Options opts = { 1000, 500, 60, 0 };
+
+        if (argc > 2)
+            opts.num_friends = atoi(argv[2]);
+        if (argc > 3)
+            opts.rate = atoi(argv[3]);
+        if (argc > 4)
+            opts.duration = atoi(argv[4]);
+        if (argc > 5)
+            opts.seed = atoi(argv[5]);
+
+        /* never touch the real profile or masters */
+        DATA_FILE = LOADGEN_DATA_FILE;
+        MASTERLIST_FILE = LOADGEN_MASTERLIST_FILE;
+        JOURNAL_FILE = LOADGEN_JOURNAL_FILE;
+        LOG_FILE = "toxbot_loadtest.log";
+        FRIENDSTATS_FILE = LOADGEN_FRIENDSTATS_FILE;
+        remove(DATA_FILE);
+        remove(MASTERLIST_FILE);
+        remove(FRIENDSTATS_FILE);
+        journal_remove(JOURNAL_FILE);
+
+        if (log_init(LOG_FILE, L_INFO, false) == -1)
+            fprintf(stderr, "Log-Datei %s konnte nicht geöffnet werden\n", LOG_FILE);
+
+        init_toxbot_state();
+        state_load(JOURNAL_FILE, true);
+        friendstats_load(m, FRIENDSTATS_FILE);
+
+        if (loadgen_run(m, &opts) == -1)
+            fprintf(stderr, "Lasttest konnte nicht gestartet werden\n");
+
+        exit_toxbot(m);
+    }
+
+    if (argc > 1 && (strcmp(argv[1], "-R")==0 || strcmp(argv[1], "--replay")==0)) {
+        if (argc < 3) {
+            printf("\nAufzeichnung fehlt! Benutze -h um die Hilfe zu zeigen.\n\n");
+            return 1;
+        }
+
+        bool fast = argc > 3 && strcmp(argv[3], "fast") == 0;
+
+        /* replay against a copy of the profile so friend numbers match the recording */
+        if (file_exists(DATA_FILE) && load_data(m, DATA_FILE) == -1)
+            fprintf(stderr, "Daten konnten nicht geladen werden\n");
+
+        DATA_FILE = REPLAY_DATA_FILE;
+        LOG_FILE = "toxbot_replay.log";
+        FRIENDSTATS_FILE = REPLAY_FRIENDSTATS_FILE;
+        remove(FRIENDSTATS_FILE);
+
+        if (log_init(LOG_FILE, L_INFO, false) == -1)
+            fprintf(stderr, "Log-Datei %s konnte nicht geöffnet werden\n", LOG_FILE);
+
+        init_toxbot_state();
+
+        /* the real masters, but nothing the replay changes is written back */
+        state_load(JOURNAL_FILE, false);
+        friends_load(m);
+        friendstats_load(m, FRIENDSTATS_FILE);
+
+        if (replay_run(m, argv[2], fast) == -1)
+            fprintf(stderr, "Aufzeichnung %s konnte nicht gelesen werden\n", argv[2]);
+
+        exit_toxbot(m);
+    }
+
+    if (log_init(LOG_FILE, L_INFO, isatty(STDOUT_FILENO)) == -1)
+        fprintf(stderr, "Log-Datei %s konnte nicht geöffnet werden\n", LOG_FILE);
+
+    log_msg(L_INFO, "startup version=%s", VERSION);
+
+    if (argc > 2 && (strcmp(argv[1], "-t")==0 || strcmp(argv[1], "--trace")==0)) {
+        if (record_open(argv[2]) == -1)
+            log_msg(L_ERROR, "record_open_failed path=%s", argv[2]);
+        else
+            log_msg(L_INFO, "record_start path=%s", argv[2]);
+    }
+
     if (load_data(m, DATA_FILE) == -1)
-        fprintf(stderr, "Daten konnten nicht geladen werden\n");
+        log_msg(L_ERROR, "load_failed path=%s", DATA_FILE);
 
     init_toxbot_state();
+
+    if (state_load(JOURNAL_FILE, true) == -1)
+        log_msg(L_ERROR, "journal_load_failed path=%s", JOURNAL_FILE);
+
+    friends_load(m);
+
+    if (friendstats_load(m, FRIENDSTATS_FILE) == -1)
+        log_msg(L_ERROR, "friendstats_load_failed path=%s", FRIENDSTATS_FILE);
+
+    state_restore_groups(m);
+
     print_profile_info(m);
     bootstrap_DHT(m);
 
     uint64_t looptimer = (uint64_t) time(NULL);
-    uint64_t last_purge = 0;
     useconds_t msleepval = 40000;
     uint64_t loopcount = 0;
 
+    timer_add(0, FRIEND_PURGE_INTERVAL * 1000, job_purge, NULL, 0, "purge");
+    timer_add(0, GROUP_COLLAPSE_INTERVAL * 1000, job_collapse, NULL, 0, "collapse");
+    timer_add(MEM_CHECK_INTERVAL * 1000, MEM_CHECK_INTERVAL * 1000, job_mem, NULL, 0, "mem");
+
+    trace_thread_name("main");
+    watchdog_start();
+
     while (!FLAG_EXIT) {
+        watchdog_heartbeat();
+        watchdog_phase("lock");
+        pthread_mutex_lock(&tox_lock);
+
         uint64_t cur_time = (uint64_t) time(NULL);
+        uint64_t span = trace_start();
 
-        if (timed_out(last_purge, cur_time, FRIEND_PURGE_INTERVAL)) {
-            purge_inactive_friends(m);
-            save_data(m, DATA_FILE);
-            last_purge = cur_time;
+        watchdog_phase("timer_run");
+        timer_run(m, get_time_usec() / 1000);
+        trace_end("timer_run", span);
+
+        if (FLAG_RELOAD) {
+            reply_cache_invalidate(REPLY_CACHE_ALL);
+            log_msg(L_INFO, "settings_reload");
+            FLAG_RELOAD = false;
         }
 
+        span = trace_start();
+        watchdog_phase("tox_do");
         tox_do(m);
+        trace_end("tox_do", span);
+
+        watchdog_phase("bridge_do");
+        bridge_do(m);
+        watchdog_phase("triggers_do");
+        triggers_do();
+        watchdog_phase("history_do");
+        history_do();
+        watchdog_phase("record_flush");
+        record_flush();
+
+        pthread_mutex_unlock(&tox_lock);
 
         msleepval = optimal_msleepval(&looptimer, &loopcount, cur_time, msleepval);
-        usleep(msleepval);
+
+        /* wake up in time for the next timer */
+        useconds_t sleepval = msleepval;
+        uint64_t deadline = timer_next_deadline();
+        uint64_t now = get_time_usec();
+
+        if (deadline != TIMER_NEVER && deadline * 1000 < now + sleepval)
+            sleepval = deadline * 1000 > now ? deadline * 1000 - now : 0;
+
+        /* time a message waits between arriving and the next tox_do */
+        span = trace_start();
+        watchdog_phase("sleep");
+        usleep(sleepval);
+        trace_end("sleep", span);
     }
 
     exit_toxbot(m);
@@ -24,6 +24,7 @@
 #define TOXBOT_H
 
 #include <stdint.h>
+#include <pthread.h>
 #include <tox/tox.h>
 #include "groupchats.h"
 
@@ -37,8 +38,24 @@ struct Tox_Bot {
     int chats_idx;
 };
 
+/* Held by the main loop while it works with the Tox instance; threads that call into toxcore take it too. */
+extern pthread_mutex_t tox_lock;
+
 int load_Masters(const char *path);
 int save_data(Tox *m, const char *path);
 bool friend_is_master(Tox *m, int32_t friendnumber);
 
+/* Tox callbacks. They are registered in init_tox() and also driven directly by the load generator. */
+void cb_friend_request(Tox *m, const uint8_t *public_key, const uint8_t *data, uint16_t length, void *userdata);
+void cb_friend_message(Tox *m, int32_t friendnumber, const uint8_t *string, uint16_t length, void *userdata);
+void cb_connection_status(Tox *m, int32_t friendnumber, uint8_t status, void *userdata);
+void cb_name_change(Tox *m, int32_t friendnumber, const uint8_t *name, uint16_t length, void *userdata);
+void cb_group_invite(Tox *m, int32_t friendnumber, uint8_t type, const uint8_t *group_pub_key, uint16_t length,
+                     void *userdata);
+void cb_group_titlechange(Tox *m, int groupnumber, int peernumber, const uint8_t *title, uint8_t length,
+                          void *userdata);
+void cb_group_message(Tox *m, int groupnumber, int peernumber, const uint8_t *message, uint16_t length,
+                      void *userdata);
+void cb_group_namelist_change(Tox *m, int groupnumber, int peernumber, uint8_t change, void *userdata);
+
 #endif /* TOXBOT_H */
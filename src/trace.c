@@ -0,0 +1,219 @@
+/*  trace.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "misc.h"
+#include "mem.h"
+
+/* spans this close to the head may be overwritten by their thread while a dump reads them */
+#define TRACE_DUMP_MARGIN 256
+
+struct Trace_Span {
+    const char *name;
+    uint64_t start;    /* usec, monotonic */
+    uint32_t dur;      /* usec */
+    uint32_t trace_id;
+};
+
+/* One per thread that recorded a span. A buffer outlives its thread so short-lived threads
+   show up in the dump; a later thread with the same name takes it over. */
+struct Trace_Buffer {
+    struct Trace_Buffer *next;
+    int tid;
+    const char *name;
+    bool in_use;
+    uint32_t head;    /* spans ever written; the writer publishes it with release */
+    struct Trace_Span spans[TRACE_RING_SIZE];
+};
+
+static struct Trace_Buffer *buffers;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t buffer_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static int num_buffers;
+
+static bool enabled;
+static uint32_t next_trace_id;
+
+static __thread struct Trace_Buffer *local;
+static __thread const char *thread_name;
+static __thread uint32_t current_trace;
+
+static void release_buffer(void *p)
+{
+    __atomic_store_n(&((struct Trace_Buffer *) p)->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&buffer_key, release_buffer);
+}
+
+static struct Trace_Buffer *get_buffer(void)
+{
+    if (local)
+        return local;
+
+    pthread_once(&key_once, make_key);
+    pthread_mutex_lock(&buffers_lock);
+
+    struct Trace_Buffer *b;
+
+    for (b = buffers; b; b = b->next) {
+        if (!b->in_use && thread_name && b->name && strcmp(b->name, thread_name) == 0)
+            break;
+    }
+
+    if (b == NULL) {
+        b = mem_calloc(MEM_IO, 1, sizeof(struct Trace_Buffer));
+
+        if (b == NULL)
+            exit(EXIT_FAILURE);
+
+        b->tid = ++num_buffers;
+        b->next = buffers;
+        buffers = b;
+    }
+
+    b->name = thread_name;
+    b->in_use = true;
+    pthread_mutex_unlock(&buffers_lock);
+
+    pthread_setspecific(buffer_key, b);
+    local = b;
+    return b;
+}
+
+void trace_enable(bool on)
+{
+    __atomic_store_n(&enabled, on, __ATOMIC_RELAXED);
+}
+
+bool trace_enabled(void)
+{
+    return __atomic_load_n(&enabled, __ATOMIC_RELAXED);
+}
+
+void trace_thread_name(const char *name)
+{
+    thread_name = name;
+
+    if (local)
+        local->name = name;
+}
+
+uint32_t trace_begin_message(void)
+{
+    current_trace = __atomic_add_fetch(&next_trace_id, 1, __ATOMIC_RELAXED);
+    return current_trace;
+}
+
+void trace_end_message(void)
+{
+    current_trace = 0;
+}
+
+uint64_t trace_start(void)
+{
+    return trace_enabled() ? get_time_usec() : 0;
+}
+
+void trace_end(const char *name, uint64_t start)
+{
+    if (start == 0)
+        return;
+
+    struct Trace_Buffer *b = get_buffer();
+    struct Trace_Span *s = &b->spans[b->head & (TRACE_RING_SIZE - 1)];
+
+    s->name = name;
+    s->start = start;
+    s->dur = MIN(get_time_usec() - start, UINT32_MAX);
+    s->trace_id = current_trace;
+    __atomic_store_n(&b->head, b->head + 1, __ATOMIC_RELEASE);
+}
+
+int trace_dump(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL)
+        return -1;
+
+    int count = 0;
+    bool first = true;
+
+    fprintf(fp, "{\"traceEvents\":[\n");
+    pthread_mutex_lock(&buffers_lock);
+
+    struct Trace_Buffer *b;
+
+    for (b = buffers; b; b = b->next) {
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", b->tid, b->name ? b->name : "thread");
+        first = false;
+
+        uint32_t head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+        uint32_t n = MIN(head, TRACE_RING_SIZE - TRACE_DUMP_MARGIN);
+        uint32_t i;
+
+        for (i = head - n; i != head; ++i) {
+            const struct Trace_Span *s = &b->spans[i & (TRACE_RING_SIZE - 1)];
+
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"toxbot\",\"ph\":\"X\",\"ts\":%"PRIu64",\"dur\":%"PRIu32","
+                    "\"pid\":1,\"tid\":%d,\"args\":{\"trace\":%"PRIu32"}}",
+                    s->name, s->start, s->dur, b->tid, s->trace_id);
+            ++count;
+        }
+    }
+
+    pthread_mutex_unlock(&buffers_lock);
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    if (fclose(fp) != 0)
+        return -1;
+
+    return count;
+}
+
+void trace_free(void)
+{
+    pthread_mutex_lock(&buffers_lock);
+
+    while (buffers) {
+        struct Trace_Buffer *next = buffers->next;
+        mem_free(buffers);
+        buffers = next;
+    }
+
+    num_buffers = 0;
+    pthread_mutex_unlock(&buffers_lock);
+    local = NULL;
+}
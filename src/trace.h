@@ -0,0 +1,65 @@
+/*  trace.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TRACE_RING_SIZE 8192               /* spans kept per thread; the oldest are overwritten */
+#define TRACE_FILE "toxbot.trace.json"
+
+/* Spans are recorded into a buffer owned by the calling thread, so recording takes no lock.
+   Incoming messages get a trace id that every span until trace_end_message() carries, which
+   ties the parse, handler, file I/O and send spans of one request together.
+
+   uint64_t t = trace_start();
+   ...
+   trace_end("save", t);
+*/
+
+/* Turns recording on or off. Spans already recorded are kept. */
+void trace_enable(bool on);
+bool trace_enabled(void);
+
+/* Names the calling thread in dumps. name must stay valid. */
+void trace_thread_name(const char *name);
+
+/* Starts a trace for an incoming message on the calling thread and returns its id. */
+uint32_t trace_begin_message(void);
+void trace_end_message(void);
+
+/* Returns the start time to pass to trace_end(), or 0 if tracing is off. */
+uint64_t trace_start(void);
+
+/* Records a span from start to now. name must stay valid (a string literal or a command name). */
+void trace_end(const char *name, uint64_t start);
+
+/* Writes the spans of every thread to path as Chrome trace JSON (chrome://tracing, Perfetto).
+   Returns the number of spans written, or -1 on error. */
+int trace_dump(const char *path);
+
+/* Frees the buffers of all threads. Call once at exit. */
+void trace_free(void);
+
+#endif /* TRACE_H */
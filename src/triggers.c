@@ -0,0 +1,649 @@
+/*  triggers.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <tox/tox.h>
+
+#include "triggers.h"
+#include "state.h"
+#include "misc.h"
+#include "log.h"
+#include "mem.h"
+#include "trace.h"
+
+#define ROOT 0
+#define NO_STATE UINT32_MAX
+
+#define DENSE_BUDGET (512 * 1024)    /* bytes of full transition rows */
+
+#define BENCH_MESSAGES 20000
+#define BENCH_MESSAGE_LENGTH 200
+#define BENCH_NAIVE_MESSAGES 200
+
+/* A copy of a trigger, so the journal can change while an older automaton is still in use */
+struct Entry {
+    const char *pattern;    /* into the pool */
+    const char *reply;
+    uint16_t reply_len;
+    int32_t groupnum;
+    uint32_t cooldown;
+    uint32_t key;           /* hash of the pattern, for the cooldowns */
+};
+
+/* Bytes are mapped to classes first: every byte that occurs in a pattern gets its own class,
+   uppercase ASCII shares the class of lowercase, and class 0 stands for all other bytes.
+   States are numbered in breadth-first order. The first num_dense of them, which is where matching
+   spends most of its time, have a full row of transitions with the fail links already followed.
+   The edges of the others are contiguous and sorted by class, and misses follow the fail links. */
+struct Automaton {
+    uint32_t num_states;
+    uint32_t num_entries;
+    uint8_t cls[256];
+    uint32_t num_classes;
+    uint32_t num_dense;
+    uint32_t *delta;         /* num_dense rows of num_classes */
+    uint32_t *first_edge;    /* num_states + 1 entries */
+    uint8_t *edge_class;
+    uint32_t *edge_target;
+    uint32_t *fail;
+    uint32_t *dict;          /* nearest state on the fail chain that ends a pattern, ROOT if none */
+    int32_t *entry;          /* entry of the pattern ending at the state, -1 if none */
+    struct Entry *entries;
+    char *pool;
+    size_t pool_size;
+    uint64_t build_usec;
+};
+
+/* Trie used while building, children in sibling lists sorted by byte */
+struct Node {
+    uint32_t first;
+    uint32_t next;
+    int32_t entry;
+    uint8_t byte;
+};
+
+struct Trie {
+    struct Node *nodes;
+    uint32_t num_nodes;
+    uint32_t size;
+};
+
+static struct Automaton *current;    /* main thread only */
+static struct Automaton *ready;      /* handed over by the build thread */
+static bool building;
+static bool build_started;
+static pthread_t build_tid;
+static uint32_t build_gen;
+
+static struct {
+    uint32_t key;
+    uint64_t until;    /* seconds */
+} cooldowns[TRIGGER_COOLDOWN_SLOTS];
+
+static uint8_t lower(uint8_t c)
+{
+    return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+static uint32_t pattern_hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+
+    for (; *s; ++s) {
+        h ^= (uint8_t) *s;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static void *alloc(size_t size)
+{
+    void *p = mem_malloc(MEM_GROUPS, size);
+
+    if (p == NULL)
+        exit(EXIT_FAILURE);
+
+    return p;
+}
+
+static uint32_t node_new(struct Trie *t, uint8_t byte)
+{
+    if (t->num_nodes == t->size) {
+        uint32_t n = t->size ? t->size * 2 : 256;
+        struct Node *p = mem_realloc(MEM_GROUPS, t->nodes, n * sizeof(struct Node));
+
+        if (p == NULL)
+            exit(EXIT_FAILURE);
+
+        t->nodes = p;
+        t->size = n;
+    }
+
+    struct Node *node = &t->nodes[t->num_nodes];
+    node->first = node->next = NO_STATE;
+    node->entry = -1;
+    node->byte = byte;
+    return t->num_nodes++;
+}
+
+static uint32_t node_child(struct Trie *t, uint32_t n, uint8_t byte)
+{
+    uint32_t prev = NO_STATE, cur = t->nodes[n].first;
+
+    while (cur != NO_STATE && t->nodes[cur].byte < byte) {
+        prev = cur;
+        cur = t->nodes[cur].next;
+    }
+
+    if (cur != NO_STATE && t->nodes[cur].byte == byte)
+        return cur;
+
+    /* node_new() may move the nodes */
+    uint32_t k = node_new(t, byte);
+    t->nodes[k].next = cur;
+
+    if (prev == NO_STATE)
+        t->nodes[n].first = k;
+    else
+        t->nodes[prev].next = k;
+
+    return k;
+}
+
+/* Deep states rarely have more than a few edges, so a linear scan beats a binary search */
+static uint32_t edge_find(const struct Automaton *a, uint32_t s, uint8_t k)
+{
+    uint32_t e, end = a->first_edge[s + 1];
+
+    for (e = a->first_edge[s]; e < end && a->edge_class[e] <= k; ++e) {
+        if (a->edge_class[e] == k)
+            return a->edge_target[e];
+    }
+
+    return NO_STATE;
+}
+
+static uint32_t step(const struct Automaton *a, uint32_t s, uint8_t k)
+{
+    /* no pattern has the byte, so every match in progress ends */
+    if (k == 0)
+        return ROOT;
+
+    while (s >= a->num_dense) {
+        uint32_t t = edge_find(a, s, k);
+
+        if (t != NO_STATE)
+            return t;
+
+        s = a->fail[s];
+    }
+
+    return a->delta[s * a->num_classes + k];
+}
+
+/* Builds the states of a from its entries. Runs in the build thread. */
+static void automaton_build(struct Automaton *a)
+{
+    uint64_t start = get_time_usec();
+    struct Trie t = { NULL, 0, 0 };
+    uint32_t i, s;
+
+    node_new(&t, 0);
+
+    for (i = 0; i < a->num_entries; ++i) {
+        const uint8_t *p = (const uint8_t *) a->entries[i].pattern;
+        uint32_t n = ROOT;
+
+        for (; *p; ++p)
+            n = node_child(&t, n, lower(*p));
+
+        if (t.nodes[n].entry == -1)
+            t.nodes[n].entry = i;
+    }
+
+    /* classes are numbered in byte order, so edges sorted by byte are sorted by class too */
+    bool used[256] = { false };
+
+    for (i = 1; i < t.num_nodes; ++i)
+        used[t.nodes[i].byte] = true;
+
+    a->num_classes = 1;
+
+    for (i = 0; i < 256; ++i)
+        a->cls[i] = used[i] ? a->num_classes++ : 0;
+
+    for (i = 'A'; i <= 'Z'; ++i)
+        a->cls[i] = a->cls[i + 'a' - 'A'];
+
+    uint32_t num = t.num_nodes;
+    uint32_t *order = alloc(num * sizeof(uint32_t));
+    a->num_states = num;
+    a->num_dense = MAX(MIN(num, DENSE_BUDGET / (a->num_classes * sizeof(uint32_t))), 1);
+    a->delta = alloc(a->num_dense * a->num_classes * sizeof(uint32_t));
+    a->first_edge = alloc((num + 1) * sizeof(uint32_t));
+    a->edge_class = alloc(num * sizeof(uint8_t));
+    a->edge_target = alloc(num * sizeof(uint32_t));
+    a->fail = alloc(num * sizeof(uint32_t));
+    a->dict = alloc(num * sizeof(uint32_t));
+    a->entry = alloc(num * sizeof(int32_t));
+
+    /* number the states breadth first; a state's children get consecutive edges */
+    uint32_t tail = 1, edges = 0;
+    order[0] = ROOT;
+
+    for (s = 0; s < num; ++s) {
+        const struct Node *node = &t.nodes[order[s]];
+        uint32_t c;
+
+        a->first_edge[s] = edges;
+        a->entry[s] = node->entry;
+
+        for (c = node->first; c != NO_STATE; c = t.nodes[c].next) {
+            a->edge_class[edges] = a->cls[t.nodes[c].byte];
+            a->edge_target[edges++] = tail;
+            order[tail++] = c;
+        }
+    }
+
+    a->first_edge[num] = edges;
+    mem_free(order);
+    mem_free(t.nodes);
+
+    /* Fail links and rows in breadth-first order. A state's fail target is shallower, so its row
+       and the rows along its fail chain are always done before they are needed. */
+    a->fail[ROOT] = a->dict[ROOT] = ROOT;
+
+    for (s = 0; s < num; ++s) {
+        uint32_t e, k;
+
+        if (s < a->num_dense) {
+            uint32_t *row = &a->delta[s * a->num_classes];
+            row[0] = ROOT;
+
+            for (k = 1; k < a->num_classes; ++k) {
+                uint32_t next = edge_find(a, s, k);
+                row[k] = next != NO_STATE ? next : s == ROOT ? ROOT : a->delta[a->fail[s] * a->num_classes + k];
+            }
+        }
+
+        for (e = a->first_edge[s]; e < a->first_edge[s + 1]; ++e) {
+            uint32_t target = a->edge_target[e];
+            uint32_t f = s == ROOT ? ROOT : step(a, a->fail[s], a->edge_class[e]);
+
+            a->fail[target] = f;
+            a->dict[target] = a->entry[f] >= 0 ? f : a->dict[f];
+        }
+    }
+
+    a->build_usec = get_time_usec() - start;
+}
+
+/* Calls cb for every pattern that ends in text, in order, until it returns true */
+static void automaton_match(const struct Automaton *a, const char *text, uint32_t length,
+                            bool (*cb)(const struct Entry *e, void *arg), void *arg)
+{
+    uint32_t s = ROOT, i;
+
+    for (i = 0; i < length; ++i) {
+        s = step(a, s, a->cls[(uint8_t) text[i]]);
+
+        uint32_t d = a->entry[s] >= 0 ? s : a->dict[s];
+
+        for (; d != ROOT; d = a->dict[d]) {
+            if (cb(&a->entries[a->entry[d]], arg))
+                return;
+        }
+    }
+}
+
+static size_t automaton_size(const struct Automaton *a)
+{
+    return sizeof(struct Automaton) + a->num_states * (4 * sizeof(uint32_t) + sizeof(uint8_t) + sizeof(int32_t))
+           + a->num_dense * a->num_classes * sizeof(uint32_t)
+           + a->num_entries * sizeof(struct Entry) + a->pool_size;
+}
+
+static struct Automaton *automaton_alloc(uint32_t num_entries, size_t pool_size)
+{
+    struct Automaton *a = mem_calloc(MEM_GROUPS, 1, sizeof(struct Automaton));
+
+    if (a == NULL)
+        exit(EXIT_FAILURE);
+
+    a->num_entries = num_entries;
+    a->entries = alloc(MAX(num_entries, 1) * sizeof(struct Entry));
+    a->pool = alloc(MAX(pool_size, 1));
+    a->pool_size = pool_size;
+    return a;
+}
+
+static void automaton_free(struct Automaton *a)
+{
+    if (a == NULL)
+        return;
+
+    mem_free(a->delta);
+    mem_free(a->first_edge);
+    mem_free(a->edge_class);
+    mem_free(a->edge_target);
+    mem_free(a->fail);
+    mem_free(a->dict);
+    mem_free(a->entry);
+    mem_free(a->entries);
+    mem_free(a->pool);
+    mem_free(a);
+}
+
+/* Copies the triggers of the journal. Runs in the main thread, the states are built later. */
+static struct Automaton *automaton_from_state(void)
+{
+    int num = state_num_triggers();
+    size_t pool_size = 0;
+    int i;
+
+    for (i = 0; i < num; ++i)
+        pool_size += strlen(state_trigger(i)->pattern) + strlen(state_trigger(i)->reply) + 2;
+
+    struct Automaton *a = automaton_alloc(num, pool_size);
+    char *pool = a->pool;
+
+    for (i = 0; i < num; ++i) {
+        const struct Trigger *t = state_trigger(i);
+        struct Entry *e = &a->entries[i];
+        size_t plen = strlen(t->pattern) + 1, rlen = strlen(t->reply);
+
+        memcpy(pool, t->pattern, plen);
+        e->pattern = pool;
+        pool += plen;
+        memcpy(pool, t->reply, rlen + 1);
+        e->reply = pool;
+        e->reply_len = rlen;
+        pool += rlen + 1;
+        e->groupnum = t->groupnum;
+        e->cooldown = t->cooldown;
+        e->key = pattern_hash(t->pattern);
+    }
+
+    return a;
+}
+
+static void *build_thread(void *arg)
+{
+    struct Automaton *a = arg;
+    uint64_t span = trace_start();
+
+    automaton_build(a);
+    trace_end("trigger_build", span);
+
+    automaton_free(__atomic_exchange_n(&ready, a, __ATOMIC_ACQ_REL));
+    __atomic_store_n(&building, false, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void *build_thread_main(void *arg)
+{
+    trace_thread_name("triggers");
+    return build_thread(arg);
+}
+
+void triggers_do(void)
+{
+    struct Automaton *a = __atomic_exchange_n(&ready, NULL, __ATOMIC_ACQ_REL);
+
+    if (a) {
+        automaton_free(current);
+        current = a;
+        log_msg(L_INFO, "trigger_swap patterns=%"PRIu32" states=%"PRIu32" usec=%"PRIu64, a->num_entries,
+                a->num_states, a->build_usec);
+    }
+
+    uint32_t gen = state_triggers_gen();
+
+    if (gen == build_gen || __atomic_load_n(&building, __ATOMIC_ACQUIRE))
+        return;
+
+    if (build_started) {
+        pthread_join(build_tid, NULL);
+        build_started = false;
+    }
+
+    build_gen = gen;
+    a = automaton_from_state();
+    __atomic_store_n(&building, true, __ATOMIC_RELEASE);
+
+    if (pthread_create(&build_tid, NULL, build_thread_main, a) != 0) {
+        build_thread(a);
+        return;
+    }
+
+    build_started = true;
+}
+
+struct Group_Match {
+    int groupnum;
+    uint64_t now;
+    const struct Entry *hit;
+};
+
+static uint32_t cooldown_key(const struct Entry *e, int groupnum)
+{
+    return e->key ^ (groupnum * 0x9e3779b1u);
+}
+
+static bool group_match(const struct Entry *e, void *arg)
+{
+    struct Group_Match *gm = arg;
+
+    if (e->groupnum != TRIGGER_ALL_GROUPS && e->groupnum != gm->groupnum)
+        return false;
+
+    uint32_t key = cooldown_key(e, gm->groupnum);
+    uint32_t slot = key % TRIGGER_COOLDOWN_SLOTS;
+
+    if (cooldowns[slot].key == key && gm->now < cooldowns[slot].until)
+        return false;
+
+    gm->hit = e;
+    return true;
+}
+
+void triggers_group_message(Tox *m, int groupnum, int peernum, const char *msg, uint16_t length)
+{
+    if (current == NULL || current->num_entries == 0 || tox_group_peernumber_is_ours(m, groupnum, peernum))
+        return;
+
+    uint64_t span = trace_start();
+    struct Group_Match gm = { groupnum, get_time_usec() / 1000000, NULL };
+
+    automaton_match(current, msg, length, group_match, &gm);
+    trace_end("trigger_match", span);
+
+    if (gm.hit == NULL)
+        return;
+
+    uint32_t key = cooldown_key(gm.hit, groupnum);
+    uint32_t slot = key % TRIGGER_COOLDOWN_SLOTS;
+    cooldowns[slot].key = key;
+    cooldowns[slot].until = gm.now + gm.hit->cooldown;
+
+    if (tox_group_message_send(m, groupnum, (const uint8_t *) gm.hit->reply, gm.hit->reply_len) == -1)
+        log_msg(L_WARN, "trigger_send_failed group=%d pattern=\"%s\"", groupnum, gm.hit->pattern);
+    else
+        log_msg(L_INFO, "trigger group=%d pattern=\"%s\"", groupnum, gm.hit->pattern);
+}
+
+int triggers_info(char *buf, int size)
+{
+    int len;
+
+    if (current == NULL)
+        len = snprintf(buf, size, "Automat: noch keiner");
+    else
+        len = snprintf(buf, size, "Automat: %"PRIu32" Muster, %"PRIu32" Zustände, %zu kB, gebaut in %"PRIu64" ms",
+                       current->num_entries, current->num_states, automaton_size(current) / 1024,
+                       current->build_usec / 1000);
+
+    if (len < size && __atomic_load_n(&building, __ATOMIC_ACQUIRE))
+        len += snprintf(buf + len, size - len, " (wird neu gebaut)");
+
+    return MIN(len, size - 1);
+}
+
+static uint32_t rng_state;
+
+/* xorshift32, so the benchmark is the same every run */
+static uint32_t rng_next(void)
+{
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rng_state = x;
+    return x;
+}
+
+static int random_word(char *buf, int min, int max)
+{
+    int len = min + rng_next() % (max - min + 1);
+    int i;
+
+    for (i = 0; i < len; ++i)
+        buf[i] = 'a' + rng_next() % 26;
+
+    return len;
+}
+
+static bool count_match(const struct Entry *e, void *arg)
+{
+    ++*(uint64_t *) arg;
+    return false;
+}
+
+void triggers_bench(uint32_t num_patterns)
+{
+    rng_state = 0x9e3779b9;
+
+    /* patterns of 6 to 12 letters, so random text rarely contains one by chance */
+    struct Automaton *a = automaton_alloc(num_patterns, num_patterns * 13);
+    char *pool = a->pool;
+    uint32_t i, j;
+
+    for (i = 0; i < num_patterns; ++i) {
+        int len = random_word(pool, 6, 12);
+        pool[len] = '\0';
+        a->entries[i].pattern = pool;
+        pool += len + 1;
+    }
+
+    automaton_build(a);
+    printf("Muster: %"PRIu32", Aufbau: %.1f ms, %"PRIu32" Zustände, %zu kB\n", num_patterns,
+           a->build_usec / 1000.0, a->num_states, automaton_size(a) / 1024);
+
+    /* words of 2 to 9 letters; every tenth message contains one of the patterns */
+    char *text = alloc((size_t) BENCH_MESSAGES * BENCH_MESSAGE_LENGTH);
+    uint16_t *lengths = alloc(BENCH_MESSAGES * sizeof(uint16_t));
+    size_t total = 0;
+
+    for (i = 0; i < BENCH_MESSAGES; ++i) {
+        char *msg = text + (size_t) i * BENCH_MESSAGE_LENGTH;
+        int len = 0;
+        bool planted = i % 10 != 0;
+
+        while (len < BENCH_MESSAGE_LENGTH - 14) {
+            if (!planted && len > BENCH_MESSAGE_LENGTH / 2) {
+                const char *p = a->entries[rng_next() % num_patterns].pattern;
+                int plen = strlen(p);
+                memcpy(msg + len, p, plen);
+                len += plen;
+                planted = true;
+            } else {
+                len += random_word(msg + len, 2, 9);
+            }
+
+            msg[len++] = ' ';
+        }
+
+        lengths[i] = len;
+        total += len;
+    }
+
+    uint64_t matches = 0;
+    uint64_t start = get_time_usec();
+
+    for (i = 0; i < BENCH_MESSAGES; ++i)
+        automaton_match(a, text + (size_t) i * BENCH_MESSAGE_LENGTH, lengths[i], count_match, &matches);
+
+    uint64_t elapsed = MAX(get_time_usec() - start, 1);
+    printf("Aho-Corasick: %d Nachrichten (%.1f MB) in %.1f ms, %.1f MB/s, %.2f us/Nachricht, %"PRIu64" Treffer\n",
+           BENCH_MESSAGES, total / 1e6, elapsed / 1000.0, total / (double) elapsed,
+           elapsed / (double) BENCH_MESSAGES, matches);
+
+    /* the same search one pattern at a time, on fewer messages */
+    char msg[BENCH_MESSAGE_LENGTH + 1];
+    uint64_t naive_matches = 0;
+    start = get_time_usec();
+
+    for (i = 0; i < BENCH_NAIVE_MESSAGES; ++i) {
+        memcpy(msg, text + (size_t) i * BENCH_MESSAGE_LENGTH, lengths[i]);
+        msg[lengths[i]] = '\0';
+
+        for (j = 0; j < num_patterns; ++j) {
+            const char *p = msg;
+
+            while ((p = strstr(p, a->entries[j].pattern)) != NULL) {
+                ++naive_matches;
+                ++p;
+            }
+        }
+    }
+
+    uint64_t naive = MAX(get_time_usec() - start, 1);
+    double per_msg = naive / (double) BENCH_NAIVE_MESSAGES;
+    printf("Einzelsuche: %d Nachrichten in %.1f ms, %.2f us/Nachricht (Aho-Corasick %.1fx schneller), %"PRIu64" Treffer\n",
+           BENCH_NAIVE_MESSAGES, naive / 1000.0, per_msg, per_msg / (elapsed / (double) BENCH_MESSAGES),
+           naive_matches);
+
+    mem_free(text);
+    mem_free(lengths);
+    automaton_free(a);
+}
+
+void triggers_free(void)
+{
+    if (build_started) {
+        pthread_join(build_tid, NULL);
+        build_started = false;
+    }
+
+    automaton_free(current);
+    automaton_free(__atomic_exchange_n(&ready, NULL, __ATOMIC_ACQ_REL));
+    current = NULL;
+    build_gen = 0;
+}
@@ -0,0 +1,52 @@
+/*  triggers.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TRIGGERS_H
+#define TRIGGERS_H
+
+#include <stdint.h>
+#include <tox/tox.h>
+
+/* The triggers of the journal are compiled into an Aho-Corasick automaton, so a group message is
+   matched against every pattern in one pass over its bytes. Matching ignores ASCII case.
+   When the triggers change the automaton is rebuilt in a background thread and swapped in by
+   triggers_do(); until then the previous one keeps answering. */
+#define TRIGGER_COOLDOWN_SLOTS 1024    /* cooldowns remembered; triggers hashing to the same slot share one */
+
+/* Swaps in a finished automaton, and starts a rebuild if the triggers changed since the last one.
+   Call once per main loop iteration. */
+void triggers_do(void);
+
+/* Called from the group message callback. Sends the reply of the first trigger that matches msg,
+   applies to groupnum and isn't cooling down there. */
+void triggers_group_message(Tox *m, int groupnum, int peernum, const char *msg, uint16_t length);
+
+/* Writes a one line description of the automaton in use into buf. Returns the length written. */
+int triggers_info(char *buf, int size);
+
+/* Builds an automaton of num_patterns random patterns and prints its build time and matching
+   throughput, compared with searching for every pattern on its own. */
+void triggers_bench(uint32_t num_patterns);
+
+void triggers_free(void);
+
+#endif /* TRIGGERS_H */
@@ -0,0 +1,212 @@
+/*  watchdog.c
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "watchdog.h"
+#include "misc.h"
+#include "log.h"
+
+struct Watchdog_Event {
+    uint64_t time;    /* usec, monotonic */
+    const char *what;
+    int32_t num;
+};
+
+/* written by the main thread only; the watchdog reads up to the published head */
+static struct Watchdog_Event events[WATCHDOG_EVENTS];
+static uint32_t events_head;
+
+static uint64_t heartbeat;    /* usec */
+static const char *phase = "start";
+static const char *command;
+static int32_t command_friend = -1;
+
+static uint32_t budget_ms = WATCHDOG_BUDGET_MS;
+static uint64_t num_stalls;
+static uint64_t longest_ms;
+
+static pthread_t watchdog_tid;
+static bool running;
+
+void watchdog_heartbeat(void)
+{
+    __atomic_store_n(&heartbeat, get_time_usec(), __ATOMIC_RELEASE);
+}
+
+void watchdog_phase(const char *name)
+{
+    __atomic_store_n(&phase, name, __ATOMIC_RELEASE);
+}
+
+void watchdog_event(const char *what, int32_t num)
+{
+    struct Watchdog_Event *e = &events[events_head % WATCHDOG_EVENTS];
+
+    e->time = get_time_usec();
+    e->what = what;
+    e->num = num;
+    __atomic_store_n(&events_head, events_head + 1, __ATOMIC_RELEASE);
+}
+
+void watchdog_command(const char *name, int32_t friendnum)
+{
+    __atomic_store_n(&command_friend, friendnum, __ATOMIC_RELAXED);
+    __atomic_store_n(&command, name, __ATOMIC_RELEASE);
+
+    if (name)
+        watchdog_event(name, friendnum);
+}
+
+void watchdog_set_budget(uint32_t ms)
+{
+    __atomic_store_n(&budget_ms, MAX(ms, WATCHDOG_MIN_BUDGET_MS), __ATOMIC_RELAXED);
+}
+
+uint32_t watchdog_budget(void)
+{
+    return __atomic_load_n(&budget_ms, __ATOMIC_RELAXED);
+}
+
+uint64_t watchdog_stalls(void)
+{
+    return __atomic_load_n(&num_stalls, __ATOMIC_RELAXED);
+}
+
+uint64_t watchdog_longest(void)
+{
+    return __atomic_load_n(&longest_ms, __ATOMIC_RELAXED);
+}
+
+static void write_report(uint64_t now, uint64_t stalled_us)
+{
+    const char *cur_phase = __atomic_load_n(&phase, __ATOMIC_ACQUIRE);
+    const char *cur_command = __atomic_load_n(&command, __ATOMIC_ACQUIRE);
+    int32_t friendnum = __atomic_load_n(&command_friend, __ATOMIC_RELAXED);
+
+    log_msg(L_WARN, "stall ms=%"PRIu64" phase=%s command=%s friend=%d", stalled_us / 1000, cur_phase,
+            cur_command ? cur_command : "-", cur_command ? friendnum : -1);
+
+    FILE *fp = fopen(WATCHDOG_REPORT_FILE, "a");
+
+    if (fp == NULL) {
+        log_msg(L_ERROR, "stall_report_failed path=%s", WATCHDOG_REPORT_FILE);
+        return;
+    }
+
+    char timestr[32];
+    struct tm tm;
+    time_t t = time(NULL);
+    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+
+    fprintf(fp, "=== Hänger %s ===\n", timestr);
+    fprintf(fp, "Dauer bisher: %"PRIu64" ms (Budget %"PRIu32" ms)\n", stalled_us / 1000, watchdog_budget());
+    fprintf(fp, "Phase: %s\n", cur_phase);
+
+    if (cur_command)
+        fprintf(fp, "Befehl: %s (Freund %d)\n", cur_command, friendnum);
+    else
+        fprintf(fp, "Befehl: -\n");
+
+    /* the main thread is stuck, so the entries below the head are stable */
+    uint32_t head = __atomic_load_n(&events_head, __ATOMIC_ACQUIRE);
+    uint32_t n = MIN(head, WATCHDOG_EVENTS);
+    uint32_t i;
+
+    fprintf(fp, "Letzte %"PRIu32" Ereignisse:\n", n);
+
+    for (i = head - n; i != head; ++i) {
+        const struct Watchdog_Event *e = &events[i % WATCHDOG_EVENTS];
+        uint64_t ago = now > e->time ? (now - e->time) / 1000 : 0;
+
+        if (e->num != -1)
+            fprintf(fp, "  vor %6"PRIu64" ms  %s %d\n", ago, e->what, e->num);
+        else
+            fprintf(fp, "  vor %6"PRIu64" ms  %s\n", ago, e->what);
+    }
+
+    fprintf(fp, "\n");
+    fclose(fp);
+}
+
+static void *watchdog_thread(void *arg)
+{
+    uint64_t reported = 0;    /* heartbeat of the iteration reported as stalled */
+
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        uint32_t budget = watchdog_budget();
+        usleep(MIN(budget / 4, 250) * 1000);
+
+        uint64_t hb = __atomic_load_n(&heartbeat, __ATOMIC_ACQUIRE);
+        uint64_t now = get_time_usec();
+
+        if (reported && hb != reported) {
+            uint64_t ms = (hb - reported) / 1000;
+            log_msg(L_WARN, "stall_end ms=%"PRIu64, ms);
+
+            if (ms > longest_ms)
+                __atomic_store_n(&longest_ms, ms, __ATOMIC_RELAXED);
+
+            reported = 0;
+        }
+
+        if (hb == 0 || hb == reported || now - hb <= (uint64_t) budget * 1000)
+            continue;
+
+        reported = hb;
+        __atomic_add_fetch(&num_stalls, 1, __ATOMIC_RELAXED);
+        write_report(now, now - hb);
+    }
+
+    return NULL;
+}
+
+int watchdog_start(void)
+{
+    watchdog_heartbeat();
+    __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+
+    if (pthread_create(&watchdog_tid, NULL, watchdog_thread, NULL) != 0) {
+        __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+        log_msg(L_ERROR, "watchdog_start_failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+void watchdog_stop(void)
+{
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+        return;
+
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+    pthread_join(watchdog_tid, NULL);
+}
@@ -0,0 +1,62 @@
+/*  watchdog.h
+ *
+ *
+ *  Copyright (C) 2014 toxbot All Rights Reserved.
+ *
+ *  This file is part of toxbot.
+ *
+ *  toxbot is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxbot is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxbot. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <stdint.h>
+
+#define WATCHDOG_BUDGET_MS 2000         /* default time one main loop iteration may take */
+#define WATCHDOG_MIN_BUDGET_MS 100
+#define WATCHDOG_EVENTS 64              /* flight recorder entries kept */
+#define WATCHDOG_REPORT_FILE "toxbot.stall"
+
+/* A thread that checks the main loop's heartbeat. When an iteration runs longer than the
+   budget it appends a report to WATCHDOG_REPORT_FILE with the loop's phase, the command being
+   run and the last WATCHDOG_EVENTS events of the flight recorder, and counts the stall.
+   Returns 0 on success, -1 if the thread couldn't be started. */
+int watchdog_start(void);
+void watchdog_stop(void);
+
+/* Called at the start of every main loop iteration. */
+void watchdog_heartbeat(void);
+
+/* Sets what the loop is doing. phase must stay valid. */
+void watchdog_phase(const char *name);
+
+/* Sets the command being run for friendnum, or NULL once it's done. The command is also
+   recorded as an event. */
+void watchdog_command(const char *name, int32_t friendnum);
+
+/* Adds an event to the flight recorder. what must stay valid; num is a friend or group
+   number, or -1. Only the main thread records events. */
+void watchdog_event(const char *what, int32_t num);
+
+void watchdog_set_budget(uint32_t ms);
+uint32_t watchdog_budget(void);
+
+uint64_t watchdog_stalls(void);
+
+/* Returns the longest stall seen, in milliseconds. */
+uint64_t watchdog_longest(void);
+
+#endif /* WATCHDOG_H */